@@ -0,0 +1,307 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <gio/gio.h>
+
+#include "budget.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define SYS_BLOCK "/sys/block"
+
+/* from linux/ioprio.h, which glibc does not wrap */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static gchar *budget_cgroup = NULL;     /* the directory, if its own */
+static gchar *budget_io_max = NULL;
+static gchar *budget_probe_procs = NULL; /* cgroup.procs of probe/ */
+
+/* The cgroup v2 of the daemon.  Only a service started by systemd has
+ * one to itself, anywhere else it is shared with whatever started the
+ * daemon, a login session, which the limits are not meant for.
+ */
+static gchar *
+budget_find_cgroup()
+{
+    gchar *contents = NULL;
+    gchar **lines;
+    gchar **line;
+    gchar *path = NULL;
+
+    if (g_getenv("INVOCATION_ID") == NULL)
+        return NULL;
+    if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line && path == NULL; line++) {
+        if (g_str_has_prefix(*line, "0::/"))
+            path = g_build_filename(CGROUP_ROOT, *line + strlen("0::/"), NULL);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return path;
+}
+
+/* A cgroup file takes a single write(), not the rename of a new file.
+ * group is the child cgroup, "" for the one of the service.
+ */
+static gboolean
+budget_write(const gchar *group, const gchar *file, const gchar *value, GError **error)
+{
+    gchar *path = g_build_filename(budget_cgroup, group, file, NULL);
+    gboolean ret = FALSE;
+    gint fd;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd >= 0 && write(fd, value, strlen(value)) == (gssize)strlen(value))
+        ret = TRUE;
+    if (!ret) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+    }
+    if (fd >= 0)
+        close(fd);
+    g_free(path);
+
+    return ret;
+}
+
+static gboolean
+budget_mkdir(const gchar *group, GError **error)
+{
+    gchar *path = g_build_filename(budget_cgroup, group, NULL);
+    gboolean ret = TRUE;
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+        ret = FALSE;
+    }
+    g_free(path);
+
+    return ret;
+}
+
+/* Split the cgroup systemd delegated to the service in two leaves, as
+ * a cgroup with processes in it takes no controller for its children:
+ * daemon/ for the daemon itself, its D-Bus handling and the reads and
+ * mounts its workers do in process, and probe/ for the tests and
+ * os-prober it spawns, which engine_child_setup() moves there.  Both
+ * get the io.max of every disk, probe/ the cpu.weight on top, so a
+ * slow D-Bus answer is not the price of a low weight.
+ */
+static gboolean
+budget_split_cgroup(guint cpu_weight, GError **error)
+{
+    gchar *pid;
+    gchar *weight;
+    gboolean ret;
+
+    if (!budget_mkdir("daemon", error) || !budget_mkdir("probe", error))
+        return FALSE;
+
+    /* no thread runs yet, the move takes the whole daemon */
+    pid = g_strdup_printf("%d", getpid());
+    ret = budget_write("daemon", "cgroup.procs", pid, error);
+    g_free(pid);
+    if (!ret)
+        return FALSE;
+
+    if (!budget_write("", "cgroup.subtree_control", "+cpu +io", error))
+        return FALSE;
+
+    if (cpu_weight) {
+        weight = g_strdup_printf("%u", cpu_weight);
+        ret = budget_write("probe", "cpu.weight", weight, error);
+        g_free(weight);
+        if (!ret)
+            return FALSE;
+    }
+
+    budget_probe_procs = g_build_filename(budget_cgroup, "probe", "cgroup.procs", NULL);
+
+    return TRUE;
+}
+
+gboolean
+budget_init(const gchar *io_max, guint cpu_weight, GError **error)
+{
+    /* the idle class is only honoured by BFQ, io.max is the real cap */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, 
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "idle I/O class: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    budget_cgroup = budget_find_cgroup();
+    if (budget_cgroup == NULL) {
+#ifdef DEBUG
+        g_print("DEBUG: not a service, the cgroup is left as it is\n");
+#endif
+        return TRUE;
+    }
+
+    if (!budget_split_cgroup(cpu_weight, error))
+        return FALSE;
+    budget_io_max = g_strdup(io_max);
+    budget_limit_disks();
+
+    return TRUE;
+}
+
+void
+budget_close()
+{
+    g_free(budget_cgroup);
+    budget_cgroup = NULL;
+    g_free(budget_io_max);
+    budget_io_max = NULL;
+    g_free(budget_probe_procs);
+    budget_probe_procs = NULL;
+}
+
+/* io.max only takes whole disks, by their numbers, one at a time */
+void
+budget_limit_disks()
+{
+    static const gchar * const groups[] = { "daemon", "probe" };
+    GDir *dir;
+    const gchar *name;
+    gchar *path;
+    gchar *dev;
+    gchar *line;
+    GError *error = NULL;
+    guint i;
+
+    if (budget_probe_procs == NULL || budget_io_max == NULL)
+        return;
+
+    dir = g_dir_open(SYS_BLOCK, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    while ((name = g_dir_read_name(dir))) {
+        path = g_build_filename(SYS_BLOCK, name, "dev", NULL);
+        if (g_file_get_contents(path, &dev, NULL, NULL)) {
+            line = g_strdup_printf("%s %s", g_strstrip(dev), budget_io_max);
+            for (i = 0; i < G_N_ELEMENTS(groups); i++) {
+                if (!budget_write(groups[i], "io.max", line, &error)) {
+#ifdef DEBUG
+                    g_print("DEBUG: no io.max for %s: %s\n", name, error->message);
+#endif
+                    g_error_free(error);
+                    error = NULL;
+                }
+            }
+            g_free(line);
+            g_free(dev);
+        }
+        g_free(path);
+    }
+    g_dir_close(dir);
+}
+
+/* Between fork and exec, so open(), write() and close() only */
+void
+budget_enter_probe()
+{
+    gint fd;
+
+    if (budget_probe_procs == NULL)
+        return;
+
+    fd = open(budget_probe_procs, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    /* a child left in daemon/ is capped all the same */
+    while (write(fd, "0", 1) < 0 && errno == EINTR)
+        ;
+    close(fd);
+}
+
+/* The total of the "some" line of a pressure file, in microseconds */
+static gint64
+budget_read_pressure(const gchar *file)
+{
+    gchar *path = g_build_filename(budget_cgroup, file, NULL);
+    gchar *contents = NULL;
+    const gchar *total;
+    gint64 ret = 0;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL) &&
+        g_str_has_prefix(contents, "some ") &&
+        (total = strstr(contents, "total=")) != NULL) {
+        ret = g_ascii_strtoll(total + strlen("total="), NULL, 10);
+    }
+    g_free(contents);
+    g_free(path);
+
+    return ret;
+}
+
+/* The stalls are counted from the start of the first of the jobs
+ * running at once to the end of the last one, every job taking what
+ * the cgroup stalled since the end of the one before it.
+ */
+static GMutex budget_stalls_lock;
+static guint budget_jobs = 0;
+static gint64 budget_io_stall = 0;
+static gint64 budget_cpu_stall = 0;
+
+void
+budget_start_stalls()
+{
+    g_mutex_lock(&budget_stalls_lock);
+    if (budget_jobs++ == 0 && budget_cgroup) {
+        budget_io_stall = budget_read_pressure("io.pressure");
+        budget_cpu_stall = budget_read_pressure("cpu.pressure");
+    }
+    g_mutex_unlock(&budget_stalls_lock);
+}
+
+void
+budget_take_stalls(gint64 *io_usec, gint64 *cpu_usec)
+{
+    gint64 io = 0;
+    gint64 cpu = 0;
+
+    g_mutex_lock(&budget_stalls_lock);
+    if (budget_cgroup) {
+        io = budget_read_pressure("io.pressure");
+        cpu = budget_read_pressure("cpu.pressure");
+    }
+    *io_usec = MAX(io - budget_io_stall, 0);
+    *cpu_usec = MAX(cpu - budget_cpu_stall, 0);
+    budget_io_stall = io;
+    budget_cpu_stall = cpu;
+    budget_jobs--;
+    g_mutex_unlock(&budget_stalls_lock);
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __BUDGET_H__
+#define __BUDGET_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Default cpu.weight of the probes, out of 100 for the daemon itself
+ * and the other services
+ */
+#define BUDGET_CPU_WEIGHT 20
+
+/* Default io.max of the daemon and of the probes on every disk */
+#define BUDGET_IO_MAX "rbps=52428800 riops=1000"
+
+/* What the probes may take of the machine: the daemon, its threads and
+ * every child they spawn do I/O in the idle class, and when the daemon
+ * runs as a systemd service with its cgroup delegated, the cgroup is
+ * split in daemon/ and probe/, both capped with an io.max for every
+ * disk and probe/ given a cpu.weight.  io_max is what follows the
+ * device in io.max ("rbps=20971520 riops=400"), NULL for no cap, a
+ * cpu_weight of 0 leaves the weight as it is.  Called in main before
+ * any thread starts, the threads get the I/O class of the one starting
+ * them.
+ */
+gboolean budget_init         (const gchar *io_max,
+                              guint        cpu_weight,
+                              GError     **error);
+void     budget_close        ();
+
+/* Cap the disks there are now, a hot-plugged one included */
+void     budget_limit_disks  ();
+
+/* Move the calling process into probe/, for a child between fork and
+ * exec.  Does nothing without budget_init(), or when it gave up.
+ */
+void     budget_enter_probe  ();
+
+/* Time some task of the cgroup waited for I/O and for CPU while jobs
+ * ran, as its pressure stall information tells.  A job calls
+ * budget_start_stalls() when it starts and budget_take_stalls() when
+ * it is over, which gives what was not taken by a job over before it,
+ * so jobs running at once do not count the same stall twice.  0 when
+ * not in a cgroup of its own, or without PSI.
+ */
+void     budget_start_stalls ();
+void     budget_take_stalls  (gint64 *io_usec,
+                              gint64 *cpu_usec);
+
+G_END_DECLS
+
+#endif /* __BUDGET_H__ */
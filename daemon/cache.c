@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <gio/gio.h>
+
+#include "cache.h"
+#include "engine.h"
+#include "store.h"
+
+/* Results of the last scan, per partition.  A partition is identified by
+ * its PARTUUID and filesystem UUID plus its size, and its entry stays
+ * valid as long as the filesystem last-write marker is the one seen when
+ * it was probed.
+ *
+ * The entries are saved to a store after every full scan.  A daemon that
+ * has just started reads that store in place until its own first scan
+ * replaces it, so it can answer straight away.
+ */
+typedef struct {
+    gchar *device;
+    guint64 generation;
+    gboolean valid;
+    GPtrArray *results;
+} CacheEntry;
+
+struct Cache {
+    GMutex lock;
+    GHashTable *entries;
+    gchar *path;
+    Store *store;
+};
+
+static void
+cache_entry_free(CacheEntry *entry)
+{
+    g_free(entry->device);
+    g_ptr_array_unref(entry->results);
+    g_free(entry);
+}
+
+/* path is the store of a previous run, it does not need to exist */
+Cache *
+cache_new(const gchar *path)
+{
+    Cache *cache = g_new0(Cache, 1);
+
+    g_mutex_init(&cache->lock);
+    cache->entries = g_hash_table_new_full(g_str_hash, 
+                                           g_str_equal, 
+                                           g_free, 
+                                           (GDestroyNotify)cache_entry_free);
+    cache->path = g_strdup(path);
+    cache->store = store_open(path);
+#ifdef DEBUG
+    if (cache->store) {
+        g_print("DEBUG: %u cached partitions loaded from %s\n", 
+                store_get_n_entries(cache->store), path);
+    }
+#endif
+
+    return cache;
+}
+
+void
+cache_free(Cache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    g_hash_table_destroy(cache->entries);
+    store_free(cache->store);
+    g_free(cache->path);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+static gchar *
+cache_key(Partition *partition)
+{
+    const gchar *uuid = partition->superblock.uuid;
+
+    if (partition->partuuid == NULL && *uuid == '\0')
+        return NULL;
+
+    return g_strdup_printf("%s:%s:%" G_GUINT64_FORMAT, 
+                           partition->partuuid ? partition->partuuid : "", 
+                           uuid, 
+                           partition->size);
+}
+
+/* Bring an entry of the store into memory, called with the lock held */
+static CacheEntry *
+cache_load_entry(Cache *cache, const gchar *key)
+{
+    CacheEntry *entry;
+    const gchar *device;
+    guint64 generation;
+    gboolean valid;
+    GPtrArray *results;
+
+    if (cache->store == NULL ||
+        !store_lookup(cache->store, key, &device, &generation, &valid, &results))
+        return NULL;
+
+    entry = g_new0(CacheEntry, 1);
+    entry->device = g_strdup(device);
+    entry->generation = generation;
+    entry->valid = valid;
+    entry->results = results;
+    g_hash_table_insert(cache->entries, g_strdup(key), entry);
+
+    return entry;
+}
+
+gboolean
+cache_has_store(Cache *cache)
+{
+    gboolean ret;
+
+    g_mutex_lock(&cache->lock);
+    ret = cache->store && store_get_n_entries(cache->store) > 0;
+    g_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+/* Answer a partition from the cache: only when it was probed under the
+ * same device name, it is not mounted (so its content cannot change
+ * behind the superblock) and its last-write marker did not move.
+ */
+gboolean
+cache_lookup(Cache *cache, Partition *partition, GPtrArray **results)
+{
+    CacheEntry *entry;
+    gchar *key;
+    gboolean ret = FALSE;
+
+    if (partition->mounted || !partition->superblock.has_generation)
+        return FALSE;
+
+    key = cache_key(partition);
+    if (key == NULL)
+        return FALSE;
+
+    g_mutex_lock(&cache->lock);
+    entry = g_hash_table_lookup(cache->entries, key);
+    if (entry == NULL)
+        entry = cache_load_entry(cache, key);
+    if (entry &&
+        entry->valid &&
+        entry->generation == partition->superblock.generation &&
+        g_strcmp0(entry->device, partition->device) == 0) {
+        *results = g_ptr_array_ref(entry->results);
+        ret = TRUE;
+    }
+    g_mutex_unlock(&cache->lock);
+    g_free(key);
+
+    return ret;
+}
+
+/* results is an array of (ssss) GVariant, referenced by the cache */
+void
+cache_store(Cache *cache, Partition *partition, GPtrArray *results)
+{
+    CacheEntry *entry;
+    gchar *key;
+
+    key = cache_key(partition);
+    if (key == NULL)
+        return;
+
+    entry = g_new0(CacheEntry, 1);
+    entry->device = g_strdup(partition->device);
+    entry->generation = partition->superblock.generation;
+    entry->valid = partition->superblock.has_generation && !partition->mounted;
+    entry->results = g_ptr_array_ref(results);
+
+    g_mutex_lock(&cache->lock);
+    g_hash_table_replace(cache->entries, key, entry);
+    g_mutex_unlock(&cache->lock);
+}
+
+/* Forget the partitions which did not show up in a full scan.  Whatever
+ * the scan kept from the store is in memory by now, so the store is
+ * dropped as well.
+ */
+void
+cache_prune(Cache *cache, GPtrArray *partitions)
+{
+    GHashTable *seen;
+    GHashTableIter iter;
+    const gchar *key;
+    gchar *partition_key;
+    guint i;
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < partitions->len; i++) {
+        partition_key = cache_key(g_ptr_array_index(partitions, i));
+        if (partition_key)
+            g_hash_table_add(seen, partition_key);
+    }
+
+    g_mutex_lock(&cache->lock);
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&key, NULL)) {
+        if (!g_hash_table_contains(seen, key))
+            g_hash_table_iter_remove(&iter);
+    }
+    store_free(cache->store);
+    cache->store = NULL;
+    g_mutex_unlock(&cache->lock);
+
+    g_hash_table_destroy(seen);
+}
+
+typedef struct {
+    Cache *cache;
+    GVariantBuilder *builder;
+} StoreResults;
+
+static void
+cache_add_stored_results(const gchar *key, GPtrArray *results, gpointer user_data)
+{
+    StoreResults *data = (StoreResults *)user_data;
+    guint i;
+
+    /* memory has the newer copy */
+    if (g_hash_table_contains(data->cache->entries, key))
+        return;
+
+    for (i = 0; i < results->len; i++)
+        g_variant_builder_add_value(data->builder, g_ptr_array_index(results, i));
+}
+
+/* Every cached result as an a(ssss), without touching any disk */
+GVariant *
+cache_get_results(Cache *cache)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    CacheEntry *entry;
+    StoreResults data = { cache, &builder };
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    g_mutex_lock(&cache->lock);
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+        for (i = 0; i < entry->results->len; i++)
+            g_variant_builder_add_value(&builder, g_ptr_array_index(entry->results, i));
+    }
+    if (cache->store)
+        store_foreach(cache->store, cache_add_stored_results, &data);
+    g_mutex_unlock(&cache->lock);
+
+    return g_variant_builder_end(&builder);
+}
+
+/* Write the entries to the store, meant to follow cache_prune() */
+gboolean
+cache_save(Cache *cache, GError **error)
+{
+    StoreWriter *writer;
+    GHashTableIter iter;
+    const gchar *key;
+    CacheEntry *entry;
+    gchar *dir;
+    gboolean ret;
+
+    dir = g_path_get_dirname(cache->path);
+    if (g_mkdir_with_parents(dir, 0755) == -1) {
+        g_set_error(error, 
+                    G_FILE_ERROR, 
+                    g_file_error_from_errno(errno), 
+                    "failed to create %s: %s", 
+                    dir, 
+                    g_strerror(errno));
+        g_free(dir);
+        return FALSE;
+    }
+    g_free(dir);
+
+    writer = store_writer_new();
+    g_mutex_lock(&cache->lock);
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&entry))
+        store_writer_add(writer, key, entry->device, entry->generation, entry->valid, entry->results);
+    g_mutex_unlock(&cache->lock);
+
+    ret = store_writer_save(writer, cache->path, error);
+    store_writer_free(writer);
+
+    return ret;
+}
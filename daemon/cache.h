@@ -0,0 +1,49 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <glib.h>
+
+#include "types.h"
+
+G_BEGIN_DECLS
+
+typedef struct Cache Cache;
+
+Cache    *cache_new         (const gchar *path);
+void      cache_free        (Cache      *cache);
+gboolean  cache_has_store   (Cache      *cache);
+gboolean  cache_lookup      (Cache      *cache,
+                             Partition  *partition,
+                             GPtrArray **results);
+void      cache_store       (Cache      *cache,
+                             Partition  *partition,
+                             GPtrArray  *results);
+void      cache_prune       (Cache      *cache,
+                             GPtrArray  *partitions);
+GVariant *cache_get_results (Cache      *cache);
+gboolean  cache_save        (Cache      *cache,
+                             GError    **error);
+
+G_END_DECLS
+
+#endif /* __CACHE_H__ */
@@ -21,22 +21,126 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mount.h>
 #include <glib/gi18n.h>
 
 #include "daemon.h"
+#include "budget.h"
+#include "cache.h"
+#include "engine.h"
+#include "image.h"
+#include "prescan.h"
+#include "result.h"
+#include "stats.h"
+#include "task.h"
+#include "trace.h"
+#include "uevent.h"
 
 enum {
     PROP_0,
     PROP_DAEMON_VERSION,
 };
 
+/* Upper bound of threads running probe jobs, whatever the number of
+ * Probe callers.
+ */
+#define DAEMON_MAX_WORKERS 4
+
+#define DAEMON_PROBER "/usr/bin/os-prober"
+#define DAEMON_MOUNT_POINT "/var/lib/os-prober/mount"
+
+#define DAEMON_CACHE_FILE PROJECT_CACHEDIR "/results.idx"
+
+/* Uevents come in bursts (a disk, then each of its partitions), they are
+ * gathered for this long before the devices are probed.
+ */
+#define DAEMON_UEVENT_DELAY_MS 500
+
+/* How many more delays a device-mapper device gets for udev to link it
+ * under /dev/mapper, before it is probed as /dev/dm-N.
+ */
+#define DAEMON_UEVENT_WAITS 10
+
+typedef struct {
+    Daemon *daemon;
+    GMutex lock;
+    GPtrArray *tasks;
+    GPtrArray *sync_invocations;
+    GPtrArray *results;
+    GHashTable *pending;    /* the records of a partition as found, for the cache */
+    GHashTable *states;     /* how far each partition got, ProbeState */
+    GPtrArray *order;       /* the partitions of the scan, in the order numbered */
+    guint released;         /* how many of them went out */
+    GMutex release_lock;    /* one release at a time, for the order to hold */
+    GPtrArray *claimed;     /* the records numbered, to give back unless kept */
+    ResultLabels *labels;   /* of the disk images, apart from the host's */
+    GHashTable *devices;
+    GCancellable *cancellable;
+    ResultTable *table;     /* the arena of what the scan parses */
+    GHashTable *boot_entries;   /* the kernels read along, by partition */
+    /* ProbeWithOptions */
+    gchar **os_types;       /* the shortnames or types wanted, NULL for all */
+    guint max_matches;      /* 0 for all */
+    guint matches;
+    gboolean satisfied;     /* stopped at max_matches */
+    gboolean priority;      /* likely partitions first */
+    /* ProbeImages */
+    gchar **images;         /* the disk images to probe instead */
+} ProbeJob;
+
+/* What became of a partition of the scan, its records wait for the
+ * partitions before it to be visited.
+ */
+typedef enum {
+    PROBE_STATE_PROBED      = 1 << 0,   /* probed in full, for the cache */
+    PROBE_STATE_ANSWERED    = 1 << 1,   /* answered from the cache */
+    PROBE_STATE_VISITED     = 1 << 2,   /* done with, whatever the outcome */
+} ProbeState;
+
+typedef enum {
+    DAEMON_SIGNAL_ADDED,
+    DAEMON_SIGNAL_REMOVED,
+    DAEMON_SIGNAL_BOOT_ENTRIES_FOUND,
+} DaemonSignalType;
+
+/* A signal of the daemon queued by a worker for the main loop to send */
+typedef struct DaemonSignal {
+    struct DaemonSignal *next;
+    DaemonSignalType type;
+    GVariant *parameters;   /* (ssss) of a result, (sa(ssssss)) of kernels */
+} DaemonSignal;
+
 struct DaemonPrivate {
     GDBusConnection *bus_connection;
     GHashTable *extension_ifaces;
     GDBusMethodInvocation *context;
+    GThreadPool *pool;
+    GMutex lock;
+    ProbeJob *job;
+    GPtrArray *jobs;        /* those of ProbeWithOptions, not shared */
+    Cache *cache;
+    Stats *stats;
+    gchar *prober;
+    GHashTable *partitions;
+    ResultTable *table;     /* the records of partitions, by any key */
+    ResultLabels *labels;   /* the short names the parts hold, numbered */
+    GHashTable *boot_entries;   /* the a(ssssss) of a Linux, by name */
+    GThreadPool *boot_pool; /* GetBootEntries */
+    guint image_workers;    /* images attached at once by a ProbeImages */
+    GHashTable *images;     /* the loop devices they are attached to */
+    UeventMonitor *uevents;
+    GHashTable *changed;
+    gboolean rescan;
+    guint changed_source;
+    guint changed_waits;    /* delays so far for udev to be done */
+    DaemonSignal *signals;  /* pushed by any thread, newest first */
 };
 
 static void daemon_osprober_iface_init(OSProberOSProberIface *iface);
+static void osprober_routine(gpointer data, gpointer user_data);
+static ProbeJob *probe_job_ensure(Daemon *daemon, GError **error);
+static void daemon_on_uevent(const gchar *action, const gchar *name, gpointer user_data);
+static void daemon_boot_routine(gpointer data, gpointer user_data);
 
 G_DEFINE_TYPE_WITH_CODE(Daemon, daemon, OSPROBER_TYPE_OSPROBER_SKELETON, G_IMPLEMENT_INTERFACE(OSPROBER_TYPE_OSPROBER, daemon_osprober_iface_init));
 
@@ -90,6 +194,43 @@ daemon_init(Daemon *daemon)
     daemon->priv = DAEMON_GET_PRIVATE(daemon);
     daemon->priv->extension_ifaces = daemon_read_extension_ifaces();
     daemon->priv->context = NULL;
+    daemon->priv->pool = g_thread_pool_new(osprober_routine, 
+                                           daemon, 
+                                           DAEMON_MAX_WORKERS, 
+                                           FALSE, 
+                                           &error);
+    if (daemon->priv->pool == NULL) {
+        g_warning("Failed to create thread pool: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+    daemon->priv->boot_pool = g_thread_pool_new(daemon_boot_routine, 
+                                                daemon, 
+                                                DAEMON_MAX_WORKERS, 
+                                                FALSE, 
+                                                &error);
+    if (daemon->priv->boot_pool == NULL) {
+        g_warning("Failed to create thread pool: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+    g_mutex_init(&daemon->priv->lock);
+    daemon->priv->job = NULL;
+    daemon->priv->jobs = g_ptr_array_new();
+    daemon->priv->cache = cache_new(DAEMON_CACHE_FILE);
+    daemon->priv->partitions = g_hash_table_new_full(g_str_hash, 
+                                                     g_str_equal, 
+                                                     g_free, 
+                                                     (GDestroyNotify)g_ptr_array_unref);
+    daemon->priv->table = result_table_new();
+    daemon->priv->labels = result_labels_new();
+    daemon->priv->boot_entries = g_hash_table_new_full(g_str_hash, 
+                                                       g_str_equal, 
+                                                       g_free, 
+                                                       (GDestroyNotify)g_variant_unref);
+    daemon->priv->image_workers = DAEMON_IMAGE_WORKERS;
+    daemon->priv->images = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    daemon->priv->changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 }
 
 static void
@@ -99,6 +240,36 @@ daemon_finalize(GObject *object)
 
     g_return_if_fail(IS_DAEMON(object));
     daemon = DAEMON(object);
+    uevent_monitor_free(daemon->priv->uevents);
+    daemon->priv->uevents = NULL;
+    if (daemon->priv->changed_source) {
+        g_source_remove(daemon->priv->changed_source);
+        daemon->priv->changed_source = 0;
+    }
+    if (daemon->priv->pool) {
+        g_thread_pool_free(daemon->priv->pool, FALSE, TRUE);
+        daemon->priv->pool = NULL;
+    }
+    if (daemon->priv->boot_pool) {
+        g_thread_pool_free(daemon->priv->boot_pool, FALSE, TRUE);
+        daemon->priv->boot_pool = NULL;
+    }
+    g_mutex_clear(&daemon->priv->lock);
+    g_ptr_array_free(daemon->priv->jobs, TRUE);
+    cache_free(daemon->priv->cache);
+    daemon->priv->cache = NULL;
+    g_hash_table_destroy(daemon->priv->partitions);
+    result_table_free(daemon->priv->table);
+    result_labels_free(daemon->priv->labels);
+    g_hash_table_destroy(daemon->priv->boot_entries);
+    g_hash_table_destroy(daemon->priv->images);
+    g_hash_table_destroy(daemon->priv->changed);
+    if (daemon->priv->prober) g_free(daemon->priv->prober); daemon->priv->prober = NULL;
+    if (daemon->priv->stats) {
+        g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(daemon->priv->stats));
+        g_object_unref(daemon->priv->stats);
+        daemon->priv->stats = NULL;
+    }
     if (daemon->priv->bus_connection) {
         g_object_unref(daemon->priv->bus_connection);
         daemon->priv->bus_connection = NULL;
@@ -108,18 +279,11 @@ daemon_finalize(GObject *object)
 }
 
 static gboolean
-register_osprober_daemon(Daemon *daemon)
+register_osprober_daemon(Daemon *daemon, GDBusConnection *connection)
 {
     GError *error = NULL;
 
-    daemon->priv->bus_connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
-    if (daemon->priv->bus_connection == NULL) {
-        if (error != NULL) {
-            g_error_free(error);
-            error = NULL;
-        }
-        return FALSE;
-    }
+    daemon->priv->bus_connection = g_object_ref(connection);
 
     if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(daemon),
                                           daemon->priv->bus_connection,
@@ -132,19 +296,56 @@ register_osprober_daemon(Daemon *daemon)
         return FALSE;
     }
 
+    daemon->priv->stats = stats_new(daemon->priv->bus_connection, 
+                                    "/org/isoftlinux/OSProber", 
+                                    &error);
+    if (daemon->priv->stats == NULL) {
+        g_warning("Failed to export statistics: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+
     return TRUE;
 }
 
+/* connection is the system bus, unless the daemon is load tested on
+ * another one.  prober replaces os-prober and its tests when not NULL.
+ * image_workers caps the disk images a ProbeImages attaches at once.
+ */
 Daemon *
-daemon_new()
+daemon_new(GDBusConnection *connection, const gchar *prober, guint image_workers)
 {
+    GError *error = NULL;
+
     Daemon *daemon = DAEMON(g_object_new(TYPE_DAEMON, NULL));
-    if (!register_osprober_daemon(DAEMON(daemon))) {
+    daemon->priv->prober = g_strdup(prober);
+    daemon->priv->image_workers = MAX(image_workers, 1);
+    if (!register_osprober_daemon(DAEMON(daemon), connection)) {
         g_object_unref(daemon);
         daemon = NULL;
         return NULL;
     }
 
+    /* GetCachedResults answers from the store of the previous run right
+     * away, refresh it before anybody asks for a Probe.
+     */
+    if (cache_has_store(daemon->priv->cache)) {
+        g_mutex_lock(&daemon->priv->lock);
+        if (probe_job_ensure(daemon, &error) == NULL) {
+            g_warning("Failed to refresh the cache: %s", error->message);
+            g_error_free(error);
+            error = NULL;
+        }
+        g_mutex_unlock(&daemon->priv->lock);
+    }
+
+    daemon->priv->uevents = uevent_monitor_new(daemon_on_uevent, daemon, &error);
+    if (daemon->priv->uevents == NULL) {
+        g_warning("Hot-plugged disks will not be probed: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+
     return daemon;
 }
 
@@ -172,103 +373,2017 @@ daemon_get_daemon_version(OSProberOSProber *object)
     return PROJECT_VERSION;
 }
 
-static gpointer osprober_routine(gpointer data) 
+static ProbeJob *
+probe_job_new(Daemon *daemon)
 {
-    Daemon *daemon = (Daemon *)data;
-	gboolean ret;
-    gchar *out = NULL;
-    gchar *err;
-    int status;
-    GError *error = NULL;
-    gchar **tokens = NULL;
-    gchar **line;
-    gchar **ptr;
-    gchar *part = NULL;
-    gchar *name = NULL;
-    gchar *shortname = NULL;
-    int i;
+    ProbeJob *job = g_new0(ProbeJob, 1);
+
+    job->daemon = daemon;
+    g_mutex_init(&job->lock);
+    job->tasks = g_ptr_array_new_with_free_func(g_object_unref);
+    job->sync_invocations = g_ptr_array_new();
+    job->results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    job->pending = g_hash_table_new_full(g_direct_hash, 
+                                         g_direct_equal, 
+                                         NULL, 
+                                         (GDestroyNotify)g_ptr_array_unref);
+    job->states = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_mutex_init(&job->release_lock);
+    job->claimed = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    job->labels = result_labels_new();
+    job->cancellable = g_cancellable_new();
+    job->table = result_table_new();
+    job->boot_entries = g_hash_table_new_full(g_direct_hash, 
+                                              g_direct_equal, 
+                                              NULL, 
+                                              (GDestroyNotify)g_variant_unref);
+
+    return job;
+}
+
+static void
+probe_job_free(ProbeJob *job)
+{
+    g_ptr_array_free(job->tasks, TRUE);
+    g_ptr_array_free(job->sync_invocations, TRUE);
+    g_ptr_array_free(job->results, TRUE);
+    g_hash_table_destroy(job->pending);
+    g_hash_table_destroy(job->states);
+    g_mutex_clear(&job->release_lock);
+    g_ptr_array_free(job->claimed, TRUE);
+    result_labels_free(job->labels);
+    if (job->devices)
+        g_hash_table_destroy(job->devices);
+    result_table_free(job->table);
+    g_hash_table_destroy(job->boot_entries);
+    g_strfreev(job->os_types);
+    g_strfreev(job->images);
+    g_object_unref(job->cancellable);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+/* Spans of the D-Bus calls answered once the scan is over */
+static void
+trace_call_begin(GDBusMethodInvocation *invocation)
+{
+    gint64 *start;
+
+    if (!trace_enabled())
+        return;
+
+    start = g_new(gint64, 1);
+    *start = trace_now();
+    g_object_set_data_full(G_OBJECT(invocation), "trace-start", start, g_free);
+}
+
+static void
+trace_call_end(GDBusMethodInvocation *invocation)
+{
+    gint64 *start = g_object_get_data(G_OBJECT(invocation), "trace-start");
+
+    if (start) {
+        trace_span("dbus", 
+                   g_dbus_method_invocation_get_method_name(invocation), 
+                   *start, 
+                   g_dbus_method_invocation_get_sender(invocation));
+    }
+}
+
+/* What the job found so far, called with the job lock held or once the
+ * job is over.
+ */
+static GVariant *
+probe_job_get_results(ProbeJob *job)
+{
+    GVariantBuilder builder;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    for (i = 0; i < job->results->len; i++)
+        g_variant_builder_add_value(&builder, g_ptr_array_index(job->results, i));
+
+    return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+/* Nobody waits for the job anymore: stop it, and let the next caller
+ * start a fresh one.  Called with both the daemon and the job lock held.
+ */
+static void
+probe_job_cancel_if_unwanted(Daemon *daemon, ProbeJob *job)
+{
+    if (job->tasks->len || job->sync_invocations->len)
+        return;
 
-    ret = g_spawn_command_line_sync("/usr/bin/os-prober", 
-                                    &out, 
-                                    &err, 
-                                    &status, 
-                                    &error);
-    if (ret && out && status == 0) {
-        tokens = g_strsplit(out, "\n", -1);
-        if (tokens) {
-            for (line = tokens; *line; line++) {
-                if (strlen(*line) == 0) 
-                    continue;
-                tokens = g_strsplit(*line, ":", -1);
-                if (tokens) {
-                    for (ptr = tokens, i = 0; *ptr; ptr++, i++) {
-                        if (i == 0)
-                            part = g_strdup(*ptr);
-                        else if (i == 1)
-                            name = g_strdup(*ptr);
-                        else if (i == 2)
-                            shortname = g_strdup(*ptr);
-                    }
 #ifdef DEBUG
-                    g_print("DEBUG: %s (%s) at %s\n", name, shortname, part);
+    g_print("DEBUG: nobody waits for the scan anymore, cancelling it\n");
 #endif
-                    osprober_osprober_emit_found(g_object_ref(OSPROBER_OSPROBER(daemon)), 
-                                                 part, 
-                                                 name, 
-                                                 shortname);
-                    if (part) {
-                        g_free(part);
-                        part = NULL;
-                    }
-                    if (name) {
-                        g_free(name);
-                        name = NULL;
-                    }
-                    if (shortname) {
-                        g_free(shortname);
-                        shortname = NULL;
-                    }
-                    g_strfreev(tokens);
-                    tokens = NULL;
-                }
-            }
-            g_strfreev(tokens);
-            tokens = NULL;
+    g_cancellable_cancel(job->cancellable);
+    if (daemon->priv->job == job)
+        daemon->priv->job = NULL;
+}
+
+/* Reply to every caller attached to the job, once the scan is over and
+ * nobody can attach any more.
+ */
+static void
+probe_job_complete(ProbeJob    *job, 
+                   gint64       status, 
+                   gboolean     success, 
+                   const gchar *message)
+{
+    OSProberOSProber *object = OSPROBER_OSPROBER(job->daemon);
+    GVariant *results = NULL;
+    guint i;
+
+    for (i = 0; i < job->tasks->len; i++)
+        task_finish(g_ptr_array_index(job->tasks, i), status);
+
+    if (job->sync_invocations->len == 0)
+        return;
+
+    if (!success) {
+        for (i = 0; i < job->sync_invocations->len; i++) {
+            trace_call_end(g_ptr_array_index(job->sync_invocations, i));
+            throw_error(g_ptr_array_index(job->sync_invocations, i), 
+                        ERROR_FAILED, 
+                        "%s", 
+                        message ? message : "os-prober failed");
         }
+        return;
     }
 
-    if (error) {
-        g_print("ERROR: %s\n%s\n", err, error->message);
-        osprober_osprober_emit_error(g_object_ref(OSPROBER_OSPROBER(daemon)), 
-                                     error->message);
-        g_error_free(error);
-        error = NULL;
+    /* ProbeWithDeadline has the same reply as ProbeSync */
+    results = probe_job_get_results(job);
+    for (i = 0; i < job->sync_invocations->len; i++) {
+        trace_call_end(g_ptr_array_index(job->sync_invocations, i));
+        osprober_osprober_complete_probe_sync(object, 
+                                              g_ptr_array_index(job->sync_invocations, i), 
+                                              results);
+    }
+    g_variant_unref(results);
+}
+
+static gboolean
+results_contain(GPtrArray *results, GVariant *result)
+{
+    guint i;
+
+    for (i = 0; i < results->len; i++) {
+        if (g_variant_equal(g_ptr_array_index(results, i), result))
+            return TRUE;
     }
 
-    status = -1;
-    for (int i = 0; i < 3; i++) {
-        if (status == 0)
+    return FALSE;
+}
+
+/* Send what the workers queued, in order, from the main loop */
+static gboolean
+daemon_flush_signals(gpointer data)
+{
+    Daemon *daemon = DAEMON(data);
+    OSProberOSProber *object = OSPROBER_OSPROBER(daemon);
+    DaemonSignal *signals;
+    DaemonSignal *signal;
+    DaemonSignal *next;
+    DaemonSignal *ordered = NULL;
+    const gchar *part, *name, *shortname, *type;
+    GVariant *entries;
+    gint64 start;
+
+    do {
+        signals = g_atomic_pointer_get(&daemon->priv->signals);
+    } while (!g_atomic_pointer_compare_and_exchange(&daemon->priv->signals, signals, NULL));
+
+    for (signal = signals; signal; signal = next) {
+        next = signal->next;
+        signal->next = ordered;
+        ordered = signal;
+    }
+
+    for (signal = ordered; signal; signal = next) {
+        next = signal->next;
+        start = trace_now();
+        switch (signal->type) {
+        case DAEMON_SIGNAL_ADDED:
+        case DAEMON_SIGNAL_REMOVED:
+            g_variant_get(signal->parameters, "(&s&s&s&s)", &part, &name, &shortname, &type);
+            if (signal->type == DAEMON_SIGNAL_ADDED)
+                osprober_osprober_emit_added(object, part, name, shortname, type);
+            else
+                osprober_osprober_emit_removed(object, part, name, shortname, type);
+            trace_span("signal", signal->type == DAEMON_SIGNAL_ADDED ? "Added" : "Removed", start, part);
             break;
-        g_spawn_command_line_sync("/usr/bin/umount /var/lib/os-prober/mount", 
-                                  NULL, 
-                                  NULL, 
-                                  &status, 
-                                  NULL);
+        case DAEMON_SIGNAL_BOOT_ENTRIES_FOUND:
+            g_variant_get(signal->parameters, "(&s@a(ssssss))", &part, &entries);
+            osprober_osprober_emit_boot_entries_found(object, part, entries);
+            g_variant_unref(entries);
+            trace_span("signal", "BootEntriesFound", start, part);
+            break;
+        }
+        g_variant_unref(signal->parameters);
+        g_free(signal);
     }
 
-    osprober_osprober_emit_finished(g_object_ref(OSPROBER_OSPROBER(daemon)), 
-                                    status);
+    return G_SOURCE_REMOVE;
+}
+
+/* Queue a signal without a lock, so that the workers may do it with
+ * the daemon lock held; the main loop sends it once that is gone.
+ */
+static void
+daemon_queue_signal(Daemon *daemon, DaemonSignalType type, GVariant *parameters)
+{
+    DaemonSignal *signal = g_new0(DaemonSignal, 1);
+    DaemonSignal *head;
+
+    signal->type = type;
+    signal->parameters = g_variant_ref_sink(parameters);
+    do {
+        head = g_atomic_pointer_get(&daemon->priv->signals);
+        signal->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&daemon->priv->signals, head, signal));
 
-    return NULL;
+    if (head == NULL)
+        g_idle_add_full(G_PRIORITY_DEFAULT, daemon_flush_signals, g_object_ref(daemon), g_object_unref);
 }
 
-static gboolean 
-daemon_probe(OSProberOSProber *object, 
-             GDBusMethodInvocation *invocation) 
+static void
+daemon_emit_delta(Daemon *daemon, GVariant *result, gboolean added)
 {
-    Daemon *daemon = (Daemon *)object;
+#ifdef DEBUG
+    const gchar *part, *name, *shortname, *type;
+
+    g_variant_get(result, "(&s&s&s&s)", &part, &name, &shortname, &type);
+    g_print("DEBUG: %s %s (%s) at %s\n", added ? "added" : "removed", name, shortname, part);
+#endif
+    daemon_queue_signal(daemon, 
+                        added ? DAEMON_SIGNAL_ADDED : DAEMON_SIGNAL_REMOVED, 
+                        result);
+}
+
+static gboolean
+results_have_linux(GPtrArray *results)
+{
+    const gchar *type;
+    guint i;
+
+    for (i = 0; results && i < results->len; i++) {
+        g_variant_get_child(g_ptr_array_index(results, i), 3, "&s", &type);
+        if (g_strcmp0(type, "linux") == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
 
-    g_thread_new(NULL, osprober_routine, daemon);
+/* Compare what a partition holds now with what was announced for it
+ * before, and only emit the difference.  results is NULL when the
+ * partition went away.
+ */
+static void
+daemon_update_partition(Daemon *daemon, Partition *partition, GPtrArray *results)
+{
+    const gchar *name = partition->name;
+    GPtrArray *known;
+    guint i;
+
+    g_mutex_lock(&daemon->priv->lock);
+    result_table_remove(daemon->priv->table, name);
+    for (i = 0; results && i < results->len; i++) {
+        result_table_add(daemon->priv->table, 
+                         g_ptr_array_index(results, i), 
+                         name, 
+                         partition->partuuid);
+    }
+    known = g_hash_table_lookup(daemon->priv->partitions, name);
+    if (known) {
+        for (i = 0; i < known->len; i++) {
+            if (results == NULL || !results_contain(results, g_ptr_array_index(known, i))) {
+                daemon_emit_delta(daemon, g_ptr_array_index(known, i), FALSE);
+                result_labels_release(daemon->priv->labels, g_ptr_array_index(known, i));
+            }
+        }
+    }
+    if (results) {
+        for (i = 0; i < results->len; i++) {
+            if (known == NULL || !results_contain(known, g_ptr_array_index(results, i)))
+                daemon_emit_delta(daemon, g_ptr_array_index(results, i), TRUE);
+            result_labels_hold(daemon->priv->labels, g_ptr_array_index(results, i));
+        }
+        g_hash_table_replace(daemon->priv->partitions, 
+                             g_strdup(name), 
+                             g_ptr_array_ref(results));
+    } else {
+        g_hash_table_remove(daemon->priv->partitions, name);
+    }
+    if (!results_have_linux(results))
+        g_hash_table_remove(daemon->priv->boot_entries, name);
+    g_mutex_unlock(&daemon->priv->lock);
+}
+
+/* Keep the kernels read on a partition, and announce them when they
+ * changed.  Only a partition known to hold a Linux keeps any, entries
+ * NULL drops them.
+ */
+static void
+daemon_set_boot_entries(Daemon *daemon, Partition *partition, GVariant *entries)
+{
+    GPtrArray *known;
+    GVariant *old;
+    gboolean changed = FALSE;
+
+    g_mutex_lock(&daemon->priv->lock);
+    known = g_hash_table_lookup(daemon->priv->partitions, partition->name);
+    if (entries && results_have_linux(known)) {
+        old = g_hash_table_lookup(daemon->priv->boot_entries, partition->name);
+        changed = old == NULL || !g_variant_equal(old, entries);
+        g_hash_table_replace(daemon->priv->boot_entries, 
+                             g_strdup(partition->name), 
+                             g_variant_ref(entries));
+    } else {
+        g_hash_table_remove(daemon->priv->boot_entries, partition->name);
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (changed) {
+#ifdef DEBUG
+        g_print("DEBUG: %" G_GSIZE_FORMAT " kernels at %s\n", 
+                g_variant_n_children(entries), partition->device);
+#endif
+        daemon_queue_signal(daemon, 
+                            DAEMON_SIGNAL_BOOT_ENTRIES_FOUND, 
+                            g_variant_new("(s@a(ssssss))", partition->device, entries));
+    }
+}
+
+/* Announce the removal of the partitions a scan did not find anymore.
+ * devices limits it to the devices a partial scan looked at.
+ */
+static void
+daemon_forget_partitions(Daemon *daemon, GPtrArray *partitions, GHashTable *devices)
+{
+    GHashTable *seen;
+    GHashTableIter iter;
+    const gchar *name;
+    GPtrArray *known;
+    guint i;
+
+    seen = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < partitions->len; i++)
+        g_hash_table_add(seen, ((Partition *)g_ptr_array_index(partitions, i))->name);
+
+    g_mutex_lock(&daemon->priv->lock);
+    g_hash_table_iter_init(&iter, daemon->priv->partitions);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&name, (gpointer *)&known)) {
+        if (g_hash_table_contains(seen, name))
+            continue;
+        if (devices && !g_hash_table_contains(devices, name))
+            continue;
+        for (i = 0; i < known->len; i++) {
+            daemon_emit_delta(daemon, g_ptr_array_index(known, i), FALSE);
+            result_labels_release(daemon->priv->labels, g_ptr_array_index(known, i));
+        }
+        result_table_remove(daemon->priv->table, name);
+        g_hash_table_remove(daemon->priv->boot_entries, name);
+        g_hash_table_iter_remove(&iter);
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    g_hash_table_destroy(seen);
+}
+
+/* Whether a result of os-prober is on one of the devices of the job,
+ * os-prober itself cannot be told which to probe.
+ */
+static gboolean
+probe_job_has_device(ProbeJob *job, const gchar *part)
+{
+    gchar *device = g_strndup(part, strcspn(part, "@"));
+    gchar *real = realpath(device, NULL);
+    gchar *name = g_path_get_basename(real ? real : device);
+    gchar *disk = engine_get_disk(name);
+    gboolean ret;
+
+    ret = g_hash_table_contains(job->devices, name) ||
+          g_hash_table_contains(job->devices, disk);
+    g_free(disk);
+    g_free(name);
+    free(real);
+    g_free(device);
+
+    return ret;
+}
+
+static gboolean
+probe_job_wants(ProbeJob *job, const gchar *part, const gchar *shortname, const gchar *type)
+{
+    gchar **os_type;
+
+    if (job->devices && !probe_job_has_device(job, part))
+        return FALSE;
+    if (job->os_types == NULL)
+        return TRUE;
+
+    for (os_type = job->os_types; *os_type; os_type++) {
+        if (g_ascii_strcasecmp(*os_type, shortname) == 0 ||
+            g_ascii_strcasecmp(*os_type, type) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Hand one (ssss) record to every task attached to the job, and keep it
+ * for the tasks and ProbeSync callers still to come.  A job wanting only
+ * so many matches stops once it has them.
+ */
+static void
+osprober_emit_result(ProbeJob *job, GVariant *result)
+{
+    const gchar *part, *name, *shortname, *type;
+    gboolean satisfied = FALSE;
+    guint i;
+
+    g_variant_get(result, "(&s&s&s&s)", &part, &name, &shortname, &type);
+    if (!probe_job_wants(job, part, shortname, type))
+        return;
+#ifdef DEBUG
+    g_print("DEBUG: %s (%s) at %s\n", name, shortname, part);
+#endif
+    g_mutex_lock(&job->lock);
+    if (job->max_matches && job->matches >= job->max_matches) {
+        g_mutex_unlock(&job->lock);
+        return;
+    }
+    job->matches++;
+    g_ptr_array_add(job->results, g_variant_ref(result));
+    for (i = 0; i < job->tasks->len; i++)
+        task_found(g_ptr_array_index(job->tasks, i), part, name, shortname, type);
+    if (job->max_matches && job->matches == job->max_matches)
+        satisfied = job->satisfied = TRUE;
+    g_mutex_unlock(&job->lock);
+
+    /* the cancel handlers of the engine run right here */
+    if (satisfied) {
+#ifdef DEBUG
+        g_print("DEBUG: %u matches found, stopping the scan\n", job->max_matches);
+#endif
+        g_cancellable_cancel(job->cancellable);
+    }
+}
+
+/* The record with its short name numbered against every label the
+ * daemon has handed out, so that a partition keeps its label from one
+ * scan to the next and a partial scan gives no label another partition
+ * holds.  The records of the host are numbered in partition order, see
+ * probe_job_release().  The disk images are numbered on their own.
+ */
+static GVariant *
+probe_job_label(ProbeJob *job, GVariant *result)
+{
+    Daemon *daemon = job->daemon;
+    GVariant *numbered;
+
+    if (job->images) {
+        g_mutex_lock(&job->lock);
+        numbered = result_labels_number(job->labels, result);
+        g_mutex_unlock(&job->lock);
+        return numbered;
+    }
+
+    g_mutex_lock(&daemon->priv->lock);
+    numbered = result_labels_number(daemon->priv->labels, result);
+    g_mutex_unlock(&daemon->priv->lock);
+
+    g_mutex_lock(&job->lock);
+    g_ptr_array_add(job->claimed, g_variant_ref(numbered));
+    g_mutex_unlock(&job->lock);
+
+    return numbered;
+}
+
+/* Give back the labels of what the job found but did not keep, for a
+ * partition which failed or a scan cancelled halfway.  Called with the
+ * daemon lock held, once the workers of the job are done.
+ */
+static void
+probe_job_release_labels(ProbeJob *job)
+{
+    Daemon *daemon = job->daemon;
+    GHashTableIter iter;
+    GPtrArray *known;
+    GVariant *claimed;
+    gboolean kept;
+    guint i;
+
+    for (i = 0; i < job->claimed->len; i++) {
+        claimed = g_ptr_array_index(job->claimed, i);
+        kept = FALSE;
+        g_hash_table_iter_init(&iter, daemon->priv->partitions);
+        while (!kept && g_hash_table_iter_next(&iter, NULL, (gpointer *)&known))
+            kept = results_contain(known, claimed);
+        if (!kept)
+            result_labels_release(daemon->priv->labels, claimed);
+    }
+}
+
+/* Add result to what table holds for partition, job->lock held */
+static void
+probe_job_keep(GHashTable *table, Partition *partition, GVariant *result)
+{
+    GPtrArray *results = g_hash_table_lookup(table, partition);
+
+    if (results == NULL) {
+        results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+        g_hash_table_insert(table, partition, results);
+    }
+    g_ptr_array_add(results, g_variant_ref(result));
+}
+
+/* Called for every line of prober output, from as many threads as the
+ * engine runs partitions at once.
+ */
+static void
+osprober_emit_line(Partition *partition, const gchar *line, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+    GVariant *result = NULL;
+
+    g_mutex_lock(&job->lock);
+    result = result_table_add_line(job->table, 
+                                   line, 
+                                   partition ? partition->name : NULL, 
+                                   partition ? partition->partuuid : NULL);
+    /* numbered and announced once the partitions before it are done */
+    if (result && partition)
+        probe_job_keep(job->pending, partition, result);
+    g_mutex_unlock(&job->lock);
+    if (result == NULL)
+        return;
+
+    if (partition == NULL)
+        osprober_emit_result(job, result);
+    g_variant_unref(result);
+    result = NULL;
+}
+
+static void
+osprober_emit_error(const gchar *message, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+    guint i;
+
+    g_print("ERROR: %s\n", message);
+    g_mutex_lock(&job->lock);
+    for (i = 0; i < job->tasks->len; i++)
+        task_error(g_ptr_array_index(job->tasks, i), message);
+    g_mutex_unlock(&job->lock);
+}
+
+static void
+osprober_emit_progress(guint done, guint total, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+    guint i;
+
+    g_mutex_lock(&job->lock);
+    for (i = 0; i < job->tasks->len; i++)
+        task_progress(g_ptr_array_index(job->tasks, i), done, total);
+    g_mutex_unlock(&job->lock);
+}
+
+static void
+probe_job_set_state(ProbeJob *job, Partition *partition, ProbeState state)
+{
+    guint states;
+
+    g_mutex_lock(&job->lock);
+    states = GPOINTER_TO_UINT(g_hash_table_lookup(job->states, partition));
+    g_hash_table_insert(job->states, partition, GUINT_TO_POINTER(states | state));
+    g_mutex_unlock(&job->lock);
+}
+
+static gboolean
+osprober_lookup(Partition *partition, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+    GPtrArray *results = NULL;
+    guint i;
+
+    if (!cache_lookup(job->daemon->priv->cache, partition, &results))
+        return FALSE;
+
+#ifdef DEBUG
+    g_print("DEBUG: %s unchanged, answered from cache\n", partition->device);
+#endif
+    /* numbered along with what the scan finds, as if probed again */
+    g_mutex_lock(&job->lock);
+    for (i = 0; i < results->len; i++)
+        probe_job_keep(job->pending, partition, g_ptr_array_index(results, i));
+    g_mutex_unlock(&job->lock);
+    probe_job_set_state(job, partition, PROBE_STATE_ANSWERED);
+    g_ptr_array_unref(results);
+
+    return TRUE;
+}
+
+static void
+osprober_probed(Partition *partition, gpointer user_data)
+{
+    probe_job_set_state((ProbeJob *)user_data, partition, PROBE_STATE_PROBED);
+}
+
+/* Number and announce what a partition holds, and keep it if it was
+ * probed in full or answered from the cache.  What a partition which
+ * failed gave is announced all the same, its labels go back at the end
+ * of the job.
+ */
+static void
+probe_job_release_partition(ProbeJob *job, Partition *partition, guint states)
+{
+    GPtrArray *results = NULL;
+    GPtrArray *numbered = NULL;
+    GVariant *entries;
+    guint i;
+
+    g_mutex_lock(&job->lock);
+    results = g_hash_table_lookup(job->pending, partition);
+    if (results)
+        g_ptr_array_ref(results);
+    else
+        results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    entries = g_hash_table_lookup(job->boot_entries, partition);
+    if (entries)
+        g_variant_ref(entries);
+    g_mutex_unlock(&job->lock);
+
+    numbered = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    for (i = 0; i < results->len; i++) {
+        g_ptr_array_add(numbered, probe_job_label(job, g_ptr_array_index(results, i)));
+        osprober_emit_result(job, g_ptr_array_index(numbered, i));
+    }
+
+    if (states & PROBE_STATE_ANSWERED) {
+        daemon_update_partition(job->daemon, partition, numbered);
+    } else if (states & PROBE_STATE_PROBED) {
+        /* the cache keeps the short names unnumbered, for the next scan
+         * to number them again
+         */
+        cache_store(job->daemon->priv->cache, partition, results);
+        daemon_update_partition(job->daemon, partition, numbered);
+
+        /* probed again, the kernels it had before are gone with the rest */
+        daemon_set_boot_entries(job->daemon, partition, entries);
+    }
+    if (entries)
+        g_variant_unref(entries);
+    g_ptr_array_unref(numbered);
+    g_ptr_array_unref(results);
+}
+
+/* Send out the records of the partitions visited, in the order of the
+ * scan, up to the first one still being probed: like os-prober, the
+ * first Debian gets Debian and the next Debian1, whichever worker
+ * finishes first.  all sends the rest too, once the engine is done.
+ */
+static void
+probe_job_release(ProbeJob *job, gboolean all)
+{
+    Partition *partition;
+    guint states;
+
+    g_mutex_lock(&job->release_lock);
+    for (;;) {
+        g_mutex_lock(&job->lock);
+        if (job->order == NULL || job->released >= job->order->len) {
+            g_mutex_unlock(&job->lock);
+            break;
+        }
+        partition = g_ptr_array_index(job->order, job->released);
+        states = GPOINTER_TO_UINT(g_hash_table_lookup(job->states, partition));
+        if (!all && !(states & PROBE_STATE_VISITED)) {
+            g_mutex_unlock(&job->lock);
+            break;
+        }
+        job->released++;
+        g_mutex_unlock(&job->lock);
+
+        probe_job_release_partition(job, partition, states);
+    }
+    g_mutex_unlock(&job->release_lock);
+}
+
+/* The kernels of a Linux as a(ssssss), from linux-boot-prober lines */
+static GVariant *
+boot_entries_to_variant(GPtrArray *lines)
+{
+    GVariantBuilder builder;
+    gchar **fields;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssssss)"));
+    for (i = 0; i < lines->len; i++) {
+        fields = g_strsplit(g_ptr_array_index(lines, i), ":", 6);
+        if (g_strv_length(fields) >= 5) {
+            g_variant_builder_add(&builder, "(ssssss)", 
+                                  fields[0], fields[1], fields[2], fields[3], fields[4], 
+                                  fields[5] ? fields[5] : "");
+        }
+        g_strfreev(fields);
+    }
+
+    return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+/* The kernels the engine read while it had the Linux open, kept until
+ * the partition is probed.
+ */
+static void
+osprober_boot_entries(Partition *partition, GPtrArray *lines, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+
+    g_mutex_lock(&job->lock);
+    g_hash_table_replace(job->boot_entries, partition, boot_entries_to_variant(lines));
+    g_mutex_unlock(&job->lock);
+}
+
+static void
+osprober_visited(Partition *partition, gint64 usec, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+
+    if (job->daemon->priv->stats)
+        stats_partition(job->daemon->priv->stats, partition->device, usec);
+
+    probe_job_set_state(job, partition, PROBE_STATE_VISITED);
+    probe_job_release(job, FALSE);
+}
+
+static void
+osprober_phase(EnginePhase phase, gint64 usec, gpointer user_data)
+{
+    ProbeJob *job = (ProbeJob *)user_data;
+
+    if (job->daemon->priv->stats)
+        stats_phase(job->daemon->priv->stats, phase, usec);
+}
+
+static const EngineCallbacks osprober_callbacks = {
+    osprober_lookup,
+    osprober_emit_line,
+    osprober_emit_error,
+    osprober_probed,
+    osprober_emit_progress,
+    osprober_visited,
+    osprober_phase,
+    osprober_boot_entries,
+};
+
+/* Keep the partitions a uevent was about, or which sit on a disk a
+ * uevent was about.
+ */
+static void
+osprober_filter_partitions(GPtrArray *partitions, GHashTable *devices)
+{
+    Partition *partition;
+    guint i = 0;
+
+    while (i < partitions->len) {
+        partition = g_ptr_array_index(partitions, i);
+        if (g_hash_table_contains(devices, partition->name) ||
+            g_hash_table_contains(devices, partition->disk))
+            i++;
+        else
+            g_ptr_array_remove_index(partitions, i);
+    }
+}
+
+/* Leave out the disk images ProbeImages has attached, they are not the
+ * host's.
+ */
+static void
+daemon_filter_images(Daemon *daemon, GPtrArray *partitions)
+{
+    Partition *partition;
+    guint i = 0;
+
+    g_mutex_lock(&daemon->priv->lock);
+    while (i < partitions->len) {
+        partition = g_ptr_array_index(partitions, i);
+        if (g_hash_table_contains(daemon->priv->images, partition->disk))
+            g_ptr_array_remove_index(partitions, i);
+        else
+            i++;
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+}
+
+/* A ProbeImages job, its images probed image_workers at a time */
+typedef struct {
+    ProbeJob *job;
+    guint total;
+    volatile gint done;
+} ImageRun;
+
+typedef struct {
+    ProbeJob *job;
+    Image *image;
+} ImageProbe;
+
+/* The part of a result on an image is the image, then the partition
+ * number on it, rather than the loop device gone by now:
+ * /srv/vm.img@p1, /srv/vm.img@p1@/EFI/debian/grubx64.efi, or the image
+ * alone when it has no partition table.
+ */
+static gchar *
+image_tag_part(ImageProbe *probe, Partition *partition, const gchar *part)
+{
+    const gchar *number = partition->name + strlen(probe->image->name);
+    const gchar *rest = part;
+
+    if (g_str_has_prefix(part, partition->device))
+        rest = part + strlen(partition->device);
+
+    return g_strdup_printf("%s%s%s%s", probe->image->path, *number ? "@" : "", number, rest);
+}
+
+static void
+image_emit_line(Partition *partition, const gchar *line, gpointer user_data)
+{
+    ImageProbe *probe = (ImageProbe *)user_data;
+    ProbeJob *job = probe->job;
+    GVariant *result = NULL;
+    GVariant *tagged = NULL;
+    GVariant *numbered = NULL;
+    const gchar *part, *name, *shortname, *type;
+    gchar *tag;
+
+    g_mutex_lock(&job->lock);
+    result = result_table_add_line(job->table, line, NULL, NULL);
+    g_mutex_unlock(&job->lock);
+    if (result == NULL || partition == NULL) {
+        if (result)
+            g_variant_unref(result);
+        return;
+    }
+
+    g_variant_get(result, "(&s&s&s&s)", &part, &name, &shortname, &type);
+    tag = image_tag_part(probe, partition, part);
+    tagged = g_variant_ref_sink(g_variant_new("(ssss)", tag, name, shortname, type));
+    numbered = probe_job_label(job, tagged);
+    osprober_emit_result(job, numbered);
+    g_variant_unref(numbered);
+    g_variant_unref(tagged);
+    g_variant_unref(result);
+    g_free(tag);
+}
+
+static void
+image_emit_error(const gchar *message, gpointer user_data)
+{
+    ImageProbe *probe = (ImageProbe *)user_data;
+    gchar *tagged = g_strdup_printf("%s: %s", probe->image->path, message);
+
+    osprober_emit_error(tagged, probe->job);
+    g_free(tagged);
+}
+
+/* Nothing of an image goes to the cache or the results of the host */
+static const EngineCallbacks image_callbacks = {
+    NULL,
+    image_emit_line,
+    image_emit_error,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
+
+/* Attach one image, probe its partitions like those of a disk, detach */
+static void
+image_routine(gpointer data, gpointer user_data)
+{
+    const gchar *path = (const gchar *)data;
+    ImageRun *run = (ImageRun *)user_data;
+    ProbeJob *job = run->job;
+    Daemon *daemon = job->daemon;
+    ImageProbe probe = { job, NULL };
+    GPtrArray *partitions = NULL;
+    gchar *message = NULL;
+    GError *error = NULL;
+    gint64 start = g_get_monotonic_time();
+
+    if (g_cancellable_is_cancelled(job->cancellable))
+        goto out;
+
+    probe.image = image_attach(path, &error);
+    if (probe.image == NULL) {
+        message = g_strdup_printf("%s: %s", path, error->message);
+        osprober_emit_error(message, job);
+        g_free(message);
+        g_error_free(error);
+        error = NULL;
+        goto out;
+    }
+    g_mutex_lock(&daemon->priv->lock);
+    g_hash_table_add(daemon->priv->images, g_strdup(probe.image->name));
+    g_mutex_unlock(&daemon->priv->lock);
+
+    partitions = engine_list_disk(probe.image->name);
+    engine_run(partitions, &image_callbacks, &probe, job->cancellable);
+    g_ptr_array_free(partitions, TRUE);
+    partitions = NULL;
+
+    g_mutex_lock(&daemon->priv->lock);
+    g_hash_table_remove(daemon->priv->images, probe.image->name);
+    g_mutex_unlock(&daemon->priv->lock);
+    image_detach(probe.image);
+    probe.image = NULL;
+    trace_span("job", "image", start, path);
+
+out:
+    osprober_emit_progress(g_atomic_int_add(&run->done, 1) + 1, run->total, job);
+}
+
+/* Probe the disk images of a ProbeImages job, several at a time, each
+ * read-only on a loop device of its own for as long as it is probed.
+ */
+static void
+osprober_probe_images(Daemon *daemon, ProbeJob *job)
+{
+    ImageRun run;
+    GThreadPool *pool;
+    GError *error = NULL;
+    guint i;
+
+    run.job = job;
+    run.total = g_strv_length(job->images);
+    run.done = 0;
+    osprober_emit_progress(0, run.total, job);
+
+    pool = g_thread_pool_new(image_routine, 
+                             &run, 
+                             MIN(daemon->priv->image_workers, MAX(run.total, 1)), 
+                             FALSE, 
+                             &error);
+    if (pool == NULL) {
+        osprober_emit_error(error->message, job);
+        g_error_free(error);
+        error = NULL;
+    }
+    for (i = 0; job->images[i]; i++) {
+        if (pool)
+            g_thread_pool_push(pool, job->images[i], NULL);
+        else
+            image_routine(job->images[i], &run);
+    }
+    if (pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+/* Whether the daemon runs the tests of os-prober itself, rather than
+ * one os-prober run for all partitions.
+ */
+static gboolean
+daemon_runs_tests(Daemon *daemon)
+{
+    return daemon->priv->prober == NULL && engine_get_probes_dir() != NULL;
+}
+
+static void 
+osprober_routine(gpointer data, gpointer user_data) 
+{
+    ProbeJob *job = (ProbeJob *)data;
+    Daemon *daemon = (Daemon *)user_data;
+    const gchar *argv[] = { daemon->priv->prober ? daemon->priv->prober : DAEMON_PROBER, NULL };
+    GPtrArray *partitions = NULL;
+    int status = -1;
+    gboolean success = FALSE;
+    gchar *message = NULL;
+    GError *error = NULL;
+    Stats *stats = daemon->priv->stats;
+    gint64 start = g_get_monotonic_time();
+    gint64 umount_start;
+    gint64 io_stall, cpu_stall;
+
+    if (stats)
+        stats_probe_started(stats);
+    budget_limit_disks();
+    budget_start_stalls();
+
+    if (job->images) {
+        /* the engine reads the images whatever the prober is */
+        osprober_probe_images(daemon, job);
+        success = TRUE;
+        status = 0;
+    } else if (daemon_runs_tests(daemon)) {
+        /* Run the per-partition tests of os-prober ourselves, several
+         * partitions at a time.
+         */
+        partitions = engine_list_partitions();
+        daemon_filter_images(daemon, partitions);
+        if (job->devices)
+            osprober_filter_partitions(partitions, job->devices);
+        prescan_filter(partitions);
+        /* numbered in the order they are probed in, which is that of
+         * engine_list_partitions() unless the likely ones go first
+         */
+        if (job->priority)
+            engine_sort_partitions(partitions);
+        job->order = partitions;
+        engine_run(partitions, &osprober_callbacks, job, job->cancellable);
+        /* those never visited, the scan cancelled before them */
+        probe_job_release(job, TRUE);
+        job->order = NULL;
+        daemon_forget_partitions(daemon, partitions, job->devices);
+        /* a cancelled scan did not see everything, the store is kept */
+        if (job->devices == NULL && !g_cancellable_is_cancelled(job->cancellable)) {
+            cache_prune(daemon->priv->cache, partitions);
+            if (!cache_save(daemon->priv->cache, &error)) {
+                g_warning("Failed to save the cache: %s", error->message);
+                g_error_free(error);
+                error = NULL;
+            }
+        }
+        g_ptr_array_free(partitions, TRUE);
+        partitions = NULL;
+        success = TRUE;
+        status = 0;
+    } else {
+        /* os-prober prints one line per OS as soon as it has visited
+         * the partition, so read its stdout while it runs and emit Found
+         * for every completed line instead of waiting for it to exit.
+         */
+        if (!engine_spawn(argv, NULL, NULL, &osprober_callbacks, job, 
+                          job->cancellable, &success, &error)) {
+            if (!g_cancellable_is_cancelled(job->cancellable))
+                osprober_emit_error(error->message, job);
+            message = g_strdup(error->message);
+            g_error_free(error);
+            error = NULL;
+        }
+
+        /* stopped once it found what the caller wanted */
+        if (job->satisfied)
+            success = TRUE;
+        status = success ? 0 : -1;
+
+        /* os-prober runs in a mount namespace of its own, whatever it
+         * left mounted goes away with it.  A lazy detach covers the case
+         * it could not have one, it returns at once even if the device
+         * behind the mount point does not answer anymore.  A stand-in
+         * prober does not mount anything.
+         */
+        if (!daemon->priv->prober) {
+            umount_start = g_get_monotonic_time();
+            umount2(DAEMON_MOUNT_POINT, MNT_DETACH);
+            trace_span("engine", "umount", umount_start, DAEMON_MOUNT_POINT);
+            if (stats)
+                stats_phase(stats, ENGINE_PHASE_UMOUNT, g_get_monotonic_time() - umount_start);
+        }
+    }
+
+    /* Detach the job before Finished goes out, so a Probe call that
+     * arrives after it starts a fresh scan instead of attaching to one
+     * that is already over.
+     */
+    g_mutex_lock(&daemon->priv->lock);
+    if (daemon->priv->job == job)
+        daemon->priv->job = NULL;
+    g_ptr_array_remove(daemon->priv->jobs, job);
+    probe_job_release_labels(job);
+    g_mutex_unlock(&daemon->priv->lock);
+
+    /* counted before Finished, a caller reading Stats then sees them */
+    budget_take_stalls(&io_stall, &cpu_stall);
+#ifdef DEBUG
+    g_print("DEBUG: stalled %.3fs on I/O, %.3fs on CPU\n", 
+            io_stall / (gdouble)G_USEC_PER_SEC, 
+            cpu_stall / (gdouble)G_USEC_PER_SEC);
+#endif
+    if (stats)
+        stats_stalls(stats, io_stall, cpu_stall);
+
+    probe_job_complete(job, status, success, message);
+    if (stats)
+        stats_probe_finished(stats, g_get_monotonic_time() - start);
+    trace_span("job", job->images ? "images" : job->devices ? "rescan" : "scan", start, NULL);
+    if (message) g_free(message); message = NULL;
+    probe_job_free(job);
+    job = NULL;
+}
+
+/* Single flight: callers arriving while a scan is running attach to it
+ * and get its results, only the first one queues a job on the pool.
+ * Called with the daemon lock held.
+ */
+static ProbeJob *
+probe_job_ensure(Daemon *daemon, GError **error)
+{
+    ProbeJob *job = daemon->priv->job;
+
+    if (job)
+        return job;
+
+    if (daemon->priv->pool == NULL) {
+        g_set_error(error, ERROR, ERROR_FAILED, "no worker available");
+        return NULL;
+    }
+
+    job = probe_job_new(daemon);
+    if (!g_thread_pool_push(daemon->priv->pool, job, error)) {
+        probe_job_free(job);
+        return NULL;
+    }
+    daemon->priv->job = job;
+
+    return job;
+}
+
+/* Probe the devices uevents were received for.  The job is not the
+ * single-flight one, Probe callers keep getting full scans.  What it
+ * finds is numbered against the labels of the partitions it leaves
+ * alone, see probe_job_label().
+ */
+static gboolean
+daemon_flush_uevents(gpointer user_data)
+{
+    Daemon *daemon = (Daemon *)user_data;
+    ProbeJob *job = NULL;
+    GError *error = NULL;
+    GHashTableIter iter;
+    const gchar *name;
+
+    daemon->priv->changed_source = 0;
+
+    /* kernel uevents come before udev has made the nodes of a new
+     * device-mapper device, probed now it would have another name
+     */
+    g_hash_table_iter_init(&iter, daemon->priv->changed);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&name, NULL)) {
+        if (!engine_device_ready(name) && daemon->priv->changed_waits < DAEMON_UEVENT_WAITS) {
+            daemon->priv->changed_waits++;
+            daemon->priv->changed_source = g_timeout_add(DAEMON_UEVENT_DELAY_MS,
+                                                         daemon_flush_uevents,
+                                                         daemon);
+            return G_SOURCE_REMOVE;
+        }
+    }
+    daemon->priv->changed_waits = 0;
+
+    g_mutex_lock(&daemon->priv->lock);
+    if (daemon->priv->rescan || !daemon_runs_tests(daemon)) {
+        /* events were lost, or os-prober can only run as a whole */
+        job = probe_job_ensure(daemon, &error);
+    } else if (daemon->priv->pool) {
+        job = probe_job_new(daemon);
+        job->devices = daemon->priv->changed;
+        daemon->priv->changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        if (!g_thread_pool_push(daemon->priv->pool, job, &error)) {
+            probe_job_free(job);
+            job = NULL;
+        }
+    }
+    daemon->priv->rescan = FALSE;
+    g_hash_table_remove_all(daemon->priv->changed);
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (error) {
+        g_warning("Failed to probe changed devices: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+daemon_on_uevent(const gchar *action, const gchar *name, gpointer user_data)
+{
+    Daemon *daemon = (Daemon *)user_data;
+
+    if (name)
+        g_hash_table_add(daemon->priv->changed, g_strdup(name));
+    else
+        daemon->priv->rescan = TRUE;
+
+    if (daemon->priv->changed_source == 0) {
+        daemon->priv->changed_source = g_timeout_add(DAEMON_UEVENT_DELAY_MS,
+                                                     daemon_flush_uevents,
+                                                     daemon);
+    }
+}
+
+/* The owner of a task cancelled it: it leaves the job, which stops if
+ * it was the last one waiting.
+ */
+static void
+daemon_cancel_task(Task *task, gpointer user_data)
+{
+    Daemon *daemon = (Daemon *)user_data;
+    ProbeJob *job = NULL;
+    gboolean found = FALSE;
+    guint i;
+
+    g_object_ref(task);
+    g_mutex_lock(&daemon->priv->lock);
+    for (i = 0; i <= daemon->priv->jobs->len && !found; i++) {
+        job = i < daemon->priv->jobs->len ? g_ptr_array_index(daemon->priv->jobs, i) 
+                                          : daemon->priv->job;
+        if (job == NULL)
+            continue;
+        g_mutex_lock(&job->lock);
+        found = g_ptr_array_remove(job->tasks, task);
+        if (found)
+            probe_job_cancel_if_unwanted(daemon, job);
+        g_mutex_unlock(&job->lock);
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (found) {
+        task_error(task, "cancelled");
+        task_finish(task, -1);
+    }
+    g_object_unref(task);
+}
+
+typedef struct {
+    Daemon *daemon;
+    GDBusMethodInvocation *invocation;
+} ProbeDeadline;
+
+static void
+probe_deadline_free(gpointer data)
+{
+    ProbeDeadline *deadline = (ProbeDeadline *)data;
+
+    g_object_unref(deadline->invocation);
+    g_free(deadline);
+}
+
+/* The budget of a ProbeWithDeadline call ran out: answer with what was
+ * found so far, unless the job answered it already.  The invocation is
+ * referenced by the deadline so that its address cannot be reused by
+ * another call in the meantime.
+ */
+static gboolean
+probe_deadline_expired(gpointer user_data)
+{
+    ProbeDeadline *deadline = (ProbeDeadline *)user_data;
+    Daemon *daemon = deadline->daemon;
+    ProbeJob *job = NULL;
+    GVariant *results = NULL;
+
+    g_mutex_lock(&daemon->priv->lock);
+    job = daemon->priv->job;
+    if (job) {
+        g_mutex_lock(&job->lock);
+        if (g_ptr_array_remove(job->sync_invocations, deadline->invocation)) {
+            results = probe_job_get_results(job);
+            probe_job_cancel_if_unwanted(daemon, job);
+        }
+        g_mutex_unlock(&job->lock);
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (results) {
+#ifdef DEBUG
+        g_print("DEBUG: deadline reached, answering with partial results\n");
+#endif
+        trace_call_end(deadline->invocation);
+        osprober_osprober_complete_probe_with_deadline(OSPROBER_OSPROBER(daemon), 
+                                                       deadline->invocation, 
+                                                       results);
+        g_variant_unref(results);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Attach either a Task or a ProbeSync invocation to the running job */
+static gboolean
+probe_job_attach(Daemon *daemon, 
+                 GDBusMethodInvocation *invocation, 
+                 Task *task)
+{
+    GError *error = NULL;
+    ProbeJob *job = NULL;
+    GVariant *result;
+    const gchar *part, *name, *shortname, *type;
+    guint i;
+
+    g_mutex_lock(&daemon->priv->lock);
+    job = probe_job_ensure(daemon, &error);
+    if (job == NULL) {
+        g_mutex_unlock(&daemon->priv->lock);
+        throw_error(invocation, ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        error = NULL;
+        return FALSE;
+    }
+
+    g_mutex_lock(&job->lock);
+    if (task) {
+        /* A late task gets what the scan found so far, then the rest as
+         * it comes.
+         */
+        for (i = 0; i < job->results->len; i++) {
+            result = g_ptr_array_index(job->results, i);
+            g_variant_get(result, "(&s&s&s&s)", &part, &name, &shortname, &type);
+            task_found(task, part, name, shortname, type);
+        }
+        g_ptr_array_add(job->tasks, g_object_ref(task));
+    } else {
+        g_ptr_array_add(job->sync_invocations, invocation);
+    }
+    g_mutex_unlock(&job->lock);
+    g_mutex_unlock(&daemon->priv->lock);
+
+    return TRUE;
+}
+
+static gboolean 
+daemon_probe(OSProberOSProber *object, 
+             GDBusMethodInvocation *invocation) 
+{
+    Daemon *daemon = (Daemon *)object;
+    Task *task = NULL;
+    GError *error = NULL;
+    gint64 start = trace_now();
+
+    task = task_new(daemon->priv->bus_connection, 
+                    g_dbus_method_invocation_get_sender(invocation), 
+                    &error);
+    if (task == NULL) {
+        throw_error(invocation, ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        error = NULL;
+        return TRUE;
+    }
+
+    task_set_cancel_func(task, daemon_cancel_task, daemon);
+    if (probe_job_attach(daemon, invocation, task)) {
+        osprober_osprober_complete_probe(object, 
+                                         invocation, 
+                                         task_get_object_path(task));
+    } else {
+        g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(task));
+    }
+    g_object_unref(task);
+    trace_span("dbus", "Probe", start, g_dbus_method_invocation_get_sender(invocation));
+
+    return TRUE;
+}
+
+/* Read the options of ProbeWithOptions into a job of its own.  Returns
+ * FALSE when there is none, the job would be the shared one.
+ */
+static gboolean
+probe_job_set_options(ProbeJob *job, GVariant *options, GError **error)
+{
+    GVariantIter iter;
+    const gchar *key;
+    GVariant *value;
+    gboolean ret = FALSE;
+
+    g_variant_iter_init(&iter, options);
+    while (g_variant_iter_next(&iter, "{&sv}", &key, &value)) {
+        if (strcmp(key, "os-types") == 0 &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY)) {
+            g_strfreev(job->os_types);
+            job->os_types = g_variant_dup_strv(value, NULL);
+        } else if (strcmp(key, "max-matches") == 0 &&
+                   g_variant_is_of_type(value, G_VARIANT_TYPE_UINT32)) {
+            job->max_matches = g_variant_get_uint32(value);
+        } else if (strcmp(key, "priority") == 0 &&
+                   g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN)) {
+            job->priority = g_variant_get_boolean(value);
+        } else {
+            g_set_error(error, ERROR, ERROR_NOT_SUPPORTED, 
+                        "unsupported option %s of type %s", 
+                        key, g_variant_get_type_string(value));
+            g_variant_unref(value);
+            return FALSE;
+        }
+        g_variant_unref(value);
+        ret = TRUE;
+    }
+
+    return ret;
+}
+
+/* Start a job of its own for a Task of the caller, one not shared with
+ * the other callers.  Returns NULL once the error has been thrown.
+ */
+static Task *
+probe_job_start(Daemon *daemon, GDBusMethodInvocation *invocation, ProbeJob *job)
+{
+    Task *task = NULL;
+    GError *error = NULL;
+
+    task = task_new(daemon->priv->bus_connection, 
+                    g_dbus_method_invocation_get_sender(invocation), 
+                    &error);
+    if (task == NULL) {
+        probe_job_free(job);
+        throw_error(invocation, ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        error = NULL;
+        return NULL;
+    }
+    task_set_cancel_func(task, daemon_cancel_task, daemon);
+    g_ptr_array_add(job->tasks, g_object_ref(task));
+
+    g_mutex_lock(&daemon->priv->lock);
+    if (daemon->priv->pool == NULL) {
+        g_set_error(&error, ERROR, ERROR_FAILED, "no worker available");
+    } else if (g_thread_pool_push(daemon->priv->pool, job, &error)) {
+        g_ptr_array_add(daemon->priv->jobs, job);
+        job = NULL;
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (job) {
+        probe_job_free(job);
+        g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(task));
+        g_object_unref(task);
+        throw_error(invocation, ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        error = NULL;
+        return NULL;
+    }
+
+    return task;
+}
+
+/* Probe with a filter on what is found, or stopping early: such a scan
+ * does not see everything, it is not shared with the other callers.
+ */
+static gboolean 
+daemon_probe_with_options(OSProberOSProber *object, 
+                          GDBusMethodInvocation *invocation, 
+                          GVariant *options) 
+{
+    Daemon *daemon = (Daemon *)object;
+    ProbeJob *job = NULL;
+    Task *task = NULL;
+    GError *error = NULL;
+    gint64 start = trace_now();
+
+    job = probe_job_new(daemon);
+    if (!probe_job_set_options(job, options, &error)) {
+        probe_job_free(job);
+        if (error) {
+            throw_error(invocation, error->code, "%s", error->message);
+            g_error_free(error);
+            error = NULL;
+            return TRUE;
+        }
+        return daemon_probe(object, invocation);
+    }
+
+    task = probe_job_start(daemon, invocation, job);
+    if (task) {
+        osprober_osprober_complete_probe_with_options(object, 
+                                                      invocation, 
+                                                      task_get_object_path(task));
+        g_object_unref(task);
+    }
+    trace_span("dbus", "ProbeWithOptions", start, g_dbus_method_invocation_get_sender(invocation));
+
+    return TRUE;
+}
+
+/* The name of a block device (sda1, dm-0) given by its node, a link to
+ * it, its name or its PARTUUID.
+ */
+static gchar *
+daemon_resolve_device(const gchar *device, GError **error)
+{
+    gchar *path = NULL;
+    gchar *partuuid = NULL;
+    gchar *real = NULL;
+    gchar *name = NULL;
+
+    if (g_str_has_prefix(device, "PARTUUID=")) {
+        partuuid = g_ascii_strdown(device + strlen("PARTUUID="), -1);
+        path = g_build_filename("/dev/disk/by-partuuid", partuuid, NULL);
+    } else if (g_path_is_absolute(device)) {
+        path = g_strdup(device);
+    } else if (strchr(device, '/') == NULL) {
+        path = g_build_filename("/sys/class/block", device, NULL);
+        if (g_file_test(path, G_FILE_TEST_EXISTS))
+            name = g_strdup(device);
+        g_free(path);
+        partuuid = g_ascii_strdown(device, -1);
+        path = g_build_filename("/dev/disk/by-partuuid", partuuid, NULL);
+    }
+
+    if (name == NULL && path)
+        real = realpath(path, NULL);
+    if (real && g_str_has_prefix(real, "/dev/"))
+        name = g_path_get_basename(real);
+    free(real);
+    g_free(path);
+    g_free(partuuid);
+
+    if (name == NULL)
+        g_set_error(error, ERROR, ERROR_FAILED, "no such device: %s", device);
+
+    return name;
+}
+
+/* Probe only the given partitions, and the partitions of the given
+ * disks, the way devices are probed after a uevent.
+ */
+static gboolean 
+daemon_probe_devices(OSProberOSProber *object, 
+                     GDBusMethodInvocation *invocation, 
+                     const gchar * const *devices) 
+{
+    Daemon *daemon = (Daemon *)object;
+    ProbeJob *job = NULL;
+    Task *task = NULL;
+    GError *error = NULL;
+    gchar *name;
+    gint64 start = trace_now();
+    guint i;
+
+    if (devices[0] == NULL) {
+        throw_error(invocation, ERROR_FAILED, "no device to probe");
+        return TRUE;
+    }
+
+    job = probe_job_new(daemon);
+    job->devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; devices[i]; i++) {
+        name = daemon_resolve_device(devices[i], &error);
+        if (name == NULL) {
+            probe_job_free(job);
+            throw_error(invocation, error->code, "%s", error->message);
+            g_error_free(error);
+            error = NULL;
+            return TRUE;
+        }
+        g_hash_table_add(job->devices, name);
+    }
+
+    task = probe_job_start(daemon, invocation, job);
+    if (task) {
+        osprober_osprober_complete_probe_devices(object, 
+                                                 invocation, 
+                                                 task_get_object_path(task));
+        g_object_unref(task);
+    }
+    trace_span("dbus", "ProbeDevices", start, g_dbus_method_invocation_get_sender(invocation));
+
+    return TRUE;
+}
+
+typedef struct {
+    Daemon *daemon;
+    GDBusMethodInvocation *invocation;
+} ProbeImagesCall;
+
+/* The caller of ProbeImages turned out to be root: probe its images */
+static void
+daemon_probe_images_authorized(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    ProbeImagesCall *call = (ProbeImagesCall *)user_data;
+    GDBusMethodInvocation *invocation = call->invocation;
+    Daemon *daemon = call->daemon;
+    ProbeJob *job = NULL;
+    Task *task = NULL;
+    GVariant *reply;
+    GError *error = NULL;
+    gchar **paths = NULL;
+    guint32 uid = G_MAXUINT32;
+    guint i;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply == NULL) {
+        throw_error(invocation, ERROR_FAILED, "%s", error->message);
+        g_error_free(error);
+        error = NULL;
+        goto out;
+    }
+    g_variant_get(reply, "(u)", &uid);
+    g_variant_unref(reply);
+    if (uid != 0) {
+        throw_error(invocation, ERROR_PERMISSION_DENIED, "only root may probe disk images");
+        goto out;
+    }
+
+    g_variant_get(g_dbus_method_invocation_get_parameters(invocation), "(^as)", &paths);
+    if (paths[0] == NULL) {
+        throw_error(invocation, ERROR_FAILED, "no image to probe");
+        goto out;
+    }
+    for (i = 0; paths[i]; i++) {
+        if (!g_path_is_absolute(paths[i]) || 
+            !g_file_test(paths[i], G_FILE_TEST_IS_REGULAR)) {
+            throw_error(invocation, ERROR_FAILED, "not a disk image: %s", paths[i]);
+            goto out;
+        }
+    }
+
+    job = probe_job_new(daemon);
+    job->images = paths;
+    paths = NULL;
+
+    task = probe_job_start(daemon, invocation, job);
+    if (task) {
+        osprober_osprober_complete_probe_images(OSPROBER_OSPROBER(daemon), 
+                                                invocation, 
+                                                task_get_object_path(task));
+        g_object_unref(task);
+    }
+    trace_call_end(invocation);
+
+out:
+    g_strfreev(paths);
+    g_object_unref(invocation);
+    g_object_unref(daemon);
+    g_free(call);
+}
+
+/* Probe raw disk images rather than the block devices of the host, the
+ * results have the image for part.  The daemon opens, attaches and
+ * mounts them as root, whatever the caller could read itself, so only
+ * root may ask; the bus policy says so too.
+ */
+static gboolean 
+daemon_probe_images(OSProberOSProber *object, 
+                    GDBusMethodInvocation *invocation, 
+                    const gchar * const *paths) 
+{
+    Daemon *daemon = (Daemon *)object;
+    ProbeImagesCall *call = g_new0(ProbeImagesCall, 1);
+
+    call->daemon = g_object_ref(daemon);
+    call->invocation = g_object_ref(invocation);
+    trace_call_begin(invocation);
+    g_dbus_connection_call(daemon->priv->bus_connection, 
+                           "org.freedesktop.DBus", 
+                           "/org/freedesktop/DBus", 
+                           "org.freedesktop.DBus", 
+                           "GetConnectionUnixUser", 
+                           g_variant_new("(s)", g_dbus_method_invocation_get_sender(invocation)), 
+                           G_VARIANT_TYPE("(u)"), 
+                           G_DBUS_CALL_FLAGS_NONE, 
+                           -1, 
+                           NULL, 
+                           daemon_probe_images_authorized, 
+                           call);
+
+    return TRUE;
+}
+
+static gboolean 
+daemon_probe_sync(OSProberOSProber *object, 
+                  GDBusMethodInvocation *invocation) 
+{
+    trace_call_begin(invocation);
+    probe_job_attach((Daemon *)object, invocation, NULL);
+
+    return TRUE;
+}
+
+static gboolean 
+daemon_probe_with_deadline(OSProberOSProber *object, 
+                           GDBusMethodInvocation *invocation, 
+                           guint timeout) 
+{
+    ProbeDeadline *deadline = NULL;
+
+    trace_call_begin(invocation);
+    if (!probe_job_attach((Daemon *)object, invocation, NULL))
+        return TRUE;
+
+    deadline = g_new0(ProbeDeadline, 1);
+    deadline->daemon = (Daemon *)object;
+    deadline->invocation = g_object_ref(invocation);
+    g_timeout_add_full(G_PRIORITY_DEFAULT, 
+                       timeout, 
+                       probe_deadline_expired, 
+                       deadline, 
+                       probe_deadline_free);
+
+    return TRUE;
+}
+
+/* The cache keeps the short names unnumbered: number them as a Probe
+ * would, the partitions known keeping their labels and the others taking
+ * the first free ones, in the order the engine lists the devices in.
+ * Nothing is held for them, the next scan numbers them for good.
+ */
+static GVariant *
+daemon_number_cached(Daemon *daemon, GVariant *cached)
+{
+    ResultLabels *labels = result_labels_new();
+    GHashTableIter known_iter;
+    GPtrArray *partitions;
+    GPtrArray *devices;
+    GPtrArray *known;
+    GVariant *numbered;
+    guint i;
+
+    partitions = engine_list_partitions();
+    devices = g_ptr_array_new();
+    for (i = 0; i < partitions->len; i++)
+        g_ptr_array_add(devices, ((Partition *)g_ptr_array_index(partitions, i))->device);
+
+    g_mutex_lock(&daemon->priv->lock);
+    g_hash_table_iter_init(&known_iter, daemon->priv->partitions);
+    while (g_hash_table_iter_next(&known_iter, NULL, (gpointer *)&known)) {
+        for (i = 0; i < known->len; i++)
+            result_labels_hold(labels, g_ptr_array_index(known, i));
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+    numbered = result_labels_number_all(labels, cached, devices);
+
+    g_ptr_array_free(devices, TRUE);
+    g_ptr_array_free(partitions, TRUE);
+    result_labels_free(labels);
+    g_variant_unref(g_variant_ref_sink(cached));
+
+    return numbered;
+}
+
+static gboolean 
+daemon_get_cached_results(OSProberOSProber *object, 
+                          GDBusMethodInvocation *invocation) 
+{
+    Daemon *daemon = (Daemon *)object;
+    gint64 start = trace_now();
+
+    osprober_osprober_complete_get_cached_results(object, 
+                                                  invocation, 
+                                                  daemon_number_cached(daemon, 
+                                                                       cache_get_results(daemon->priv->cache)));
+    trace_span("dbus", "GetCachedResults", start, g_dbus_method_invocation_get_sender(invocation));
+
+    return TRUE;
+}
+
+/* What the daemon knows of a partition, by its device, name or PARTUUID,
+ * or else by a link to its device.  Nothing is probed.
+ */
+static gboolean 
+daemon_get_osfor_device(OSProberOSProber *object, 
+                        GDBusMethodInvocation *invocation, 
+                        const gchar *device) 
+{
+    Daemon *daemon = (Daemon *)object;
+    GVariant *results = NULL;
+    gchar *name = NULL;
+    GError *error = NULL;
+    gint64 start = trace_now();
+
+    g_mutex_lock(&daemon->priv->lock);
+    results = result_table_lookup(daemon->priv->table, device);
+    g_mutex_unlock(&daemon->priv->lock);
+
+    if (results == NULL) {
+        name = daemon_resolve_device(device, &error);
+        if (name == NULL) {
+            throw_error(invocation, error->code, "%s", error->message);
+            g_error_free(error);
+            error = NULL;
+            return TRUE;
+        }
+        g_mutex_lock(&daemon->priv->lock);
+        results = result_table_lookup(daemon->priv->table, name);
+        g_mutex_unlock(&daemon->priv->lock);
+        g_free(name);
+    }
+    if (results == NULL)
+        results = g_variant_ref_sink(g_variant_new_array(G_VARIANT_TYPE("(ssss)"), NULL, 0));
+
+    osprober_osprober_complete_get_osfor_device(object, invocation, results);
+    g_variant_unref(results);
+    trace_span("dbus", "GetOSForDevice", start, g_dbus_method_invocation_get_sender(invocation));
+
+    return TRUE;
+}
+
+/* A GetBootEntries call, answered once its last partition is read */
+typedef struct {
+    Daemon *daemon;
+    GDBusMethodInvocation *invocation;
+    GPtrArray *names;
+    gboolean named;         /* for one partition, not every Linux */
+    GVariant **entries;     /* per name, NULL while unknown */
+    GPtrArray *partitions;  /* those the workers read */
+    GMutex lock;
+    GPtrArray *failed;      /* (ss) name and why, under lock */
+    volatile gint pending;
+} BootRequest;
+
+typedef struct {
+    BootRequest *request;
+    guint index;
+    Partition *partition;
+} BootRead;
+
+static void
+boot_request_fail(BootRequest *request, const gchar *name, const gchar *message)
+{
+    g_mutex_lock(&request->lock);
+    g_ptr_array_add(request->failed, g_variant_ref_sink(g_variant_new("(ss)", name, message)));
+    g_mutex_unlock(&request->lock);
+}
+
+/* Answer with the kernels read, and the partitions which could not be
+ * read.  For a single partition, the failure is the answer.
+ */
+static void
+boot_request_done(BootRequest *request)
+{
+    GVariantBuilder builder;
+    GVariantBuilder failed;
+    GVariantIter iter;
+    GVariant *entry;
+    const gchar *name, *message;
+    guint i;
+
+    if (!g_atomic_int_dec_and_test(&request->pending))
+        return;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssssss)"));
+    for (i = 0; i < request->names->len; i++) {
+        if (request->entries[i] == NULL)
+            continue;
+        g_variant_iter_init(&iter, request->entries[i]);
+        while ((entry = g_variant_iter_next_value(&iter))) {
+            g_variant_builder_add_value(&builder, entry);
+            g_variant_unref(entry);
+        }
+        g_variant_unref(request->entries[i]);
+    }
+    g_variant_builder_init(&failed, G_VARIANT_TYPE("a(ss)"));
+    for (i = 0; i < request->failed->len; i++)
+        g_variant_builder_add_value(&failed, g_ptr_array_index(request->failed, i));
+
+    trace_call_end(request->invocation);
+    if (request->named && request->failed->len) {
+        g_variant_get(g_ptr_array_index(request->failed, 0), "(&s&s)", &name, &message);
+        throw_error(request->invocation, ERROR_FAILED, "%s: %s", name, message);
+        g_variant_builder_clear(&builder);
+        g_variant_builder_clear(&failed);
+    } else {
+        osprober_osprober_complete_get_boot_entries(OSPROBER_OSPROBER(request->daemon), 
+                                                    request->invocation, 
+                                                    g_variant_builder_end(&builder), 
+                                                    g_variant_builder_end(&failed));
+    }
+
+    if (request->partitions)
+        g_ptr_array_free(request->partitions, TRUE);
+    g_ptr_array_free(request->names, TRUE);
+    g_free(request->entries);
+    g_ptr_array_free(request->failed, TRUE);
+    g_mutex_clear(&request->lock);
+    g_object_unref(request->daemon);
+    g_free(request);
+}
+
+/* Read the kernels of one partition, alongside the others of the call */
+static void
+daemon_boot_routine(gpointer data, gpointer user_data)
+{
+    BootRead *read = (BootRead *)data;
+    Daemon *daemon = (Daemon *)user_data;
+    GPtrArray *lines;
+    GVariant *entries;
+    GError *error = NULL;
+
+    lines = engine_read_boot_entries(read->partition, NULL, &error);
+    if (lines) {
+        entries = boot_entries_to_variant(lines);
+        daemon_set_boot_entries(daemon, read->partition, entries);
+        read->request->entries[read->index] = entries;
+        g_ptr_array_free(lines, TRUE);
+    } else {
+        g_print("ERROR: %s: %s\n", read->partition->device, error->message);
+        boot_request_fail(read->request, read->partition->name, error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+
+    boot_request_done(read->request);
+    g_free(read);
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+/* The kernels of a Linux partition, given as for GetOSForDevice, or of
+ * every Linux found when partition is empty.  Those read along with the
+ * scan are answered at once, the others are read side by side, each
+ * through the reader or the mount the scan would use.
+ */
+static gboolean 
+daemon_get_boot_entries(OSProberOSProber *object, 
+                        GDBusMethodInvocation *invocation, 
+                        const gchar *partition) 
+{
+    Daemon *daemon = (Daemon *)object;
+    BootRequest *request = NULL;
+    BootRead *read = NULL;
+    GHashTableIter iter;
+    const gchar *name;
+    GPtrArray *known;
+    Partition *part;
+    gchar *resolved;
+    GError *error = NULL;
+    guint i, j;
+
+    trace_call_begin(invocation);
+    request = g_new0(BootRequest, 1);
+    request->names = g_ptr_array_new_with_free_func(g_free);
+    if (*partition) {
+        resolved = daemon_resolve_device(partition, &error);
+        if (resolved == NULL) {
+            g_ptr_array_free(request->names, TRUE);
+            g_free(request);
+            throw_error(invocation, error->code, "%s", error->message);
+            g_error_free(error);
+            error = NULL;
+            return TRUE;
+        }
+        /* only what a scan found to be a Linux gets read or mounted */
+        g_mutex_lock(&daemon->priv->lock);
+        known = g_hash_table_lookup(daemon->priv->partitions, resolved);
+        if (!results_have_linux(known)) {
+            g_mutex_unlock(&daemon->priv->lock);
+            g_ptr_array_free(request->names, TRUE);
+            g_free(request);
+            throw_error(invocation, ERROR_FAILED, "no Linux found on %s", resolved);
+            g_free(resolved);
+            return TRUE;
+        }
+        g_mutex_unlock(&daemon->priv->lock);
+        g_ptr_array_add(request->names, resolved);
+        request->named = TRUE;
+    } else {
+        g_mutex_lock(&daemon->priv->lock);
+        g_hash_table_iter_init(&iter, daemon->priv->partitions);
+        while (g_hash_table_iter_next(&iter, (gpointer *)&name, (gpointer *)&known)) {
+            if (results_have_linux(known))
+                g_ptr_array_add(request->names, g_strdup(name));
+        }
+        g_mutex_unlock(&daemon->priv->lock);
+        g_ptr_array_sort(request->names, compare_names);
+    }
+
+    request->daemon = g_object_ref(daemon);
+    request->invocation = invocation;
+    request->entries = g_new0(GVariant *, request->names->len);
+    g_mutex_init(&request->lock);
+    request->failed = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    request->pending = 1;
+
+    g_mutex_lock(&daemon->priv->lock);
+    for (i = 0; i < request->names->len; i++) {
+        request->entries[i] = g_hash_table_lookup(daemon->priv->boot_entries, 
+                                                  g_ptr_array_index(request->names, i));
+        if (request->entries[i])
+            g_variant_ref(request->entries[i]);
+    }
+    g_mutex_unlock(&daemon->priv->lock);
+
+    for (i = 0; i < request->names->len; i++) {
+        if (request->entries[i])
+            continue;
+        if (request->partitions == NULL)
+            request->partitions = engine_list_partitions();
+        for (j = 0; j < request->partitions->len; j++) {
+            part = g_ptr_array_index(request->partitions, j);
+            if (g_strcmp0(part->name, g_ptr_array_index(request->names, i)) != 0)
+                continue;
+            read = g_new0(BootRead, 1);
+            read->request = request;
+            read->index = i;
+            read->partition = part;
+            g_atomic_int_inc(&request->pending);
+            if (daemon->priv->boot_pool)
+                g_thread_pool_push(daemon->priv->boot_pool, read, NULL);
+            else
+                daemon_boot_routine(read, daemon);
+            break;
+        }
+        if (j == request->partitions->len)
+            boot_request_fail(request, g_ptr_array_index(request->names, i), "no such partition anymore");
+    }
+    boot_request_done(request);
 
     return TRUE;
 }
@@ -335,4 +2450,12 @@ daemon_osprober_iface_init(OSProberOSProberIface *iface)
 {
     iface->get_daemon_version = daemon_get_daemon_version;
     iface->handle_probe = daemon_probe;
+    iface->handle_probe_with_options = daemon_probe_with_options;
+    iface->handle_probe_devices = daemon_probe_devices;
+    iface->handle_probe_images = daemon_probe_images;
+    iface->handle_probe_sync = daemon_probe_sync;
+    iface->handle_probe_with_deadline = daemon_probe_with_deadline;
+    iface->handle_get_cached_results = daemon_get_cached_results;
+    iface->handle_get_osfor_device = daemon_get_osfor_device;
+    iface->handle_get_boot_entries = daemon_get_boot_entries;
 }
@@ -52,6 +52,9 @@ typedef enum {
     NUM_ERRORS
 } Error;
 
+/* Disk images a ProbeImages attaches and probes at once, by default */
+#define DAEMON_IMAGE_WORKERS 4
+
 #define ERROR error_quark()
 
 GType error_get_type();
@@ -59,7 +62,9 @@ GType error_get_type();
 GQuark error_quark();
 
 GType   daemon_get_type              (void) G_GNUC_CONST;
-Daemon *daemon_new                   (void);
+Daemon *daemon_new                   (GDBusConnection *connection,
+                                      const gchar     *prober,
+                                      guint            image_workers);
 
 /* local methods */
 
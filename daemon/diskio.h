@@ -0,0 +1,101 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __DISKIO_H__
+#define __DISKIO_H__
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Little and big endian accessors for on-disk structures */
+
+static inline guint16
+get_le16(const guint8 *p)
+{
+    return (guint16)p[0] | (guint16)p[1] << 8;
+}
+
+static inline guint32
+get_le32(const guint8 *p)
+{
+    return (guint32)get_le16(p) | (guint32)get_le16(p + 2) << 16;
+}
+
+static inline guint64
+get_le64(const guint8 *p)
+{
+    return (guint64)get_le32(p) | (guint64)get_le32(p + 4) << 32;
+}
+
+static inline guint16
+get_be16(const guint8 *p)
+{
+    return (guint16)p[0] << 8 | (guint16)p[1];
+}
+
+static inline guint32
+get_be32(const guint8 *p)
+{
+    return (guint32)get_be16(p) << 16 | (guint32)get_be16(p + 2);
+}
+
+static inline guint64
+get_be64(const guint8 *p)
+{
+    return (guint64)get_be32(p) << 32 | (guint64)get_be32(p + 4);
+}
+
+/* pread() the whole range or fail, a short read past the end of the
+ * device is an error too.
+ */
+static inline gboolean
+disk_read(gint fd, guint64 offset, gpointer buf, gsize len, GError **error)
+{
+    gsize done = 0;
+    gssize ret;
+
+    while (done < len) {
+        ret = pread(fd, (guint8 *)buf + done, len - done, (off_t)(offset + done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "read at %" G_GUINT64_FORMAT ": %s", 
+                        offset + done, g_strerror(errno));
+            return FALSE;
+        }
+        if (ret == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                        "short read at %" G_GUINT64_FORMAT, offset + done);
+            return FALSE;
+        }
+        done += ret;
+    }
+
+    return TRUE;
+}
+
+G_END_DECLS
+
+#endif /* __DISKIO_H__ */
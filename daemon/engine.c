@@ -0,0 +1,1600 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <glib/gstdio.h>
+
+#include "budget.h"
+#include "engine.h"
+#include "fsreader.h"
+#include "trace.h"
+
+#define SYS_CLASS_BLOCK "/sys/class/block"
+#define ENGINE_BOOT_PROBER "/usr/bin/linux-boot-prober"
+
+typedef struct {
+    GPtrArray *tests;
+    GPtrArray *mounted_tests;   /* for a partition mounted already */
+    gboolean mount_test;        /* tests has 50mounted-tests */
+    gchar *tmpdir;
+    const EngineCallbacks *callbacks;
+    gpointer user_data;
+    GCancellable *cancellable;
+    guint total;
+    volatile gint done;
+} EngineRun;
+
+/* How the engine mounts the types it knows for the tests: read-only,
+ * without replaying a journal, which would write to the device all the
+ * same.  The first that works wins.
+ */
+static const struct {
+    FsType type;
+    const gchar *fstype;
+    const gchar *data;
+    const gchar *name;      /* for the tests, as blkid has it */
+} engine_mounts[] = {
+    { FS_EXT, "ext4", "noload", "ext4" },
+    { FS_XFS, "xfs", "norecovery", "xfs" },
+    { FS_BTRFS, "btrfs", "rescue=nologreplay", "btrfs" },
+    { FS_BTRFS, "btrfs", "nologreplay", "btrfs" },
+    { FS_VFAT, "vfat", NULL, "vfat" },
+    { FS_NTFS, "ntfs3", NULL, "ntfs" },
+};
+
+/* Whether the mounts of the engine are its own, unseen by the host */
+static gboolean engine_private_mounts = FALSE;
+
+/* The partitions being probed on a disk, by any run of the process */
+typedef struct {
+    guint running;
+    guint limit;
+} EngineDisk;
+
+static GMutex engine_disks_lock;
+static GCond engine_disks_cond;
+static GHashTable *engine_disks = NULL;
+
+static const gchar * const probes_dirs[] = {
+    "/usr/lib/os-probes",
+    "/usr/libexec/os-probes",
+    NULL
+};
+
+Partition *
+partition_new(const gchar *name)
+{
+    Partition *partition = g_new0(Partition, 1);
+
+    partition->name = g_strdup(name);
+
+    return partition;
+}
+
+void
+partition_free(Partition *partition)
+{
+    if (partition == NULL)
+        return;
+
+    g_free(partition->name);
+    g_free(partition->device);
+    g_free(partition->disk);
+    g_free(partition->partuuid);
+    g_free(partition->type);
+    g_free(partition->mount_point);
+    g_free(partition->mount_type);
+    g_free(partition);
+}
+
+/* Directory of the per-partition tests shipped with os-prober, this is
+ * what /usr/bin/os-prober itself loops over for every partition.
+ */
+const gchar *
+engine_get_probes_dir()
+{
+    gchar *path;
+    gint i;
+
+    for (i = 0; probes_dirs[i]; i++) {
+        path = g_build_filename(probes_dirs[i], "50mounted-tests", NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_EXECUTABLE)) {
+            g_free(path);
+            return probes_dirs[i];
+        }
+        g_free(path);
+    }
+
+    return NULL;
+}
+
+static gchar *
+sysfs_read(const gchar *name, const gchar *attr)
+{
+    gchar *path = g_build_filename(SYS_CLASS_BLOCK, name, attr, NULL);
+    gchar *contents = NULL;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+        g_strstrip(contents);
+    g_free(path);
+
+    return contents;
+}
+
+static gboolean
+sysfs_has_entries(const gchar *name, const gchar *subdir)
+{
+    gchar *path = g_build_filename(SYS_CLASS_BLOCK, name, subdir, NULL);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    gboolean ret = FALSE;
+
+    g_free(path);
+    if (dir) {
+        ret = g_dir_read_name(dir) != NULL;
+        g_dir_close(dir);
+    }
+
+    return ret;
+}
+
+static gboolean
+sysfs_is_partition(const gchar *name)
+{
+    gchar *path = g_build_filename(SYS_CLASS_BLOCK, name, "partition", NULL);
+    gboolean ret = g_file_test(path, G_FILE_TEST_EXISTS);
+
+    g_free(path);
+
+    return ret;
+}
+
+/* Whole devices having partitions of their own are not probed, their
+ * partitions are.
+ */
+static gboolean
+sysfs_has_partitions(const gchar *name)
+{
+    gchar *path = g_build_filename(SYS_CLASS_BLOCK, name, NULL);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *entry;
+    gboolean ret = FALSE;
+
+    g_free(path);
+    if (dir == NULL)
+        return FALSE;
+
+    while (!ret && (entry = g_dir_read_name(dir))) {
+        if (g_str_has_prefix(entry, name))
+            ret = sysfs_is_partition(entry);
+    }
+    g_dir_close(dir);
+
+    return ret;
+}
+
+/* The disk queueing the I/O of a block device: the parent of a
+ * partition, or for a device-mapper/md device stacked on a single
+ * device, the disk below it.
+ */
+static gchar *
+sysfs_get_disk(const gchar *name, gint depth)
+{
+    gchar *path = NULL;
+    gchar *link = NULL;
+    gchar *parent = NULL;
+    gchar *disk = NULL;
+    GDir *dir = NULL;
+    const gchar *slave = NULL;
+
+    if (depth > 8)
+        return g_strdup(name);
+
+    if (sysfs_is_partition(name)) {
+        path = g_build_filename(SYS_CLASS_BLOCK, name, NULL);
+        link = g_file_read_link(path, NULL);
+        g_free(path);
+        if (link == NULL)
+            return g_strdup(name);
+        parent = g_path_get_dirname(link);
+        disk = g_path_get_basename(parent);
+        g_free(parent);
+        g_free(link);
+        return disk;
+    }
+
+    path = g_build_filename(SYS_CLASS_BLOCK, name, "slaves", NULL);
+    dir = g_dir_open(path, 0, NULL);
+    g_free(path);
+    if (dir) {
+        slave = g_dir_read_name(dir);
+        if (slave && g_dir_read_name(dir) == NULL)
+            disk = sysfs_get_disk(slave, depth + 1);
+        g_dir_close(dir);
+    }
+
+    return disk ? disk : g_strdup(name);
+}
+
+/* The disk of a block device, as the partitions listed have it */
+gchar *
+engine_get_disk(const gchar *name)
+{
+    return sysfs_get_disk(name, 0);
+}
+
+static gboolean
+is_swap(const gchar *device)
+{
+    gchar *contents = NULL;
+    gchar **lines = NULL;
+    gchar **line;
+    gboolean ret = FALSE;
+    gsize len = strlen(device);
+
+    if (!g_file_get_contents("/proc/swaps", &contents, NULL, NULL))
+        return FALSE;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line && !ret; line++) {
+        if (strncmp(*line, device, len) == 0 &&
+            g_ascii_isspace((*line)[len])) {
+            ret = TRUE;
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return ret;
+}
+
+/* Map of device names (sda1) to their PARTUUID, as udev links them */
+static GHashTable *
+list_partuuids()
+{
+    GHashTable *partuuids;
+    GDir *dir;
+    const gchar *name;
+    gchar *path;
+    gchar *link;
+
+    partuuids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    dir = g_dir_open("/dev/disk/by-partuuid", 0, NULL);
+    if (dir == NULL)
+        return partuuids;
+
+    while ((name = g_dir_read_name(dir))) {
+        path = g_build_filename("/dev/disk/by-partuuid", name, NULL);
+        link = g_file_read_link(path, NULL);
+        if (link)
+            g_hash_table_insert(partuuids, g_path_get_basename(link), g_strdup(name));
+        g_free(link);
+        g_free(path);
+    }
+    g_dir_close(dir);
+
+    return partuuids;
+}
+
+/* Where a device is mounted, as /proc/self/mountinfo tells */
+typedef struct {
+    gchar *mount_point;     /* of the whole filesystem, NULL if none */
+    gchar *type;
+    gboolean root;          /* the running system */
+} EngineMount;
+
+static void
+engine_mount_free(EngineMount *mount)
+{
+    g_free(mount->mount_point);
+    g_free(mount->type);
+    g_free(mount);
+}
+
+static void
+engine_add_mount(GHashTable *mounts, const gchar *dev, const gchar *root, const gchar *mount_point, const gchar *type)
+{
+    EngineMount *mount = g_hash_table_lookup(mounts, dev);
+
+    if (mount == NULL) {
+        mount = g_new0(EngineMount, 1);
+        g_hash_table_insert(mounts, g_strdup(dev), mount);
+    }
+
+    /* a bind mount of a subdirectory shows only part of it */
+    if (strcmp(root, "/") != 0)
+        return;
+    if (strcmp(mount_point, "/") == 0) {
+        mount->root = TRUE;
+    } else if (mount->mount_point == NULL) {
+        mount->mount_point = g_strdup(mount_point);
+        mount->type = g_strdup(type);
+    }
+}
+
+/* The devices mounted somewhere, by "major:minor".  The numbers of
+ * mountinfo are not those of the device for btrfs, the source is
+ * looked up too.
+ */
+static GHashTable *
+list_mounted()
+{
+    GHashTable *mounts;
+    gchar *contents = NULL;
+    gchar **lines = NULL;
+    gchar **line;
+    gchar **fields;
+    gchar **source;
+    gchar *separator;
+    gchar *root;
+    gchar *mount_point;
+    gchar *dev;
+    struct stat st;
+
+    mounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)engine_mount_free);
+    if (!g_file_get_contents("/proc/self/mountinfo", &contents, NULL, NULL))
+        return mounts;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line; line++) {
+        /* id parent major:minor root mount-point options... - type source options */
+        separator = strstr(*line, " - ");
+        if (separator == NULL)
+            continue;
+        *separator = '\0';
+        fields = g_strsplit(*line, " ", 6);
+        source = g_strsplit(separator + 3, " ", 3);
+        if (g_strv_length(fields) < 5 || g_strv_length(source) < 2) {
+            g_strfreev(fields);
+            g_strfreev(source);
+            continue;
+        }
+
+        /* spaces and the like are octal escapes */
+        root = g_strcompress(fields[3]);
+        mount_point = g_strcompress(fields[4]);
+        engine_add_mount(mounts, fields[2], root, mount_point, source[0]);
+        if (*source[1] == '/' && stat(source[1], &st) == 0 && S_ISBLK(st.st_mode)) {
+            dev = g_strdup_printf("%u:%u", major(st.st_rdev), minor(st.st_rdev));
+            if (strcmp(dev, fields[2]) != 0)
+                engine_add_mount(mounts, dev, root, mount_point, source[0]);
+            g_free(dev);
+        }
+        g_free(root);
+        g_free(mount_point);
+        g_strfreev(fields);
+        g_strfreev(source);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return mounts;
+}
+
+/* The /dev/mapper link of a device-mapper device, as os-prober names
+ * it, NULL for another device or until udev has made the link.
+ */
+static gchar *
+engine_mapper_path(const gchar *name, gboolean *pending)
+{
+    gchar *dm_name = g_str_has_prefix(name, "dm-") ? sysfs_read(name, "dm/name") : NULL;
+    gchar *path = NULL;
+
+    if (pending)
+        *pending = FALSE;
+    if (dm_name && *dm_name) {
+        path = g_strdup_printf("/dev/mapper/%s", dm_name);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            if (pending)
+                *pending = TRUE;
+            g_free(path);
+            path = NULL;
+        }
+    }
+    g_free(dm_name);
+
+    return path;
+}
+
+/* The node a device is opened and reported by.  A device-mapper device
+ * falls back to the /dev/dm-N the kernel makes at once.
+ */
+static gchar *
+engine_device_path(const gchar *name)
+{
+    gchar *path = engine_mapper_path(name, NULL);
+
+    return path ? path : g_strdup_printf("/dev/%s", name);
+}
+
+/* Whether udev is done with a device, as far as the engine cares: a
+ * device-mapper device without its /dev/mapper link yet would be known
+ * by another name than the next scan gives it.
+ */
+gboolean
+engine_device_ready(const gchar *name)
+{
+    gboolean pending;
+
+    g_free(engine_mapper_path(name, &pending));
+
+    return !pending;
+}
+
+/* A partition as sysfs has it, NULL when it is empty */
+static Partition *
+engine_new_partition(const gchar *name, guint major_nr, guint minor_nr)
+{
+    Partition *partition;
+    gchar *value;
+
+    partition = partition_new(name);
+    partition->major = major_nr;
+    partition->minor = minor_nr;
+
+    value = sysfs_read(name, "size");
+    partition->size = value ? g_ascii_strtoull(value, NULL, 10) * 512 : 0;
+    g_free(value);
+    if (partition->size == 0) {
+        partition_free(partition);
+        return NULL;
+    }
+
+    partition->device = engine_device_path(name);
+
+    partition->disk = sysfs_get_disk(name, 0);
+    value = sysfs_read(name, "partition");
+    partition->number = value ? (guint)g_ascii_strtoull(value, NULL, 10) : 0;
+    g_free(value);
+
+    return partition;
+}
+
+static gint
+compare_devices(gconstpointer a, gconstpointer b)
+{
+    const Partition *pa = *(const Partition * const *)a;
+    const Partition *pb = *(const Partition * const *)b;
+
+    if (pa->major != pb->major)
+        return (pa->major > pb->major) - (pa->major < pb->major);
+    return (pa->minor > pb->minor) - (pa->minor < pb->minor);
+}
+
+/* List the partitions os-prober would visit: real partitions plus
+ * device-mapper and md devices without partitions, leaving out the
+ * running root filesystem, active swap and devices that are members
+ * of another device (RAID, LVM physical volumes, ...).  Those mounted
+ * already get the mount point the tests can use as it is.  They come in
+ * the order of their device numbers, like /proc/partitions, whatever
+ * order sysfs lists them in.
+ */
+GPtrArray *
+engine_list_partitions()
+{
+    GPtrArray *partitions;
+    GDir *dir;
+    const gchar *name;
+    gchar *dev;
+    struct stat root;
+    gboolean has_root;
+    Partition *partition;
+    guint major_nr, minor_nr;
+    GHashTable *partuuids;
+    GHashTable *mounted;
+    EngineMount *mount;
+
+    partitions = g_ptr_array_new_with_free_func((GDestroyNotify)partition_free);
+
+    dir = g_dir_open(SYS_CLASS_BLOCK, 0, NULL);
+    if (dir == NULL)
+        return partitions;
+
+    has_root = stat("/", &root) == 0;
+    partuuids = list_partuuids();
+    mounted = list_mounted();
+
+    while ((name = g_dir_read_name(dir))) {
+        if (!sysfs_is_partition(name)) {
+            if (!g_str_has_prefix(name, "dm-") && !g_str_has_prefix(name, "md"))
+                continue;
+            if (sysfs_has_partitions(name))
+                continue;
+        }
+
+        if (sysfs_has_entries(name, "holders"))
+            continue;
+
+        dev = sysfs_read(name, "dev");
+        if (dev == NULL || sscanf(dev, "%u:%u", &major_nr, &minor_nr) != 2) {
+            g_free(dev);
+            continue;
+        }
+
+        mount = g_hash_table_lookup(mounted, dev);
+        if ((has_root &&
+             major(root.st_dev) == major_nr &&
+             minor(root.st_dev) == minor_nr) ||
+            (mount && mount->root)) {
+            g_free(dev);
+            continue;
+        }
+
+        partition = engine_new_partition(name, major_nr, minor_nr);
+        if (partition == NULL || is_swap(partition->device)) {
+            if (partition)
+                partition_free(partition);
+            g_free(dev);
+            continue;
+        }
+        partition->partuuid = g_strdup(g_hash_table_lookup(partuuids, name));
+        partition->mounted = mount != NULL;
+        if (mount) {
+            partition->mount_point = g_strdup(mount->mount_point);
+            partition->mount_type = g_strdup(mount->type);
+        }
+        g_free(dev);
+        g_ptr_array_add(partitions, partition);
+    }
+    g_dir_close(dir);
+    g_hash_table_destroy(partuuids);
+    g_hash_table_destroy(mounted);
+    g_ptr_array_sort(partitions, compare_devices);
+
+    return partitions;
+}
+
+static gint
+compare_numbers(gconstpointer a, gconstpointer b)
+{
+    const Partition *pa = *(const Partition * const *)a;
+    const Partition *pb = *(const Partition * const *)b;
+
+    return (pa->number > pb->number) - (pa->number < pb->number);
+}
+
+/* The partitions of a disk of the daemon's own, a disk image on a loop
+ * device, or the disk itself when it has none.  Nobody else uses it, so
+ * nothing of it is mounted or left out.
+ */
+GPtrArray *
+engine_list_disk(const gchar *disk)
+{
+    GPtrArray *partitions;
+    gchar *path;
+    GDir *dir;
+    const gchar *name;
+    gchar *dev;
+    Partition *partition;
+    guint major_nr, minor_nr;
+
+    partitions = g_ptr_array_new_with_free_func((GDestroyNotify)partition_free);
+
+    path = g_build_filename(SYS_CLASS_BLOCK, disk, NULL);
+    dir = g_dir_open(path, 0, NULL);
+    g_free(path);
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_prefix(name, disk) || !sysfs_is_partition(name))
+            continue;
+        dev = sysfs_read(name, "dev");
+        if (dev && sscanf(dev, "%u:%u", &major_nr, &minor_nr) == 2) {
+            partition = engine_new_partition(name, major_nr, minor_nr);
+            if (partition)
+                g_ptr_array_add(partitions, partition);
+        }
+        g_free(dev);
+    }
+    if (dir)
+        g_dir_close(dir);
+
+    if (partitions->len == 0) {
+        dev = sysfs_read(disk, "dev");
+        if (dev && sscanf(dev, "%u:%u", &major_nr, &minor_nr) == 2) {
+            partition = engine_new_partition(disk, major_nr, minor_nr);
+            if (partition)
+                g_ptr_array_add(partitions, partition);
+        }
+        g_free(dev);
+    }
+    g_ptr_array_sort(partitions, compare_numbers);
+
+    return partitions;
+}
+
+/* Partition types an OS is most likely found on, and those mostly
+ * holding data, which are probed last.
+ */
+static const gchar * const likely_types[] = {
+    "c12a7328-f81f-11d2-ba4b-00a0c93ec93b",     /* EFI system */
+    "4f68bce3-e8cd-4db1-96e7-fbcaf984b709",     /* Linux root (x86-64) */
+    "44479540-f297-41b2-9af7-d131d5f0458a",     /* Linux root (x86) */
+    "b921b045-1df0-41c3-af44-4c6f280d3fae",     /* Linux root (ARM64) */
+    "69dad710-2ce4-4e3c-b16c-21a1d49abed3",     /* Linux root (ARM) */
+    "ebd0a0a2-b9e5-4433-87c0-68b6b72699c7",     /* Microsoft basic data */
+    "0xef", "0x07", "0x0b", "0x0c", "0x83",     /* ESP, NTFS, FAT32, Linux */
+    NULL
+};
+
+static const gchar * const unlikely_types[] = {
+    "933ac7e1-2eb4-4f90-9a9a-4a8f9d6b8d7b",     /* Linux /home */
+    "3b8f8425-20e0-4f3b-907f-1a25a76f98e8",     /* Linux /srv */
+    "a19d880f-05fc-4d3b-a006-743f0f84911e",     /* Linux RAID */
+    "e6d6d379-f507-44c2-a23c-238f2a3df928",     /* Linux LVM */
+    "0x8e", "0xfd",                             /* LVM, RAID */
+    NULL
+};
+
+static gint
+engine_partition_rank(Partition *partition)
+{
+    if (partition->type == NULL)
+        return 1;
+    if (g_strv_contains(likely_types, partition->type))
+        return 0;
+    if (g_strv_contains(unlikely_types, partition->type))
+        return 2;
+
+    return 1;
+}
+
+static gint
+compare_ranks(gconstpointer a, gconstpointer b)
+{
+    return engine_partition_rank(*(Partition **)a) - engine_partition_rank(*(Partition **)b);
+}
+
+/* Put the partitions an OS is likely on first, for a scan stopping at
+ * the first matches.  The order of the partitions of a rank is kept.
+ * Their type is known once prescanned.
+ */
+void
+engine_sort_partitions(GPtrArray *partitions)
+{
+    g_ptr_array_sort(partitions, compare_ranks);
+}
+
+/* One worker per rotational spindle, since concurrent probes on it only
+ * add seeks, and several per flash device, which rather want a deep
+ * queue.  The limit is for all the runs of the process together, see
+ * engine_disk_acquire().
+ */
+guint
+engine_get_disk_concurrency(const gchar *disk)
+{
+    gchar *rotational;
+    guint ret = ENGINE_ROTATIONAL_WORKERS;
+
+    if (g_str_has_prefix(disk, "nvme"))
+        return ENGINE_NVME_WORKERS;
+
+    rotational = sysfs_read(disk, "queue/rotational");
+    if (rotational && g_strcmp0(rotational, "0") == 0)
+        ret = ENGINE_SSD_WORKERS;
+    g_free(rotational);
+
+    return ret;
+}
+
+static void
+engine_wake_disks(GCancellable *cancellable, gpointer user_data)
+{
+    g_mutex_lock(&engine_disks_lock);
+    g_cond_broadcast(&engine_disks_cond);
+    g_mutex_unlock(&engine_disks_lock);
+}
+
+/* Wait for the disk to be under its limit, whichever runs probe it at
+ * the moment: the scans, rescans and ProbeDevices of the daemon run side
+ * by side, each with workers of its own.  Returns FALSE once
+ * cancellable is cancelled instead.
+ */
+static gboolean
+engine_disk_acquire(const gchar *name, GCancellable *cancellable)
+{
+    EngineDisk *disk;
+    gulong handler = 0;
+    gboolean ret;
+
+    /* the handler takes the lock, it must not be held to connect */
+    if (cancellable)
+        handler = g_cancellable_connect(cancellable, G_CALLBACK(engine_wake_disks), NULL, NULL);
+
+    g_mutex_lock(&engine_disks_lock);
+    if (engine_disks == NULL)
+        engine_disks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    disk = g_hash_table_lookup(engine_disks, name);
+    if (disk == NULL) {
+        disk = g_new0(EngineDisk, 1);
+        disk->limit = engine_get_disk_concurrency(name);
+        g_hash_table_insert(engine_disks, g_strdup(name), disk);
+    }
+    while (disk->running >= disk->limit && !g_cancellable_is_cancelled(cancellable))
+        g_cond_wait(&engine_disks_cond, &engine_disks_lock);
+    ret = !g_cancellable_is_cancelled(cancellable);
+    if (ret)
+        disk->running++;
+    g_mutex_unlock(&engine_disks_lock);
+
+    if (handler)
+        g_cancellable_disconnect(cancellable, handler);
+
+    return ret;
+}
+
+static void
+engine_disk_release(const gchar *name)
+{
+    EngineDisk *disk;
+
+    g_mutex_lock(&engine_disks_lock);
+    disk = g_hash_table_lookup(engine_disks, name);
+    disk->running--;
+    g_cond_broadcast(&engine_disks_cond);
+    g_mutex_unlock(&engine_disks_lock);
+}
+
+/* Give the daemon a mount namespace of its own, before any thread is
+ * started, for the threads share the namespace of the one starting
+ * them.  The mounts of the host still show up in it, those of the
+ * engine stay there and are gone with the daemon, even killed.
+ */
+gboolean
+engine_unshare_mounts(GError **error)
+{
+    if (unshare(CLONE_NEWNS) < 0 ||
+        mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "private mount namespace: %s", g_strerror(errno));
+        return FALSE;
+    }
+    engine_private_mounts = TRUE;
+
+    return TRUE;
+}
+
+/* Run in the child between fork and exec: give every probe step its
+ * own mount namespace, so the tests mounting candidates on the shared
+ * /var/lib/os-prober/mount do not step on each other, and whatever
+ * they leave mounted goes away with the namespace.  The step also gets
+ * its own process group, to be killed as a whole, and the cgroup of the
+ * probes.
+ */
+static void
+engine_child_setup(gpointer user_data)
+{
+    setpgid(0, 0);
+    budget_enter_probe();
+    if (unshare(CLONE_NEWNS) == 0)
+        mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+}
+
+/* Kill a step and whatever it forked (mount, grub-probe...), without
+ * waiting: a process stuck on a dead device only dies once its I/O
+ * fails, GLib reaps it whenever that happens.
+ */
+static void
+engine_kill(GSubprocess *subprocess)
+{
+    const gchar *pid = g_subprocess_get_identifier(subprocess);
+
+    if (pid)
+        kill(-atoi(pid), SIGKILL);
+    g_subprocess_force_exit(subprocess);
+}
+
+gboolean
+engine_spawn(const gchar * const   *argv,
+             const gchar           *tmpdir,
+             Partition             *partition,
+             const EngineCallbacks *callbacks,
+             gpointer               user_data,
+             GCancellable          *cancellable,
+             gboolean              *success,
+             GError               **error)
+{
+    GSubprocessLauncher *launcher = NULL;
+    GSubprocess *subprocess = NULL;
+    GDataInputStream *stream = NULL;
+    gchar *line = NULL;
+    gboolean ret = FALSE;
+    GError *local_error = NULL;
+    gint64 start = g_get_monotonic_time();
+
+    if (success)
+        *success = FALSE;
+
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+    if (tmpdir)
+        g_subprocess_launcher_setenv(launcher, "OS_PROBER_TMP", tmpdir, TRUE);
+    g_subprocess_launcher_set_child_setup(launcher, engine_child_setup, NULL, NULL);
+    subprocess = g_subprocess_launcher_spawnv(launcher, argv, error);
+    g_object_unref(launcher);
+    if (callbacks->phase)
+        callbacks->phase(ENGINE_PHASE_SPAWN, g_get_monotonic_time() - start, user_data);
+    trace_span("engine", "spawn", start, argv[0]);
+    if (subprocess == NULL)
+        return FALSE;
+    start = g_get_monotonic_time();
+
+    stream = g_data_input_stream_new(g_subprocess_get_stdout_pipe(subprocess));
+    while ((line = g_data_input_stream_read_line(stream, NULL, cancellable, &local_error))) {
+        if (*line && callbacks->found)
+            callbacks->found(partition, line, user_data);
+        g_free(line);
+        line = NULL;
+    }
+    g_object_unref(stream);
+
+    if (local_error == NULL) {
+        ret = g_subprocess_wait(subprocess, cancellable, &local_error);
+        if (ret && success)
+            *success = g_subprocess_get_successful(subprocess);
+    }
+
+    if (callbacks->phase)
+        callbacks->phase(ENGINE_PHASE_DETECT, g_get_monotonic_time() - start, user_data);
+    if (trace_enabled()) {
+        line = g_strdup_printf("%s %s", argv[0], partition ? partition->device : "");
+        trace_span("engine", "detect", start, line);
+        g_free(line);
+        line = NULL;
+    }
+
+    if (local_error) {
+        if (g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            engine_kill(subprocess);
+        g_propagate_error(error, local_error);
+        local_error = NULL;
+    }
+    g_object_unref(subprocess);
+
+    return ret;
+}
+
+static void
+engine_found(EngineRun *run, Partition *partition, const gchar *line)
+{
+    if (run->callbacks->found)
+        run->callbacks->found(partition, line, run->user_data);
+}
+
+/* The kernels of the Linux the reader is on, as linux-boot-prober lines.
+ * Without a command line in the configuration, the kernel gets the root
+ * it is on, as the 90fallback test gives it.
+ */
+static GPtrArray *
+engine_detect_boot_entries(Partition *partition, FsReader *reader, GError **error)
+{
+    GPtrArray *entries;
+    GPtrArray *lines;
+    FsBootEntry *entry;
+    gchar *params;
+    guint i;
+
+    entries = g_ptr_array_new_with_free_func((GDestroyNotify)fsreader_boot_entry_free);
+    if (!fsreader_detect_boot_entries(reader, entries, error)) {
+        g_ptr_array_free(entries, TRUE);
+        return NULL;
+    }
+
+    lines = g_ptr_array_new_with_free_func(g_free);
+    for (i = 0; i < entries->len; i++) {
+        entry = g_ptr_array_index(entries, i);
+        /* the fields are split at colons */
+        g_strdelimit(entry->label, ":", ' ');
+        if (*entry->params)
+            params = g_strdup(entry->params);
+        else
+            params = g_strdup_printf("root=%s", partition->device);
+        g_ptr_array_add(lines, g_strdup_printf("%s:%s:%s:%s:%s:%s",
+                                               partition->device, partition->device,
+                                               entry->label, entry->kernel,
+                                               entry->initrd, params));
+        g_free(params);
+    }
+    g_ptr_array_free(entries, TRUE);
+
+    return lines;
+}
+
+/* The Linux on an ext, xfs or btrfs filesystem.  Without os-release
+ * the tests have the last word: distributions still have their own
+ * release files in /etc, GNU/Hurd has no /etc at all, and a test added
+ * by the distribution may look for anything.
+ */
+static gboolean
+engine_read_linux(EngineRun *run, Partition *partition, FsReader *reader, GError **error)
+{
+    gchar *long_name = NULL;
+    gchar *short_name = NULL;
+    GPtrArray *entries;
+    gchar *line;
+
+    if (fsreader_detect_linux(reader, &long_name, &short_name, error)) {
+        line = g_strdup_printf("%s:%s:%s:linux", partition->device, long_name, short_name);
+        engine_found(run, partition, line);
+        g_free(line);
+        g_free(long_name);
+        g_free(short_name);
+        /* the filesystem is open now, its kernels come almost for free;
+         * what the reader cannot tell is left to GetBootEntries
+         */
+        if (run->callbacks->boot_entries) {
+            entries = engine_detect_boot_entries(partition, reader, NULL);
+            if (entries) {
+                run->callbacks->boot_entries(partition, entries, run->user_data);
+                g_ptr_array_free(entries, TRUE);
+            }
+        }
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Whether the partition is typed as an EFI system partition, or its
+ * type is not known
+ */
+static gboolean
+engine_is_esp(Partition *partition)
+{
+    return partition->type == NULL ||
+           g_ascii_strcasecmp(partition->type, "c12a7328-f81f-11d2-ba4b-00a0c93ec93b") == 0 ||
+           g_strcmp0(partition->type, "0xef") == 0;
+}
+
+/* The boot loaders of an EFI system partition, as the 05efi test gives
+ * them, or the Windows on a FAT or NTFS filesystem, as 20microsoft does.
+ * Anything else, DOS or whatever the tests installed look for, is left
+ * to them.
+ */
+static gboolean
+engine_read_windows(EngineRun *run, Partition *partition, FsReader *reader, GError **error)
+{
+    GPtrArray *loaders;
+    FsBootLoader *loader;
+    gchar *long_name = NULL;
+    gchar *line;
+    gboolean found = FALSE;
+    guint i;
+
+    if (partition->superblock.type == FS_VFAT && engine_is_esp(partition)) {
+        loaders = g_ptr_array_new_with_free_func((GDestroyNotify)fsreader_boot_loader_free);
+        if (fsreader_detect_efi(reader, loaders, error)) {
+            for (i = 0; i < loaders->len; i++) {
+                loader = g_ptr_array_index(loaders, i);
+                line = g_strdup_printf("%s@%s:%s:%s:efi",
+                                       partition->device, loader->path,
+                                       loader->long_name, loader->short_name);
+                engine_found(run, partition, line);
+                g_free(line);
+            }
+            found = loaders->len > 0;
+        }
+        g_ptr_array_free(loaders, TRUE);
+        if (found)
+            return TRUE;
+        if (*error && !g_error_matches(*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            return FALSE;
+        g_clear_error(error);
+    }
+
+    if (fsreader_detect_windows(reader, &long_name, error)) {
+        line = g_strdup_printf("%s:%s:Windows:chain", partition->device, long_name);
+        engine_found(run, partition, line);
+        g_free(line);
+        g_free(long_name);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Look for an OS by reading the filesystem in place, sparing the mount,
+ * the journal replay it may bring and the umount, or through where it is
+ * mounted already.  Returns TRUE once the reader found an OS, the tests
+ * run on whatever else.  The reader stops early once step is cancelled.
+ */
+static gboolean
+engine_read_partition(EngineRun    *run,
+                      Partition    *partition,
+                      const gchar  *mount_point,
+                      GCancellable *step)
+{
+    FsReader *reader;
+    GError *error = NULL;
+    gboolean ret = FALSE;
+    gint64 start = g_get_monotonic_time();
+
+    /* a filesystem in use changes under a reader of the device */
+    if (mount_point)
+        reader = fsreader_open_mounted(mount_point, partition->superblock.type, &error);
+    else if (!partition->mounted)
+        reader = fsreader_open(partition->device, partition->superblock.type, &error);
+    else
+        return FALSE;
+    if (reader == NULL)
+        goto out;
+    fsreader_set_cancellable(reader, step);
+
+    if (partition->superblock.type == FS_VFAT || partition->superblock.type == FS_NTFS)
+        ret = engine_read_windows(run, partition, reader, &error);
+    else
+        ret = engine_read_linux(run, partition, reader, &error);
+    fsreader_free(reader);
+
+    if (run->callbacks->phase)
+        run->callbacks->phase(ENGINE_PHASE_DETECT, g_get_monotonic_time() - start, run->user_data);
+    trace_span("engine", "read", start, partition->device);
+
+out:
+    if (error) {
+#ifdef DEBUG
+        g_print("DEBUG: %s left to the tests: %s\n", partition->device, error->message);
+#endif
+        g_error_free(error);
+    }
+
+    return ret;
+}
+
+/* Mount the partition for the tests on a directory of its own, where no
+ * other step mounts, in the namespace of the daemon.  What 50mounted-tests
+ * would do, without forking mount.
+ */
+static gchar *
+engine_mount_partition(EngineRun *run, Partition *partition, const gchar **type)
+{
+    gchar *mount_point;
+    gint64 start = g_get_monotonic_time();
+    gboolean mounted = FALSE;
+    gint saved_errno = ENODEV;
+    guint i;
+
+    if (run->tmpdir == NULL || !engine_private_mounts)
+        return NULL;
+
+    mount_point = g_build_filename(run->tmpdir, partition->name, NULL);
+    if (g_mkdir(mount_point, 0700) < 0) {
+        g_free(mount_point);
+        return NULL;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(engine_mounts) && !mounted; i++) {
+        if (engine_mounts[i].type != partition->superblock.type)
+            continue;
+        mounted = mount(partition->device, mount_point, engine_mounts[i].fstype,
+                        MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC,
+                        engine_mounts[i].data) == 0;
+        if (mounted)
+            *type = engine_mounts[i].name;
+        else
+            saved_errno = errno;
+    }
+
+    if (run->callbacks->phase)
+        run->callbacks->phase(ENGINE_PHASE_MOUNT, g_get_monotonic_time() - start, run->user_data);
+    trace_span("engine", "mount", start, partition->device);
+
+    if (!mounted) {
+#ifdef DEBUG
+        g_print("DEBUG: %s left to 50mounted-tests: %s\n", partition->device, g_strerror(saved_errno));
+#endif
+        g_rmdir(mount_point);
+        g_free(mount_point);
+        return NULL;
+    }
+
+    return mount_point;
+}
+
+/* A lazy detach returns at once, even when the device does not answer */
+static void
+engine_umount_partition(EngineRun *run, Partition *partition, gchar *mount_point)
+{
+    gint64 start = g_get_monotonic_time();
+
+    umount2(mount_point, MNT_DETACH);
+    g_rmdir(mount_point);
+    g_free(mount_point);
+
+    if (run->callbacks->phase)
+        run->callbacks->phase(ENGINE_PHASE_UMOUNT, g_get_monotonic_time() - start, run->user_data);
+    trace_span("engine", "umount", start, partition->device);
+}
+
+static void
+engine_add_boot_entry(Partition *partition, const gchar *line, gpointer user_data)
+{
+    g_ptr_array_add((GPtrArray *)user_data, g_strdup(line));
+}
+
+static const EngineCallbacks engine_boot_callbacks = {
+    NULL,
+    engine_add_boot_entry,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
+
+/* The kernels of the Linux on partition, as linux-boot-prober lines.  The
+ * filesystem is read where it is, or through where it is mounted; what
+ * the reader cannot list is mounted as the tests have it, and only what
+ * is left, a /boot on another filesystem, runs linux-boot-prober.  An
+ * empty array is a partition without kernels.
+ */
+static GPtrArray *
+engine_read_partition_boot_entries(Partition *partition, GCancellable *cancellable, GError **error)
+{
+    const gchar *argv[] = { ENGINE_BOOT_PROBER, partition->device, NULL };
+    EngineRun run = { 0 };
+    FsReader *reader = NULL;
+    GPtrArray *entries = NULL;
+    gchar *mount_point = NULL;
+    const gchar *type = NULL;
+    GError *local_error = NULL;
+
+    if (!partition->scanned)
+        superblock_read(partition->device, &partition->superblock, NULL);
+
+    if (partition->mount_point)
+        reader = fsreader_open_mounted(partition->mount_point, partition->superblock.type, &local_error);
+    else if (!partition->mounted)
+        reader = fsreader_open(partition->device, partition->superblock.type, &local_error);
+    if (reader) {
+        fsreader_set_cancellable(reader, cancellable);
+        entries = engine_detect_boot_entries(partition, reader, &local_error);
+        fsreader_free(reader);
+    }
+
+    /* the readers of ext, xfs and btrfs list no directories */
+    if (entries == NULL && !partition->mounted &&
+        !g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        g_clear_error(&local_error);
+        run.tmpdir = g_dir_make_tmp("os-prober.XXXXXX", NULL);
+        run.callbacks = &engine_boot_callbacks;
+        mount_point = engine_mount_partition(&run, partition, &type);
+        if (mount_point) {
+            reader = fsreader_open_mounted(mount_point, partition->superblock.type, &local_error);
+            if (reader) {
+                fsreader_set_cancellable(reader, cancellable);
+                entries = engine_detect_boot_entries(partition, reader, &local_error);
+                fsreader_free(reader);
+            }
+            engine_umount_partition(&run, partition, mount_point);
+        }
+        if (run.tmpdir) {
+            g_rmdir(run.tmpdir);
+            g_free(run.tmpdir);
+        }
+    }
+
+    if (entries == NULL && g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        entries = g_ptr_array_new_with_free_func(g_free);
+    if (entries) {
+        g_clear_error(&local_error);
+        return entries;
+    }
+
+#ifdef DEBUG
+    if (local_error)
+        g_print("DEBUG: %s left to linux-boot-prober: %s\n", partition->device, local_error->message);
+#endif
+    g_clear_error(&local_error);
+    entries = g_ptr_array_new_with_free_func(g_free);
+    if (!engine_spawn(argv, NULL, partition, &engine_boot_callbacks, entries,
+                      cancellable, NULL, error)) {
+        g_ptr_array_free(entries, TRUE);
+        return NULL;
+    }
+
+    return entries;
+}
+
+/* Read the kernels under the limit of the disk, as a probe would */
+GPtrArray *
+engine_read_boot_entries(Partition *partition, GCancellable *cancellable, GError **error)
+{
+    GPtrArray *entries;
+
+    if (!engine_disk_acquire(partition->disk, cancellable)) {
+        g_cancellable_set_error_if_cancelled(cancellable, error);
+        return NULL;
+    }
+    entries = engine_read_partition_boot_entries(partition, cancellable, error);
+    engine_disk_release(partition->disk);
+
+    return entries;
+}
+
+static void
+engine_remove_tmpdir(const gchar *tmpdir)
+{
+    GDir *dir = g_dir_open(tmpdir, 0, NULL);
+    const gchar *name;
+    gchar *path;
+
+    if (dir) {
+        while ((name = g_dir_read_name(dir))) {
+            path = g_build_filename(tmpdir, name, NULL);
+            g_unlink(path);
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+    g_rmdir(tmpdir);
+}
+
+/* The OS_PROBER_TMP of the tests of one partition.  Each partition has
+ * a labels file of its own, so that the tests running side by side do
+ * not count in the same one: they all name what they find as the first
+ * of its kind, and the caller numbers the names once it has them all.
+ */
+static gchar *
+engine_make_scratch(EngineRun *run, Partition *partition)
+{
+    gchar *scratch;
+
+    if (run->tmpdir == NULL)
+        return NULL;
+
+    scratch = g_strdup_printf("%s/%s.tmp", run->tmpdir, partition->name);
+    if (g_mkdir(scratch, 0700) < 0) {
+        g_free(scratch);
+        return NULL;
+    }
+
+    return scratch;
+}
+
+/* Run tests in order on the partition until one recognizes it */
+static gboolean
+engine_run_tests(EngineRun     *run,
+                 Partition     *partition,
+                 GPtrArray     *tests,
+                 const gchar   *mount_point,
+                 const gchar   *type,
+                 const gchar   *scratch,
+                 GCancellable  *step,
+                 gboolean      *success,
+                 GError       **error)
+{
+    const gchar *argv[5] = { NULL, partition->device, mount_point, type, NULL };
+    guint i;
+
+    for (i = 0; i < tests->len && !*success; i++) {
+        argv[0] = g_ptr_array_index(tests, i);
+        if (!engine_spawn(argv, scratch, partition, run->callbacks,
+                          run->user_data, step, success, error)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+engine_is_mount_test(const gchar *test)
+{
+    return g_str_has_suffix(test, "/50mounted-tests");
+}
+
+static void
+engine_cancel_step(GCancellable *cancellable, gpointer user_data)
+{
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+}
+
+static gboolean
+engine_step_timeout(gpointer user_data)
+{
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+engine_timer_thread(gpointer data)
+{
+    GMainContext *context = data;
+
+    for (;;)
+        g_main_context_iteration(context, TRUE);
+
+    return NULL;
+}
+
+/* The context the time budgets of the partitions run in, with a thread
+ * of its own: the workers are blocked in the tests, and the caller may
+ * run no main loop at all, as bench-os-prober does.
+ */
+static GMainContext *
+engine_get_timer_context()
+{
+    static GMainContext *context = NULL;
+
+    if (g_once_init_enter(&context)) {
+        GMainContext *timers = g_main_context_new();
+
+        g_thread_unref(g_thread_new("engine-timer", engine_timer_thread, timers));
+        g_once_init_leave(&context, timers);
+    }
+
+    return context;
+}
+
+/* The per-partition step of os-prober: run the tests in order until one
+ * of them recognizes the partition.  The step is cancelled along with
+ * the run, or when the partition is over its time budget, see
+ * engine_get_timer_context().
+ */
+static void
+engine_probe_partition(gpointer data, gpointer user_data)
+{
+    Partition *partition = (Partition *)data;
+    EngineRun *run = (EngineRun *)user_data;
+    const gchar *argv[3] = { NULL, partition->device, NULL };
+    gchar *mount_point = NULL;
+    gchar *scratch = NULL;
+    const gchar *type = NULL;
+    GCancellable *step = NULL;
+    GSource *timeout = NULL;
+    gulong handler = 0;
+    gboolean success = FALSE;
+    gboolean failed = FALSE;
+    gboolean answered = FALSE;
+    GError *error = NULL;
+    gchar *message = NULL;
+    gint64 start;
+    guint i;
+
+    if (!engine_disk_acquire(partition->disk, run->cancellable))
+        goto out;
+    start = g_get_monotonic_time();
+
+    /* the budget of the partition covers the reads of the engine too */
+    step = g_cancellable_new();
+    if (run->cancellable)
+        handler = g_cancellable_connect(run->cancellable, G_CALLBACK(engine_cancel_step), step, NULL);
+    timeout = g_timeout_source_new_seconds(ENGINE_PARTITION_TIMEOUT_SECONDS);
+    g_source_set_callback(timeout, engine_step_timeout, g_object_ref(step), g_object_unref);
+    g_source_attach(timeout, engine_get_timer_context());
+
+    if (!partition->scanned)
+        superblock_read(partition->device, &partition->superblock, NULL);
+    if (run->callbacks->lookup &&
+        run->callbacks->lookup(partition, run->user_data)) {
+        answered = TRUE;
+        goto done;
+    }
+
+    if (engine_read_partition(run, partition, partition->mount_point, step))
+        goto done;
+
+    /* cancelled or over its time while the reader read */
+    if (g_cancellable_set_error_if_cancelled(step, &error)) {
+        failed = TRUE;
+        goto done;
+    }
+
+#ifdef DEBUG
+    g_print("DEBUG: probing %s on %s\n", partition->device, partition->disk);
+#endif
+    scratch = engine_make_scratch(run, partition);
+    if (partition->mount_point) {
+        /* like os-prober, the tests of a mounted filesystem run on the
+         * mount point there is, without a mount of their own
+         */
+        failed = !engine_run_tests(run, partition, run->mounted_tests,
+                                   partition->mount_point, partition->mount_type,
+                                   scratch, step, &success, &error);
+    } else {
+        if (run->mount_test && !partition->mounted)
+            mount_point = engine_mount_partition(run, partition, &type);
+        /* mounted, the reader may go where it could not on the device */
+        if (mount_point && engine_read_partition(run, partition, mount_point, step))
+            success = TRUE;
+        for (i = 0; i < run->tests->len && !success && !failed; i++) {
+            argv[0] = g_ptr_array_index(run->tests, i);
+            if (mount_point && engine_is_mount_test(argv[0])) {
+                failed = !engine_run_tests(run, partition, run->mounted_tests,
+                                           mount_point, type,
+                                           scratch, step, &success, &error);
+            } else {
+                failed = !engine_spawn(argv, scratch, partition, run->callbacks,
+                                       run->user_data, step, &success, &error);
+            }
+        }
+        if (mount_point)
+            engine_umount_partition(run, partition, mount_point);
+    }
+
+done:
+    if (scratch) {
+        engine_remove_tmpdir(scratch);
+        g_free(scratch);
+    }
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+    if (handler)
+        g_cancellable_disconnect(run->cancellable, handler);
+    engine_disk_release(partition->disk);
+
+    /* a cancelled run is not an error of the partition */
+    if (failed && !g_cancellable_is_cancelled(run->cancellable)) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            message = g_strdup_printf("%s: timed out after %d seconds", 
+                                      partition->device, 
+                                      ENGINE_PARTITION_TIMEOUT_SECONDS);
+        } else {
+            message = g_strdup_printf("%s: %s", partition->device, error->message);
+        }
+        if (run->callbacks->error)
+            run->callbacks->error(message, run->user_data);
+        g_free(message);
+    }
+    if (error) {
+        g_error_free(error);
+        error = NULL;
+    }
+    g_object_unref(step);
+
+    if (!answered && !failed && run->callbacks->probed)
+        run->callbacks->probed(partition, run->user_data);
+
+    if (run->callbacks->visited)
+        run->callbacks->visited(partition, g_get_monotonic_time() - start, run->user_data);
+    trace_span("engine", "visit", start, partition->device);
+
+out:
+    if (run->callbacks->progress) {
+        run->callbacks->progress(g_atomic_int_add(&run->done, 1) + 1, 
+                                 run->total, 
+                                 run->user_data);
+    }
+}
+
+static gint
+compare_paths(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static GPtrArray *
+engine_list_tests(const gchar *probes_dir)
+{
+    GPtrArray *tests = g_ptr_array_new_with_free_func(g_free);
+    GDir *dir = NULL;
+    const gchar *name;
+    gchar *path;
+
+    if (probes_dir)
+        dir = g_dir_open(probes_dir, 0, NULL);
+    if (dir == NULL)
+        return tests;
+
+    while ((name = g_dir_read_name(dir))) {
+        path = g_build_filename(probes_dir, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_REGULAR) &&
+            g_file_test(path, G_FILE_TEST_IS_EXECUTABLE)) {
+            g_ptr_array_add(tests, path);
+        } else {
+            g_free(path);
+        }
+    }
+    g_dir_close(dir);
+
+    g_ptr_array_sort(tests, compare_paths);
+
+    return tests;
+}
+
+/* Probe the partitions several at a time: every disk gets its own
+ * queue bounded by its concurrency limit, all disks run side by side,
+ * so the wall time follows the slowest disk rather than the sum of
+ * them; runs going on at once share the limit of a disk.  Returns once
+ * every partition has been visited, or once cancellable is cancelled
+ * and the reads and tests in flight are over: the readers give up
+ * between two reads and the tests get killed, a read blocked on a
+ * device that does not answer returns when the device does.
+ */
+void
+engine_run(GPtrArray             *partitions,
+           const EngineCallbacks *callbacks,
+           gpointer               user_data,
+           GCancellable          *cancellable)
+{
+    EngineRun run;
+    const gchar *probes_dir;
+    gchar *mounted_dir;
+    GHashTable *pools;
+    GHashTableIter iter;
+    GThreadPool *pool;
+    Partition *partition;
+    GError *error = NULL;
+    guint i;
+
+    probes_dir = engine_get_probes_dir();
+    run.tests = engine_list_tests(probes_dir);
+    mounted_dir = probes_dir ? g_build_filename(probes_dir, "mounted", NULL) : NULL;
+    run.mounted_tests = engine_list_tests(mounted_dir);
+    g_free(mounted_dir);
+    run.mount_test = FALSE;
+    for (i = 0; i < run.tests->len; i++) {
+        if (engine_is_mount_test(g_ptr_array_index(run.tests, i)))
+            run.mount_test = TRUE;
+    }
+    run.tmpdir = g_dir_make_tmp("os-prober.XXXXXX", NULL);
+    run.callbacks = callbacks;
+    run.user_data = user_data;
+    run.cancellable = cancellable;
+    run.total = partitions->len;
+    run.done = 0;
+
+    if (callbacks->progress)
+        callbacks->progress(0, run.total, user_data);
+
+    pools = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < partitions->len; i++) {
+        partition = g_ptr_array_index(partitions, i);
+        pool = g_hash_table_lookup(pools, partition->disk);
+        if (pool == NULL) {
+            pool = g_thread_pool_new(engine_probe_partition,
+                                     &run,
+                                     engine_get_disk_concurrency(partition->disk),
+                                     FALSE,
+                                     &error);
+            if (pool == NULL) {
+                if (callbacks->error)
+                    callbacks->error(error->message, user_data);
+                g_error_free(error);
+                error = NULL;
+                engine_probe_partition(partition, &run);
+                continue;
+            }
+            g_hash_table_insert(pools, g_strdup(partition->disk), pool);
+        }
+        g_thread_pool_push(pool, partition, NULL);
+    }
+
+    g_hash_table_iter_init(&iter, pools);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&pool))
+        g_thread_pool_free(pool, FALSE, TRUE);
+    g_hash_table_destroy(pools);
+
+    if (run.tmpdir) {
+        engine_remove_tmpdir(run.tmpdir);
+        g_free(run.tmpdir);
+    }
+    g_ptr_array_free(run.tests, TRUE);
+    g_ptr_array_free(run.mounted_tests, TRUE);
+}
@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <gio/gio.h>
+
+#include "types.h"
+#include "superblock.h"
+
+G_BEGIN_DECLS
+
+/* Workers per disk, picked from the device topology in sysfs */
+#define ENGINE_ROTATIONAL_WORKERS   1
+#define ENGINE_SSD_WORKERS          4
+#define ENGINE_NVME_WORKERS         8
+
+/* Time a partition gets for all its tests, after which the test running
+ * is killed and the partition reported as failed.
+ */
+#define ENGINE_PARTITION_TIMEOUT_SECONDS 30
+
+/* Where the time of a scan goes.  The mounts the engine does for the
+ * tests count as mount and umount, those the tests of os-prober do by
+ * themselves count as detect.
+ */
+typedef enum {
+    ENGINE_PHASE_SPAWN,
+    ENGINE_PHASE_MOUNT,
+    ENGINE_PHASE_DETECT,
+    ENGINE_PHASE_UMOUNT,
+    ENGINE_N_PHASES
+} EnginePhase;
+
+struct Partition {
+    gchar *name;        /* sda1, dm-0 */
+    gchar *device;      /* /dev/sda1, /dev/mapper/vg-root */
+    gchar *disk;        /* sda, the device queueing the I/O */
+    guint64 size;       /* in bytes */
+    guint major;
+    guint minor;
+    gchar *partuuid;    /* from udev, or the table by the prescan */
+    gboolean mounted;
+    gchar *mount_point; /* where it is mounted whole, if it is */
+    gchar *mount_type;  /* ext4, vfat, as mounted there */
+    guint number;       /* in the partition table of disk, 0 if none */
+    gchar *type;        /* GPT type GUID or MBR type (0x83), if known */
+    gboolean scanned;   /* superblock filled in by the prescan */
+    Superblock superblock;
+};
+
+/* Hooks of a scan, called from the engine workers.  lookup() may answer
+ * a partition without probing it, by returning TRUE, probed() tells that
+ * a partition has been probed successfully.  found() gets the lines of
+ * a partition with the short names as they are, Debian rather than
+ * Debian1, numbering them is up to the caller.  partition is NULL for
+ * output of a whole os-prober run, numbered by os-prober already.
+ * visited() gives the time a partition took, phase() the time of every
+ * step of it.  boot_entries() gives the kernels of a Linux found by
+ * reading it, as the lines of linux-boot-prober,
+ * root:boot:label:kernel:initrd:params.
+ */
+struct EngineCallbacks {
+    gboolean (*lookup)(Partition *partition, gpointer user_data);
+    void (*found)(Partition *partition, const gchar *line, gpointer user_data);
+    void (*error)(const gchar *message, gpointer user_data);
+    void (*probed)(Partition *partition, gpointer user_data);
+    void (*progress)(guint done, guint total, gpointer user_data);
+    void (*visited)(Partition *partition, gint64 usec, gpointer user_data);
+    void (*phase)(EnginePhase phase, gint64 usec, gpointer user_data);
+    void (*boot_entries)(Partition *partition, GPtrArray *entries, gpointer user_data);
+};
+
+Partition   *partition_new              (const gchar *name);
+void         partition_free             (Partition *partition);
+
+gboolean     engine_unshare_mounts      (GError **error);
+const gchar *engine_get_probes_dir      ();
+GPtrArray   *engine_list_partitions     ();
+GPtrArray   *engine_list_disk           (const gchar *disk);
+void         engine_sort_partitions     (GPtrArray *partitions);
+gchar       *engine_get_disk            (const gchar *name);
+gboolean     engine_device_ready        (const gchar *name);
+guint        engine_get_disk_concurrency(const gchar *disk);
+
+gboolean     engine_spawn               (const gchar * const   *argv,
+                                         const gchar           *tmpdir,
+                                         Partition             *partition,
+                                         const EngineCallbacks *callbacks,
+                                         gpointer               user_data,
+                                         GCancellable          *cancellable,
+                                         gboolean              *success,
+                                         GError               **error);
+void         engine_run                 (GPtrArray             *partitions,
+                                         const EngineCallbacks *callbacks,
+                                         gpointer               user_data,
+                                         GCancellable          *cancellable);
+GPtrArray   *engine_read_boot_entries   (Partition             *partition,
+                                         GCancellable          *cancellable,
+                                         GError               **error);
+
+G_END_DECLS
+
+#endif /* __ENGINE_H__ */
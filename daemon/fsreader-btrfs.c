@@ -0,0 +1,650 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+#define BTRFS_SUPER_OFFSET          65536
+#define BTRFS_SUPER_MAGIC           "_BHRfS_M"
+#define BTRFS_SYS_CHUNK_ARRAY       0x32b
+#define BTRFS_SYS_CHUNK_ARRAY_SIZE  2048
+#define BTRFS_HEADER_SIZE           101
+#define BTRFS_ITEM_SIZE             25
+#define BTRFS_KEY_PTR_SIZE          33
+#define BTRFS_KEY_SIZE              17
+#define BTRFS_CHUNK_ITEM_SIZE       48
+#define BTRFS_STRIPE_SIZE           32
+#define BTRFS_MAX_LEVEL             8
+#define BTRFS_MAX_COMPRESSED        (128 * 1024)
+
+#define BTRFS_INODE_ITEM_KEY        1
+#define BTRFS_DIR_ITEM_KEY          84
+#define BTRFS_EXTENT_DATA_KEY       108
+#define BTRFS_ROOT_ITEM_KEY         132
+#define BTRFS_CHUNK_ITEM_KEY        228
+
+#define BTRFS_FS_TREE_OBJECTID          5
+#define BTRFS_ROOT_TREE_DIR_OBJECTID    6
+#define BTRFS_FIRST_FREE_OBJECTID       256
+#define BTRFS_FIRST_CHUNK_TREE_OBJECTID 256
+
+#define BTRFS_FILE_EXTENT_INLINE    0
+#define BTRFS_FILE_EXTENT_REG       1
+#define BTRFS_COMPRESS_NONE         0
+#define BTRFS_COMPRESS_ZLIB         1
+
+/* Data split over several devices, or not mirrored on this one */
+#define BTRFS_BLOCK_GROUP_STRIPED   (0x8 | 0x40 | 0x80 | 0x100)
+
+#define BTRFS_INCOMPAT_METADATA_UUID    0x400
+#define BTRFS_INCOMPAT_KNOWN            (0x1fff | 0x10000)
+
+typedef struct {
+    guint64 objectid;
+    guint8 type;
+    guint64 offset;
+} BtrfsKey;
+
+typedef struct {
+    guint64 logical;
+    guint64 length;
+    guint64 physical;   /* G_MAXUINT64 when not readable from this device */
+} BtrfsChunk;
+
+typedef struct {
+    FsReader parent;
+    guint32 nodesize;
+    guint64 devid;
+    guint64 root_tree;
+    guint8 fsid[16];
+    GArray *chunks;
+    GHashTable *trees;  /* subvolume id to the bytenr of its tree */
+} BtrfsReader;
+
+typedef gboolean (*BtrfsItemFunc)(const BtrfsKey *key, 
+                                  const guint8   *data, 
+                                  guint32         size, 
+                                  gpointer        user_data);
+
+static void
+btrfs_read_key(const guint8 *p, BtrfsKey *key)
+{
+    key->objectid = get_le64(p);
+    key->type = p[8];
+    key->offset = get_le64(p + 9);
+}
+
+static gint
+btrfs_compare_keys(const BtrfsKey *a, const BtrfsKey *b)
+{
+    if (a->objectid != b->objectid)
+        return a->objectid < b->objectid ? -1 : 1;
+    if (a->type != b->type)
+        return a->type < b->type ? -1 : 1;
+    if (a->offset != b->offset)
+        return a->offset < b->offset ? -1 : 1;
+
+    return 0;
+}
+
+/* The name hash of directory items, crc32c seeded with ~1 and not
+ * inverted at the end.
+ */
+static guint32
+btrfs_name_hash(const gchar *name)
+{
+    guint32 crc = ~1u;
+    gint i;
+
+    for (; *name; name++) {
+        crc ^= (guint8)*name;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+
+    return crc;
+}
+
+static void
+btrfs_add_chunk(BtrfsReader *btrfs, guint64 logical, const guint8 *item, guint32 size)
+{
+    BtrfsChunk chunk;
+    guint16 stripes;
+    guint i;
+
+    if (size < BTRFS_CHUNK_ITEM_SIZE)
+        return;
+    stripes = get_le16(item + 44);
+    if (size < BTRFS_CHUNK_ITEM_SIZE + stripes * BTRFS_STRIPE_SIZE)
+        return;
+
+    chunk.logical = logical;
+    chunk.length = get_le64(item);
+    chunk.physical = G_MAXUINT64;
+    if (!(get_le64(item + 24) & BTRFS_BLOCK_GROUP_STRIPED)) {
+        for (i = 0; i < stripes; i++) {
+            if (get_le64(item + BTRFS_CHUNK_ITEM_SIZE + i * BTRFS_STRIPE_SIZE) == btrfs->devid) {
+                chunk.physical = get_le64(item + BTRFS_CHUNK_ITEM_SIZE + i * BTRFS_STRIPE_SIZE + 8);
+                break;
+            }
+        }
+    }
+    g_array_append_val(btrfs->chunks, chunk);
+}
+
+static gboolean
+btrfs_read_logical(BtrfsReader *btrfs, guint64 logical, gpointer buf, gsize len, GError **error)
+{
+    BtrfsChunk *chunk;
+    guint i;
+
+    for (i = 0; i < btrfs->chunks->len; i++) {
+        chunk = &g_array_index(btrfs->chunks, BtrfsChunk, i);
+        if (logical < chunk->logical || logical + len > chunk->logical + chunk->length)
+            continue;
+        if (chunk->physical == G_MAXUINT64)
+            continue;
+        return fsreader_pread(&btrfs->parent, chunk->physical + (logical - chunk->logical), 
+                              buf, len, error);
+    }
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                "no copy of %" G_GUINT64_FORMAT " on this device", logical);
+
+    return FALSE;
+}
+
+/* Call func on every item between min and max of the tree at bytenr, in
+ * key order, until it returns FALSE.
+ */
+static gboolean
+btrfs_walk(BtrfsReader    *btrfs,
+           guint64         bytenr,
+           gint            level,
+           const BtrfsKey *min,
+           const BtrfsKey *max,
+           BtrfsItemFunc   func,
+           gpointer        user_data,
+           gboolean       *stop,
+           GError        **error)
+{
+    guint8 *node = g_malloc(btrfs->nodesize);
+    BtrfsKey key;
+    BtrfsKey next;
+    guint32 nritems;
+    guint32 offset;
+    guint32 size;
+    gboolean ret = FALSE;
+    guint i;
+
+    if (!btrfs_read_logical(btrfs, bytenr, node, btrfs->nodesize, error))
+        goto out;
+    if (memcmp(node + 32, btrfs->fsid, 16) != 0 || get_le64(node + 48) != bytenr ||
+        node[100] >= BTRFS_MAX_LEVEL || (level >= 0 && node[100] != level)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "bad tree block at %" G_GUINT64_FORMAT, bytenr);
+        goto out;
+    }
+    level = node[100];
+    nritems = get_le32(node + 96);
+
+    if (level == 0) {
+        if (BTRFS_HEADER_SIZE + (gsize)nritems * BTRFS_ITEM_SIZE > btrfs->nodesize)
+            nritems = 0;
+        for (i = 0; i < nritems && !*stop; i++) {
+            btrfs_read_key(node + BTRFS_HEADER_SIZE + i * BTRFS_ITEM_SIZE, &key);
+            if (btrfs_compare_keys(&key, min) < 0)
+                continue;
+            if (btrfs_compare_keys(&key, max) > 0)
+                break;
+            offset = get_le32(node + BTRFS_HEADER_SIZE + i * BTRFS_ITEM_SIZE + 17);
+            size = get_le32(node + BTRFS_HEADER_SIZE + i * BTRFS_ITEM_SIZE + 21);
+            if (BTRFS_HEADER_SIZE + (gsize)offset + size > btrfs->nodesize)
+                continue;
+            *stop = !func(&key, node + BTRFS_HEADER_SIZE + offset, size, user_data);
+        }
+        ret = TRUE;
+        goto out;
+    }
+
+    if (BTRFS_HEADER_SIZE + (gsize)nritems * BTRFS_KEY_PTR_SIZE > btrfs->nodesize)
+        nritems = 0;
+    for (i = 0; i < nritems && !*stop; i++) {
+        btrfs_read_key(node + BTRFS_HEADER_SIZE + i * BTRFS_KEY_PTR_SIZE, &key);
+        if (btrfs_compare_keys(&key, max) > 0)
+            break;
+        if (i + 1 < nritems) {
+            btrfs_read_key(node + BTRFS_HEADER_SIZE + (i + 1) * BTRFS_KEY_PTR_SIZE, &next);
+            if (btrfs_compare_keys(&next, min) <= 0)
+                continue;
+        }
+        if (!btrfs_walk(btrfs, 
+                        get_le64(node + BTRFS_HEADER_SIZE + i * BTRFS_KEY_PTR_SIZE + BTRFS_KEY_SIZE),
+                        level - 1, min, max, func, user_data, stop, error)) {
+            goto out;
+        }
+    }
+    ret = TRUE;
+
+out:
+    g_free(node);
+
+    return ret;
+}
+
+static gboolean
+btrfs_search(BtrfsReader    *btrfs,
+             guint64         bytenr,
+             const BtrfsKey *min,
+             const BtrfsKey *max,
+             BtrfsItemFunc   func,
+             gpointer        user_data,
+             GError        **error)
+{
+    gboolean stop = FALSE;
+
+    return btrfs_walk(btrfs, bytenr, -1, min, max, func, user_data, &stop, error);
+}
+
+static gboolean
+btrfs_chunk_item(const BtrfsKey *key, const guint8 *data, guint32 size, gpointer user_data)
+{
+    btrfs_add_chunk((BtrfsReader *)user_data, key->offset, data, size);
+
+    return TRUE;
+}
+
+static gboolean
+btrfs_root_item(const BtrfsKey *key, const guint8 *data, guint32 size, gpointer user_data)
+{
+    /* the last one is the most recent */
+    if (size >= 184)
+        *(guint64 *)user_data = get_le64(data + 176);
+
+    return TRUE;
+}
+
+/* Root of the tree of a subvolume */
+static gboolean
+btrfs_get_tree(BtrfsReader *btrfs, guint64 id, guint64 *bytenr, GError **error)
+{
+    BtrfsKey min = { id, BTRFS_ROOT_ITEM_KEY, 0 };
+    BtrfsKey max = { id, BTRFS_ROOT_ITEM_KEY, G_MAXUINT64 };
+    gpointer cached = g_hash_table_lookup(btrfs->trees, &id);
+    guint64 *key;
+    guint64 *value;
+
+    if (cached) {
+        *bytenr = *(guint64 *)cached;
+        return TRUE;
+    }
+
+    *bytenr = 0;
+    if (!btrfs_search(btrfs, btrfs->root_tree, &min, &max, btrfs_root_item, bytenr, error))
+        return FALSE;
+    if (*bytenr == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, 
+                    "no subvolume %" G_GUINT64_FORMAT, id);
+        return FALSE;
+    }
+    key = g_new(guint64, 1);
+    *key = id;
+    value = g_new(guint64, 1);
+    *value = *bytenr;
+    g_hash_table_insert(btrfs->trees, key, value);
+
+    return TRUE;
+}
+
+typedef struct {
+    const gchar *name;
+    BtrfsKey location;
+    gboolean found;
+} BtrfsDirLookup;
+
+static gboolean
+btrfs_dir_item(const BtrfsKey *key, const guint8 *data, guint32 size, gpointer user_data)
+{
+    BtrfsDirLookup *lookup = (BtrfsDirLookup *)user_data;
+    gsize name_len = strlen(lookup->name);
+    guint32 offset = 0;
+    guint16 data_len;
+    guint16 len;
+
+    /* names colliding on the hash share the item */
+    while (offset + 30 <= size) {
+        data_len = get_le16(data + offset + 25);
+        len = get_le16(data + offset + 27);
+        if (offset + 30 + len > size)
+            break;
+        if (len == name_len && memcmp(data + offset + 30, lookup->name, len) == 0) {
+            btrfs_read_key(data + offset, &lookup->location);
+            lookup->found = TRUE;
+            return FALSE;
+        }
+        offset += 30 + len + data_len;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btrfs_find_dir_item(BtrfsReader *btrfs, 
+                    guint64 tree, 
+                    guint64 dir, 
+                    const gchar *name, 
+                    BtrfsKey *location, 
+                    GError **error)
+{
+    BtrfsKey key = { dir, BTRFS_DIR_ITEM_KEY, btrfs_name_hash(name) };
+    BtrfsDirLookup lookup = { name, { 0, 0, 0 }, FALSE };
+
+    if (!btrfs_search(btrfs, tree, &key, &key, btrfs_dir_item, &lookup, error))
+        return FALSE;
+    if (!lookup.found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        return FALSE;
+    }
+    *location = lookup.location;
+
+    return TRUE;
+}
+
+static gboolean
+btrfs_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    BtrfsReader *btrfs = (BtrfsReader *)reader;
+    BtrfsKey location;
+    guint64 tree;
+
+    if (!btrfs_get_tree(btrfs, dir->tree, &tree, error) ||
+        !btrfs_find_dir_item(btrfs, tree, dir->ino, name, &location, error)) {
+        return FALSE;
+    }
+
+    /* the entry of a subvolume leads to the root directory of its tree */
+    if (location.type == BTRFS_ROOT_ITEM_KEY) {
+        inode->tree = location.objectid;
+        inode->ino = BTRFS_FIRST_FREE_OBJECTID;
+    } else {
+        inode->tree = dir->tree;
+        inode->ino = location.objectid;
+    }
+
+    return TRUE;
+}
+
+typedef struct {
+    guint32 mode;
+    guint64 size;
+    gboolean found;
+} BtrfsStat;
+
+static gboolean
+btrfs_inode_item(const BtrfsKey *key, const guint8 *data, guint32 size, gpointer user_data)
+{
+    BtrfsStat *stat = (BtrfsStat *)user_data;
+
+    if (size >= 56) {
+        stat->size = get_le64(data + 16);
+        stat->mode = get_le32(data + 52);
+        stat->found = TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+btrfs_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    BtrfsReader *btrfs = (BtrfsReader *)reader;
+    BtrfsKey key = { inode->ino, BTRFS_INODE_ITEM_KEY, 0 };
+    BtrfsStat stat = { 0, 0, FALSE };
+    guint64 tree;
+
+    if (!btrfs_get_tree(btrfs, inode->tree, &tree, error) ||
+        !btrfs_search(btrfs, tree, &key, &key, btrfs_inode_item, &stat, error)) {
+        return FALSE;
+    }
+    if (!stat.found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "no inode %" G_GUINT64_FORMAT, inode->ino);
+        return FALSE;
+    }
+    *mode = stat.mode;
+    *size = stat.size;
+
+    return TRUE;
+}
+
+typedef struct {
+    BtrfsReader *btrfs;
+    guint8 *buf;
+    gsize len;
+    GError *error;
+} BtrfsRead;
+
+/* Copy the part of one file extent that falls within the read */
+static gboolean
+btrfs_extent_data(const BtrfsKey *key, const guint8 *data, guint32 size, gpointer user_data)
+{
+    BtrfsRead *read = (BtrfsRead *)user_data;
+    guint8 compression;
+    guint64 ram_bytes;
+    guint64 disk_bytenr;
+    guint64 disk_bytes;
+    guint64 offset;
+    guint64 count;
+    guint8 *raw = NULL;
+    guint8 *plain = NULL;
+    gboolean ret = TRUE;
+
+    if (size < 21 || key->offset >= read->len)
+        return TRUE;
+    compression = data[16];
+    ram_bytes = get_le64(data + 8);
+    if (data[17] || get_le16(data + 18) ||
+        (compression != BTRFS_COMPRESS_NONE && compression != BTRFS_COMPRESS_ZLIB)) {
+        g_set_error(&read->error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "unsupported compression or encryption");
+        return FALSE;
+    }
+
+    if (data[20] == BTRFS_FILE_EXTENT_INLINE) {
+        count = MIN(read->len - key->offset, compression ? ram_bytes : size - 21);
+        if (compression == BTRFS_COMPRESS_NONE) {
+            memcpy(read->buf + key->offset, data + 21, count);
+        } else if (ram_bytes <= BTRFS_MAX_COMPRESSED) {
+            plain = g_malloc(ram_bytes);
+            ret = fsreader_inflate(data + 21, size - 21, plain, ram_bytes, &read->error);
+            if (ret)
+                memcpy(read->buf + key->offset, plain, count);
+        } else {
+            ret = FALSE;
+        }
+        g_free(plain);
+        if (!ret && read->error == NULL)
+            g_set_error(&read->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad inline extent");
+        return ret;
+    }
+
+    /* preallocated extents read as zeros, like holes */
+    if (data[20] != BTRFS_FILE_EXTENT_REG || size < 53)
+        return TRUE;
+    disk_bytenr = get_le64(data + 21);
+    disk_bytes = get_le64(data + 29);
+    offset = get_le64(data + 37);
+    count = MIN(get_le64(data + 45), read->len - key->offset);
+    if (disk_bytenr == 0)
+        return TRUE;
+
+    if (compression == BTRFS_COMPRESS_NONE)
+        return btrfs_read_logical(read->btrfs, disk_bytenr + offset, 
+                                  read->buf + key->offset, count, &read->error);
+
+    if (disk_bytes > BTRFS_MAX_COMPRESSED || ram_bytes > BTRFS_MAX_COMPRESSED ||
+        offset + count > ram_bytes) {
+        g_set_error(&read->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad compressed extent");
+        return FALSE;
+    }
+    raw = g_malloc(disk_bytes);
+    plain = g_malloc(ram_bytes);
+    ret = btrfs_read_logical(read->btrfs, disk_bytenr, raw, disk_bytes, &read->error) &&
+          fsreader_inflate(raw, disk_bytes, plain, ram_bytes, &read->error);
+    if (ret)
+        memcpy(read->buf + key->offset, plain + offset, count);
+    g_free(plain);
+    g_free(raw);
+
+    return ret;
+}
+
+static gboolean
+btrfs_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    BtrfsReader *btrfs = (BtrfsReader *)reader;
+    BtrfsKey min = { inode->ino, BTRFS_EXTENT_DATA_KEY, 0 };
+    BtrfsKey max = { inode->ino, BTRFS_EXTENT_DATA_KEY, len ? len - 1 : 0 };
+    BtrfsRead read = { btrfs, buf, len, NULL };
+    guint64 tree;
+
+    memset(buf, 0, len);
+    if (len == 0)
+        return TRUE;
+    if (!btrfs_get_tree(btrfs, inode->tree, &tree, error) ||
+        !btrfs_search(btrfs, tree, &min, &max, btrfs_extent_data, &read, error)) {
+        return FALSE;
+    }
+    if (read.error) {
+        g_propagate_error(error, read.error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+btrfs_free(FsReader *reader)
+{
+    BtrfsReader *btrfs = (BtrfsReader *)reader;
+
+    g_array_free(btrfs->chunks, TRUE);
+    g_hash_table_destroy(btrfs->trees);
+    g_free(btrfs);
+}
+
+static const FsReaderOps btrfs_ops = {
+    btrfs_lookup,
+    btrfs_stat,
+    btrfs_read,
+    btrfs_free,
+};
+
+/* Map the chunks, the system ones from the superblock first, which the
+ * chunk tree lives in, and find the subvolume a mount would show.
+ */
+FsReader *
+btrfs_reader_open(gint fd, GError **error)
+{
+    BtrfsReader *btrfs;
+    guint8 sb[4096];
+    BtrfsKey key;
+    BtrfsKey min = { BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY, 0 };
+    BtrfsKey max = { BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY, G_MAXUINT64 };
+    BtrfsKey location;
+    guint64 incompat;
+    guint32 array_size;
+    guint32 offset;
+    guint32 size;
+    GError *local_error = NULL;
+
+    if (!disk_read(fd, BTRFS_SUPER_OFFSET, sb, sizeof(sb), error))
+        return NULL;
+    if (memcmp(sb + 0x40, BTRFS_SUPER_MAGIC, 8) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad superblock");
+        return NULL;
+    }
+
+    incompat = get_le64(sb + 0xbc);
+    if (incompat & ~(guint64)BTRFS_INCOMPAT_KNOWN) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "unsupported features 0x%" G_GINT64_MODIFIER "x", 
+                    incompat & ~(guint64)BTRFS_INCOMPAT_KNOWN);
+        return NULL;
+    }
+    /* what the log tree holds only shows once a mount replayed it */
+    if (get_le64(sb + 0x60)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "log tree needs replay");
+        return NULL;
+    }
+
+    btrfs = g_new0(BtrfsReader, 1);
+    btrfs->parent.ops = &btrfs_ops;
+    btrfs->parent.fd = fd;
+    btrfs->nodesize = get_le32(sb + 0x94);
+    btrfs->devid = get_le64(sb + 0xc9);
+    btrfs->root_tree = get_le64(sb + 0x50);
+    memcpy(btrfs->fsid, sb + ((incompat & BTRFS_INCOMPAT_METADATA_UUID) ? 0x23b : 0x20), 16);
+    btrfs->chunks = g_array_new(FALSE, FALSE, sizeof(BtrfsChunk));
+    btrfs->trees = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+
+    if (btrfs->nodesize < 4096 || btrfs->nodesize > 65536) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad superblock");
+        goto failed;
+    }
+
+    array_size = MIN(get_le32(sb + 0xa0), BTRFS_SYS_CHUNK_ARRAY_SIZE);
+    for (offset = 0; offset + BTRFS_KEY_SIZE + BTRFS_CHUNK_ITEM_SIZE <= array_size;) {
+        btrfs_read_key(sb + BTRFS_SYS_CHUNK_ARRAY + offset, &key);
+        offset += BTRFS_KEY_SIZE;
+        size = BTRFS_CHUNK_ITEM_SIZE + 
+               get_le16(sb + BTRFS_SYS_CHUNK_ARRAY + offset + 44) * BTRFS_STRIPE_SIZE;
+        if (key.type != BTRFS_CHUNK_ITEM_KEY || offset + size > array_size)
+            break;
+        btrfs_add_chunk(btrfs, key.offset, sb + BTRFS_SYS_CHUNK_ARRAY + offset, size);
+        offset += size;
+    }
+
+    if (!btrfs_search(btrfs, get_le64(sb + 0x58), &min, &max, btrfs_chunk_item, btrfs, error))
+        goto failed;
+
+    /* the default subvolume, the top level one unless set otherwise */
+    btrfs->parent.root.tree = BTRFS_FS_TREE_OBJECTID;
+    btrfs->parent.root.ino = BTRFS_FIRST_FREE_OBJECTID;
+    if (btrfs_find_dir_item(btrfs, btrfs->root_tree, BTRFS_ROOT_TREE_DIR_OBJECTID, 
+                            "default", &location, &local_error)) {
+        if (location.objectid > BTRFS_FS_TREE_OBJECTID)
+            btrfs->parent.root.tree = location.objectid;
+    } else if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        g_propagate_error(error, local_error);
+        goto failed;
+    } else {
+        g_error_free(local_error);
+    }
+
+    return &btrfs->parent;
+
+failed:
+    btrfs_free(&btrfs->parent);
+
+    return NULL;
+}
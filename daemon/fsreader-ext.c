@@ -0,0 +1,440 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+#define EXT_SUPERBLOCK          1024
+#define EXT_ROOT_INO            2
+#define EXT_N_BLOCKS            15
+#define EXT_IND_BLOCK           12
+
+#define EXT_INCOMPAT_FILETYPE   0x0002
+#define EXT_INCOMPAT_RECOVER    0x0004
+#define EXT_INCOMPAT_EXTENTS    0x0040
+#define EXT_INCOMPAT_64BIT      0x0080
+#define EXT_INCOMPAT_MMP        0x0100
+#define EXT_INCOMPAT_FLEX_BG    0x0200
+#define EXT_INCOMPAT_EA_INODE   0x0400
+#define EXT_INCOMPAT_CSUM_SEED  0x2000
+#define EXT_INCOMPAT_LARGEDIR   0x4000
+#define EXT_INCOMPAT_INLINE     0x8000
+#define EXT_INCOMPAT_ENCRYPT    0x10000
+#define EXT_INCOMPAT_CASEFOLD   0x20000
+#define EXT_INCOMPAT_KNOWN      (EXT_INCOMPAT_FILETYPE | EXT_INCOMPAT_EXTENTS | \
+                                 EXT_INCOMPAT_64BIT | EXT_INCOMPAT_MMP | \
+                                 EXT_INCOMPAT_FLEX_BG | EXT_INCOMPAT_EA_INODE | \
+                                 EXT_INCOMPAT_CSUM_SEED | EXT_INCOMPAT_LARGEDIR | \
+                                 EXT_INCOMPAT_INLINE | EXT_INCOMPAT_ENCRYPT | \
+                                 EXT_INCOMPAT_CASEFOLD)
+
+#define EXT_EXTENTS_FL          0x00080000
+#define EXT_INLINE_DATA_FL      0x10000000
+#define EXT_EXTENT_MAGIC        0xF30A
+#define EXT_MAX_EXTENT_DEPTH    5
+#define EXT_MAX_INODE_SIZE      1024
+#define EXT_XATTR_MAGIC         0xEA020000
+#define EXT_XATTR_INDEX_SYSTEM  7
+
+typedef struct {
+    FsReader parent;
+    guint32 block_size;
+    guint32 inode_size;
+    guint32 inodes_per_group;
+    guint32 desc_size;
+    guint64 desc_block;
+    guint32 groups;
+    gboolean filetype;
+} ExtReader;
+
+typedef struct {
+    guint32 mode;
+    guint64 size;
+    guint32 flags;
+    guint8 block[EXT_N_BLOCKS * 4];
+    guint8 raw[EXT_MAX_INODE_SIZE];
+    gsize raw_size;
+} ExtInode;
+
+static gboolean
+ext_read_inode(ExtReader *ext, guint32 ino, ExtInode *inode, GError **error)
+{
+    guint8 desc[64];
+    guint32 group;
+    guint32 index;
+    guint64 table;
+
+    if (ino == 0 || (ino - 1) / ext->inodes_per_group >= ext->groups) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad inode %u", ino);
+        return FALSE;
+    }
+    group = (ino - 1) / ext->inodes_per_group;
+    index = (ino - 1) % ext->inodes_per_group;
+
+    if (!fsreader_pread(&ext->parent, 
+                        ext->desc_block * ext->block_size + (guint64)group * ext->desc_size,
+                        desc, ext->desc_size, error)) {
+        return FALSE;
+    }
+    table = get_le32(desc + 8);
+    if (ext->desc_size >= 64)
+        table |= (guint64)get_le32(desc + 0x28) << 32;
+
+    inode->raw_size = MIN(ext->inode_size, sizeof(inode->raw));
+    if (!fsreader_pread(&ext->parent,
+                        table * ext->block_size + (guint64)index * ext->inode_size,
+                        inode->raw, inode->raw_size, error)) {
+        return FALSE;
+    }
+
+    inode->mode = get_le16(inode->raw);
+    inode->size = get_le32(inode->raw + 4) | (guint64)get_le32(inode->raw + 0x6C) << 32;
+    inode->flags = get_le32(inode->raw + 0x20);
+    memcpy(inode->block, inode->raw + 0x28, sizeof(inode->block));
+
+    return TRUE;
+}
+
+/* Physical block of logical block lblk in an extent tree, 0 for a hole
+ * or an extent not written yet. node is size bytes long, the i_block of
+ * the inode for the root, a block for the others.
+ */
+static gboolean
+ext_map_extent(ExtReader *ext, const guint8 *node, gsize size, guint32 lblk, guint depth, 
+               guint64 *pblk, GError **error)
+{
+    guint8 *child;
+    guint16 entries;
+    guint64 leaf = 0;
+    guint32 start;
+    guint16 len;
+    gboolean ret;
+    guint i;
+
+    *pblk = 0;
+    entries = get_le16(node + 2);
+    if (get_le16(node) != EXT_EXTENT_MAGIC || depth > EXT_MAX_EXTENT_DEPTH ||
+        entries > get_le16(node + 4) || 12 + (gsize)entries * 12 > size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad extent header");
+        return FALSE;
+    }
+
+    if (get_le16(node + 6) == 0) {
+        for (i = 0; i < entries; i++) {
+            start = get_le32(node + 12 + i * 12);
+            len = get_le16(node + 12 + i * 12 + 4);
+            if (lblk < start || len > 32768 || lblk >= start + len)
+                continue;
+            *pblk = ((guint64)get_le16(node + 12 + i * 12 + 6) << 32 |
+                     get_le32(node + 12 + i * 12 + 8)) + (lblk - start);
+            break;
+        }
+        return TRUE;
+    }
+
+    for (i = 0; i < entries && get_le32(node + 12 + i * 12) <= lblk; i++) {
+        leaf = get_le32(node + 12 + i * 12 + 4) | 
+               (guint64)get_le16(node + 12 + i * 12 + 8) << 32;
+    }
+    if (leaf == 0)
+        return TRUE;
+
+    child = g_malloc(ext->block_size);
+    ret = fsreader_pread(&ext->parent, leaf * ext->block_size, child, ext->block_size, error) &&
+          ext_map_extent(ext, child, ext->block_size, lblk, depth + 1, pblk, error);
+    g_free(child);
+
+    return ret;
+}
+
+/* Physical block of logical block lblk through the indirect blocks of
+ * ext2/3, 0 for a hole.
+ */
+static gboolean
+ext_map_indirect(ExtReader *ext, const ExtInode *inode, guint64 lblk, guint64 *pblk, GError **error)
+{
+    guint64 per = ext->block_size / 4;
+    guint64 span = 1;
+    guint8 entry[4];
+    guint level;
+    guint i;
+
+    *pblk = 0;
+    if (lblk < EXT_IND_BLOCK) {
+        *pblk = get_le32(inode->block + lblk * 4);
+        return TRUE;
+    }
+    lblk -= EXT_IND_BLOCK;
+
+    for (level = 1; level <= 3; level++) {
+        span *= per;
+        if (lblk < span)
+            break;
+        lblk -= span;
+    }
+    if (level > 3)
+        return TRUE;
+
+    *pblk = get_le32(inode->block + (EXT_IND_BLOCK + level - 1) * 4);
+    for (i = level; i > 0 && *pblk; i--) {
+        span /= per;
+        if (!fsreader_pread(&ext->parent, 
+                            *pblk * ext->block_size + (lblk / span) * 4, 
+                            entry, sizeof(entry), error)) {
+            return FALSE;
+        }
+        *pblk = get_le32(entry);
+        lblk %= span;
+    }
+
+    return TRUE;
+}
+
+/* Inline data past the 60 bytes of i_block goes to the system.data
+ * extended attribute, in the inode body.
+ */
+static const guint8 *
+ext_inline_tail(const ExtInode *inode, gsize *len)
+{
+    const guint8 *base;
+    const guint8 *entry;
+    const guint8 *end = inode->raw + inode->raw_size;
+    gsize extra;
+
+    if (inode->raw_size <= 128 + 2)
+        return NULL;
+    extra = get_le16(inode->raw + 128);
+    if (128 + extra + 4 > inode->raw_size || get_le32(inode->raw + 128 + extra) != EXT_XATTR_MAGIC)
+        return NULL;
+
+    base = entry = inode->raw + 128 + extra + 4;
+    while (entry + 16 <= end && get_le32(entry) != 0) {
+        if (entry[1] == EXT_XATTR_INDEX_SYSTEM && entry[0] == 4 &&
+            entry + 20 <= end && memcmp(entry + 16, "data", 4) == 0) {
+            *len = get_le32(entry + 8);
+            if (get_le32(entry + 4) || base + get_le16(entry + 2) + *len > end)
+                return NULL;
+            return base + get_le16(entry + 2);
+        }
+        entry += (16 + entry[0] + 3) & ~3;
+    }
+
+    return NULL;
+}
+
+static gboolean
+ext_read_data(ExtReader *ext, const ExtInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    guint64 lblk;
+    guint64 pblk;
+    gsize done;
+    gsize chunk;
+    const guint8 *tail;
+    gsize tail_len = 0;
+    gboolean ret;
+
+    /* small files and fast symbolic links live in the inode itself */
+    if ((inode->flags & EXT_INLINE_DATA_FL) ||
+        (S_ISLNK(inode->mode) && inode->size < sizeof(inode->block) && 
+         !(inode->flags & EXT_EXTENTS_FL))) {
+        memcpy(buf, inode->block, MIN(len, sizeof(inode->block)));
+        if (len <= sizeof(inode->block))
+            return TRUE;
+        tail = (inode->flags & EXT_INLINE_DATA_FL) ? ext_inline_tail(inode, &tail_len) : NULL;
+        if (tail == NULL || sizeof(inode->block) + tail_len < len) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad inline data");
+            return FALSE;
+        }
+        memcpy(buf + sizeof(inode->block), tail, len - sizeof(inode->block));
+        return TRUE;
+    }
+
+    for (done = 0, lblk = 0; done < len; done += chunk, lblk++) {
+        chunk = MIN(len - done, ext->block_size);
+        if (inode->flags & EXT_EXTENTS_FL)
+            ret = ext_map_extent(ext, inode->block, sizeof(inode->block), lblk, 0, &pblk, error);
+        else
+            ret = ext_map_indirect(ext, inode, lblk, &pblk, error);
+        if (!ret)
+            return FALSE;
+
+        if (pblk == 0)
+            memset(buf + done, 0, chunk);
+        else if (!fsreader_pread(&ext->parent, pblk * ext->block_size, buf + done, chunk, error))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+ext_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    ExtInode raw;
+
+    if (!ext_read_inode((ExtReader *)reader, inode->ino, &raw, error))
+        return FALSE;
+
+    *mode = raw.mode;
+    *size = raw.size;
+
+    return TRUE;
+}
+
+static gboolean
+ext_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    ExtInode raw;
+
+    return ext_read_inode((ExtReader *)reader, inode->ino, &raw, error) &&
+           ext_read_data((ExtReader *)reader, &raw, buf, len, error);
+}
+
+/* Linear scan of the directory, which holds for htree directories too:
+ * their index blocks look like a single unused entry.
+ */
+static gboolean
+ext_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    ExtReader *ext = (ExtReader *)reader;
+    ExtInode raw;
+    guint8 *buf;
+    gsize name_len = strlen(name);
+    gsize offset = 0;
+    gsize start = 0;
+    gsize block = ext->block_size;
+    guint32 ino;
+    guint16 rec_len;
+    guint16 len;
+    gboolean found = FALSE;
+
+    if (!ext_read_inode(ext, dir->ino, &raw, error))
+        return FALSE;
+    if (raw.size > FSREADER_MAX_DIR) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "directory of %" G_GUINT64_FORMAT " bytes", raw.size);
+        return FALSE;
+    }
+
+    buf = g_malloc(raw.size);
+    if (!ext_read_data(ext, &raw, buf, raw.size, error)) {
+        g_free(buf);
+        return FALSE;
+    }
+
+    /* an inline directory starts with the inode of its parent */
+    if (raw.flags & EXT_INLINE_DATA_FL) {
+        offset = start = 4;
+        block = raw.size;
+    }
+
+    while (!found && offset + 8 <= raw.size) {
+        ino = get_le32(buf + offset);
+        rec_len = get_le16(buf + offset + 4);
+        len = ext->filetype ? buf[offset + 6] : get_le16(buf + offset + 6);
+        if (rec_len < 8 || offset + rec_len > raw.size) {
+            /* skip to the next block of a damaged directory */
+            offset = start + ((offset - start) / block + 1) * block;
+            continue;
+        }
+        if (ino && len == name_len && offset + 8 + len <= raw.size &&
+            memcmp(buf + offset + 8, name, len) == 0) {
+            inode->tree = 0;
+            inode->ino = ino;
+            found = TRUE;
+        }
+        offset += rec_len;
+    }
+    g_free(buf);
+
+    if (!found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+ext_free(FsReader *reader)
+{
+    g_free(reader);
+}
+
+static const FsReaderOps ext_ops = {
+    ext_lookup,
+    ext_stat,
+    ext_read,
+    ext_free,
+};
+
+FsReader *
+ext_reader_open(gint fd, GError **error)
+{
+    ExtReader *ext;
+    guint8 sb[1024];
+    guint32 incompat;
+    guint64 blocks;
+    guint32 blocks_per_group;
+
+    if (!disk_read(fd, EXT_SUPERBLOCK, sb, sizeof(sb), error))
+        return NULL;
+
+    incompat = get_le32(sb + 96);
+    if (incompat & EXT_INCOMPAT_RECOVER) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "journal needs recovery");
+        return NULL;
+    }
+    if (incompat & ~EXT_INCOMPAT_KNOWN) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "unsupported features 0x%x", incompat & ~EXT_INCOMPAT_KNOWN);
+        return NULL;
+    }
+
+    ext = g_new0(ExtReader, 1);
+    ext->parent.ops = &ext_ops;
+    ext->parent.fd = fd;
+    ext->parent.root.ino = EXT_ROOT_INO;
+    ext->block_size = 1024u << MIN(get_le32(sb + 24), 6);
+    ext->inode_size = get_le32(sb + 76) >= 1 ? get_le16(sb + 88) : 128;
+    ext->inodes_per_group = get_le32(sb + 40);
+    ext->desc_size = (incompat & EXT_INCOMPAT_64BIT) ? get_le16(sb + 254) : 32;
+    ext->desc_block = get_le32(sb + 20) + 1;
+    ext->filetype = (incompat & EXT_INCOMPAT_FILETYPE) != 0;
+
+    blocks = get_le32(sb + 4);
+    if (incompat & EXT_INCOMPAT_64BIT)
+        blocks |= (guint64)get_le32(sb + 0x150) << 32;
+    blocks_per_group = get_le32(sb + 32);
+
+    if (ext->inode_size < 128 || ext->inodes_per_group == 0 || blocks_per_group == 0 ||
+        ext->desc_size < 32 || ext->desc_size > 64) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad superblock");
+        g_free(ext);
+        return NULL;
+    }
+    ext->groups = (blocks - get_le32(sb + 20) + blocks_per_group - 1) / blocks_per_group;
+
+    return &ext->parent;
+}
@@ -0,0 +1,431 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+#define FAT_ATTR_VOLUME         0x08
+#define FAT_ATTR_DIR            0x10
+#define FAT_ATTR_LFN            0x0F
+#define FAT_DELETED             0xE5
+#define FAT_LFN_LAST            0x40
+#define FAT_LFN_CHARS           13
+#define FAT_LFN_MAX             20
+#define FAT_CASE_LOWER_BASE     0x08
+#define FAT_CASE_LOWER_EXT      0x10
+#define FAT_BLOCK               4096
+
+typedef struct {
+    FsReader parent;
+    guint32 bits;               /* FAT12, FAT16 or FAT32 */
+    guint32 cluster_size;
+    guint32 clusters;           /* data clusters, numbered from 2 */
+    guint64 fat_offset;
+    guint64 data_offset;
+    guint64 root_offset;        /* the fixed root directory of FAT12/16 */
+    guint32 root_size;
+    guint8 block[FAT_BLOCK];    /* of the FAT, read last */
+    guint64 block_offset;
+} FatReader;
+
+/* The entry of the FAT for cluster, the next cluster of the chain */
+static gboolean
+fat_next(FatReader *fat, guint32 cluster, guint32 *next, GError **error)
+{
+    guint64 offset;
+    guint64 block;
+    guint8 pair[2];
+
+    if (fat->bits == 12)
+        offset = cluster + cluster / 2;
+    else
+        offset = (guint64)cluster * (fat->bits / 8);
+
+    block = offset - offset % FAT_BLOCK;
+    if (fat->bits == 12 && offset % FAT_BLOCK == FAT_BLOCK - 1) {
+        /* a FAT12 entry across two blocks */
+        if (!fsreader_pread(&fat->parent, fat->fat_offset + offset, pair, 2, error))
+            return FALSE;
+    } else {
+        if (block != fat->block_offset &&
+            !fsreader_pread(&fat->parent, fat->fat_offset + block, fat->block, FAT_BLOCK, error)) {
+            fat->block_offset = G_MAXUINT64;
+            return FALSE;
+        }
+        fat->block_offset = block;
+        memcpy(pair, fat->block + offset % FAT_BLOCK, 2);
+    }
+
+    if (fat->bits == 12) {
+        *next = get_le16(pair);
+        *next = (cluster & 1) ? *next >> 4 : *next & 0xFFF;
+        if (*next >= 0xFF8)
+            *next = 0;
+    } else if (fat->bits == 16) {
+        *next = get_le16(fat->block + offset % FAT_BLOCK);
+        if (*next >= 0xFFF8)
+            *next = 0;
+    } else {
+        *next = get_le32(fat->block + offset % FAT_BLOCK) & 0x0FFFFFFF;
+        if (*next >= 0x0FFFFFF8)
+            *next = 0;
+    }
+
+    /* free and bad clusters end no chain */
+    if (*next && (*next < 2 || *next >= fat->clusters + 2)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "cluster %u follows %u", *next, cluster);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Read len bytes of the chain from cluster, or the whole chain when len
+ * is 0, up to max bytes.
+ */
+static gboolean
+fat_read_chain(FatReader *fat, guint32 cluster, GByteArray *data, gsize len, gsize max, GError **error)
+{
+    gsize chunk;
+
+    while (cluster && (len == 0 || data->len < len)) {
+        if (cluster < 2 || cluster >= fat->clusters + 2) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "cluster %u out of range", cluster);
+            return FALSE;
+        }
+        chunk = len ? MIN(fat->cluster_size, len - data->len) : fat->cluster_size;
+        if (data->len + chunk > max) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "chain longer than %" G_GSIZE_FORMAT " bytes", max);
+            return FALSE;
+        }
+        g_byte_array_set_size(data, data->len + chunk);
+        if (!fsreader_pread(&fat->parent,
+                            fat->data_offset + (guint64)(cluster - 2) * fat->cluster_size,
+                            data->data + data->len - chunk, chunk,
+                            error) ||
+            !fat_next(fat, cluster, &cluster, error)) {
+            return FALSE;
+        }
+    }
+
+    if (data->len < len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "chain shorter than the file");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GByteArray *
+fat_read_dir(FatReader *fat, const FsInode *dir, GError **error)
+{
+    GByteArray *data = g_byte_array_new();
+
+    if (dir->ino == 0) {
+        g_byte_array_set_size(data, fat->root_size);
+        if (!fsreader_pread(&fat->parent, fat->root_offset, data->data, data->len, error)) {
+            g_byte_array_unref(data);
+            return NULL;
+        }
+    } else if (!fat_read_chain(fat, dir->ino, data, 0, FSREADER_MAX_DIR, error)) {
+        g_byte_array_unref(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/* The 8.3 name of an entry, lowercased the way Windows NT marks it */
+static gchar *
+fat_short_name(const guint8 *entry)
+{
+    GString *name = g_string_new(NULL);
+    gint base = 8;
+    gint ext = 3;
+    gint i;
+    gchar c;
+
+    while (base > 0 && entry[base - 1] == ' ')
+        base--;
+    while (ext > 0 && entry[8 + ext - 1] == ' ')
+        ext--;
+
+    for (i = 0; i < base + ext; i++) {
+        if (i == base)
+            g_string_append_c(name, '.');
+        c = entry[i < base ? i : 8 + i - base];
+        if (i == 0 && (guint8)c == 0x05)
+            c = (gchar)FAT_DELETED;
+        /* the OEM code page is not known, only ASCII is kept */
+        if ((guint8)c >= 0x80)
+            c = '_';
+        if (entry[12] & (i < base ? FAT_CASE_LOWER_BASE : FAT_CASE_LOWER_EXT))
+            c = g_ascii_tolower(c);
+        g_string_append_c(name, c);
+    }
+
+    return g_string_free(name, FALSE);
+}
+
+static guint8
+fat_checksum(const guint8 *entry)
+{
+    guint8 sum = 0;
+    gint i;
+
+    for (i = 0; i < 11; i++)
+        sum = (guint8)(((sum & 1) << 7) + (sum >> 1) + entry[i]);
+
+    return sum;
+}
+
+/* Walk the entries of dir, gluing the long names to the short entries
+ * they belong to.  Finds name when given, case-insensitively as Windows
+ * does, or else lists the names to names.
+ */
+static gboolean
+fat_scan(FatReader *fat, const FsInode *dir, const gchar *name, FsInode *inode, GPtrArray *names, GError **error)
+{
+    GByteArray *data;
+    const guint8 *entry;
+    guint8 lfn[FAT_LFN_MAX * FAT_LFN_CHARS * 2];
+    guint lfn_slots = 0;
+    guint lfn_next = 0;
+    guint8 lfn_sum = 0;
+    gchar *long_name;
+    gchar *short_name;
+    gboolean found = FALSE;
+    gsize offset;
+    guint seq;
+    guint i;
+
+    data = fat_read_dir(fat, dir, error);
+    if (data == NULL)
+        return FALSE;
+
+    for (offset = 0; !found && offset + 32 <= data->len; offset += 32) {
+        entry = data->data + offset;
+        if (entry[0] == 0)
+            break;
+        if (entry[0] == FAT_DELETED) {
+            lfn_slots = 0;
+            continue;
+        }
+
+        if ((entry[11] & 0x3F) == FAT_ATTR_LFN) {
+            /* the pieces of a long name come last first */
+            seq = entry[0] & 0x1F;
+            if (entry[0] & FAT_LFN_LAST) {
+                lfn_slots = seq;
+                lfn_sum = entry[13];
+                memset(lfn, 0xFF, sizeof(lfn));
+            } else if (lfn_slots == 0 || seq != lfn_next || entry[13] != lfn_sum) {
+                lfn_slots = 0;
+                continue;
+            }
+            if (seq == 0 || seq > FAT_LFN_MAX) {
+                lfn_slots = 0;
+                continue;
+            }
+            memcpy(lfn + (seq - 1) * 26, entry + 1, 10);
+            memcpy(lfn + (seq - 1) * 26 + 10, entry + 14, 12);
+            memcpy(lfn + (seq - 1) * 26 + 22, entry + 28, 4);
+            lfn_next = seq - 1;
+            continue;
+        }
+
+        if (entry[11] & FAT_ATTR_VOLUME || entry[0] == '.') {
+            lfn_slots = 0;
+            continue;
+        }
+
+        /* a long name is only good with all its pieces, for this entry */
+        long_name = NULL;
+        if (lfn_slots && lfn_next == 0 && lfn_sum == fat_checksum(entry)) {
+            for (i = 0; i < lfn_slots * FAT_LFN_CHARS; i++) {
+                if (get_le16(lfn + i * 2) == 0 || get_le16(lfn + i * 2) == 0xFFFF)
+                    break;
+            }
+            long_name = fsreader_utf16_name(lfn, i);
+        }
+        lfn_slots = 0;
+        short_name = fat_short_name(entry);
+
+        if (name == NULL) {
+            g_ptr_array_add(names, long_name ? long_name : g_strdup(short_name));
+            long_name = NULL;
+        } else if ((long_name && fsreader_name_equal(long_name, name)) ||
+                   fsreader_name_equal(short_name, name)) {
+            inode->ino = (fat->bits == 32 ? (guint32)get_le16(entry + 20) << 16 : 0) |
+                         get_le16(entry + 26);
+            inode->tree = get_le32(entry + 28) | (guint64)entry[11] << 32;
+            found = TRUE;
+        }
+        g_free(long_name);
+        g_free(short_name);
+    }
+    g_byte_array_unref(data);
+
+    if (name && !found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+fat_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    return fat_scan((FatReader *)reader, dir, name, inode, NULL, error);
+}
+
+static gboolean
+fat_list(FsReader *reader, const FsInode *dir, GPtrArray *names, GError **error)
+{
+    return fat_scan((FatReader *)reader, dir, NULL, NULL, names, error);
+}
+
+static gboolean
+fat_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    if ((inode->tree >> 32) & FAT_ATTR_DIR) {
+        *mode = S_IFDIR | 0755;
+        *size = 0;
+    } else {
+        *mode = S_IFREG | 0644;
+        *size = inode->tree & 0xFFFFFFFF;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+fat_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    GByteArray *data;
+
+    if (len == 0)
+        return TRUE;
+
+    data = g_byte_array_sized_new(len);
+    if (!fat_read_chain((FatReader *)reader, inode->ino, data, len, len, error)) {
+        g_byte_array_unref(data);
+        return FALSE;
+    }
+    memcpy(buf, data->data, len);
+    g_byte_array_unref(data);
+
+    return TRUE;
+}
+
+static void
+fat_free(FsReader *reader)
+{
+    g_free(reader);
+}
+
+static const FsReaderOps fat_ops = {
+    fat_lookup,
+    fat_stat,
+    fat_read,
+    fat_free,
+    fat_list,
+};
+
+/* The layout from the BIOS parameter block; which FAT it is follows from
+ * the count of clusters alone.
+ */
+FsReader *
+fat_reader_open(gint fd, GError **error)
+{
+    FatReader *fat;
+    guint8 bpb[512];
+    guint32 sector_size;
+    guint32 cluster_sectors;
+    guint32 reserved;
+    guint32 fats;
+    guint32 root_entries;
+    guint32 fat_sectors;
+    guint32 sectors;
+    guint32 root_sectors;
+    guint32 data_sector;
+
+    if (!disk_read(fd, 0, bpb, sizeof(bpb), error))
+        return NULL;
+
+    sector_size = get_le16(bpb + 11);
+    cluster_sectors = bpb[13];
+    reserved = get_le16(bpb + 14);
+    fats = bpb[16];
+    root_entries = get_le16(bpb + 17);
+    sectors = get_le16(bpb + 19) ? get_le16(bpb + 19) : get_le32(bpb + 32);
+    fat_sectors = get_le16(bpb + 22) ? get_le16(bpb + 22) : get_le32(bpb + 36);
+
+    if (sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+        cluster_sectors == 0 || (cluster_sectors & (cluster_sectors - 1)) ||
+        reserved == 0 || fats == 0 || fat_sectors == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad BIOS parameter block");
+        return NULL;
+    }
+
+    root_sectors = (root_entries * 32 + sector_size - 1) / sector_size;
+    data_sector = reserved + fats * fat_sectors + root_sectors;
+    if (data_sector >= sectors) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad BIOS parameter block");
+        return NULL;
+    }
+
+    fat = g_new0(FatReader, 1);
+    fat->parent.ops = &fat_ops;
+    fat->parent.fd = fd;
+    fat->cluster_size = sector_size * cluster_sectors;
+    fat->clusters = (sectors - data_sector) / cluster_sectors;
+    fat->fat_offset = (guint64)reserved * sector_size;
+    fat->data_offset = (guint64)data_sector * sector_size;
+    fat->root_offset = (guint64)(reserved + fats * fat_sectors) * sector_size;
+    fat->root_size = root_sectors * sector_size;
+    fat->block_offset = G_MAXUINT64;
+
+    if (fat->clusters < 4085) {
+        fat->bits = 12;
+    } else if (fat->clusters < 65525) {
+        fat->bits = 16;
+    } else {
+        fat->bits = 32;
+        fat->parent.root.ino = get_le32(bpb + 44);
+    }
+    fat->parent.root.tree = (guint64)FAT_ATTR_DIR << 32;
+
+    if (fat->bits == 32 ? fat->parent.root.ino < 2 : root_entries == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "no root directory");
+        g_free(fat);
+        return NULL;
+    }
+
+    return &fat->parent;
+}
@@ -0,0 +1,205 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fsreader.h"
+
+/* A filesystem mounted already, read through its mount point.  The
+ * paths resolved so far are the inodes, relative to the mount point.
+ */
+typedef struct {
+    FsReader parent;
+    GPtrArray *paths;
+    gboolean nocase;            /* FAT or NTFS, whatever the driver does */
+} MountedReader;
+
+static const gchar *
+mounted_path(MountedReader *mounted, const FsInode *inode)
+{
+    return g_ptr_array_index(mounted->paths, inode->ino);
+}
+
+static gboolean
+mounted_list(FsReader *reader, const FsInode *dir, GPtrArray *names, GError **error)
+{
+    MountedReader *mounted = (MountedReader *)reader;
+    struct dirent *entry;
+    DIR *stream;
+    gint fd;
+
+    fd = openat(reader->fd, mounted_path(mounted, dir), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || (stream = fdopendir(fd)) == NULL) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", mounted_path(mounted, dir), g_strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    while ((entry = readdir(stream))) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            g_ptr_array_add(names, g_strdup(entry->d_name));
+    }
+    closedir(stream);
+
+    return TRUE;
+}
+
+/* The components handed in never are links, the resolver follows them
+ * itself, so the path can be taken from the mount point at once.
+ */
+static gboolean
+mounted_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    MountedReader *mounted = (MountedReader *)reader;
+    GPtrArray *names;
+    gchar *path;
+    struct stat st;
+    guint i;
+
+    path = g_build_filename(mounted_path(mounted, dir), name, NULL);
+    if (fstatat(reader->fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0 && errno == ENOENT && mounted->nocase) {
+        /* ntfs-3g matches names exactly */
+        names = g_ptr_array_new_with_free_func(g_free);
+        if (mounted_list(reader, dir, names, NULL)) {
+            for (i = 0; i < names->len; i++) {
+                if (fsreader_name_equal(g_ptr_array_index(names, i), name)) {
+                    g_free(path);
+                    path = g_build_filename(mounted_path(mounted, dir), g_ptr_array_index(names, i), NULL);
+                    break;
+                }
+            }
+        }
+        g_ptr_array_free(names, TRUE);
+    }
+    if (fstatat(reader->fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+        g_free(path);
+        return FALSE;
+    }
+
+    inode->tree = 0;
+    inode->ino = mounted->paths->len;
+    g_ptr_array_add(mounted->paths, path);
+
+    return TRUE;
+}
+
+static gboolean
+mounted_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    MountedReader *mounted = (MountedReader *)reader;
+    struct stat st;
+
+    if (fstatat(reader->fd, mounted_path(mounted, inode), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", mounted_path(mounted, inode), g_strerror(errno));
+        return FALSE;
+    }
+    *mode = st.st_mode;
+    *size = st.st_size;
+
+    return TRUE;
+}
+
+static gboolean
+mounted_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    MountedReader *mounted = (MountedReader *)reader;
+    const gchar *path = mounted_path(mounted, inode);
+    gsize done = 0;
+    gssize ret;
+    gint fd;
+
+    /* the target of a link, or else the content of a file */
+    ret = readlinkat(reader->fd, path, (gchar *)buf, len);
+    if (ret >= 0) {
+        if ((gsize)ret < len) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s: link changed", path);
+            return FALSE;
+        }
+        return TRUE;
+    }
+    if (errno != EINVAL) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+        return FALSE;
+    }
+
+    fd = openat(reader->fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", path, g_strerror(errno));
+        return FALSE;
+    }
+    while (done < len) {
+        ret = read(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            g_set_error(error, G_IO_ERROR, ret < 0 ? g_io_error_from_errno(errno) : G_IO_ERROR_INVALID_DATA,
+                        "%s: %s", path, ret < 0 ? g_strerror(errno) : "file changed");
+            close(fd);
+            return FALSE;
+        }
+        done += ret;
+    }
+    close(fd);
+
+    return TRUE;
+}
+
+static void
+mounted_free(FsReader *reader)
+{
+    MountedReader *mounted = (MountedReader *)reader;
+
+    g_ptr_array_free(mounted->paths, TRUE);
+    g_free(mounted);
+}
+
+static const FsReaderOps mounted_ops = {
+    mounted_lookup,
+    mounted_stat,
+    mounted_read,
+    mounted_free,
+    mounted_list,
+};
+
+FsReader *
+mounted_reader_open(gint fd, gboolean nocase)
+{
+    MountedReader *mounted = g_new0(MountedReader, 1);
+
+    mounted->parent.ops = &mounted_ops;
+    mounted->parent.fd = fd;
+    mounted->parent.root.ino = 0;
+    mounted->paths = g_ptr_array_new_with_free_func(g_free);
+    mounted->nocase = nocase;
+    g_ptr_array_add(mounted->paths, g_strdup("."));
+
+    return &mounted->parent;
+}
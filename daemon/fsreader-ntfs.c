@@ -0,0 +1,645 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+#define NTFS_ROOT_INO           5
+#define NTFS_SECTOR             512     /* the stride of the fixups */
+#define NTFS_REF_MASK           G_GUINT64_CONSTANT(0xFFFFFFFFFFFF)
+
+#define NTFS_RECORD_IN_USE      0x0001
+#define NTFS_RECORD_DIR         0x0002
+
+#define NTFS_AT_ATTRIBUTE_LIST  0x20
+#define NTFS_AT_DATA            0x80
+#define NTFS_AT_INDEX_ROOT      0x90
+#define NTFS_AT_INDEX_ALLOC     0xA0
+#define NTFS_AT_BITMAP          0xB0
+#define NTFS_AT_END             0xFFFFFFFF
+
+#define NTFS_ATTR_COMPRESSED    0x0001
+#define NTFS_ATTR_ENCRYPTED     0x4000
+
+#define NTFS_INDEX_LARGE        0x01
+#define NTFS_ENTRY_SUBNODE      0x01
+#define NTFS_ENTRY_LAST         0x02
+#define NTFS_NAMESPACE_DOS      2
+
+#define NTFS_MAX_RECORD         (64 * 1024)
+
+typedef struct {
+    guint64 vcn;
+    guint64 lcn;                /* G_MAXUINT64 for a hole */
+    guint64 length;
+} NtfsRun;
+
+typedef struct {
+    FsReader parent;
+    guint32 cluster_size;
+    guint32 record_size;
+    GArray *mft;                /* the runs of $MFT */
+} NtfsReader;
+
+/* Undo the update sequence: the last two bytes of every sector were
+ * swapped for a counter, to catch torn writes.
+ */
+static gboolean
+ntfs_fixup(guint8 *buf, gsize len, const gchar *magic, GError **error)
+{
+    guint16 offset = get_le16(buf + 4);
+    guint16 count = get_le16(buf + 6);
+    guint16 usn;
+    guint i;
+
+    if (memcmp(buf, magic, 4) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "no %s record", magic);
+        return FALSE;
+    }
+    if (count != len / NTFS_SECTOR + 1 || offset + count * 2u > len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad update sequence");
+        return FALSE;
+    }
+
+    usn = get_le16(buf + offset);
+    for (i = 1; i < count; i++) {
+        if (get_le16(buf + i * NTFS_SECTOR - 2) != usn) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "torn %s record", magic);
+            return FALSE;
+        }
+        memcpy(buf + i * NTFS_SECTOR - 2, buf + offset + i * 2, 2);
+    }
+
+    return TRUE;
+}
+
+/* Decode the mapping pairs of a non-resident attribute: lengths and
+ * cluster deltas of variable size, a delta of no size is a hole.
+ */
+static GArray *
+ntfs_decode_runs(NtfsReader *ntfs, const guint8 *attr, guint32 attr_len, GError **error)
+{
+    GArray *runs = g_array_new(FALSE, FALSE, sizeof(NtfsRun));
+    const guint8 *p = attr + get_le16(attr + 0x20);
+    const guint8 *end = attr + attr_len;
+    NtfsRun run = { get_le64(attr + 0x10), 0, 0 };
+    guint64 allocated = get_le64(attr + 0x28);
+    guint64 lcn = 0;
+    gint64 delta;
+    guint length_size;
+    guint offset_size;
+    guint i;
+
+    /* the runs of a fragmented file go on in other records */
+    if (run.vcn != 0 || (get_le64(attr + 0x18) + 1) * ntfs->cluster_size < allocated) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "attribute split over records");
+        goto fail;
+    }
+
+    while (p < end && *p) {
+        length_size = *p & 0x0F;
+        offset_size = *p >> 4;
+        if (length_size == 0 || length_size > 8 || offset_size > 8 ||
+            p + 1 + length_size + offset_size > end) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad mapping pairs");
+            goto fail;
+        }
+        p++;
+
+        run.length = 0;
+        for (i = 0; i < length_size; i++)
+            run.length |= (guint64)p[i] << (i * 8);
+        p += length_size;
+
+        if (offset_size) {
+            delta = (gint8)p[offset_size - 1];
+            for (i = offset_size - 1; i > 0; i--)
+                delta = delta * 256 + p[i - 1];
+            lcn += delta;
+            run.lcn = lcn;
+        } else {
+            run.lcn = G_MAXUINT64;
+        }
+        p += offset_size;
+
+        g_array_append_val(runs, run);
+        run.vcn += run.length;
+    }
+
+    return runs;
+
+fail:
+    g_array_free(runs, TRUE);
+    return NULL;
+}
+
+/* Read len bytes at offset of the data the runs map, holes read as zeros */
+static gboolean
+ntfs_read_runs(NtfsReader *ntfs, GArray *runs, guint64 offset, guint8 *buf, gsize len, GError **error)
+{
+    const NtfsRun *run;
+    guint64 start;
+    guint64 end;
+    gsize chunk;
+    guint i;
+
+    for (i = 0; i < runs->len && len; i++) {
+        run = &g_array_index(runs, NtfsRun, i);
+        start = run->vcn * ntfs->cluster_size;
+        end = (run->vcn + run->length) * ntfs->cluster_size;
+        if (offset < start || offset >= end)
+            continue;
+
+        chunk = MIN(len, end - offset);
+        if (run->lcn == G_MAXUINT64)
+            memset(buf, 0, chunk);
+        else if (!fsreader_pread(&ntfs->parent,
+                                 run->lcn * ntfs->cluster_size + (offset - start),
+                                 buf, chunk,
+                                 error))
+            return FALSE;
+        buf += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    if (len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "offset %" G_GUINT64_FORMAT " not mapped", offset);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+ntfs_read_record(NtfsReader *ntfs, guint64 ino, guint8 *record, GError **error)
+{
+    if (!ntfs_read_runs(ntfs, ntfs->mft, ino * ntfs->record_size, record, ntfs->record_size, error) ||
+        !ntfs_fixup(record, ntfs->record_size, "FILE", error)) {
+        return FALSE;
+    }
+
+    if (!(get_le16(record + 0x16) & NTFS_RECORD_IN_USE) || get_le64(record + 0x20) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "record %" G_GUINT64_FORMAT " is not a file", ino);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+ntfs_attr_named(const guint8 *attr, const gchar *name)
+{
+    guint8 name_len = attr[9];
+    const guint8 *p = attr + get_le16(attr + 0x0A);
+    guint i;
+
+    if (name == NULL)
+        return name_len == 0;
+    if (name_len != strlen(name))
+        return FALSE;
+    for (i = 0; i < name_len; i++) {
+        if (get_le16(p + i * 2) != (guchar)name[i])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The attribute of type and name in record, with its length.  When it
+ * is not there, it may still be in an extension record the attribute
+ * list points to, which is not followed.
+ */
+static const guint8 *
+ntfs_find_attr(NtfsReader *ntfs, const guint8 *record, guint32 type, const gchar *name, guint32 *len, GError **error)
+{
+    guint32 used = MIN(get_le32(record + 0x18), ntfs->record_size);
+    guint32 offset = get_le16(record + 0x14);
+    gboolean listed = FALSE;
+    const guint8 *attr;
+    guint32 attr_type;
+    guint32 attr_len;
+
+    while (offset + 16 <= used) {
+        attr = record + offset;
+        attr_type = get_le32(attr);
+        if (attr_type == NTFS_AT_END)
+            break;
+        attr_len = get_le32(attr + 4);
+        if (attr_len < 16 || offset + attr_len > used ||
+            get_le16(attr + 0x0A) + attr[9] * 2u > attr_len ||
+            (attr[8] ? attr_len < 0x40 : attr_len < 0x18)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad attribute");
+            return NULL;
+        }
+        if (attr_type == NTFS_AT_ATTRIBUTE_LIST)
+            listed = TRUE;
+        if (attr_type == type && ntfs_attr_named(attr, name)) {
+            *len = attr_len;
+            return attr;
+        }
+        offset += attr_len;
+    }
+
+    g_set_error(error, G_IO_ERROR,
+                listed ? G_IO_ERROR_NOT_SUPPORTED : G_IO_ERROR_INVALID_DATA,
+                "no attribute 0x%x", type);
+    return NULL;
+}
+
+/* The value of an attribute, resident or not, as far as max bytes */
+static guint8 *
+ntfs_read_attr(NtfsReader *ntfs, const guint8 *attr, guint32 attr_len, gsize max, gsize *len, GError **error)
+{
+    GArray *runs;
+    guint8 *value;
+    guint64 size;
+    guint64 initialized;
+
+    if (!attr[8]) {
+        size = get_le32(attr + 0x10);
+        if (get_le16(attr + 0x14) + size > attr_len) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad resident attribute");
+            return NULL;
+        }
+        size = MIN(size, max);
+        *len = size;
+        value = g_malloc(size + 1);
+        memcpy(value, attr + get_le16(attr + 0x14), size);
+        return value;
+    }
+
+    if (get_le16(attr + 0x0C) & (NTFS_ATTR_COMPRESSED | NTFS_ATTR_ENCRYPTED)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "compressed or encrypted");
+        return NULL;
+    }
+
+    size = MIN(get_le64(attr + 0x30), max);
+    initialized = MIN(get_le64(attr + 0x38), size);
+    runs = ntfs_decode_runs(ntfs, attr, attr_len, error);
+    if (runs == NULL)
+        return NULL;
+
+    /* past the initialized size, the clusters are stale */
+    value = g_malloc0(size + 1);
+    if (!ntfs_read_runs(ntfs, runs, 0, value, initialized, error)) {
+        g_array_free(runs, TRUE);
+        g_free(value);
+        return NULL;
+    }
+    g_array_free(runs, TRUE);
+    *len = size;
+
+    return value;
+}
+
+/* Look for name among the entries of an index node, or list them.
+ * Errors are told apart from a miss by error being set.
+ */
+static gboolean
+ntfs_scan_entries(const guint8 *p, const guint8 *end, const gchar *name, guint64 *ino, GPtrArray *names, GError **error)
+{
+    const guint8 *key;
+    guint16 entry_len;
+    gchar *entry_name;
+    gboolean found = FALSE;
+
+    while (!found) {
+        if (p + 16 > end || (entry_len = get_le16(p + 8)) < 16 || p + entry_len > end) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad index entry");
+            return FALSE;
+        }
+        if (get_le16(p + 12) & NTFS_ENTRY_LAST)
+            break;
+
+        /* the key length is only what the entry claims */
+        key = p + 16;
+        if (entry_len < 16 + 0x42 || get_le16(p + 10) < 0x42 || 
+            key + 0x42 + key[0x40] * 2 > p + entry_len) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad index key");
+            return FALSE;
+        }
+
+        /* the 8.3 alias of a long name is an entry of its own */
+        if (key[0x41] != NTFS_NAMESPACE_DOS) {
+            entry_name = fsreader_utf16_name(key + 0x42, key[0x40]);
+            if (entry_name && name == NULL) {
+                g_ptr_array_add(names, entry_name);
+                entry_name = NULL;
+            } else if (entry_name && fsreader_name_equal(entry_name, name)) {
+                *ino = get_le64(p) & NTFS_REF_MASK;
+                found = TRUE;
+            }
+            g_free(entry_name);
+        }
+        p += entry_len;
+    }
+
+    return found;
+}
+
+/* Scan the directory index through: the root node in the record, then
+ * the index blocks in use, regardless of the order of the B+ tree.
+ */
+static gboolean
+ntfs_scan(NtfsReader *ntfs, const FsInode *dir, const gchar *name, FsInode *inode, GPtrArray *names, GError **error)
+{
+    guint8 *record = g_malloc(ntfs->record_size);
+    const guint8 *attr;
+    guint32 attr_len;
+    guint32 value_len;
+    const guint8 *header;
+    guint8 *bitmap = NULL;
+    gsize bitmap_len = 0;
+    guint8 *block = NULL;
+    guint32 block_size;
+    GArray *runs = NULL;
+    guint64 alloc_size;
+    guint64 ino = 0;
+    guint64 i;
+    gboolean found = FALSE;
+    gboolean ret = FALSE;
+    GError *local_error = NULL;
+
+    if (!ntfs_read_record(ntfs, dir->ino, record, error))
+        goto out;
+    if (!(get_le16(record + 0x16) & NTFS_RECORD_DIR)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_DIRECTORY, "not a directory");
+        goto out;
+    }
+
+    attr = ntfs_find_attr(ntfs, record, NTFS_AT_INDEX_ROOT, "$I30", &attr_len, error);
+    if (attr == NULL)
+        goto out;
+    value_len = get_le32(attr + 0x10);
+    header = attr + get_le16(attr + 0x14);
+    if (attr[8] || get_le16(attr + 0x14) + value_len > attr_len || value_len < 32 ||
+        16 + get_le32(header + 20) > value_len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad index root");
+        goto out;
+    }
+    block_size = get_le32(header + 8);
+
+    found = ntfs_scan_entries(header + 16 + get_le32(header + 16),
+                              header + 16 + get_le32(header + 20),
+                              name, &ino, names, &local_error);
+    if (local_error) {
+        g_propagate_error(error, local_error);
+        goto out;
+    }
+    if (found || !(header[16 + 12] & NTFS_INDEX_LARGE))
+        goto done;
+
+    if (block_size < NTFS_SECTOR || block_size > NTFS_MAX_RECORD || (block_size & (block_size - 1))) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad index block size");
+        goto out;
+    }
+
+    attr = ntfs_find_attr(ntfs, record, NTFS_AT_BITMAP, "$I30", &attr_len, error);
+    if (attr == NULL)
+        goto out;
+    bitmap = ntfs_read_attr(ntfs, attr, attr_len, FSREADER_MAX_DIR / NTFS_SECTOR / 8, &bitmap_len, error);
+    if (bitmap == NULL)
+        goto out;
+
+    attr = ntfs_find_attr(ntfs, record, NTFS_AT_INDEX_ALLOC, "$I30", &attr_len, error);
+    if (attr == NULL)
+        goto out;
+    if (!attr[8]) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "resident index allocation");
+        goto out;
+    }
+    runs = ntfs_decode_runs(ntfs, attr, attr_len, error);
+    if (runs == NULL)
+        goto out;
+    alloc_size = get_le64(attr + 0x30);
+    if (alloc_size > FSREADER_MAX_DIR) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "directory of %" G_GUINT64_FORMAT " bytes", alloc_size);
+        goto out;
+    }
+
+    block = g_malloc(block_size);
+    for (i = 0; !found && (i + 1) * block_size <= alloc_size; i++) {
+        /* a block out of use keeps its stale entries */
+        if (i / 8 >= bitmap_len || !(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+        if (!ntfs_read_runs(ntfs, runs, i * block_size, block, block_size, error) ||
+            !ntfs_fixup(block, block_size, "INDX", error)) {
+            goto out;
+        }
+        header = block + 0x18;
+        if (0x18 + get_le32(header + 4) > block_size) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad index block");
+            goto out;
+        }
+        found = ntfs_scan_entries(header + get_le32(header),
+                                  header + get_le32(header + 4),
+                                  name, &ino, names, &local_error);
+        if (local_error) {
+            g_propagate_error(error, local_error);
+            goto out;
+        }
+    }
+
+done:
+    if (name && !found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        goto out;
+    }
+    if (inode) {
+        inode->tree = 0;
+        inode->ino = ino;
+    }
+    ret = TRUE;
+
+out:
+    if (runs)
+        g_array_free(runs, TRUE);
+    g_free(block);
+    g_free(bitmap);
+    g_free(record);
+
+    return ret;
+}
+
+static gboolean
+ntfs_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    return ntfs_scan((NtfsReader *)reader, dir, name, inode, NULL, error);
+}
+
+static gboolean
+ntfs_list(FsReader *reader, const FsInode *dir, GPtrArray *names, GError **error)
+{
+    return ntfs_scan((NtfsReader *)reader, dir, NULL, NULL, names, error);
+}
+
+static gboolean
+ntfs_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    NtfsReader *ntfs = (NtfsReader *)reader;
+    guint8 *record = g_malloc(ntfs->record_size);
+    const guint8 *attr;
+    guint32 attr_len;
+    gboolean ret = FALSE;
+
+    if (!ntfs_read_record(ntfs, inode->ino, record, error))
+        goto out;
+
+    if (get_le16(record + 0x16) & NTFS_RECORD_DIR) {
+        *mode = S_IFDIR | 0755;
+        *size = 0;
+        ret = TRUE;
+        goto out;
+    }
+
+    attr = ntfs_find_attr(ntfs, record, NTFS_AT_DATA, NULL, &attr_len, error);
+    if (attr == NULL)
+        goto out;
+    *mode = S_IFREG | 0644;
+    *size = attr[8] ? get_le64(attr + 0x30) : get_le32(attr + 0x10);
+    ret = TRUE;
+
+out:
+    g_free(record);
+
+    return ret;
+}
+
+static gboolean
+ntfs_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    NtfsReader *ntfs = (NtfsReader *)reader;
+    guint8 *record = g_malloc(ntfs->record_size);
+    const guint8 *attr;
+    guint32 attr_len;
+    guint8 *value = NULL;
+    gsize value_len = 0;
+
+    if (ntfs_read_record(ntfs, inode->ino, record, error) &&
+        (attr = ntfs_find_attr(ntfs, record, NTFS_AT_DATA, NULL, &attr_len, error)) != NULL)
+        value = ntfs_read_attr(ntfs, attr, attr_len, len, &value_len, error);
+    g_free(record);
+    if (value == NULL)
+        return FALSE;
+
+    if (value_len < len) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "file shorter than read");
+        g_free(value);
+        return FALSE;
+    }
+    memcpy(buf, value, len);
+    g_free(value);
+
+    return TRUE;
+}
+
+static void
+ntfs_free(FsReader *reader)
+{
+    NtfsReader *ntfs = (NtfsReader *)reader;
+
+    if (ntfs->mft)
+        g_array_free(ntfs->mft, TRUE);
+    g_free(ntfs);
+}
+
+static const FsReaderOps ntfs_ops = {
+    ntfs_lookup,
+    ntfs_stat,
+    ntfs_read,
+    ntfs_free,
+    ntfs_list,
+};
+
+/* The geometry from the boot sector, then the runs of $MFT from its own
+ * first record, which every other record is found through.
+ */
+FsReader *
+ntfs_reader_open(gint fd, GError **error)
+{
+    NtfsReader *ntfs;
+    guint8 boot[512];
+    guint8 *record;
+    const guint8 *attr;
+    guint32 attr_len;
+    guint32 sector_size;
+    guint32 cluster_sectors;
+    gint8 record_clusters;
+
+    if (!disk_read(fd, 0, boot, sizeof(boot), error))
+        return NULL;
+
+    sector_size = get_le16(boot + 11);
+    cluster_sectors = boot[13];
+    /* past 128, the log2 of the count negated */
+    if (cluster_sectors > 128)
+        cluster_sectors = 1u << MIN(256 - cluster_sectors, 31);
+    record_clusters = (gint8)boot[0x40];
+
+    if (memcmp(boot + 3, "NTFS    ", 8) != 0 ||
+        sector_size < 256 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+        cluster_sectors == 0 || (cluster_sectors & (cluster_sectors - 1)) ||
+        (guint64)sector_size * cluster_sectors > G_MAXINT32) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad boot sector");
+        return NULL;
+    }
+
+    ntfs = g_new0(NtfsReader, 1);
+    ntfs->parent.ops = &ntfs_ops;
+    ntfs->parent.fd = fd;
+    ntfs->parent.root.ino = NTFS_ROOT_INO;
+    ntfs->cluster_size = sector_size * cluster_sectors;
+    if (record_clusters > 0)
+        ntfs->record_size = record_clusters * ntfs->cluster_size;
+    else
+        ntfs->record_size = 1u << MIN(-record_clusters, 31);
+    if (ntfs->record_size < NTFS_SECTOR || ntfs->record_size > NTFS_MAX_RECORD ||
+        (ntfs->record_size & (ntfs->record_size - 1))) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad record size");
+        g_free(ntfs);
+        return NULL;
+    }
+
+    record = g_malloc(ntfs->record_size);
+    if (!disk_read(fd, get_le64(boot + 0x30) * ntfs->cluster_size, record, ntfs->record_size, error) ||
+        !ntfs_fixup(record, ntfs->record_size, "FILE", error) ||
+        (attr = ntfs_find_attr(ntfs, record, NTFS_AT_DATA, NULL, &attr_len, error)) == NULL ||
+        (attr[8] && (ntfs->mft = ntfs_decode_runs(ntfs, attr, attr_len, error)) == NULL)) {
+        g_free(record);
+        ntfs_free(&ntfs->parent);
+        return NULL;
+    }
+    g_free(record);
+
+    if (ntfs->mft == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "resident $MFT");
+        ntfs_free(&ntfs->parent);
+        return NULL;
+    }
+
+    return &ntfs->parent;
+}
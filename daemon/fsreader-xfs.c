@@ -0,0 +1,405 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+#define XFS_DINODE_MAGIC        0x494e      /* "IN" */
+#define XFS_DINODE_FMT_LOCAL    1
+#define XFS_DINODE_FMT_EXTENTS  2
+
+#define XFS_FEAT_INCOMPAT_FTYPE         0x01
+#define XFS_FEAT_INCOMPAT_NEEDSREPAIR   0x10
+#define XFS_FEAT_INCOMPAT_NREXT64       0x20
+#define XFS_FEAT_INCOMPAT_KNOWN         0x1ff
+#define XFS_VERSION2_FTYPE              0x200
+
+/* Directory data blocks sit below this offset of the directory, the
+ * leaf and free space index above.
+ */
+#define XFS_DIR2_LEAF_OFFSET    (32ULL << 30)
+#define XFS_SYMLINK_HDR_SIZE    56
+
+typedef struct {
+    FsReader parent;
+    guint32 block_size;
+    guint32 agblocks;
+    guint32 agcount;
+    guint16 inode_size;
+    guint8 blocklog;
+    guint8 inodelog;
+    guint8 inopblog;
+    guint8 agblklog;
+    guint32 dir_block_size;
+    gboolean v5;
+    gboolean ftype;
+    gboolean nrext64;
+} XfsReader;
+
+typedef struct {
+    guint16 mode;
+    guint8 format;
+    guint64 size;
+    guint64 nextents;
+    guint8 *fork;       /* the data fork, within raw */
+    gsize fork_size;
+    guint8 *raw;
+} XfsInode;
+
+static guint64
+xfs_fsb_to_offset(XfsReader *xfs, guint64 fsb)
+{
+    guint64 agno = fsb >> xfs->agblklog;
+    guint64 agbno = fsb & ((1ULL << xfs->agblklog) - 1);
+
+    return (agno * xfs->agblocks + agbno) << xfs->blocklog;
+}
+
+static void
+xfs_inode_clear(XfsInode *inode)
+{
+    g_free(inode->raw);
+    inode->raw = NULL;
+}
+
+static gboolean
+xfs_read_inode(XfsReader *xfs, guint64 ino, XfsInode *inode, GError **error)
+{
+    guint shift = xfs->agblklog + xfs->inopblog;
+    guint64 agno = ino >> shift;
+    guint64 agino = ino & ((1ULL << shift) - 1);
+    guint64 offset;
+    guint8 version;
+    gsize core;
+
+    memset(inode, 0, sizeof(XfsInode));
+    if (agno >= xfs->agcount) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, 
+                    "bad inode %" G_GUINT64_FORMAT, ino);
+        return FALSE;
+    }
+    offset = ((agno * xfs->agblocks + (agino >> xfs->inopblog)) << xfs->blocklog) +
+             ((agino & ((1ULL << xfs->inopblog) - 1)) << xfs->inodelog);
+
+    inode->raw = g_malloc(xfs->inode_size);
+    if (!fsreader_pread(&xfs->parent, offset, inode->raw, xfs->inode_size, error)) {
+        xfs_inode_clear(inode);
+        return FALSE;
+    }
+    if (get_be16(inode->raw) != XFS_DINODE_MAGIC) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, 
+                    "bad inode magic at %" G_GUINT64_FORMAT, ino);
+        xfs_inode_clear(inode);
+        return FALSE;
+    }
+
+    version = inode->raw[4];
+    core = version >= 3 ? 176 : 100;
+    inode->mode = get_be16(inode->raw + 2);
+    inode->format = inode->raw[5];
+    inode->size = get_be64(inode->raw + 56);
+    if (xfs->nrext64 && version >= 3)
+        inode->nextents = get_be64(inode->raw + 24);
+    else
+        inode->nextents = get_be32(inode->raw + 76);
+    inode->fork = inode->raw + core;
+    inode->fork_size = inode->raw[82] ? (gsize)inode->raw[82] * 8 : xfs->inode_size - core;
+    if (core + inode->fork_size > xfs->inode_size)
+        inode->fork_size = xfs->inode_size - core;
+
+    return TRUE;
+}
+
+/* Read the first len bytes of the file behind an extent list, holes
+ * and unwritten extents reading as zeros.
+ */
+static gboolean
+xfs_read_extents(XfsReader *xfs, const XfsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    const guint8 *rec;
+    guint64 l0, l1;
+    guint64 startoff;
+    guint64 startblock;
+    guint64 count;
+    guint64 from, to;
+    guint64 i;
+
+    if (inode->format != XFS_DINODE_FMT_EXTENTS || 
+        inode->nextents * 16 > inode->fork_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "unsupported inode format %u", inode->format);
+        return FALSE;
+    }
+
+    memset(buf, 0, len);
+    for (i = 0; i < inode->nextents; i++) {
+        rec = inode->fork + i * 16;
+        l0 = get_be64(rec);
+        l1 = get_be64(rec + 8);
+        if (l0 >> 63)
+            continue;
+        startoff = (l0 & G_GUINT64_CONSTANT(0x7fffffffffffffff)) >> 9;
+        startblock = (l0 & 0x1ff) << 43 | l1 >> 21;
+        count = l1 & 0x1fffff;
+
+        from = startoff << xfs->blocklog;
+        if (from >= len)
+            continue;
+        to = MIN((startoff + count) << xfs->blocklog, len);
+        if (!fsreader_pread(&xfs->parent, xfs_fsb_to_offset(xfs, startblock), 
+                            buf + from, to - from, error)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+xfs_stat(FsReader *reader, const FsInode *inode, guint32 *mode, guint64 *size, GError **error)
+{
+    XfsInode raw;
+
+    if (!xfs_read_inode((XfsReader *)reader, inode->ino, &raw, error))
+        return FALSE;
+
+    *mode = raw.mode;
+    *size = raw.size;
+    xfs_inode_clear(&raw);
+
+    return TRUE;
+}
+
+static gboolean
+xfs_read(FsReader *reader, const FsInode *inode, guint8 *buf, gsize len, GError **error)
+{
+    XfsReader *xfs = (XfsReader *)reader;
+    XfsInode raw;
+    guint8 *block;
+    gboolean ret = FALSE;
+
+    if (!xfs_read_inode(xfs, inode->ino, &raw, error))
+        return FALSE;
+
+    if (raw.format == XFS_DINODE_FMT_LOCAL) {
+        if (len > raw.fork_size) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad local inode");
+        } else {
+            memcpy(buf, raw.fork, len);
+            ret = TRUE;
+        }
+    } else if (S_ISLNK(raw.mode) && xfs->v5) {
+        /* remote symbolic links carry a header on v5 */
+        block = g_malloc(len + XFS_SYMLINK_HDR_SIZE);
+        ret = xfs_read_extents(xfs, &raw, block, len + XFS_SYMLINK_HDR_SIZE, error);
+        if (ret)
+            memcpy(buf, block + XFS_SYMLINK_HDR_SIZE, len);
+        g_free(block);
+    } else {
+        ret = xfs_read_extents(xfs, &raw, buf, len, error);
+    }
+    xfs_inode_clear(&raw);
+
+    return ret;
+}
+
+static gboolean
+xfs_lookup_shortform(XfsReader *xfs, const XfsInode *dir, const gchar *name, guint64 *ino)
+{
+    const guint8 *p = dir->fork;
+    const guint8 *end = dir->fork + MIN(dir->size, dir->fork_size);
+    gsize name_len = strlen(name);
+    guint8 count = p[0];
+    gboolean i8 = p[1] != 0;
+    guint8 len;
+    guint i;
+
+    /* all inode numbers take 8 bytes as soon as one needs them */
+    p += i8 ? 10 : 6;
+
+    for (i = 0; i < count && p + 3 <= end; i++) {
+        len = p[0];
+        if (p + 3 + len + xfs->ftype + (i8 ? 8 : 4) > end)
+            break;
+        if (len == name_len && memcmp(p + 3, name, len) == 0) {
+            p += 3 + len + xfs->ftype;
+            *ino = i8 ? get_be64(p) : get_be32(p);
+            return TRUE;
+        }
+        p += 3 + len + xfs->ftype + (i8 ? 8 : 4);
+    }
+
+    return FALSE;
+}
+
+static gboolean
+xfs_lookup_block(XfsReader *xfs, const guint8 *block, const gchar *name, guint64 *ino)
+{
+    gsize name_len = strlen(name);
+    gsize header = xfs->v5 ? 64 : 16;
+    gsize end = xfs->dir_block_size;
+    gsize offset;
+    gsize size;
+    gsize leaf;
+    guint8 len;
+
+    if (memcmp(block, "XD2B", 4) == 0 || memcmp(block, "XDB3", 4) == 0) {
+        /* the leaf entries and the tail close a single-block directory */
+        leaf = 8 + (gsize)get_be32(block + xfs->dir_block_size - 8) * 8;
+        if (leaf > xfs->dir_block_size - header)
+            return FALSE;
+        end -= leaf;
+    } else if (memcmp(block, "XD2D", 4) != 0 && memcmp(block, "XDD3", 4) != 0) {
+        return FALSE;
+    }
+
+    for (offset = header; offset + 12 <= end; offset += size) {
+        if (get_be16(block + offset) == 0xffff) {
+            size = get_be16(block + offset + 2);
+            if (size < 8)
+                break;
+            continue;
+        }
+        len = block[offset + 8];
+        size = (8 + 1 + len + xfs->ftype + 2 + 7) & ~7;
+        if (offset + size > end)
+            break;
+        if (len == name_len && memcmp(block + offset + 9, name, len) == 0) {
+            *ino = get_be64(block + offset);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+xfs_lookup(FsReader *reader, const FsInode *dir, const gchar *name, FsInode *inode, GError **error)
+{
+    XfsReader *xfs = (XfsReader *)reader;
+    XfsInode raw;
+    guint8 *data = NULL;
+    gsize data_size;
+    gsize offset;
+    guint64 ino = 0;
+    gboolean found = FALSE;
+
+    if (!xfs_read_inode(xfs, dir->ino, &raw, error))
+        return FALSE;
+
+    if (raw.format == XFS_DINODE_FMT_LOCAL) {
+        found = xfs_lookup_shortform(xfs, &raw, name, &ino);
+    } else {
+        data_size = MIN(raw.size, XFS_DIR2_LEAF_OFFSET);
+        if (data_size > FSREADER_MAX_DIR) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "directory of %" G_GSIZE_FORMAT " bytes", data_size);
+            xfs_inode_clear(&raw);
+            return FALSE;
+        }
+        /* whole directory blocks, the size of a directory rounds to them */
+        data_size = (data_size + xfs->dir_block_size - 1) & ~((gsize)xfs->dir_block_size - 1);
+        data = g_malloc(data_size);
+        if (!xfs_read_extents(xfs, &raw, data, data_size, error)) {
+            g_free(data);
+            xfs_inode_clear(&raw);
+            return FALSE;
+        }
+        for (offset = 0; !found && offset < data_size; offset += xfs->dir_block_size)
+            found = xfs_lookup_block(xfs, data + offset, name, &ino);
+        g_free(data);
+    }
+    xfs_inode_clear(&raw);
+
+    if (!found) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        return FALSE;
+    }
+    inode->tree = 0;
+    inode->ino = ino;
+
+    return TRUE;
+}
+
+static void
+xfs_free(FsReader *reader)
+{
+    g_free(reader);
+}
+
+static const FsReaderOps xfs_ops = {
+    xfs_lookup,
+    xfs_stat,
+    xfs_read,
+    xfs_free,
+};
+
+FsReader *
+xfs_reader_open(gint fd, GError **error)
+{
+    XfsReader *xfs;
+    guint8 sb[512];
+    guint32 incompat = 0;
+
+    if (!disk_read(fd, 0, sb, sizeof(sb), error))
+        return NULL;
+
+    xfs = g_new0(XfsReader, 1);
+    xfs->parent.ops = &xfs_ops;
+    xfs->parent.fd = fd;
+    xfs->parent.root.ino = get_be64(sb + 56);
+    xfs->block_size = get_be32(sb + 4);
+    xfs->agblocks = get_be32(sb + 84);
+    xfs->agcount = get_be32(sb + 88);
+    xfs->inode_size = get_be16(sb + 104);
+    xfs->blocklog = sb[120];
+    xfs->inodelog = sb[122];
+    xfs->inopblog = sb[123];
+    xfs->agblklog = sb[124];
+    xfs->dir_block_size = xfs->block_size << MIN(sb[192], 16);
+    xfs->v5 = (get_be16(sb + 100) & 0xf) == 5;
+    if (xfs->v5) {
+        incompat = get_be32(sb + 216);
+        xfs->ftype = (incompat & XFS_FEAT_INCOMPAT_FTYPE) != 0;
+        xfs->nrext64 = (incompat & XFS_FEAT_INCOMPAT_NREXT64) != 0;
+    } else {
+        xfs->ftype = (get_be32(sb + 200) & XFS_VERSION2_FTYPE) != 0;
+    }
+
+    if ((incompat & ~XFS_FEAT_INCOMPAT_KNOWN) || (incompat & XFS_FEAT_INCOMPAT_NEEDSREPAIR)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "unsupported features 0x%x", incompat);
+        g_free(xfs);
+        return NULL;
+    }
+    if (xfs->block_size != (1u << xfs->blocklog) || xfs->blocklog < 9 || xfs->blocklog > 16 ||
+        xfs->inode_size != (1u << xfs->inodelog) || xfs->inode_size < 128 ||
+        xfs->agblklog > 32 || xfs->agcount == 0 || 
+        xfs->dir_block_size < xfs->block_size || xfs->dir_block_size > 65536) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "bad superblock");
+        g_free(xfs);
+        return NULL;
+    }
+
+    return &xfs->parent;
+}
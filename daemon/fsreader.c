@@ -0,0 +1,1196 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+
+/* Open the filesystem on device with the reader for its type, failing
+ * with G_IO_ERROR_NOT_SUPPORTED for the types and features no reader
+ * handles.
+ */
+FsReader *
+fsreader_open(const gchar *device, FsType type, GError **error)
+{
+    FsReader *reader = NULL;
+    gint fd;
+
+    if (type != FS_EXT && type != FS_XFS && type != FS_BTRFS &&
+        type != FS_VFAT && type != FS_NTFS) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "%s: no reader for %s", device, superblock_type_name(type));
+        return NULL;
+    }
+
+    fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", device, g_strerror(errno));
+        return NULL;
+    }
+
+    if (type == FS_EXT)
+        reader = ext_reader_open(fd, error);
+    else if (type == FS_XFS)
+        reader = xfs_reader_open(fd, error);
+    else if (type == FS_BTRFS)
+        reader = btrfs_reader_open(fd, error);
+    else if (type == FS_VFAT)
+        reader = fat_reader_open(fd, error);
+    else
+        reader = ntfs_reader_open(fd, error);
+    if (reader == NULL) {
+        close(fd);
+        return NULL;
+    }
+    reader->fd = fd;
+
+    return reader;
+}
+
+/* Read the filesystem of type mounted at mount_point through it, the
+ * device changes under a reader while it is in use.
+ */
+FsReader *
+fsreader_open_mounted(const gchar *mount_point, FsType type, GError **error)
+{
+    gint fd;
+
+    fd = open(mount_point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", mount_point, g_strerror(errno));
+        return NULL;
+    }
+
+    return mounted_reader_open(fd, type == FS_VFAT || type == FS_NTFS);
+}
+
+void
+fsreader_free(FsReader *reader)
+{
+    gint fd;
+
+    if (reader == NULL)
+        return;
+
+    fd = reader->fd;
+    if (reader->cancellable)
+        g_object_unref(reader->cancellable);
+    reader->ops->free(reader);
+    close(fd);
+}
+
+/* A read blocked on a device that does not answer cannot be stopped,
+ * but the reader gives up before the next one once cancellable is.
+ */
+void
+fsreader_set_cancellable(FsReader *reader, GCancellable *cancellable)
+{
+    if (cancellable)
+        g_object_ref(cancellable);
+    if (reader->cancellable)
+        g_object_unref(reader->cancellable);
+    reader->cancellable = cancellable;
+}
+
+gboolean
+fsreader_pread(FsReader *reader, guint64 offset, gpointer buf, gsize len, GError **error)
+{
+    if (g_cancellable_set_error_if_cancelled(reader->cancellable, error))
+        return FALSE;
+
+    return disk_read(reader->fd, offset, buf, len, error);
+}
+
+/* Inflate a zlib stream into out, as far as out goes.  The part of out
+ * past the end of the stream is zeroed, like the tail of a block.
+ */
+gboolean
+fsreader_inflate(const guint8 *in, gsize in_len, guint8 *out, gsize out_len, GError **error)
+{
+    GConverter *converter;
+    GConverterResult result = G_CONVERTER_CONVERTED;
+    gsize in_done = 0;
+    gsize out_done = 0;
+    gsize nread;
+    gsize nwritten;
+
+    converter = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+    while (out_done < out_len && result != G_CONVERTER_FINISHED) {
+        result = g_converter_convert(converter,
+                                     in + in_done, in_len - in_done,
+                                     out + out_done, out_len - out_done,
+                                     G_CONVERTER_INPUT_AT_END,
+                                     &nread, &nwritten,
+                                     error);
+        if (result == G_CONVERTER_ERROR) {
+            g_object_unref(converter);
+            return FALSE;
+        }
+        in_done += nread;
+        out_done += nwritten;
+    }
+    g_object_unref(converter);
+
+    memset(out + out_done, 0, out_len - out_done);
+
+    return TRUE;
+}
+
+/* A name stored as little endian UTF-16, NULL when it is not valid */
+gchar *
+fsreader_utf16_name(const guint8 *name, gsize n_chars)
+{
+    gunichar2 *units = g_new(gunichar2, n_chars + 1);
+    gchar *utf8;
+    gsize i;
+
+    for (i = 0; i < n_chars; i++)
+        units[i] = get_le16(name + i * 2);
+    utf8 = g_utf16_to_utf8(units, n_chars, NULL, NULL, NULL);
+    g_free(units);
+
+    return utf8;
+}
+
+/* Whether two names are the same to a case-insensitive filesystem */
+gboolean
+fsreader_name_equal(const gchar *a, const gchar *b)
+{
+    gchar *folded_a;
+    gchar *folded_b;
+    gboolean ret;
+
+    if (g_ascii_strcasecmp(a, b) == 0)
+        return TRUE;
+
+    folded_a = g_utf8_casefold(a, -1);
+    folded_b = g_utf8_casefold(b, -1);
+    ret = strcmp(folded_a, folded_b) == 0;
+    g_free(folded_a);
+    g_free(folded_b);
+
+    return ret;
+}
+
+static gboolean
+fsreader_read_link(FsReader *reader, const FsInode *inode, guint64 size, gchar **target, GError **error)
+{
+    if (size == 0 || size >= PATH_MAX) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "symbolic link of %" G_GUINT64_FORMAT " bytes", size);
+        return FALSE;
+    }
+
+    *target = g_malloc0(size + 1);
+    if (!reader->ops->read(reader, inode, (guint8 *)*target, size, error)) {
+        g_free(*target);
+        *target = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Walk path from the root of the filesystem the way the kernel would,
+ * following symbolic links anywhere in it, the last component included.
+ * Links resolve within the filesystem: an absolute one starts over from
+ * its root, as it would once the OS on it boots.
+ */
+static gboolean
+fsreader_resolve(FsReader *reader, 
+                 const gchar *path, 
+                 FsInode *inode, 
+                 guint32 *mode, 
+                 guint64 *size, 
+                 GError **error)
+{
+    GArray *dirs = g_array_new(FALSE, FALSE, sizeof(FsInode));
+    GPtrArray *pending = g_ptr_array_new_with_free_func(g_free);
+    gchar **components;
+    gchar *name = NULL;
+    gchar *target = NULL;
+    FsInode child;
+    gboolean ret = FALSE;
+    guint links = 0;
+    gint i;
+
+    g_array_append_val(dirs, reader->root);
+    *mode = S_IFDIR;
+    *size = 0;
+
+    /* a stack, the next component last */
+    components = g_strsplit(path, "/", -1);
+    for (i = g_strv_length(components) - 1; i >= 0; i--)
+        g_ptr_array_add(pending, g_strdup(components[i]));
+    g_strfreev(components);
+
+    while (pending->len) {
+        name = g_ptr_array_steal_index(pending, pending->len - 1);
+        if (*name == '\0' || strcmp(name, ".") == 0) {
+            g_free(name);
+            continue;
+        }
+        if (strcmp(name, "..") == 0) {
+            if (dirs->len > 1)
+                g_array_set_size(dirs, dirs->len - 1);
+            *mode = S_IFDIR;
+            g_free(name);
+            continue;
+        }
+
+        if (!S_ISDIR(*mode)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                        "%s: not a directory", path);
+            goto out;
+        }
+        /* the mounted reader reads by itself */
+        if (g_cancellable_set_error_if_cancelled(reader->cancellable, error))
+            goto out;
+        if (!reader->ops->lookup(reader, 
+                                 &g_array_index(dirs, FsInode, dirs->len - 1), 
+                                 name, 
+                                 &child, 
+                                 error) ||
+            !reader->ops->stat(reader, &child, mode, size, error)) {
+            goto out;
+        }
+        g_free(name);
+        name = NULL;
+
+        if (!S_ISLNK(*mode)) {
+            g_array_append_val(dirs, child);
+            continue;
+        }
+
+        if (++links > FSREADER_MAX_LINKS) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_LINKS,
+                        "%s: too many levels of symbolic links", path);
+            goto out;
+        }
+        if (!fsreader_read_link(reader, &child, *size, &target, error))
+            goto out;
+        if (*target == '/')
+            g_array_set_size(dirs, 1);
+        components = g_strsplit(target, "/", -1);
+        for (i = g_strv_length(components) - 1; i >= 0; i--)
+            g_ptr_array_add(pending, g_strdup(components[i]));
+        g_strfreev(components);
+        g_free(target);
+        target = NULL;
+        *mode = S_IFDIR;
+    }
+
+    *inode = g_array_index(dirs, FsInode, dirs->len - 1);
+    ret = TRUE;
+
+out:
+    g_free(name);
+    g_ptr_array_free(pending, TRUE);
+    g_array_free(dirs, TRUE);
+
+    return ret;
+}
+
+/* Whether path exists.  Fails with G_IO_ERROR_NOT_FOUND when it does
+ * not, and any other error when the reader cannot tell.
+ */
+gboolean
+fsreader_test(FsReader *reader, const gchar *path, GError **error)
+{
+    FsInode inode;
+    guint32 mode;
+    guint64 size;
+
+    return fsreader_resolve(reader, path, &inode, &mode, &size, error);
+}
+
+/* Read a small regular file, NUL-terminated like g_file_get_contents() */
+gboolean
+fsreader_read_file(FsReader    *reader,
+                   const gchar *path,
+                   gchar      **contents,
+                   gsize       *length,
+                   GError     **error)
+{
+    FsInode inode;
+    guint32 mode;
+    guint64 size;
+    gchar *buf;
+
+    if (!fsreader_resolve(reader, path, &inode, &mode, &size, error))
+        return FALSE;
+
+    if (!S_ISREG(mode)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE,
+                    "%s: not a regular file", path);
+        return FALSE;
+    }
+    if (size > FSREADER_MAX_FILE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "%s: %" G_GUINT64_FORMAT " bytes is too large", path, size);
+        return FALSE;
+    }
+
+    if (g_cancellable_set_error_if_cancelled(reader->cancellable, error))
+        return FALSE;
+
+    buf = g_malloc0(size + 1);
+    if (!reader->ops->read(reader, &inode, (guint8 *)buf, size, error)) {
+        g_free(buf);
+        return FALSE;
+    }
+
+    *contents = buf;
+    if (length)
+        *length = size;
+
+    return TRUE;
+}
+
+/* Value of a KEY=value line of a shell-style release file, unquoted */
+static gchar *
+fsreader_get_field(const gchar *contents, const gchar *key)
+{
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gchar **line;
+    gchar *value = NULL;
+    gsize len = strlen(key);
+
+    for (line = lines; *line && value == NULL; line++) {
+        if (strncmp(*line, key, len) != 0 || (*line)[len] != '=')
+            continue;
+        value = g_shell_unquote(*line + len + 1, NULL);
+        if (value == NULL)
+            value = g_strdup(*line + len + 1);
+    }
+    g_strfreev(lines);
+
+    /* the fields of a result are separated by colons */
+    if (value)
+        g_strdelimit(g_strstrip(value), ":\n", ' ');
+
+    return value;
+}
+
+/* The Linux distribution installed on the filesystem, named the way the
+ * 40lsb and 90linux-distro tests of os-prober name it: from
+ * /etc/lsb-release first, /etc/os-release then.  Fails with
+ * G_IO_ERROR_NOT_FOUND when neither names one.
+ */
+gboolean
+fsreader_detect_linux(FsReader *reader, gchar **long_name, gchar **short_name, GError **error)
+{
+    gchar *contents = NULL;
+    gchar *id = NULL;
+    gchar *description = NULL;
+    gchar *release = NULL;
+    gchar *space;
+    gchar *src, *dst;
+    GError *local_error = NULL;
+
+    *long_name = NULL;
+    *short_name = NULL;
+
+    if (fsreader_read_file(reader, "/etc/lsb-release", &contents, NULL, &local_error)) {
+        id = fsreader_get_field(contents, "DISTRIB_ID");
+        description = fsreader_get_field(contents, "DISTRIB_DESCRIPTION");
+        release = fsreader_get_field(contents, "DISTRIB_RELEASE");
+        g_free(contents);
+        contents = NULL;
+        if (id && *id) {
+            /* without its spaces */
+            *short_name = g_strdup(id);
+            for (src = dst = *short_name; *src; src++) {
+                if (*src != ' ')
+                    *dst++ = *src;
+            }
+            *dst = '\0';
+            if (description == NULL || *description == '\0') {
+                g_free(description);
+                description = g_strdup(id);
+            }
+            if (release && *release && strstr(description, release) == NULL)
+                *long_name = g_strdup_printf("%s (%s)", description, release);
+            else
+                *long_name = g_strdup(description);
+        }
+        g_free(id);
+        g_free(description);
+        g_free(release);
+        if (*long_name)
+            return TRUE;
+    } else if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        g_propagate_error(error, local_error);
+        return FALSE;
+    } else {
+        g_error_free(local_error);
+        local_error = NULL;
+    }
+
+    if (!fsreader_read_file(reader, "/etc/os-release", &contents, NULL, error))
+        return FALSE;
+    id = fsreader_get_field(contents, "NAME");
+    description = fsreader_get_field(contents, "PRETTY_NAME");
+    g_free(contents);
+
+    if (id == NULL || *id == '\0') {
+        g_free(id);
+        g_free(description);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no distribution name");
+        return FALSE;
+    }
+
+    /* the short name is the first word of NAME */
+    space = strpbrk(id, " \t");
+    if (space)
+        *space = '\0';
+    *short_name = id;
+    if (description && *description) {
+        *long_name = description;
+    } else {
+        g_free(description);
+        *long_name = g_strdup(id);
+    }
+
+    return TRUE;
+}
+
+/* Whether path exists, FALSE for the errors of a reader that cannot tell */
+static gboolean
+fsreader_exists(FsReader *reader, const gchar *path, gboolean *exists, GError **error)
+{
+    GError *local_error = NULL;
+
+    *exists = fsreader_test(reader, path, &local_error);
+    if (local_error && !g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        g_propagate_error(error, local_error);
+        return FALSE;
+    }
+    g_clear_error(&local_error);
+
+    return TRUE;
+}
+
+/* Whether pattern is in buf, a dot matching any byte: how the grep of
+ * os-prober matches the UTF-16 strings of a BCD store.
+ */
+static gboolean
+fsreader_grep(const gchar *buf, gsize len, const gchar *pattern)
+{
+    gsize n = strlen(pattern);
+    gsize i;
+    gsize j;
+
+    for (i = 0; i + n <= len; i++) {
+        for (j = 0; j < n; j++) {
+            if (pattern[j] != '.' && pattern[j] != buf[i + j])
+                break;
+        }
+        if (j == n)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* The Windows names in a BCD store, first match wins */
+static const struct {
+    const gchar *pattern;
+    const gchar *long_name;
+} bcd_names[] = {
+    { "W.i.n.d.o.w.s. .1.1", "Windows 11" },
+    { "W.i.n.d.o.w.s. .1.0", "Windows 10" },
+    { "W.i.n.d.o.w.s. .8", "Windows 8" },
+    { "W.i.n.d.o.w.s. .7", "Windows 7" },
+    { "W.i.n.d.o.w.s. .V.i.s.t.a", "Windows Vista" },
+    { "W.i.n.d.o.w.s. .S.e.r.v.e.r. .2.0.0.8. .R.2.", "Windows Server 2008 R2" },
+    { "W.i.n.d.o.w.s. .S.e.r.v.e.r. .2.0.0.8.", "Windows Server 2008" },
+    { "W.i.n.d.o.w.s. .R.e.c.o.v.e.r.y. .E.n.v.i.r.o.n.m.e.n.t", "Windows Recovery Environment" },
+    { "W.i.n.d.o.w.s. .S.e.t.u.p", "Windows Recovery Environment" },
+};
+
+/* The name boot.ini gives when it boots a single Windows, NULL else */
+static gchar *
+fsreader_boot_ini_name(const gchar *contents)
+{
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gchar **line;
+    gchar **fields;
+    gchar *name = NULL;
+    guint count = 0;
+
+    for (line = lines; *line; line++) {
+        if (!g_str_has_prefix(*line, "multi") && !g_str_has_prefix(*line, "scsi"))
+            continue;
+        if (count++)
+            continue;
+        fields = g_strsplit(*line, "\"", 3);
+        name = g_strdup(fields[1] ? fields[1] : fields[0]);
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+
+    if (count != 1) {
+        g_free(name);
+        return NULL;
+    }
+    g_strdelimit(name, "\r", ' ');
+    g_strdelimit(g_strstrip(name), ":", ' ');
+
+    return name;
+}
+
+/* The Windows booting from the filesystem, named the way the
+ * 20microsoft test of os-prober names it: from the BCD store next to
+ * bootmgr, boot.ini next to ntldr, or io.sys for the oldest.  Fails with
+ * G_IO_ERROR_NOT_FOUND when there is none.
+ */
+gboolean
+fsreader_detect_windows(FsReader *reader, gchar **long_name, GError **error)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+    gboolean bootmgr;
+    gboolean ntldr;
+    gboolean ntdetect;
+    gboolean io_sys;
+    gboolean command;
+    GError *local_error = NULL;
+    guint i;
+
+    *long_name = NULL;
+
+    if (!fsreader_exists(reader, "/bootmgr", &bootmgr, error))
+        return FALSE;
+    if (bootmgr) {
+        if (!fsreader_read_file(reader, "/boot/bcd", &contents, &length, error))
+            return FALSE;
+        for (i = 0; i < G_N_ELEMENTS(bcd_names) && *long_name == NULL; i++) {
+            if (fsreader_grep(contents, length, bcd_names[i].pattern))
+                *long_name = g_strdup(bcd_names[i].long_name);
+        }
+        if (*long_name == NULL)
+            *long_name = g_strdup("Windows Vista");
+        g_free(contents);
+        return TRUE;
+    }
+
+    if (!fsreader_exists(reader, "/ntldr", &ntldr, error) ||
+        !fsreader_exists(reader, "/ntdetect.com", &ntdetect, error)) {
+        return FALSE;
+    }
+    if (ntldr && ntdetect) {
+        if (fsreader_read_file(reader, "/boot.ini", &contents, NULL, &local_error)) {
+            *long_name = fsreader_boot_ini_name(contents);
+            g_free(contents);
+        } else if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+            g_propagate_error(error, local_error);
+            return FALSE;
+        } else {
+            g_error_free(local_error);
+        }
+        if (*long_name == NULL)
+            *long_name = g_strdup("Windows NT/2000/XP");
+        return TRUE;
+    }
+
+    if (!fsreader_exists(reader, "/io.sys", &io_sys, error) ||
+        !fsreader_exists(reader, "/command.com", &command, error)) {
+        return FALSE;
+    }
+    if (io_sys && command) {
+        *long_name = g_strdup("Windows 95/98/Me");
+        return TRUE;
+    }
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no Windows boot files");
+    return FALSE;
+}
+
+/* The entry of dir called name whatever its case, like item_in_dir of
+ * os-prober: the name it has on disk and what it is.
+ */
+static gboolean
+fsreader_find(FsReader      *reader,
+              const FsInode *dir,
+              const gchar   *name,
+              gchar        **real_name,
+              FsInode       *inode,
+              guint32       *mode,
+              GError       **error)
+{
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    guint64 size;
+    guint i;
+
+    *real_name = NULL;
+    if (!reader->ops->list(reader, dir, names, error)) {
+        g_ptr_array_free(names, TRUE);
+        return FALSE;
+    }
+    for (i = 0; i < names->len && *real_name == NULL; i++) {
+        if (fsreader_name_equal(g_ptr_array_index(names, i), name))
+            *real_name = g_strdup(g_ptr_array_index(names, i));
+    }
+    g_ptr_array_free(names, TRUE);
+
+    if (*real_name == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s: not found", name);
+        return FALSE;
+    }
+    if (!reader->ops->lookup(reader, dir, *real_name, inode, error) ||
+        !reader->ops->stat(reader, inode, mode, &size, error)) {
+        g_free(*real_name);
+        *real_name = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Look for loader in vendor, below the Boot directory of it when boot */
+static gboolean
+fsreader_find_loader(FsReader      *reader,
+                     const FsInode *vendor,
+                     const gchar   *prefix,
+                     gboolean       boot,
+                     const gchar   *loader,
+                     gchar        **path,
+                     GError       **error)
+{
+    FsInode dir = *vendor;
+    FsInode inode;
+    gchar *boot_name = NULL;
+    gchar *loader_name = NULL;
+    guint32 mode;
+    GError *local_error = NULL;
+
+    *path = NULL;
+    if ((!boot || fsreader_find(reader, vendor, "boot", &boot_name, &dir, &mode, &local_error)) &&
+        (!boot || S_ISDIR(mode)) &&
+        fsreader_find(reader, &dir, loader, &loader_name, &inode, &mode, &local_error) &&
+        S_ISREG(mode)) {
+        if (boot)
+            *path = g_strdup_printf("%s/%s/%s", prefix, boot_name, loader_name);
+        else
+            *path = g_strdup_printf("%s/%s", prefix, loader_name);
+    }
+    g_free(boot_name);
+    g_free(loader_name);
+
+    if (local_error && !g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+        g_propagate_error(error, local_error);
+        return FALSE;
+    }
+    g_clear_error(&local_error);
+
+    return TRUE;
+}
+
+/* The boot loaders on an EFI system partition the efi tests of
+ * os-prober know of, in their order: ELILO in any directory of /EFI,
+ * then the Windows Boot Manager.  Fails with G_IO_ERROR_NOT_FOUND when
+ * there is no /EFI.
+ */
+gboolean
+fsreader_detect_efi(FsReader *reader, GPtrArray *loaders, GError **error)
+{
+    static const struct {
+        const gchar *vendor;    /* any vendor when NULL */
+        gboolean boot;
+        const gchar *loader;
+        const gchar *long_name;
+        const gchar *short_name;
+    } known[] = {
+        { NULL, FALSE, "elilo.efi", "ELILO Boot Manager", "ELILO" },
+        { "microsoft", TRUE, "bootmgfw.efi", "Windows Boot Manager", "Windows" },
+    };
+    GPtrArray *names = NULL;
+    FsBootLoader *loader;
+    FsInode efi;
+    FsInode vendor;
+    gchar *efi_name = NULL;
+    gchar *vendor_name = NULL;
+    gchar *prefix;
+    gchar *path;
+    guint32 mode;
+    guint64 size;
+    gboolean ret = FALSE;
+    guint i;
+    guint j;
+
+    if (reader->ops->list == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "directories cannot be listed");
+        return FALSE;
+    }
+
+    if (!fsreader_find(reader, &reader->root, "efi", &efi_name, &efi, &mode, error))
+        return FALSE;
+    if (!S_ISDIR(mode)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "/%s: not a directory", efi_name);
+        goto out;
+    }
+
+    names = g_ptr_array_new_with_free_func(g_free);
+    if (!reader->ops->list(reader, &efi, names, error))
+        goto out;
+
+    for (i = 0; i < G_N_ELEMENTS(known); i++) {
+        for (j = 0; j < names->len; j++) {
+            vendor_name = g_ptr_array_index(names, j);
+            if (known[i].vendor && !fsreader_name_equal(vendor_name, known[i].vendor))
+                continue;
+            if (!reader->ops->lookup(reader, &efi, vendor_name, &vendor, error) ||
+                !reader->ops->stat(reader, &vendor, &mode, &size, error)) {
+                goto out;
+            }
+            if (!S_ISDIR(mode))
+                continue;
+
+            prefix = g_strdup_printf("/%s/%s", efi_name, vendor_name);
+            if (!fsreader_find_loader(reader, &vendor, prefix, known[i].boot, known[i].loader,
+                                      &path, error)) {
+                g_free(prefix);
+                goto out;
+            }
+            g_free(prefix);
+            if (path == NULL)
+                continue;
+
+            loader = g_new0(FsBootLoader, 1);
+            loader->path = path;
+            loader->long_name = known[i].long_name;
+            loader->short_name = known[i].short_name;
+            g_ptr_array_add(loaders, loader);
+        }
+    }
+    ret = TRUE;
+
+out:
+    if (names)
+        g_ptr_array_free(names, TRUE);
+    g_free(efi_name);
+
+    return ret;
+}
+
+void
+fsreader_boot_loader_free(FsBootLoader *loader)
+{
+    g_free(loader->path);
+    g_free(loader);
+}
+
+void
+fsreader_boot_entry_free(FsBootEntry *entry)
+{
+    g_free(entry->label);
+    g_free(entry->kernel);
+    g_free(entry->initrd);
+    g_free(entry->params);
+    g_free(entry);
+}
+
+/* A path of a boot loader configuration as it is on the filesystem: the
+ * configuration is relative to /boot, which is a directory of the root
+ * filesystem or a filesystem of its own.  NULL when the file is not on
+ * this one, FALSE for a reader which cannot tell.
+ */
+static gboolean
+fsreader_boot_path(FsReader *reader, const gchar *path, gchar **real_path, GError **error)
+{
+    gchar *boot_path;
+    gboolean exists;
+
+    *real_path = NULL;
+    if (!fsreader_exists(reader, path, &exists, error))
+        return FALSE;
+    if (exists) {
+        *real_path = g_strdup(path);
+        return TRUE;
+    }
+
+    boot_path = g_strconcat("/boot", path, NULL);
+    if (!fsreader_exists(reader, boot_path, &exists, error)) {
+        g_free(boot_path);
+        return FALSE;
+    }
+    if (exists)
+        *real_path = boot_path;
+    else
+        g_free(boot_path);
+
+    return TRUE;
+}
+
+/* Add an entry unless its kernel is on another filesystem, which the
+ * configuration on this one does not tell
+ */
+static gboolean
+fsreader_add_boot_entry(FsReader    *reader,
+                        GPtrArray   *entries,
+                        const gchar *label,
+                        const gchar *kernel,
+                        const gchar *initrd,
+                        const gchar *params,
+                        GError     **error)
+{
+    FsBootEntry *entry;
+    gchar *kernel_path = NULL;
+    gchar *initrd_path = NULL;
+
+    if (kernel == NULL || strchr(kernel, '$'))
+        return TRUE;
+    if (!fsreader_boot_path(reader, kernel, &kernel_path, error))
+        return FALSE;
+    if (kernel_path == NULL)
+        return TRUE;
+    if (initrd && !fsreader_boot_path(reader, initrd, &initrd_path, error)) {
+        g_free(kernel_path);
+        return FALSE;
+    }
+
+    entry = g_new0(FsBootEntry, 1);
+    entry->label = g_strdup(label ? label : "");
+    entry->kernel = kernel_path;
+    entry->initrd = initrd_path ? initrd_path : g_strdup("");
+    entry->params = g_strdup(params ? params : "");
+    g_ptr_array_add(entries, entry);
+
+    return TRUE;
+}
+
+/* The words of a grub.cfg line, unquoted.  NULL for what the shell
+ * syntax does not make sense of, grub has a few of its own.
+ */
+static gchar **
+fsreader_grub_words(const gchar *line)
+{
+    gchar **argv = NULL;
+
+    if (!g_shell_parse_argv(line, NULL, &argv, NULL))
+        return NULL;
+
+    return argv;
+}
+
+/* The menu entries of a grub.cfg, as 40grub2 of linux-boot-prober reads
+ * them: the first linux and initrd command of every menuentry.
+ */
+static gboolean
+fsreader_parse_grub(FsReader *reader, const gchar *contents, GPtrArray *entries, GError **error)
+{
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gchar **line;
+    gchar **argv;
+    gchar *label = NULL;
+    gchar *kernel = NULL;
+    gchar *initrd = NULL;
+    gchar *params = NULL;
+    gboolean in_entry = FALSE;
+    gboolean ret = TRUE;
+
+    for (line = lines; *line && ret; line++) {
+        g_strstrip(*line);
+        if (in_entry && strcmp(*line, "}") == 0) {
+            ret = fsreader_add_boot_entry(reader, entries, label, kernel, initrd, params, error);
+            in_entry = FALSE;
+            g_clear_pointer(&label, g_free);
+            g_clear_pointer(&kernel, g_free);
+            g_clear_pointer(&initrd, g_free);
+            g_clear_pointer(&params, g_free);
+            continue;
+        }
+        if (!g_str_has_prefix(*line, "menuentry ") && 
+            !(in_entry && (g_str_has_prefix(*line, "linux") || g_str_has_prefix(*line, "initrd")))) {
+            continue;
+        }
+
+        argv = fsreader_grub_words(*line);
+        if (argv == NULL || argv[1] == NULL) {
+            g_strfreev(argv);
+            continue;
+        }
+        if (strcmp(argv[0], "menuentry") == 0) {
+            in_entry = TRUE;
+            g_free(label);
+            label = g_strdup(argv[1]);
+        } else if (kernel == NULL &&
+                   (strcmp(argv[0], "linux") == 0 || strcmp(argv[0], "linux16") == 0 ||
+                    strcmp(argv[0], "linuxefi") == 0)) {
+            kernel = g_strdup(argv[1]);
+            params = g_strjoinv(" ", argv + 2);
+        } else if (initrd == NULL &&
+                   (strcmp(argv[0], "initrd") == 0 || strcmp(argv[0], "initrd16") == 0 ||
+                    strcmp(argv[0], "initrdefi") == 0)) {
+            initrd = g_strdup(argv[1]);
+        }
+        g_strfreev(argv);
+    }
+    g_free(label);
+    g_free(kernel);
+    g_free(initrd);
+    g_free(params);
+    g_strfreev(lines);
+
+    return ret;
+}
+
+static gint
+compare_names(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+/* Value of a "key value" line of a Boot Loader Specification entry */
+static gchar *
+fsreader_get_bls_key(const gchar *contents, const gchar *key)
+{
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gchar **line;
+    gchar *value = NULL;
+    gsize len = strlen(key);
+
+    for (line = lines; *line && value == NULL; line++) {
+        if (strncmp(*line, key, len) == 0 && g_ascii_isspace((*line)[len]))
+            value = g_strstrip(g_strdup(*line + len));
+    }
+    g_strfreev(lines);
+
+    return value;
+}
+
+/* The entries of the Boot Loader Specification, in /boot/loader/entries,
+ * the options of which may refer to the kernelopts of the grub
+ * environment.
+ */
+static gboolean
+fsreader_read_bls(FsReader *reader, GPtrArray *entries, GError **error)
+{
+    static const gchar * const dirs[] = { "/boot/loader/entries", "/loader/entries", NULL };
+    GPtrArray *names = NULL;
+    FsInode dir;
+    guint32 mode;
+    guint64 size;
+    gchar *contents = NULL;
+    gchar *kernelopts = NULL;
+    gchar *path;
+    gchar *title, *kernel, *initrd, *options;
+    gchar *expanded;
+    gchar **parts;
+    GError *local_error = NULL;
+    gboolean ret = TRUE;
+    guint i, j;
+
+    for (i = 0; dirs[i] && names == NULL; i++) {
+        if (!fsreader_resolve(reader, dirs[i], &dir, &mode, &size, &local_error)) {
+            if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+                g_propagate_error(error, local_error);
+                return FALSE;
+            }
+            g_clear_error(&local_error);
+            continue;
+        }
+        if (reader->ops->list == NULL) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "directories cannot be listed");
+            return FALSE;
+        }
+        names = g_ptr_array_new_with_free_func(g_free);
+        if (!reader->ops->list(reader, &dir, names, error)) {
+            g_ptr_array_free(names, TRUE);
+            return FALSE;
+        }
+    }
+    if (names == NULL)
+        return TRUE;
+
+    if (fsreader_read_file(reader, "/boot/grub2/grubenv", &contents, NULL, NULL)) {
+        kernelopts = fsreader_get_field(contents, "kernelopts");
+        g_free(contents);
+        contents = NULL;
+    }
+
+    g_ptr_array_sort(names, compare_names);
+    for (j = 0; j < names->len && ret; j++) {
+        if (!g_str_has_suffix(g_ptr_array_index(names, j), ".conf"))
+            continue;
+        path = g_build_filename(dirs[i - 1], g_ptr_array_index(names, j), NULL);
+        if (!fsreader_read_file(reader, path, &contents, NULL, error)) {
+            g_free(path);
+            ret = FALSE;
+            break;
+        }
+        g_free(path);
+
+        title = fsreader_get_bls_key(contents, "title");
+        kernel = fsreader_get_bls_key(contents, "linux");
+        initrd = fsreader_get_bls_key(contents, "initrd");
+        options = fsreader_get_bls_key(contents, "options");
+        if (options && kernelopts && strstr(options, "$kernelopts")) {
+            parts = g_strsplit(options, "$kernelopts", -1);
+            expanded = g_strjoinv(kernelopts, parts);
+            g_strfreev(parts);
+            g_free(options);
+            options = expanded;
+        }
+        ret = fsreader_add_boot_entry(reader, entries, title, kernel, initrd, options, error);
+        g_free(title);
+        g_free(kernel);
+        g_free(initrd);
+        g_free(options);
+        g_free(contents);
+        contents = NULL;
+    }
+    g_free(kernelopts);
+    g_ptr_array_free(names, TRUE);
+
+    return ret;
+}
+
+/* The kernels in /boot with the initrd of their version, as the
+ * 90fallback test of linux-boot-prober finds them
+ */
+static gboolean
+fsreader_list_kernels(FsReader *reader, GPtrArray *entries, GError **error)
+{
+    static const gchar * const initrds[] = {
+        "initrd.img-%s", "initrd-%s.img", "initramfs-%s.img", "initrd-%s", NULL
+    };
+    GPtrArray *names;
+    FsInode dir;
+    guint32 mode;
+    guint64 size;
+    const gchar *name;
+    const gchar *version;
+    gchar *kernel;
+    gchar *initrd;
+    gchar *path;
+    gboolean exists;
+    gboolean ret = TRUE;
+    guint i, j;
+
+    if (!fsreader_resolve(reader, "/boot", &dir, &mode, &size, error))
+        return FALSE;
+    if (reader->ops->list == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "directories cannot be listed");
+        return FALSE;
+    }
+    names = g_ptr_array_new_with_free_func(g_free);
+    if (!reader->ops->list(reader, &dir, names, error)) {
+        g_ptr_array_free(names, TRUE);
+        return FALSE;
+    }
+
+    g_ptr_array_sort(names, compare_names);
+    for (i = 0; i < names->len && ret; i++) {
+        name = g_ptr_array_index(names, i);
+        if (!g_str_has_prefix(name, "vmlinuz-") && !g_str_has_prefix(name, "vmlinux-") &&
+            !g_str_has_prefix(name, "kernel-")) {
+            continue;
+        }
+        version = strchr(name, '-') + 1;
+        kernel = g_strconcat("/boot/", name, NULL);
+        initrd = NULL;
+        for (j = 0; initrds[j] && initrd == NULL && ret; j++) {
+            path = g_strdup_printf(initrds[j], version);
+            initrd = g_strconcat("/boot/", path, NULL);
+            g_free(path);
+            ret = fsreader_exists(reader, initrd, &exists, error);
+            if (!ret || !exists)
+                g_clear_pointer(&initrd, g_free);
+        }
+        /* the root of the kernel command line is for the caller to add */
+        if (ret)
+            ret = fsreader_add_boot_entry(reader, entries, name, kernel, initrd, NULL, error);
+        g_free(kernel);
+        g_free(initrd);
+    }
+    g_ptr_array_free(names, TRUE);
+
+    return ret;
+}
+
+/* The kernels of the Linux installed on the filesystem, as
+ * linux-boot-prober gives them for a /boot on the root filesystem:
+ * from grub.cfg, the Boot Loader Specification entries, or else the
+ * kernels in /boot.  Fails with G_IO_ERROR_NOT_FOUND when there is no
+ * kernel to boot, and G_IO_ERROR_NOT_SUPPORTED when they might be on
+ * another filesystem, a /boot of its own, or the reader cannot list
+ * the directories it would need to.
+ */
+gboolean
+fsreader_detect_boot_entries(FsReader *reader, GPtrArray *entries, GError **error)
+{
+    static const gchar * const configs[] = {
+        "/boot/grub/grub.cfg", "/boot/grub2/grub.cfg", NULL
+    };
+    gchar *contents = NULL;
+    gboolean configured = FALSE;
+    gboolean exists;
+    GError *local_error = NULL;
+    guint i;
+
+    for (i = 0; configs[i] && entries->len == 0; i++) {
+        if (!fsreader_read_file(reader, configs[i], &contents, NULL, &local_error)) {
+            if (!g_error_matches(local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+                g_propagate_error(error, local_error);
+                return FALSE;
+            }
+            g_clear_error(&local_error);
+            continue;
+        }
+        configured = TRUE;
+        if (!fsreader_parse_grub(reader, contents, entries, error)) {
+            g_free(contents);
+            return FALSE;
+        }
+        g_free(contents);
+        contents = NULL;
+    }
+
+    if (entries->len == 0 && !fsreader_read_bls(reader, entries, error))
+        return FALSE;
+    if (entries->len)
+        return TRUE;
+
+    /* a configuration for kernels which are not here */
+    if (configured) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "kernels on another filesystem");
+        return FALSE;
+    }
+
+    if (!fsreader_exists(reader, "/boot", &exists, error))
+        return FALSE;
+    if (exists && !fsreader_list_kernels(reader, entries, error))
+        return FALSE;
+    if (entries->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "no kernel");
+        return FALSE;
+    }
+
+    return TRUE;
+}
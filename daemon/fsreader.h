@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __FSREADER_H__
+#define __FSREADER_H__
+
+#include <gio/gio.h>
+
+#include "types.h"
+#include "superblock.h"
+
+G_BEGIN_DECLS
+
+/* Largest file and directory read in memory, a BCD store fits */
+#define FSREADER_MAX_FILE   (1024 * 1024)
+#define FSREADER_MAX_DIR    (4 * 1024 * 1024)
+
+/* Symbolic links followed while resolving one path */
+#define FSREADER_MAX_LINKS  8
+
+/* An inode of the filesystem, tree tells the subvolume for btrfs.  FAT
+ * has no inodes: ino is the first cluster, tree the size and attributes
+ * of the directory entry.
+ */
+typedef struct {
+    guint64 tree;
+    guint64 ino;
+} FsInode;
+
+/* What a reader implements.  Any error but G_IO_ERROR_NOT_FOUND means
+ * the reader cannot tell, the caller has to mount instead.  Listing a
+ * directory is optional, the case-insensitive filesystems have it to
+ * give the names as they are on disk.
+ */
+typedef struct {
+    gboolean (*lookup)(FsReader      *reader,
+                       const FsInode *dir,
+                       const gchar   *name,
+                       FsInode       *inode,
+                       GError       **error);
+    gboolean (*stat)  (FsReader      *reader,
+                       const FsInode *inode,
+                       guint32       *mode,
+                       guint64       *size,
+                       GError       **error);
+    gboolean (*read)  (FsReader      *reader,
+                       const FsInode *inode,
+                       guint8        *buf,
+                       gsize          len,
+                       GError       **error);
+    void     (*free)  (FsReader      *reader);
+    gboolean (*list)  (FsReader      *reader,
+                       const FsInode *dir,
+                       GPtrArray     *names,
+                       GError       **error);
+} FsReaderOps;
+
+/* A boot loader on an EFI system partition */
+typedef struct {
+    gchar *path;                /* as on disk, /EFI/Microsoft/Boot/bootmgfw.efi */
+    const gchar *long_name;
+    const gchar *short_name;
+} FsBootLoader;
+
+/* A kernel of a Linux install, as linux-boot-prober gives it */
+typedef struct {
+    gchar *label;
+    gchar *kernel;              /* /boot/vmlinuz-4.9.0-8-amd64 */
+    gchar *initrd;              /* empty when none */
+    gchar *params;              /* empty when the configuration has none */
+} FsBootEntry;
+
+/* Read-only access to the files of an unmounted filesystem, without
+ * mounting it: enough to resolve a path and read a small file.  The
+ * same goes through the mount point of a filesystem mounted already.
+ */
+struct FsReader {
+    const FsReaderOps *ops;
+    gint fd;
+    FsInode root;
+    GCancellable *cancellable;  /* checked between reads, if any */
+};
+
+FsReader *fsreader_open        (const gchar *device,
+                                FsType       type,
+                                GError     **error);
+FsReader *fsreader_open_mounted(const gchar *mount_point,
+                                FsType       type,
+                                GError     **error);
+void      fsreader_free        (FsReader    *reader);
+void      fsreader_set_cancellable(FsReader     *reader,
+                                   GCancellable *cancellable);
+gboolean  fsreader_read_file   (FsReader    *reader,
+                                const gchar *path,
+                                gchar      **contents,
+                                gsize       *length,
+                                GError     **error);
+gboolean  fsreader_test        (FsReader    *reader,
+                                const gchar *path,
+                                GError     **error);
+gboolean  fsreader_detect_linux(FsReader    *reader,
+                                gchar      **long_name,
+                                gchar      **short_name,
+                                GError     **error);
+gboolean  fsreader_detect_windows(FsReader *reader,
+                                  gchar   **long_name,
+                                  GError  **error);
+gboolean  fsreader_detect_efi  (FsReader    *reader,
+                                GPtrArray   *loaders,
+                                GError     **error);
+void      fsreader_boot_loader_free(FsBootLoader *loader);
+gboolean  fsreader_detect_boot_entries(FsReader  *reader,
+                                       GPtrArray *entries,
+                                       GError   **error);
+void      fsreader_boot_entry_free(FsBootEntry *entry);
+
+/* For the readers */
+FsReader *ext_reader_open      (gint fd, GError **error);
+FsReader *xfs_reader_open      (gint fd, GError **error);
+FsReader *btrfs_reader_open    (gint fd, GError **error);
+FsReader *fat_reader_open      (gint fd, GError **error);
+FsReader *ntfs_reader_open     (gint fd, GError **error);
+FsReader *mounted_reader_open  (gint fd, gboolean nocase);
+gboolean  fsreader_pread       (FsReader    *reader,
+                                guint64      offset,
+                                gpointer     buf,
+                                gsize        len,
+                                GError     **error);
+gboolean  fsreader_inflate     (const guint8 *in,
+                                gsize         in_len,
+                                guint8       *out,
+                                gsize         out_len,
+                                GError      **error);
+gchar    *fsreader_utf16_name  (const guint8 *name,
+                                gsize         n_chars);
+gboolean  fsreader_name_equal  (const gchar  *a,
+                                const gchar  *b);
+
+G_END_DECLS
+
+#endif /* __FSREADER_H__ */
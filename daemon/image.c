@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+
+#include <gio/gio.h>
+
+#include "image.h"
+
+#define LOOP_CONTROL "/dev/loop-control"
+
+static gboolean
+image_set_error(GError **error, const gchar *what, const gchar *path)
+{
+    gint saved_errno = errno;
+
+    g_set_error(error, 
+                G_IO_ERROR, 
+                g_io_error_from_errno(saved_errno), 
+                "%s %s: %s", 
+                what, 
+                path, 
+                g_strerror(saved_errno));
+
+    return FALSE;
+}
+
+/* Back the loop device with the image, read-only, detached with the
+ * last close of it and its partitions scanned.  LOOP_CONFIGURE does it
+ * at once, older kernels take two steps.
+ */
+static gboolean
+image_configure(gint loop_fd, gint fd, const gchar *path)
+{
+    struct loop_info64 info;
+#ifdef LOOP_CONFIGURE
+    struct loop_config config;
+#endif
+
+    memset(&info, 0, sizeof(info));
+    info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_PARTSCAN;
+    g_strlcpy((gchar *)info.lo_file_name, path, sizeof(info.lo_file_name));
+
+#ifdef LOOP_CONFIGURE
+    memset(&config, 0, sizeof(config));
+    config.fd = fd;
+    config.info = info;
+    if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+        return TRUE;
+    if (errno != EINVAL && errno != ENOTTY)
+        return FALSE;
+#endif
+
+    if (ioctl(loop_fd, LOOP_SET_FD, fd) < 0)
+        return FALSE;
+    if (ioctl(loop_fd, LOOP_SET_STATUS64, &info) < 0) {
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Attach the image to a free loop device.  Another process may take the
+ * device loop-control gave between the two steps, EBUSY, then the next
+ * free one is tried.
+ */
+Image *
+image_attach(const gchar *path, GError **error)
+{
+    Image *image;
+    gchar *device;
+    gint control;
+    gint fd;
+    gint loop_fd = -1;
+    gint nr = -1;
+    gint saved_errno = 0;
+    guint i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        image_set_error(error, "failed to open", path);
+        return NULL;
+    }
+
+    control = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+    if (control < 0) {
+        image_set_error(error, "failed to open", LOOP_CONTROL);
+        close(fd);
+        return NULL;
+    }
+
+    for (i = 0; i < IMAGE_ATTACH_TRIES && loop_fd < 0; i++) {
+        g_clear_error(error);
+        nr = ioctl(control, LOOP_CTL_GET_FREE);
+        if (nr < 0) {
+            image_set_error(error, "no free loop device for", path);
+            break;
+        }
+        device = g_strdup_printf("/dev/loop%d", nr);
+        loop_fd = open(device, O_RDONLY | O_CLOEXEC);
+        if (loop_fd < 0) {
+            saved_errno = errno;
+            image_set_error(error, "failed to open", device);
+        } else if (!image_configure(loop_fd, fd, path)) {
+            saved_errno = errno;
+            close(loop_fd);
+            loop_fd = -1;
+            errno = saved_errno;
+            image_set_error(error, "failed to attach", path);
+        }
+        g_free(device);
+        if (loop_fd < 0 && saved_errno != EBUSY)
+            break;
+    }
+    close(control);
+    close(fd);
+
+    if (loop_fd < 0)
+        return NULL;
+
+    image = g_new0(Image, 1);
+    image->path = g_strdup(path);
+    image->name = g_strdup_printf("loop%d", nr);
+    image->fd = loop_fd;
+#ifdef DEBUG
+    g_print("DEBUG: %s attached to /dev/%s\n", image->path, image->name);
+#endif
+
+    return image;
+}
+
+/* The loop device lives as long as something holds it open, the mounts
+ * of the tests included; they are all gone by now.
+ */
+void
+image_detach(Image *image)
+{
+    if (image == NULL)
+        return;
+
+#ifdef DEBUG
+    g_print("DEBUG: %s detached from /dev/%s\n", image->path, image->name);
+#endif
+    ioctl(image->fd, LOOP_CLR_FD, 0);
+    close(image->fd);
+    g_free(image->name);
+    g_free(image->path);
+    g_free(image);
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Tries at a free loop device, another attach may take the one asked for */
+#define IMAGE_ATTACH_TRIES 8
+
+/* A raw disk image attached read-only to a loop device, its partitions
+ * scanned by the kernel: loop3, loop3p1...  The loop device goes away
+ * by itself once the image is detached or the daemon exits.
+ */
+typedef struct {
+    gchar *path;
+    gchar *name;        /* loop3 */
+    gint fd;
+} Image;
+
+Image *image_attach(const gchar *path,
+                    GError     **error);
+void   image_detach(Image       *image);
+
+G_END_DECLS
+
+#endif /* __IMAGE_H__ */
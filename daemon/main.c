@@ -27,12 +27,18 @@
 #include <glib-unix.h>
 #include <gio/gio.h>
 
+#include "budget.h"
 #include "daemon.h"
+#include "engine.h"
+#include "trace.h"
 
 #define NAME_TO_CLAIM "org.isoftlinux.OSProber"
 
 static GMainLoop *loop;
 static gboolean debug = FALSE;
+static gchar *prober = NULL;
+static gint image_workers = DAEMON_IMAGE_WORKERS;
+static GBusNameOwnerFlags flags;
 
 static void
 on_bus_acquired(GDBusConnection  *connection,
@@ -43,7 +49,7 @@ on_bus_acquired(GDBusConnection  *connection,
     GError *local_error = NULL;
     GError **error = &local_error;
 
-    daemon = daemon_new();
+    daemon = daemon_new(connection, prober, MAX(image_workers, 1));
     if (daemon == NULL) {
         g_print("ERROR: failed to initialize daemon\n");
         g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
@@ -71,6 +77,26 @@ on_name_lost(GDBusConnection  *connection,
     g_main_loop_quit(loop);
 }
 
+/* Same as g_bus_own_name() for a connection opened by ourselves: the
+ * objects are exported before the name is claimed.
+ */
+static gboolean
+on_connection_ready(gpointer user_data)
+{
+    GDBusConnection *connection = G_DBUS_CONNECTION(user_data);
+
+    on_bus_acquired(connection, NAME_TO_CLAIM, NULL);
+    g_bus_own_name_on_connection(connection, 
+                                 NAME_TO_CLAIM, 
+                                 flags, 
+                                 NULL, 
+                                 on_name_lost, 
+                                 NULL, 
+                                 NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
 static void
 log_handler(const gchar   *domain,
             GLogLevelFlags level,
@@ -95,14 +121,26 @@ main(int argc, char *argv[])
 {
     GError *error = NULL;
     gint ret = 1;
-    GBusNameOwnerFlags flags;
     GOptionContext *context = NULL;
     static gboolean replace;
     static gboolean show_version;
+    static gchar *trace_file = NULL;
+    static gboolean session = FALSE;
+    static gchar *address = NULL;
+    static gchar *io_max = NULL;
+    static gint cpu_weight = BUDGET_CPU_WEIGHT;
+    GDBusConnection *connection = NULL;
     static GOptionEntry entries[] = {
         { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, N_("Output version information and exit"), NULL },
         { "replace", 0, 0, G_OPTION_ARG_NONE, &replace, N_("Replace existing instance"), NULL },
         { "debug", 0, 0, G_OPTION_ARG_NONE, &debug, N_("Enable debugging code"), NULL },
+        { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file, N_("Record a Chrome trace of the probes to FILE"), N_("FILE") },
+        { "session", 0, 0, G_OPTION_ARG_NONE, &session, N_("Use the session bus instead of the system bus"), NULL },
+        { "address", 0, 0, G_OPTION_ARG_STRING, &address, N_("Use the message bus at ADDRESS"), N_("ADDRESS") },
+        { "prober", 0, 0, G_OPTION_ARG_FILENAME, &prober, N_("Run PATH instead of os-prober"), N_("PATH") },
+        { "io-max", 0, 0, G_OPTION_ARG_STRING, &io_max, N_("Cap the I/O of the daemon and of the probes on every disk to LIMITS of io.max"), N_("LIMITS") },
+        { "cpu-weight", 0, 0, G_OPTION_ARG_INT, &cpu_weight, N_("CPU weight of the probes, 0 to keep the one of the service"), N_("WEIGHT") },
+        { "image-workers", 0, 0, G_OPTION_ARG_INT, &image_workers, N_("Probe up to N disk images at once"), N_("N") },
 
         { NULL }
     };
@@ -144,18 +182,46 @@ main(int argc, char *argv[])
     }
 
     g_log_set_default_handler(log_handler, NULL);
+    trace_init(trace_file);
+
+    /* no thread runs yet, they all get the namespace */
+    if (!engine_unshare_mounts(&error)) {
+        g_warning("Probing without a mount namespace of its own: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+    if (!budget_init(io_max ? io_max : BUDGET_IO_MAX, MAX(cpu_weight, 0), &error)) {
+        g_warning("Probing without a resource budget: %s", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
 
     flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
     if (replace)
         flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
-    g_bus_own_name(G_BUS_TYPE_SYSTEM,
-                   NAME_TO_CLAIM,
-                   flags,
-                   on_bus_acquired,
-                   NULL,
-                   on_name_lost,
-                   NULL,
-                   NULL);
+    if (address) {
+        /* a private dbus-daemon, for load testing without root */
+        connection = g_dbus_connection_new_for_address_sync(address, 
+                                                            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | 
+                                                            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, 
+                                                            NULL, 
+                                                            NULL, 
+                                                            &error);
+        if (connection == NULL) {
+            g_print("ERROR: %s\n", error->message);
+            goto out;
+        }
+        g_idle_add(on_connection_ready, connection);
+    } else {
+        g_bus_own_name(session ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM,
+                       NAME_TO_CLAIM,
+                       flags,
+                       on_bus_acquired,
+                       NULL,
+                       on_name_lost,
+                       NULL,
+                       NULL);
+    }
 
     loop = g_main_loop_new(NULL, FALSE);
 
@@ -170,9 +236,16 @@ main(int argc, char *argv[])
     g_print("DEBUG: exiting\n");
 #endif
     g_main_loop_unref(loop);
+    budget_close();
+    trace_close();
     ret = 0;
 
 out:
     if (error) g_error_free(error); error = NULL;
+    if (trace_file) g_free(trace_file); trace_file = NULL;
+    if (address) g_free(address); address = NULL;
+    if (io_max) g_free(io_max); io_max = NULL;
+    if (prober) g_free(prober); prober = NULL;
+    if (connection) g_object_unref(connection); connection = NULL;
     return ret;
 }
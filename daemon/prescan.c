@@ -0,0 +1,466 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "diskio.h"
+#include "engine.h"
+#include "prescan.h"
+#include "trace.h"
+
+/* The MBR and the GPT header, for 512 and 4096 byte sectors */
+#define PRESCAN_TABLE_SIZE      8192
+#define PRESCAN_MAX_GPT_ENTRIES (1024 * 1024)
+#define GPT_SIGNATURE           "EFI PART"
+
+typedef struct {
+    gint fd;
+    guint64 offset;
+    gsize len;
+    guint8 *buf;
+    gssize done;        /* bytes read, or -errno */
+    gboolean complete;
+} PrescanRead;
+
+typedef struct {
+    gint fd;
+    guint sector_size;
+    PrescanRead *table;
+    PrescanRead *entries;   /* NULL unless the disk is GPT */
+    guint32 n_entries;
+    guint32 entry_size;
+    gboolean gpt;
+} PrescanDisk;
+
+/* Partition types which never hold an OS, whatever their content looks
+ * like.  Only trusted when the partition itself could not be read.
+ */
+static const gchar * const non_os_types[] = {
+    "0657fd6d-a4ab-43c4-84e5-0933c84b4f4f",     /* Linux swap */
+    "e6d6d379-f507-44c2-a23c-238f2a3df928",     /* Linux LVM */
+    "a19d880f-05fc-4d3b-a006-743f0f84911e",     /* Linux RAID */
+    "ca7d7ccb-63ed-4c53-861c-1742536059cc",     /* Linux LUKS */
+    "21686148-6449-6e6f-744e-656564454649",     /* BIOS boot */
+    "e3c9e316-0b5c-4db8-817d-f92df00215ae",     /* Microsoft reserved */
+    "5808c8aa-7e8f-42e0-85d2-e1e90434cfb3",     /* LDM metadata */
+    "00000000-0000-0000-0000-000000000000",     /* unused entry */
+    "0x00", "0x05", "0x0f", "0x85",             /* empty, extended */
+    "0x82", "0x8e", "0xfd",                     /* swap, LVM, RAID */
+    NULL
+};
+
+static PrescanRead *
+prescan_read_new(GPtrArray *reads, gint fd, guint64 offset, gsize len)
+{
+    PrescanRead *read = g_new0(PrescanRead, 1);
+
+    read->fd = fd;
+    read->offset = offset;
+    read->len = len;
+    read->buf = g_malloc0(len);
+    g_ptr_array_add(reads, read);
+
+    return read;
+}
+
+static void
+prescan_read_free(PrescanRead *read)
+{
+    g_free(read->buf);
+    g_free(read);
+}
+
+static void
+prescan_pread(PrescanRead *read)
+{
+    gssize ret;
+
+    while (read->done < (gssize)read->len) {
+        ret = pread(read->fd, 
+                    read->buf + read->done, 
+                    read->len - read->done, 
+                    (off_t)(read->offset + read->done));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            if (read->done == 0)
+                read->done = -errno;
+            break;
+        }
+        if (ret == 0)
+            break;
+        read->done += ret;
+    }
+    read->complete = TRUE;
+}
+
+#ifdef HAVE_LIBURING
+/* Keep up to PRESCAN_QUEUE_DEPTH reads in flight, all disks at once.
+ * Whatever the ring did not get to, because io_uring is missing or
+ * disabled for this process, is left incomplete, and so is a short
+ * read, for prescan_pread() to finish from where it stopped.
+ */
+static void
+prescan_uring(GPtrArray *reads, guint from)
+{
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    PrescanRead *read;
+    guint batch;
+    guint i;
+    gint submitted;
+    gint ret;
+
+    if (io_uring_queue_init(PRESCAN_QUEUE_DEPTH, &ring, 0) < 0)
+        return;
+
+    while (from < reads->len) {
+        batch = MIN(PRESCAN_QUEUE_DEPTH, reads->len - from);
+        for (i = 0; i < batch; i++) {
+            read = g_ptr_array_index(reads, from + i);
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_read(sqe, read->fd, read->buf, read->len, read->offset);
+            io_uring_sqe_set_data(sqe, read);
+        }
+
+        do {
+            submitted = io_uring_submit(&ring);
+        } while (submitted == -EINTR);
+        if (submitted <= 0)
+            break;
+
+        for (i = 0; i < (guint)submitted; i++) {
+            do {
+                ret = io_uring_wait_cqe(&ring, &cqe);
+            } while (ret == -EINTR);
+            if (ret < 0)
+                goto out;
+            read = io_uring_cqe_get_data(cqe);
+            read->done = cqe->res;
+            read->complete = cqe->res <= 0 || cqe->res == (gint)read->len;
+            io_uring_cqe_seen(&ring, cqe);
+        }
+        if ((guint)submitted < batch)
+            break;
+        from += batch;
+    }
+
+out:
+    io_uring_queue_exit(&ring);
+}
+#endif
+
+/* Read everything queued from index from on, in one batch */
+static void
+prescan_read_all(GPtrArray *reads, guint from)
+{
+    PrescanRead *read;
+    guint i;
+
+#ifdef HAVE_LIBURING
+    prescan_uring(reads, from);
+#endif
+    for (i = from; i < reads->len; i++) {
+        read = g_ptr_array_index(reads, i);
+        if (!read->complete)
+            prescan_pread(read);
+    }
+}
+
+static PrescanDisk *
+prescan_disk_new(const gchar *name, GPtrArray *reads)
+{
+    PrescanDisk *disk = g_new0(PrescanDisk, 1);
+    gchar *path = g_strdup_printf("/dev/%s", name);
+    gint sector_size = 0;
+
+    disk->fd = open(path, O_RDONLY | O_CLOEXEC);
+    g_free(path);
+    if (disk->fd < 0)
+        return disk;
+
+    if (ioctl(disk->fd, BLKSSZGET, &sector_size) < 0 || sector_size < 512)
+        sector_size = 512;
+    disk->sector_size = sector_size;
+    disk->table = prescan_read_new(reads, disk->fd, 0, PRESCAN_TABLE_SIZE);
+
+    return disk;
+}
+
+static void
+prescan_disk_free(PrescanDisk *disk)
+{
+    if (disk->fd >= 0)
+        close(disk->fd);
+    g_free(disk);
+}
+
+/* Queue the read of the GPT entries, once the header is in */
+static void
+prescan_disk_parse_table(PrescanDisk *disk, GPtrArray *reads)
+{
+    const guint8 *header;
+    guint64 lba;
+
+    if (disk->table == NULL || 
+        disk->table->done < (gssize)(disk->sector_size + 92)) {
+        return;
+    }
+
+    header = disk->table->buf + disk->sector_size;
+    if (memcmp(header, GPT_SIGNATURE, 8) != 0)
+        return;
+
+    disk->gpt = TRUE;
+    lba = get_le64(header + 72);
+    disk->n_entries = get_le32(header + 80);
+    disk->entry_size = get_le32(header + 84);
+    if (disk->n_entries == 0 || disk->entry_size < 128 ||
+        (guint64)disk->n_entries * disk->entry_size > PRESCAN_MAX_GPT_ENTRIES) {
+        return;
+    }
+
+    disk->entries = prescan_read_new(reads, 
+                                     disk->fd, 
+                                     lba * disk->sector_size,
+                                     disk->n_entries * disk->entry_size);
+}
+
+/* A GUID of GPT, mixed-endian, as blkid gives it */
+static gchar *
+format_guid(const guint8 *p)
+{
+    return g_strdup_printf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                           p[3], p[2], p[1], p[0], p[5], p[4], p[7], p[6],
+                           p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+}
+
+/* The GPT entry of a partition, NULL if not read */
+static const guint8 *
+prescan_disk_get_entry(PrescanDisk *disk, guint number)
+{
+    if (disk->entries == NULL || number > disk->n_entries ||
+        disk->entries->done < (gssize)(number * disk->entry_size)) {
+        return NULL;
+    }
+
+    return disk->entries->buf + (number - 1) * disk->entry_size;
+}
+
+/* Type of a partition as its table has it: the type GUID for GPT, the
+ * system id byte for the primary partitions of MBR.
+ */
+static gchar *
+prescan_disk_get_type(PrescanDisk *disk, guint number)
+{
+    const guint8 *p;
+
+    if (disk == NULL || disk->table == NULL || number == 0)
+        return NULL;
+
+    if (disk->gpt) {
+        p = prescan_disk_get_entry(disk, number);
+        return p ? format_guid(p) : NULL;
+    }
+
+    if (number > 4 || disk->table->done < 512 ||
+        get_le16(disk->table->buf + 510) != 0xAA55) {
+        return NULL;
+    }
+
+    return g_strdup_printf("0x%02x", disk->table->buf[446 + (number - 1) * 16 + 4]);
+}
+
+/* PARTUUID of a partition as the kernel and udev derive it from the
+ * table: the unique GUID for GPT, the disk signature and the number for
+ * the primary partitions of MBR.  Read here, it does not depend on udev
+ * having handled the uevent of the partition yet.
+ */
+static gchar *
+prescan_disk_get_partuuid(PrescanDisk *disk, guint number)
+{
+    const guint8 *p;
+
+    if (disk == NULL || disk->table == NULL || number == 0)
+        return NULL;
+
+    if (disk->gpt) {
+        p = prescan_disk_get_entry(disk, number);
+        return p ? format_guid(p + 16) : NULL;
+    }
+
+    if (number > 4 || disk->table->done < 512 ||
+        get_le16(disk->table->buf + 510) != 0xAA55 ||
+        get_le32(disk->table->buf + 440) == 0) {
+        return NULL;
+    }
+
+    return g_strdup_printf("%08x-%02x", get_le32(disk->table->buf + 440), number);
+}
+
+static gboolean
+is_zero(const guint8 *buf, gsize len)
+{
+    gsize i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i])
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Whether os-prober has anything to look for on a partition: anything
+ * but empty space, swap or a container.  A partition which could not be
+ * read, or whose content has no signature known here, is left to
+ * os-prober, unless its type in the partition table says otherwise:
+ * the superblocks parsed are a few, os-prober knows many more.
+ */
+static gboolean
+prescan_is_candidate(Partition *partition, PrescanRead *head, const gchar **reason)
+{
+    if (head == NULL || head->done <= 0)
+        goto unknown;
+
+    switch (partition->superblock.type) {
+    case FS_EXT:
+    case FS_XFS:
+    case FS_BTRFS:
+    case FS_VFAT:
+    case FS_NTFS:
+    case FS_OTHER:
+        return TRUE;
+    case FS_UNKNOWN:
+        if (is_zero(head->buf, head->done)) {
+            *reason = "empty";
+            return FALSE;
+        }
+        goto unknown;
+    default:
+        *reason = superblock_type_name(partition->superblock.type);
+        return FALSE;
+    }
+
+unknown:
+    if (partition->type && g_strv_contains(non_os_types, partition->type)) {
+        *reason = partition->type;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Drop the partitions which cannot hold an OS before any test runs on
+ * them.  The partition tables of the disks and the first
+ * SUPERBLOCK_SCAN_SIZE bytes of every partition are read in one batch,
+ * through io_uring when available, and the superblocks found are kept
+ * in the partitions, sparing the engine to read them again.
+ */
+void
+prescan_filter(GPtrArray *partitions)
+{
+    GPtrArray *reads;
+    GHashTable *disks;
+    GHashTableIter iter;
+    PrescanRead **heads;
+    PrescanDisk *disk;
+    Partition *partition;
+    const gchar *reason = NULL;
+    gint64 start = trace_now();
+    guint from;
+    gint fd;
+    guint i;
+
+    if (partitions->len == 0)
+        return;
+
+    reads = g_ptr_array_new_with_free_func((GDestroyNotify)prescan_read_free);
+    disks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)prescan_disk_free);
+    heads = g_new0(PrescanRead *, partitions->len);
+
+    for (i = 0; i < partitions->len; i++) {
+        partition = g_ptr_array_index(partitions, i);
+        if (partition->number && partition->disk &&
+            !g_hash_table_contains(disks, partition->disk)) {
+            g_hash_table_insert(disks, 
+                                g_strdup(partition->disk), 
+                                prescan_disk_new(partition->disk, reads));
+        }
+
+        fd = open(partition->device, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        heads[i] = prescan_read_new(reads, 
+                                    fd, 
+                                    0, 
+                                    partition->size ? MIN(partition->size, SUPERBLOCK_SCAN_SIZE) 
+                                                    : SUPERBLOCK_SCAN_SIZE);
+    }
+    prescan_read_all(reads, 0);
+
+    from = reads->len;
+    g_hash_table_iter_init(&iter, disks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&disk))
+        prescan_disk_parse_table(disk, reads);
+    prescan_read_all(reads, from);
+
+    /* backwards, removing keeps the order of the rest */
+    for (i = partitions->len; i-- > 0;) {
+        partition = g_ptr_array_index(partitions, i);
+        if (partition->number && partition->disk) {
+            g_free(partition->type);
+            partition->type = prescan_disk_get_type(g_hash_table_lookup(disks, partition->disk),
+                                                    partition->number);
+            if (partition->partuuid == NULL) {
+                partition->partuuid = prescan_disk_get_partuuid(g_hash_table_lookup(disks, partition->disk),
+                                                                partition->number);
+            }
+        }
+
+        if (heads[i] && heads[i]->done > 0) {
+            superblock_parse(heads[i]->fd, heads[i]->buf, heads[i]->done, &partition->superblock);
+            partition->scanned = TRUE;
+        }
+        if (heads[i])
+            close(heads[i]->fd);
+
+        if (!prescan_is_candidate(partition, heads[i], &reason)) {
+#ifdef DEBUG
+            g_print("DEBUG: %s skipped: %s\n", partition->device, reason);
+#endif
+            g_ptr_array_remove_index(partitions, i);
+        }
+    }
+
+    g_free(heads);
+    g_hash_table_destroy(disks);
+    g_ptr_array_free(reads, TRUE);
+
+    trace_span("engine", "prescan", start, NULL);
+}
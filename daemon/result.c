@@ -0,0 +1,443 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+
+#include "result.h"
+
+/* One OS found by a prober, the strings in the arena of its table */
+typedef struct {
+    const gchar *part;      /* /dev/sda1, /dev/sda1@/EFI/... for EFI */
+    const gchar *name;      /* Debian GNU/Linux 9 (stretch) */
+    const gchar *shortname; /* Debian */
+    const gchar *type;      /* linux, chain, efi, macosx, ... */
+    const gchar *device;    /* part without the path of a boot loader */
+    const gchar *partition; /* sda1, NULL when not known */
+    const gchar *partuuid;  /* NULL when not known */
+    gint next;              /* next of the same partition, -1 if last */
+} Result;
+
+/* The records live in one array, the strings in one arena, neither is
+ * freed until the table is.  The device, the name of the partition and
+ * its PARTUUID all map to the first record of the partition, the others
+ * follow by index.
+ */
+struct ResultTable {
+    GStringChunk *arena;
+    GArray *records;
+    GHashTable *index;
+    guint live;
+};
+
+/* Records of a partition removed are dead, they are dropped once they
+ * outnumber the live ones by that much.
+ */
+#define RESULT_TABLE_SLACK 64
+
+ResultTable *
+result_table_new()
+{
+    ResultTable *table = g_new0(ResultTable, 1);
+
+    table->arena = g_string_chunk_new(4096);
+    table->records = g_array_new(FALSE, FALSE, sizeof(Result));
+    table->index = g_hash_table_new(g_str_hash, g_str_equal);
+
+    return table;
+}
+
+void
+result_table_free(ResultTable *table)
+{
+    if (table == NULL)
+        return;
+
+    g_hash_table_destroy(table->index);
+    g_array_free(table->records, TRUE);
+    g_string_chunk_free(table->arena);
+    g_free(table);
+}
+
+static Result *
+result_table_record(ResultTable *table, gint i)
+{
+    return &g_array_index(table->records, Result, i);
+}
+
+static void
+result_table_index(ResultTable *table, const gchar *key, gint i)
+{
+    if (key && *key)
+        g_hash_table_insert(table->index, (gpointer)key, GINT_TO_POINTER(i + 1));
+}
+
+static gint
+result_table_first(ResultTable *table, const gchar *key)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(table->index, key)) - 1;
+}
+
+/* Append a record whose strings are in the arena already */
+static void
+result_table_append(ResultTable *table, Result *result)
+{
+    gint i = table->records->len;
+    gint first = result_table_first(table, result->device);
+
+    result->next = -1;
+    g_array_append_vals(table->records, result, 1);
+    table->live++;
+
+    if (first < 0) {
+        result_table_index(table, result->device, i);
+        result_table_index(table, result->partition, i);
+        result_table_index(table, result->partuuid, i);
+        return;
+    }
+
+    /* a partition has a few records, found in order */
+    while (result_table_record(table, first)->next >= 0)
+        first = result_table_record(table, first)->next;
+    result_table_record(table, first)->next = i;
+}
+
+static GVariant *
+result_to_variant(const Result *result)
+{
+    return g_variant_new("(ssss)", result->part, result->name, result->shortname, result->type);
+}
+
+/* One line of prober output, "part:name:shortname:type", copied once
+ * into the arena and cut there.  A missing field is empty.  Returns the
+ * (ssss) record, NULL for an empty line.
+ */
+GVariant *
+result_table_add_line(ResultTable *table, 
+                      const gchar *line, 
+                      const gchar *partition, 
+                      const gchar *partuuid)
+{
+    Result result = { "", "", "", "", NULL, NULL, NULL, -1 };
+    const gchar **fields[] = { &result.part, &result.name, &result.shortname, &result.type };
+    gchar *copy;
+    gchar *p;
+    gchar *at;
+    guint i;
+
+    if (*line == '\0')
+        return NULL;
+
+    copy = g_string_chunk_insert(table->arena, line);
+    p = copy;
+    for (i = 0; i < G_N_ELEMENTS(fields) && p; i++) {
+        *fields[i] = p;
+        p = strchr(p, ':');
+        /* the type is the rest of the line */
+        if (p && i + 1 < G_N_ELEMENTS(fields))
+            *p++ = '\0';
+        else
+            p = NULL;
+    }
+
+    at = strchr(result.part, '@');
+    result.device = at ? g_string_chunk_insert_len(table->arena, result.part, at - result.part) 
+                       : result.part;
+    result.partition = partition ? g_string_chunk_insert_const(table->arena, partition) : NULL;
+    result.partuuid = partuuid ? g_string_chunk_insert_const(table->arena, partuuid) : NULL;
+    result_table_append(table, &result);
+
+    return g_variant_ref_sink(result_to_variant(&result));
+}
+
+/* A (ssss) record of a partition, as another table or the cache has it */
+void
+result_table_add(ResultTable *table, 
+                 GVariant    *record, 
+                 const gchar *partition, 
+                 const gchar *partuuid)
+{
+    Result result = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, -1 };
+    const gchar *part, *name, *shortname, *type;
+    const gchar *at;
+
+    g_variant_get(record, "(&s&s&s&s)", &part, &name, &shortname, &type);
+    result.part = g_string_chunk_insert(table->arena, part);
+    result.name = g_string_chunk_insert(table->arena, name);
+    result.shortname = g_string_chunk_insert_const(table->arena, shortname);
+    result.type = g_string_chunk_insert_const(table->arena, type);
+    at = strchr(result.part, '@');
+    result.device = at ? g_string_chunk_insert_len(table->arena, result.part, at - result.part) 
+                       : result.part;
+    result.partition = partition ? g_string_chunk_insert_const(table->arena, partition) : NULL;
+    result.partuuid = partuuid ? g_string_chunk_insert_const(table->arena, partuuid) : NULL;
+    result_table_append(table, &result);
+}
+
+/* Copy the live records to a new arena, the dead ones are gone */
+static void
+result_table_compact(ResultTable *table)
+{
+    ResultTable *fresh = result_table_new();
+    GHashTableIter iter;
+    gpointer value;
+    GHashTable *firsts;
+    Result *result;
+    GVariant *record;
+    gint i;
+
+    /* the keys of a partition share its first record */
+    firsts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_iter_init(&iter, table->index);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        g_hash_table_add(firsts, value);
+
+    g_hash_table_iter_init(&iter, firsts);
+    while (g_hash_table_iter_next(&iter, &value, NULL)) {
+        for (i = GPOINTER_TO_INT(value) - 1; i >= 0; i = result->next) {
+            result = result_table_record(table, i);
+            record = g_variant_ref_sink(result_to_variant(result));
+            result_table_add(fresh, record, result->partition, result->partuuid);
+            g_variant_unref(record);
+        }
+    }
+    g_hash_table_destroy(firsts);
+
+    g_hash_table_destroy(table->index);
+    g_array_free(table->records, TRUE);
+    g_string_chunk_free(table->arena);
+    *table = *fresh;
+    g_free(fresh);
+}
+
+/* Forget what a partition holds, by any of its keys */
+void
+result_table_remove(ResultTable *table, const gchar *key)
+{
+    Result *result;
+    gint i = result_table_first(table, key);
+
+    if (i < 0)
+        return;
+
+    result = result_table_record(table, i);
+    g_hash_table_remove(table->index, result->device);
+    if (result->partition)
+        g_hash_table_remove(table->index, result->partition);
+    if (result->partuuid)
+        g_hash_table_remove(table->index, result->partuuid);
+    for (; i >= 0; i = result_table_record(table, i)->next)
+        table->live--;
+
+    if (table->records->len - table->live > table->live + RESULT_TABLE_SLACK)
+        result_table_compact(table);
+}
+
+/* The records of a partition, given its device (/dev/sda1), its name
+ * (sda1) or its PARTUUID, as a(ssss).  NULL when none is known.
+ */
+GVariant *
+result_table_lookup(ResultTable *table, const gchar *key)
+{
+    GVariantBuilder builder;
+    gint i = result_table_first(table, key);
+
+    if (i < 0)
+        return NULL;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    for (; i >= 0; i = result_table_record(table, i)->next)
+        g_variant_builder_add_value(&builder, result_to_variant(result_table_record(table, i)));
+
+    return g_variant_ref_sink(g_variant_builder_end(&builder));
+}
+
+/* The part holding every label */
+struct ResultLabels {
+    GHashTable *owners;
+};
+
+ResultLabels *
+result_labels_new()
+{
+    ResultLabels *labels = g_new0(ResultLabels, 1);
+
+    labels->owners = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    return labels;
+}
+
+void
+result_labels_free(ResultLabels *labels)
+{
+    if (labels == NULL)
+        return;
+
+    g_hash_table_destroy(labels->owners);
+    g_free(labels);
+}
+
+/* Whether label is shortname, numbered or not */
+static gboolean
+result_label_is_of(const gchar *label, const gchar *shortname)
+{
+    const gchar *p;
+
+    if (!g_str_has_prefix(label, shortname))
+        return FALSE;
+
+    for (p = label + strlen(shortname); *p; p++) {
+        if (!g_ascii_isdigit(*p))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* The (ssss) record with its short name numbered: the label the part
+ * holds already, or else the first one nobody holds, which the part
+ * holds from now on.
+ */
+GVariant *
+result_labels_number(ResultLabels *labels, GVariant *record)
+{
+    const gchar *part, *name, *shortname, *type;
+    GHashTableIter iter;
+    gpointer label, owner;
+    guint count;
+
+    g_variant_get(record, "(&s&s&s&s)", &part, &name, &shortname, &type);
+    if (*shortname == '\0')
+        return g_variant_ref(record);
+
+    g_hash_table_iter_init(&iter, labels->owners);
+    while (g_hash_table_iter_next(&iter, &label, &owner)) {
+        if (strcmp(owner, part) == 0 && result_label_is_of(label, shortname))
+            return g_variant_ref_sink(g_variant_new("(ssss)", part, name, label, type));
+    }
+
+    /* the table is finite, one of them is free */
+    for (count = 0; ; count++) {
+        label = count ? g_strdup_printf("%s%u", shortname, count) : g_strdup(shortname);
+        if (!g_hash_table_contains(labels->owners, label))
+            break;
+        g_free(label);
+    }
+    g_hash_table_insert(labels->owners, label, g_strdup(part));
+
+    return g_variant_ref_sink(g_variant_new("(ssss)", part, name, label, type));
+}
+
+/* Have the part of a numbered record hold its label */
+void
+result_labels_hold(ResultLabels *labels, GVariant *record)
+{
+    const gchar *part, *label;
+
+    g_variant_get(record, "(&s&s&s&s)", &part, NULL, &label, NULL);
+    g_hash_table_replace(labels->owners, g_strdup(label), g_strdup(part));
+}
+
+/* Give the label of a numbered record back, for the next to take */
+void
+result_labels_release(ResultLabels *labels, GVariant *record)
+{
+    const gchar *part, *label;
+
+    g_variant_get(record, "(&s&s&s&s)", &part, NULL, &label, NULL);
+    if (g_strcmp0(g_hash_table_lookup(labels->owners, label), part) == 0)
+        g_hash_table_remove(labels->owners, label);
+}
+
+/* Where the device of a part comes in the order, G_MAXUINT if nowhere */
+static guint
+result_labels_rank(GHashTable *ranks, const gchar *part, gchar **device)
+{
+    gpointer rank;
+
+    *device = g_strndup(part, strcspn(part, "@"));
+    if (!g_hash_table_lookup_extended(ranks, *device, NULL, &rank))
+        return G_MAXUINT;
+
+    return GPOINTER_TO_UINT(rank);
+}
+
+static gint
+result_labels_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const gchar *part_a, *part_b;
+    gchar *device_a, *device_b;
+    guint rank_a, rank_b;
+    gint ret;
+
+    g_variant_get_child(*(GVariant * const *)a, 0, "&s", &part_a);
+    g_variant_get_child(*(GVariant * const *)b, 0, "&s", &part_b);
+    rank_a = result_labels_rank(user_data, part_a, &device_a);
+    rank_b = result_labels_rank(user_data, part_b, &device_b);
+    if (rank_a != rank_b)
+        ret = rank_a < rank_b ? -1 : 1;
+    else if (rank_a == G_MAXUINT)
+        ret = g_strcmp0(device_a, device_b);
+    else
+        ret = 0;
+    g_free(device_a);
+    g_free(device_b);
+
+    return ret;
+}
+
+/* The a(ssss) records, in no order, numbered as a scan going through
+ * devices in order would number them: the records of a device in the
+ * order they come, those of a device not in devices after all the
+ * others.  Returns a floating a(ssss).
+ */
+GVariant *
+result_labels_number_all(ResultLabels *labels, GVariant *records, GPtrArray *devices)
+{
+    GVariantBuilder builder;
+    GHashTable *ranks;
+    GPtrArray *sorted;
+    GVariant *record;
+    gsize n;
+    guint i;
+
+    ranks = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; devices && i < devices->len; i++) {
+        if (!g_hash_table_contains(ranks, g_ptr_array_index(devices, i)))
+            g_hash_table_insert(ranks, g_ptr_array_index(devices, i), GUINT_TO_POINTER(i));
+    }
+
+    n = g_variant_n_children(records);
+    sorted = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    for (i = 0; i < n; i++)
+        g_ptr_array_add(sorted, g_variant_get_child_value(records, i));
+    /* a stable sort, the records of a device keep their order */
+    g_ptr_array_sort_with_data(sorted, result_labels_compare, ranks);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    for (i = 0; i < sorted->len; i++) {
+        record = result_labels_number(labels, g_ptr_array_index(sorted, i));
+        g_variant_builder_add_value(&builder, record);
+        g_variant_unref(record);
+    }
+    g_ptr_array_free(sorted, TRUE);
+    g_hash_table_destroy(ranks);
+
+    return g_variant_builder_end(&builder);
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __RESULT_H__
+#define __RESULT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The OSes found by a scan, or known by the daemon, indexed by the
+ * partition they are on.  Not locked, one thread at a time.
+ */
+typedef struct ResultTable ResultTable;
+
+ResultTable *result_table_new     ();
+void         result_table_free    (ResultTable *table);
+GVariant    *result_table_add_line(ResultTable *table,
+                                   const gchar *line,
+                                   const gchar *partition,
+                                   const gchar *partuuid);
+void         result_table_add     (ResultTable *table,
+                                   GVariant    *record,
+                                   const gchar *partition,
+                                   const gchar *partuuid);
+void         result_table_remove  (ResultTable *table,
+                                   const gchar *key);
+GVariant    *result_table_lookup  (ResultTable *table,
+                                   const gchar *key);
+
+/* The short names handed out, numbered as os-prober numbers them: the
+ * first Debian is labelled Debian, the next Debian1, Debian2...  A part
+ * keeps its label for as long as it is held, whatever the order the
+ * parts are found in.  Not locked either.
+ */
+typedef struct ResultLabels ResultLabels;
+
+ResultLabels *result_labels_new    ();
+void          result_labels_free   (ResultLabels *labels);
+GVariant     *result_labels_number (ResultLabels *labels,
+                                    GVariant     *record);
+void          result_labels_hold   (ResultLabels *labels,
+                                    GVariant     *record);
+void          result_labels_release(ResultLabels *labels,
+                                    GVariant     *record);
+GVariant     *result_labels_number_all(ResultLabels *labels,
+                                       GVariant     *records,
+                                       GPtrArray    *devices);
+
+G_END_DECLS
+
+#endif /* __RESULT_H__ */
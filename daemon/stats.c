@@ -0,0 +1,226 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <sys/resource.h>
+
+#include "stats.h"
+
+/* Upper bounds of the duration buckets, in milliseconds */
+static const guint64 stats_buckets[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, G_MAXUINT64
+};
+
+static const gchar * const stats_phase_names[ENGINE_N_PHASES] = {
+    "spawn",
+    "mount",
+    "detect",
+    "umount",
+};
+
+struct StatsPrivate {
+    GMutex lock;
+    guint64 probe_count;
+    guint in_flight;
+    guint64 histogram[G_N_ELEMENTS(stats_buckets)];
+    GHashTable *partitions;
+    gint64 phases[ENGINE_N_PHASES];
+    gint64 io_stall;
+    gint64 cpu_stall;
+    guint publish_source;
+};
+
+G_DEFINE_TYPE(Stats, stats, OSPROBER_TYPE_OSPROBER_STATS_SKELETON);
+
+#define STATS_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE((o), TYPE_STATS, StatsPrivate))
+
+static void
+stats_init(Stats *stats)
+{
+    stats->priv = STATS_GET_PRIVATE(stats);
+    g_mutex_init(&stats->priv->lock);
+    stats->priv->partitions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+stats_finalize(GObject *object)
+{
+    Stats *stats = NULL;
+
+    g_return_if_fail(IS_STATS(object));
+    stats = STATS(object);
+    if (stats->priv->publish_source) {
+        g_source_remove(stats->priv->publish_source);
+        stats->priv->publish_source = 0;
+    }
+    g_hash_table_destroy(stats->priv->partitions);
+    g_mutex_clear(&stats->priv->lock);
+
+    G_OBJECT_CLASS(stats_parent_class)->finalize(object);
+}
+
+static void
+stats_class_init(StatsClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = stats_finalize;
+
+    g_type_class_add_private(klass, sizeof(StatsPrivate));
+}
+
+/* Exported on the object of the daemon, as a second interface */
+Stats *
+stats_new(GDBusConnection *connection,
+          const gchar     *object_path,
+          GError         **error)
+{
+    Stats *stats = STATS(g_object_new(TYPE_STATS, NULL));
+
+    if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(stats),
+                                          connection,
+                                          object_path,
+                                          error)) {
+        g_object_unref(stats);
+        stats = NULL;
+        return NULL;
+    }
+
+    return stats;
+}
+
+/* Copy the counters to the properties, in the main loop */
+static gboolean
+stats_publish(gpointer data)
+{
+    Stats *stats = STATS(data);
+    OSProberOSProberStats *object = OSPROBER_OSPROBER_STATS(stats);
+    GVariantBuilder histogram;
+    GVariantBuilder partitions;
+    GVariantBuilder phases;
+    GHashTableIter iter;
+    const gchar *device;
+    gint64 *usec;
+    struct rusage usage;
+    guint i;
+
+    g_variant_builder_init(&histogram, G_VARIANT_TYPE("a(tt)"));
+    g_variant_builder_init(&partitions, G_VARIANT_TYPE("a{sd}"));
+    g_variant_builder_init(&phases, G_VARIANT_TYPE("a{sd}"));
+
+    g_mutex_lock(&stats->priv->lock);
+    stats->priv->publish_source = 0;
+    osprober_osprober_stats_set_probe_count(object, stats->priv->probe_count);
+    osprober_osprober_stats_set_in_flight(object, stats->priv->in_flight);
+    osprober_osprober_stats_set_iostall_time(object, stats->priv->io_stall / (gdouble)G_USEC_PER_SEC);
+    osprober_osprober_stats_set_cpustall_time(object, stats->priv->cpu_stall / (gdouble)G_USEC_PER_SEC);
+    for (i = 0; i < G_N_ELEMENTS(stats_buckets); i++)
+        g_variant_builder_add(&histogram, "(tt)", stats_buckets[i], stats->priv->histogram[i]);
+    g_hash_table_iter_init(&iter, stats->priv->partitions);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&device, (gpointer *)&usec))
+        g_variant_builder_add(&partitions, "{sd}", device, *usec / (gdouble)G_USEC_PER_SEC);
+    for (i = 0; i < ENGINE_N_PHASES; i++) {
+        g_variant_builder_add(&phases, 
+                              "{sd}", 
+                              stats_phase_names[i], 
+                              stats->priv->phases[i] / (gdouble)G_USEC_PER_SEC);
+    }
+    g_mutex_unlock(&stats->priv->lock);
+
+    osprober_osprober_stats_set_duration_histogram(object, g_variant_builder_end(&histogram));
+    osprober_osprober_stats_set_partition_times(object, g_variant_builder_end(&partitions));
+    osprober_osprober_stats_set_phase_times(object, g_variant_builder_end(&phases));
+
+    /* only children which have been waited for, GLib reaps them all */
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0) {
+        osprober_osprober_stats_set_child_user_time(object, 
+                                                    usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+        osprober_osprober_stats_set_child_system_time(object, 
+                                                      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+        osprober_osprober_stats_set_child_max_rss(object, usage.ru_maxrss);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Called with the lock held, a burst of updates is published once */
+static void
+stats_changed(Stats *stats)
+{
+    if (stats->priv->publish_source == 0)
+        stats->priv->publish_source = g_idle_add(stats_publish, stats);
+}
+
+void
+stats_probe_started(Stats *stats)
+{
+    g_mutex_lock(&stats->priv->lock);
+    stats->priv->in_flight++;
+    stats_changed(stats);
+    g_mutex_unlock(&stats->priv->lock);
+}
+
+void
+stats_probe_finished(Stats *stats, gint64 usec)
+{
+    guint64 msec = usec / 1000;
+    guint i;
+
+    g_mutex_lock(&stats->priv->lock);
+    stats->priv->in_flight--;
+    stats->priv->probe_count++;
+    for (i = 0; msec > stats_buckets[i]; i++)
+        ;
+    stats->priv->histogram[i]++;
+    stats_changed(stats);
+    g_mutex_unlock(&stats->priv->lock);
+}
+
+void
+stats_partition(Stats *stats, const gchar *device, gint64 usec)
+{
+    gint64 *value = g_new(gint64, 1);
+
+    *value = usec;
+    g_mutex_lock(&stats->priv->lock);
+    g_hash_table_replace(stats->priv->partitions, g_strdup(device), value);
+    stats_changed(stats);
+    g_mutex_unlock(&stats->priv->lock);
+}
+
+void
+stats_phase(Stats *stats, EnginePhase phase, gint64 usec)
+{
+    g_return_if_fail(phase < ENGINE_N_PHASES);
+
+    g_mutex_lock(&stats->priv->lock);
+    stats->priv->phases[phase] += usec;
+    stats_changed(stats);
+    g_mutex_unlock(&stats->priv->lock);
+}
+
+void
+stats_stalls(Stats *stats, gint64 io_usec, gint64 cpu_usec)
+{
+    g_mutex_lock(&stats->priv->lock);
+    stats->priv->io_stall += io_usec;
+    stats->priv->cpu_stall += cpu_usec;
+    stats_changed(stats);
+    g_mutex_unlock(&stats->priv->lock);
+}
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "types.h"
+#include "engine.h"
+#include "stats-generated.h"
+
+G_BEGIN_DECLS
+
+#define TYPE_STATS         (stats_get_type())
+#define STATS(o)           (G_TYPE_CHECK_INSTANCE_CAST((o), TYPE_STATS, Stats))
+#define STATS_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), TYPE_STATS, StatsClass))
+#define IS_STATS(o)        (G_TYPE_CHECK_INSTANCE_TYPE((o), TYPE_STATS))
+#define IS_STATS_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE((k), TYPE_STATS))
+#define STATS_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS((o), TYPE_STATS, StatsClass))
+
+typedef struct StatsClass StatsClass;
+typedef struct StatsPrivate StatsPrivate;
+
+struct Stats {
+    OSProberOSProberStatsSkeleton parent;
+    StatsPrivate *priv;
+};
+
+struct StatsClass {
+    OSProberOSProberStatsSkeletonClass parent_class;
+};
+
+GType    stats_get_type       (void) G_GNUC_CONST;
+Stats   *stats_new            (GDBusConnection *connection,
+                               const gchar     *object_path,
+                               GError         **error);
+
+/* safe to call from any thread, the properties follow in the main loop */
+
+void     stats_probe_started  (Stats           *stats);
+void     stats_probe_finished (Stats           *stats,
+                               gint64           usec);
+void     stats_partition      (Stats           *stats,
+                               const gchar     *device,
+                               gint64           usec);
+void     stats_phase          (Stats           *stats,
+                               EnginePhase      phase,
+                               gint64           usec);
+void     stats_stalls         (Stats           *stats,
+                               gint64           io_usec,
+                               gint64           cpu_usec);
+
+G_END_DECLS
+
+#endif /* __STATS_H__ */
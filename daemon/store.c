@@ -0,0 +1,412 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "diskio.h"
+#include "store.h"
+
+#define HEADER_SIZE     48
+#define ENTRY_SIZE      32
+#define RESULT_SIZE     16
+
+#define ENTRY_VALID     (1 << 0)
+
+struct Store {
+    GMappedFile *file;
+    const guint8 *entries;
+    const guint8 *results;
+    const gchar *strings;
+    guint32 n_entries;
+    guint32 n_results;
+    guint32 strings_size;
+};
+
+typedef struct {
+    guint32 hash;
+    guint32 key;
+    guint32 device;
+    guint32 flags;
+    guint64 generation;
+    guint32 first_result;
+    guint32 n_results;
+} WriterEntry;
+
+struct StoreWriter {
+    GString *strings;
+    GHashTable *offsets;
+    GArray *entries;
+    GArray *results;
+};
+
+/* FNV-1a, the hash is part of the file format and must not change */
+static guint32
+store_hash(const gchar *key)
+{
+    guint32 hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (guchar)*key;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static gboolean
+store_range_ok(gsize length, guint32 offset, guint32 count, guint32 size)
+{
+    return (guint64)offset + (guint64)count * size <= length;
+}
+
+/* Map the file and check that every table lies within it, the entries
+ * themselves are checked when they are read.
+ */
+Store *
+store_open(const gchar *path)
+{
+    GMappedFile *file;
+    const guint8 *data;
+    gsize length;
+    guint32 entries_offset, results_offset, strings_offset;
+    Store *store;
+
+    file = g_mapped_file_new(path, FALSE, NULL);
+    if (file == NULL)
+        return NULL;
+
+    data = (const guint8 *)g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+    if (length < HEADER_SIZE ||
+        memcmp(data, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0 ||
+        get_le32(data + 8) != STORE_VERSION) {
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+
+    store = g_new0(Store, 1);
+    store->file = file;
+    store->n_entries = get_le32(data + 12);
+    store->n_results = get_le32(data + 16);
+    store->strings_size = get_le32(data + 20);
+    entries_offset = get_le32(data + 24);
+    results_offset = get_le32(data + 28);
+    strings_offset = get_le32(data + 32);
+
+    if (!store_range_ok(length, entries_offset, store->n_entries, ENTRY_SIZE) ||
+        !store_range_ok(length, results_offset, store->n_results, RESULT_SIZE) ||
+        !store_range_ok(length, strings_offset, store->strings_size, 1) ||
+        store->strings_size == 0 ||
+        data[strings_offset + store->strings_size - 1] != '\0') {
+        store_free(store);
+        return NULL;
+    }
+
+    store->entries = data + entries_offset;
+    store->results = data + results_offset;
+    store->strings = (const gchar *)data + strings_offset;
+
+    return store;
+}
+
+void
+store_free(Store *store)
+{
+    if (store == NULL)
+        return;
+
+    g_mapped_file_unref(store->file);
+    g_free(store);
+}
+
+guint
+store_get_n_entries(Store *store)
+{
+    return store->n_entries;
+}
+
+static const gchar *
+store_string(Store *store, guint32 offset)
+{
+    const gchar *str;
+
+    if (offset >= store->strings_size)
+        return NULL;
+
+    str = store->strings + offset;
+
+    return g_utf8_validate(str, -1, NULL) ? str : NULL;
+}
+
+static GPtrArray *
+store_entry_results(Store *store, const guint8 *entry)
+{
+    GPtrArray *results;
+    const guint8 *result;
+    const gchar *fields[4];
+    guint32 first = get_le32(entry + 24);
+    guint32 count = get_le32(entry + 28);
+    guint32 i, j;
+
+    results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    if ((guint64)first + count > store->n_results)
+        return results;
+
+    for (i = 0; i < count; i++) {
+        result = store->results + (gsize)(first + i) * RESULT_SIZE;
+        for (j = 0; j < 4; j++) {
+            fields[j] = store_string(store, get_le32(result + j * 4));
+            if (fields[j] == NULL)
+                break;
+        }
+        if (j < 4)
+            continue;
+        g_ptr_array_add(results, 
+                        g_variant_ref_sink(g_variant_new("(ssss)", 
+                                                         fields[0], 
+                                                         fields[1], 
+                                                         fields[2], 
+                                                         fields[3])));
+    }
+
+    return results;
+}
+
+/* Binary search on (hash, key), straight in the mapping */
+gboolean
+store_lookup(Store        *store,
+             const gchar  *key,
+             const gchar **device,
+             guint64      *generation,
+             gboolean     *valid,
+             GPtrArray   **results)
+{
+    guint32 hash = store_hash(key);
+    guint32 low = 0, high = store->n_entries, mid;
+    const guint8 *entry;
+    const gchar *entry_key;
+    gint cmp;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        entry = store->entries + (gsize)mid * ENTRY_SIZE;
+        if (get_le32(entry) != hash) {
+            cmp = get_le32(entry) < hash ? -1 : 1;
+        } else {
+            entry_key = store_string(store, get_le32(entry + 4));
+            if (entry_key == NULL)
+                return FALSE;
+            cmp = strcmp(entry_key, key);
+        }
+
+        if (cmp == 0) {
+            *device = store_string(store, get_le32(entry + 8));
+            if (*device == NULL)
+                return FALSE;
+            *generation = get_le64(entry + 16);
+            *valid = (get_le32(entry + 12) & ENTRY_VALID) != 0;
+            *results = store_entry_results(store, entry);
+            return TRUE;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return FALSE;
+}
+
+void
+store_foreach(Store *store, StoreFunc func, gpointer user_data)
+{
+    const guint8 *entry;
+    const gchar *key;
+    GPtrArray *results;
+    guint32 i;
+
+    for (i = 0; i < store->n_entries; i++) {
+        entry = store->entries + (gsize)i * ENTRY_SIZE;
+        key = store_string(store, get_le32(entry + 4));
+        if (key == NULL)
+            continue;
+        results = store_entry_results(store, entry);
+        func(key, results, user_data);
+        g_ptr_array_unref(results);
+    }
+}
+
+StoreWriter *
+store_writer_new()
+{
+    StoreWriter *writer = g_new0(StoreWriter, 1);
+
+    writer->strings = g_string_new(NULL);
+    writer->offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    writer->entries = g_array_new(FALSE, TRUE, sizeof(WriterEntry));
+    writer->results = g_array_new(FALSE, TRUE, sizeof(guint32));
+
+    return writer;
+}
+
+void
+store_writer_free(StoreWriter *writer)
+{
+    if (writer == NULL)
+        return;
+
+    g_string_free(writer->strings, TRUE);
+    g_hash_table_destroy(writer->offsets);
+    g_array_free(writer->entries, TRUE);
+    g_array_free(writer->results, TRUE);
+    g_free(writer);
+}
+
+static guint32
+store_writer_string(StoreWriter *writer, const gchar *str)
+{
+    gpointer offset;
+    guint32 ret;
+
+    if (g_hash_table_lookup_extended(writer->offsets, str, NULL, &offset))
+        return GPOINTER_TO_UINT(offset);
+
+    ret = writer->strings->len;
+    g_string_append_len(writer->strings, str, strlen(str) + 1);
+    g_hash_table_insert(writer->offsets, g_strdup(str), GUINT_TO_POINTER(ret));
+
+    return ret;
+}
+
+void
+store_writer_add(StoreWriter *writer,
+                 const gchar *key,
+                 const gchar *device,
+                 guint64      generation,
+                 gboolean     valid,
+                 GPtrArray   *results)
+{
+    WriterEntry entry;
+    const gchar *fields[4];
+    guint32 offset;
+    guint i, j;
+
+    entry.hash = store_hash(key);
+    entry.key = store_writer_string(writer, key);
+    entry.device = store_writer_string(writer, device);
+    entry.flags = valid ? ENTRY_VALID : 0;
+    entry.generation = generation;
+    entry.first_result = writer->results->len / 4;
+    entry.n_results = results->len;
+
+    for (i = 0; i < results->len; i++) {
+        g_variant_get(g_ptr_array_index(results, i), "(&s&s&s&s)", 
+                      &fields[0], &fields[1], &fields[2], &fields[3]);
+        for (j = 0; j < 4; j++) {
+            offset = store_writer_string(writer, fields[j]);
+            g_array_append_val(writer->results, offset);
+        }
+    }
+
+    g_array_append_val(writer->entries, entry);
+}
+
+static gint
+compare_entries(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const WriterEntry *ea = a;
+    const WriterEntry *eb = b;
+    const gchar *strings = user_data;
+
+    if (ea->hash != eb->hash)
+        return ea->hash < eb->hash ? -1 : 1;
+
+    return strcmp(strings + ea->key, strings + eb->key);
+}
+
+static void
+append_le32(GByteArray *data, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    g_byte_array_append(data, (const guint8 *)&value, sizeof(value));
+}
+
+static void
+append_le64(GByteArray *data, guint64 value)
+{
+    value = GUINT64_TO_LE(value);
+    g_byte_array_append(data, (const guint8 *)&value, sizeof(value));
+}
+
+/* Written next to the target and renamed over it, so the daemon never
+ * maps a half-written file.
+ */
+gboolean
+store_writer_save(StoreWriter *writer, const gchar *path, GError **error)
+{
+    GByteArray *data;
+    WriterEntry *entry;
+    guint8 reserved[12] = { 0 };
+    guint32 n_results = writer->results->len / 4;
+    guint32 entries_offset = HEADER_SIZE;
+    guint32 results_offset = entries_offset + writer->entries->len * ENTRY_SIZE;
+    guint32 strings_offset = results_offset + n_results * RESULT_SIZE;
+    gboolean ret;
+    guint i;
+
+    /* an empty string table would not pass store_open() */
+    if (writer->strings->len == 0)
+        g_string_append_c(writer->strings, '\0');
+
+    g_array_sort_with_data(writer->entries, compare_entries, writer->strings->str);
+
+    data = g_byte_array_new();
+    g_byte_array_append(data, (const guint8 *)STORE_MAGIC, sizeof(STORE_MAGIC));
+    append_le32(data, STORE_VERSION);
+    append_le32(data, writer->entries->len);
+    append_le32(data, n_results);
+    append_le32(data, writer->strings->len);
+    append_le32(data, entries_offset);
+    append_le32(data, results_offset);
+    append_le32(data, strings_offset);
+    g_byte_array_append(data, reserved, sizeof(reserved));
+
+    for (i = 0; i < writer->entries->len; i++) {
+        entry = &g_array_index(writer->entries, WriterEntry, i);
+        append_le32(data, entry->hash);
+        append_le32(data, entry->key);
+        append_le32(data, entry->device);
+        append_le32(data, entry->flags);
+        append_le64(data, entry->generation);
+        append_le32(data, entry->first_result);
+        append_le32(data, entry->n_results);
+    }
+
+    for (i = 0; i < writer->results->len; i++)
+        append_le32(data, g_array_index(writer->results, guint32, i));
+
+    g_byte_array_append(data, (const guint8 *)writer->strings->str, writer->strings->len);
+
+    ret = g_file_set_contents(path, (const gchar *)data->data, data->len, error);
+    g_byte_array_unref(data);
+
+    return ret;
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* On-disk copy of the result cache: a versioned little-endian file,
+ * memory-mapped and looked up in place.  Strings are referenced by their
+ * offset in the string table, integers are 32 bits unless said.
+ *
+ *   header   48 bytes: STORE_MAGIC with its NUL at 0, the version at 8,
+ *            n_entries at 12, n_results at 16, the size of the strings
+ *            at 20, the offsets of entries, results and strings at 24,
+ *            28 and 32, the rest is reserved
+ *   entries  n_entries x 32 bytes, sorted by (hash, key): the FNV-1a
+ *            hash of the key at 0, the key at 4, the device at 8, the
+ *            flags at 12, the 64-bit generation at 16, the first result
+ *            at 24 and how many at 28
+ *   results  n_results x 16 bytes: part, name, shortname and type
+ *   strings  NUL-terminated, the last byte of the table is a NUL
+ */
+#define STORE_MAGIC     "OSPRIDX"
+#define STORE_VERSION   2
+
+typedef struct Store Store;
+typedef struct StoreWriter StoreWriter;
+
+typedef void (*StoreFunc)(const gchar *key,
+                          GPtrArray   *results,
+                          gpointer     user_data);
+
+Store       *store_open         (const gchar *path);
+void         store_free         (Store       *store);
+guint        store_get_n_entries(Store       *store);
+gboolean     store_lookup       (Store       *store,
+                                 const gchar *key,
+                                 const gchar **device,
+                                 guint64     *generation,
+                                 gboolean    *valid,
+                                 GPtrArray  **results);
+void         store_foreach      (Store       *store,
+                                 StoreFunc    func,
+                                 gpointer     user_data);
+
+StoreWriter *store_writer_new   ();
+void         store_writer_add   (StoreWriter *writer,
+                                 const gchar *key,
+                                 const gchar *device,
+                                 guint64      generation,
+                                 gboolean     valid,
+                                 GPtrArray   *results);
+gboolean     store_writer_save  (StoreWriter *writer,
+                                 const gchar *path,
+                                 GError     **error);
+void         store_writer_free  (StoreWriter *writer);
+
+G_END_DECLS
+
+#endif /* __STORE_H__ */
@@ -0,0 +1,316 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "superblock.h"
+
+#define EXT_SUPERBLOCK      1024
+#define EXT_MAGIC           0xEF53
+#define BTRFS_SUPERBLOCK    65536
+#define BTRFS_MAGIC         "_BHRfS_M"
+#define XFS_MAGIC           "XFSB"
+#define NTFS_VOLUME_RECORD  3
+#define MD_MAGIC            0xa92b4efc
+
+static void
+format_uuid(gchar *uuid, const guint8 *p)
+{
+    g_snprintf(uuid, 37,
+               "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+               p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+               p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+}
+
+static void
+parse_ext(const guint8 *sb, Superblock *superblock)
+{
+    superblock->type = FS_EXT;
+    format_uuid(superblock->uuid, sb + 104);
+    /* s_mtime and s_wtime change on every mount and superblock write,
+     * s_kbytes_written on every write-back of it.
+     */
+    superblock->generation = ((guint64)get_le32(sb + 48) << 32 | get_le32(sb + 44)) ^
+                             get_le64(sb + 0x178);
+    superblock->has_generation = TRUE;
+}
+
+static void
+parse_xfs(const guint8 *sb, Superblock *superblock)
+{
+    superblock->type = FS_XFS;
+    format_uuid(superblock->uuid, sb + 32);
+    /* v5 filesystems stamp the superblock with the LSN of its last
+     * write, older ones only have the counters written back at unmount.
+     */
+    if ((get_be16(sb + 100) & 0xf) == 5) {
+        superblock->generation = get_be64(sb + 240);
+    } else {
+        superblock->generation = get_be64(sb + 128) ^
+                                 get_be64(sb + 136) << 21 ^
+                                 get_be64(sb + 144) << 42;
+    }
+    superblock->has_generation = TRUE;
+}
+
+static void
+parse_btrfs(const guint8 *sb, Superblock *superblock)
+{
+    superblock->type = FS_BTRFS;
+    format_uuid(superblock->uuid, sb + 0x20);
+    superblock->generation = get_le64(sb + 0x48);
+    superblock->has_generation = TRUE;
+}
+
+static void
+parse_vfat(const guint8 *sb, Superblock *superblock)
+{
+    guint32 serial;
+
+    superblock->type = FS_VFAT;
+    if (memcmp(sb + 0x52, "FAT32   ", 8) == 0)
+        serial = get_le32(sb + 0x43);
+    else
+        serial = get_le32(sb + 0x27);
+    g_snprintf(superblock->uuid, sizeof(superblock->uuid), "%04X-%04X",
+               serial >> 16, serial & 0xffff);
+    /* FAT has no write marker, such entries are probed every time */
+    superblock->has_generation = FALSE;
+}
+
+/* NTFS keeps no write counter in the boot sector, but Windows flags the
+ * $Volume file dirty on every mount and clean on shutdown, each time
+ * stamping its MFT record with a new $LogFile sequence number.
+ */
+static void
+parse_ntfs(gint fd, const guint8 *sb, Superblock *superblock)
+{
+    guint8 record[48];
+    guint32 cluster_size;
+    guint32 record_size;
+    guint8 sectors_per_cluster = sb[0x0D];
+    gint8 clusters_per_record = (gint8)sb[0x40];
+
+    superblock->type = FS_NTFS;
+    g_snprintf(superblock->uuid, sizeof(superblock->uuid), "%016" G_GINT64_MODIFIER "X",
+               get_le64(sb + 0x48));
+    superblock->has_generation = FALSE;
+
+    if (sectors_per_cluster > 0x80)
+        cluster_size = get_le16(sb + 0x0B) << (256 - sectors_per_cluster);
+    else
+        cluster_size = get_le16(sb + 0x0B) * sectors_per_cluster;
+    if (clusters_per_record > 0)
+        record_size = clusters_per_record * cluster_size;
+    else
+        record_size = 1u << -clusters_per_record;
+    if (cluster_size == 0 || record_size == 0)
+        return;
+
+    if (!disk_read(fd,
+                   get_le64(sb + 0x30) * cluster_size + NTFS_VOLUME_RECORD * record_size,
+                   record, sizeof(record), NULL)) {
+        return;
+    }
+    if (memcmp(record, "FILE", 4) != 0)
+        return;
+
+    superblock->generation = get_le64(record + 8);
+    superblock->has_generation = TRUE;
+}
+
+/* Signatures of what a partition may hold besides the filesystems
+ * parsed above: containers and swap, which never hold an OS by
+ * themselves, and filesystems os-prober may mount without their UUID
+ * or write marker being of any use here.
+ */
+static gboolean
+has_bytes(const guint8 *buf, gsize len, gsize offset, const gchar *magic, gsize size)
+{
+    return offset + size <= len && memcmp(buf + offset, magic, size) == 0;
+}
+
+static gboolean
+has_le32(const guint8 *buf, gsize len, gsize offset, guint32 magic)
+{
+    return offset + 4 <= len && get_le32(buf + offset) == magic;
+}
+
+static gboolean
+is_swap_area(const guint8 *buf, gsize len)
+{
+    static const gsize page_sizes[] = { 4096, 8192, 16384, 65536 };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(page_sizes); i++) {
+        if (has_bytes(buf, len, page_sizes[i] - 10, "SWAPSPACE2", 10) ||
+            has_bytes(buf, len, page_sizes[i] - 10, "SWAP-SPACE", 10))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+is_lvm_member(const guint8 *buf, gsize len)
+{
+    guint sector;
+
+    /* the label sits in any of the first four sectors */
+    for (sector = 0; sector < 4; sector++) {
+        if (has_bytes(buf, len, sector * 512, "LABELONE", 8) &&
+            has_bytes(buf, len, sector * 512 + 24, "LVM2 001", 8))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+is_other_fs(const guint8 *buf, gsize len)
+{
+    return has_bytes(buf, len, 3, "EXFAT   ", 8) ||
+           has_bytes(buf, len, 0, "hsqs", 4) ||
+           has_bytes(buf, len, 32, "NXSB", 4) ||
+           has_le32(buf, len, 1024, 0xF2F52010) ||         /* f2fs */
+           has_le32(buf, len, 1024, 0xE0F5E1E2) ||         /* erofs */
+           has_bytes(buf, len, 1024, "H+", 2) ||
+           has_bytes(buf, len, 1024, "HX", 2) ||
+           has_bytes(buf, len, 1024, "BD", 2) ||
+           has_bytes(buf, len, 32768, "JFS1", 4) ||
+           has_bytes(buf, len, 32769, "CD001", 5) ||
+           has_bytes(buf, len, 32769, "BEA01", 5) ||
+           has_bytes(buf, len, 8192 + 52, "ReIsEr", 6) ||
+           has_bytes(buf, len, 65536 + 52, "ReIsEr", 6) ||
+           has_le32(buf, len, 8192 + 1372, 0x00011954) ||  /* ufs */
+           has_le32(buf, len, 65536 + 1372, 0x00011954) ||
+           (len >= 8192 + 1376 && get_be32(buf + 8192 + 1372) == 0x00011954) ||
+           (len >= 65536 + 1376 && get_be32(buf + 65536 + 1372) == 0x00011954);
+}
+
+/* Identify the filesystem from the first len bytes of a device, which
+ * should be SUPERBLOCK_SCAN_SIZE unless the device is smaller.  fd is
+ * only needed for NTFS, whose write marker lives in the MFT, and may be
+ * -1 to go without it.
+ */
+void
+superblock_parse(gint fd, const guint8 *buf, gsize len, Superblock *superblock)
+{
+    memset(superblock, 0, sizeof(Superblock));
+
+    if (len >= EXT_SUPERBLOCK + 1024 &&
+        get_le16(buf + EXT_SUPERBLOCK + 56) == EXT_MAGIC) {
+        parse_ext(buf + EXT_SUPERBLOCK, superblock);
+    } else if (len >= 512 && memcmp(buf, XFS_MAGIC, 4) == 0) {
+        parse_xfs(buf, superblock);
+    } else if (len >= 512 && memcmp(buf + 3, "NTFS    ", 8) == 0) {
+        if (fd >= 0)
+            parse_ntfs(fd, buf, superblock);
+        else
+            superblock->type = FS_NTFS;
+    } else if (len >= 512 && get_le16(buf + 510) == 0xAA55 &&
+               (memcmp(buf + 0x36, "FAT", 3) == 0 ||
+                memcmp(buf + 0x52, "FAT32", 5) == 0)) {
+        parse_vfat(buf, superblock);
+    } else if (has_bytes(buf, len, BTRFS_SUPERBLOCK + 0x40, BTRFS_MAGIC, 8)) {
+        parse_btrfs(buf + BTRFS_SUPERBLOCK, superblock);
+    } else if (has_bytes(buf, len, 0, "LUKS\xba\xbe", 6)) {
+        superblock->type = FS_LUKS;
+    } else if (is_lvm_member(buf, len)) {
+        superblock->type = FS_LVM;
+    } else if (has_le32(buf, len, 0, MD_MAGIC) ||
+               has_le32(buf, len, 4096, MD_MAGIC)) {
+        superblock->type = FS_RAID;
+    } else if (is_swap_area(buf, len)) {
+        superblock->type = FS_SWAP;
+    } else if (is_other_fs(buf, len)) {
+        superblock->type = FS_OTHER;
+    }
+}
+
+/* Identify the filesystem on a device and fetch its UUID and last-write
+ * marker, reading no more than its superblocks.
+ */
+gboolean
+superblock_read(const gchar *device, Superblock *superblock, GError **error)
+{
+    guint8 *buf;
+    off_t size;
+    gsize len;
+    gint fd;
+
+    memset(superblock, 0, sizeof(Superblock));
+
+    fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "%s: %s", device, g_strerror(errno));
+        return FALSE;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    len = size > 0 ? MIN((guint64)size, SUPERBLOCK_SCAN_SIZE) : SUPERBLOCK_SCAN_SIZE;
+    buf = g_malloc(len);
+    if (!disk_read(fd, 0, buf, len, error)) {
+        g_free(buf);
+        close(fd);
+        return FALSE;
+    }
+
+    superblock_parse(fd, buf, len, superblock);
+
+    g_free(buf);
+    close(fd);
+
+    return TRUE;
+}
+
+const gchar *
+superblock_type_name(FsType type)
+{
+    switch (type) {
+    case FS_EXT:
+        return "ext";
+    case FS_XFS:
+        return "xfs";
+    case FS_BTRFS:
+        return "btrfs";
+    case FS_VFAT:
+        return "vfat";
+    case FS_NTFS:
+        return "ntfs";
+    case FS_SWAP:
+        return "swap";
+    case FS_LUKS:
+        return "crypto_LUKS";
+    case FS_LVM:
+        return "LVM2_member";
+    case FS_RAID:
+        return "linux_raid_member";
+    case FS_OTHER:
+        return "other";
+    default:
+        return "unknown";
+    }
+}
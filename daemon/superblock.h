@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __SUPERBLOCK_H__
+#define __SUPERBLOCK_H__
+
+#include <glib.h>
+
+#include "types.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+    FS_UNKNOWN,
+    FS_EXT,
+    FS_XFS,
+    FS_BTRFS,
+    FS_VFAT,
+    FS_NTFS,
+    FS_SWAP,
+    FS_LUKS,
+    FS_LVM,
+    FS_RAID,
+    FS_OTHER,       /* a filesystem not parsed any further */
+} FsType;
+
+/* Bytes from the start of a device covering every signature known here,
+ * up to the btrfs superblock at 64 KiB.
+ */
+#define SUPERBLOCK_SCAN_SIZE (68 * 1024)
+
+struct Superblock {
+    FsType type;
+    gchar uuid[37];
+    /* Last-write marker of the filesystem, changes whenever it has been
+     * mounted read-write.  Only meaningful if has_generation is set.
+     */
+    guint64 generation;
+    gboolean has_generation;
+};
+
+gboolean     superblock_read      (const gchar *device,
+                                   Superblock  *superblock,
+                                   GError     **error);
+void         superblock_parse     (gint          fd,
+                                   const guint8 *buf,
+                                   gsize         len,
+                                   Superblock   *superblock);
+const gchar *superblock_type_name (FsType       type);
+
+G_END_DECLS
+
+#endif /* __SUPERBLOCK_H__ */
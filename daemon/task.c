@@ -0,0 +1,418 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <string.h>
+
+#include "daemon.h"
+#include "task.h"
+#include "trace.h"
+
+#define TASK_INTERFACE "org.isoftlinux.OSProber.Task"
+
+typedef enum {
+    TASK_EVENT_FOUND,
+    TASK_EVENT_ERROR,
+    TASK_EVENT_PROGRESS,
+    TASK_EVENT_FINISHED,
+} TaskEventType;
+
+/* What a worker has to tell the owner of the task, queued for the main
+ * loop to send.
+ */
+typedef struct TaskEvent {
+    struct TaskEvent *next;
+    TaskEventType type;
+    GVariant *record;       /* (ssss) of FOUND */
+    gchar *message;         /* of ERROR */
+    gdouble progress;
+    gint64 status;
+} TaskEvent;
+
+struct TaskPrivate {
+    GDBusConnection *connection;
+    gchar *sender;
+    guint watch;            /* of sender, until the task is finished */
+    gchar *object_path;
+    GPtrArray *results;     /* main loop only */
+    TaskEvent *events;      /* pushed by any thread, newest first */
+    volatile gint finished;
+    TaskCancelFunc cancel_func;
+    gpointer cancel_data;
+};
+
+static void task_osprober_task_iface_init(OSProberOSProberTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(Task, task, OSPROBER_TYPE_OSPROBER_TASK_SKELETON, G_IMPLEMENT_INTERFACE(OSPROBER_TYPE_OSPROBER_TASK, task_osprober_task_iface_init));
+
+#define TASK_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE((o), TYPE_TASK, TaskPrivate))
+
+static void
+task_init(Task *task)
+{
+    task->priv = TASK_GET_PRIVATE(task);
+    task->priv->connection = NULL;
+    task->priv->sender = NULL;
+    task->priv->watch = 0;
+    task->priv->object_path = NULL;
+    task->priv->events = NULL;
+    task->priv->finished = FALSE;
+    task->priv->results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+}
+
+static void
+task_finalize(GObject *object)
+{
+    Task *task = NULL;
+
+    g_return_if_fail(IS_TASK(object));
+    task = TASK(object);
+    if (task->priv->watch) {
+        g_bus_unwatch_name(task->priv->watch);
+        task->priv->watch = 0;
+    }
+    if (task->priv->connection) {
+        g_object_unref(task->priv->connection);
+        task->priv->connection = NULL;
+    }
+    if (task->priv->sender) g_free(task->priv->sender); task->priv->sender = NULL;
+    if (task->priv->object_path) g_free(task->priv->object_path); task->priv->object_path = NULL;
+    g_ptr_array_free(task->priv->results, TRUE);
+
+    G_OBJECT_CLASS(task_parent_class)->finalize(object);
+}
+
+static void
+task_class_init(TaskClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = task_finalize;
+
+    g_type_class_add_private(klass, sizeof(TaskPrivate));
+}
+
+/* The owner of the task left the bus, nobody waits for it anymore */
+static void
+task_sender_vanished(GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    Task *task = TASK(user_data);
+
+#ifdef DEBUG
+    g_print("DEBUG: %s left, cancelling %s\n", name, task->priv->object_path);
+#endif
+    if (!g_atomic_int_get(&task->priv->finished) && task->priv->cancel_func)
+        task->priv->cancel_func(task, task->priv->cancel_data);
+}
+
+Task *
+task_new(GDBusConnection *connection,
+         const gchar     *sender,
+         GError         **error)
+{
+    static guint serial = 0;
+    Task *task = TASK(g_object_new(TYPE_TASK, NULL));
+
+    task->priv->connection = g_object_ref(connection);
+    task->priv->sender = g_strdup(sender);
+    task->priv->object_path = g_strdup_printf("/org/isoftlinux/OSProber/Task/%u", 
+                                              ++serial);
+
+    if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(task),
+                                          connection,
+                                          task->priv->object_path,
+                                          error)) {
+        g_object_unref(task);
+        task = NULL;
+        return NULL;
+    }
+    if (sender) {
+        task->priv->watch = g_bus_watch_name_on_connection(connection, 
+                                                           sender, 
+                                                           G_BUS_NAME_WATCHER_FLAGS_NONE, 
+                                                           NULL, 
+                                                           task_sender_vanished, 
+                                                           task, 
+                                                           NULL);
+    }
+
+    return task;
+}
+
+const gchar *
+task_get_object_path(Task *task)
+{
+    return task->priv->object_path;
+}
+
+void
+task_set_cancel_func(Task *task, TaskCancelFunc func, gpointer user_data)
+{
+    task->priv->cancel_func = func;
+    task->priv->cancel_data = user_data;
+}
+
+static gboolean
+task_cancel(OSProberOSProberTask *object, 
+            GDBusMethodInvocation *invocation)
+{
+    Task *task = TASK(object);
+
+    if (g_strcmp0(g_dbus_method_invocation_get_sender(invocation), task->priv->sender) != 0) {
+        g_dbus_method_invocation_return_error(invocation, 
+                                              ERROR, 
+                                              ERROR_PERMISSION_DENIED, 
+                                              "not the owner of %s", 
+                                              task->priv->object_path);
+        return TRUE;
+    }
+
+    /* cancelling a finished task is a no-op */
+    if (!g_atomic_int_get(&task->priv->finished) && task->priv->cancel_func)
+        task->priv->cancel_func(task, task->priv->cancel_data);
+
+    osprober_osprober_task_complete_cancel(object, invocation);
+
+    return TRUE;
+}
+
+/* Unicast to the caller owning the task instead of broadcasting to
+ * every listener of the bus.
+ */
+static void
+task_emit(Task *task, const gchar *signal_name, GVariant *parameters)
+{
+    GError *error = NULL;
+    gint64 start = trace_now();
+
+    if (!g_dbus_connection_emit_signal(task->priv->connection,
+                                       task->priv->sender,
+                                       task->priv->object_path,
+                                       TASK_INTERFACE,
+                                       signal_name,
+                                       parameters,
+                                       &error)) {
+        g_warning("Failed to emit %s on %s: %s", 
+                  signal_name, task->priv->object_path, error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+    trace_span("signal", signal_name, start, task->priv->object_path);
+}
+
+static void
+task_event_free(TaskEvent *event)
+{
+    if (event->record)
+        g_variant_unref(event->record);
+    g_free(event->message);
+    g_free(event);
+}
+
+static gboolean
+task_unexport(gpointer data)
+{
+    Task *task = TASK(data);
+
+    g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(task));
+    g_object_unref(task);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* The results gathered since the previous batch, as one signal */
+static void
+task_emit_batch(Task *task, GVariantBuilder *batch, guint *count)
+{
+    if (*count == 0)
+        return;
+
+    task_emit(task, "FoundBatch", g_variant_new("(a(ssss))", batch));
+    g_variant_builder_init(batch, G_VARIANT_TYPE("a(ssss)"));
+    *count = 0;
+}
+
+static void
+task_complete(Task *task, gint64 status)
+{
+    GVariantBuilder builder;
+    guint i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    for (i = 0; i < task->priv->results->len; i++)
+        g_variant_builder_add_value(&builder, g_ptr_array_index(task->priv->results, i));
+
+    osprober_osprober_task_set_results(OSPROBER_OSPROBER_TASK(task), 
+                                       g_variant_builder_end(&builder));
+    osprober_osprober_task_set_status(OSPROBER_OSPROBER_TASK(task), status);
+    osprober_osprober_task_set_progress(OSPROBER_OSPROBER_TASK(task), 1.0);
+    osprober_osprober_task_set_completed(OSPROBER_OSPROBER_TASK(task), TRUE);
+
+    task_emit(task, "Finished", g_variant_new("(x)", status));
+    if (task->priv->watch) {
+        g_bus_unwatch_name(task->priv->watch);
+        task->priv->watch = 0;
+    }
+
+    /* Keep it around for a while so that the caller can still read the
+     * properties, then drop it from the bus.
+     */
+    g_timeout_add_seconds(TASK_LINGER_SECONDS, task_unexport, g_object_ref(task));
+}
+
+/* Send what the workers queued since the last time, in the order they
+ * queued it.  The results in between two other events go out as one
+ * FoundBatch, and of several progresses in a row only the last one.
+ */
+static gboolean
+task_drain(gpointer data)
+{
+    Task *task = TASK(data);
+    TaskEvent *events;
+    TaskEvent *event;
+    TaskEvent *next;
+    TaskEvent *ordered = NULL;
+    GVariantBuilder batch;
+    guint count = 0;
+    const gchar *part, *name, *shortname;
+
+    do {
+        events = g_atomic_pointer_get(&task->priv->events);
+    } while (!g_atomic_pointer_compare_and_exchange(&task->priv->events, events, NULL));
+
+    for (event = events; event; event = next) {
+        next = event->next;
+        event->next = ordered;
+        ordered = event;
+    }
+
+    g_variant_builder_init(&batch, G_VARIANT_TYPE("a(ssss)"));
+    for (event = ordered; event; event = next) {
+        next = event->next;
+        switch (event->type) {
+        case TASK_EVENT_FOUND:
+            g_ptr_array_add(task->priv->results, g_variant_ref(event->record));
+            g_variant_builder_add_value(&batch, event->record);
+            count++;
+            /* for the clients that know no better, the type is in the batch */
+            g_variant_get(event->record, "(&s&s&s&s)", &part, &name, &shortname, NULL);
+            task_emit(task, "Found", g_variant_new("(sss)", part, name, shortname));
+            break;
+        case TASK_EVENT_ERROR:
+            task_emit_batch(task, &batch, &count);
+            task_emit(task, "Error", g_variant_new("(s)", event->message));
+            break;
+        case TASK_EVENT_PROGRESS:
+            if (next && next->type == TASK_EVENT_PROGRESS)
+                break;
+            osprober_osprober_task_set_progress(OSPROBER_OSPROBER_TASK(task), event->progress);
+            task_emit(task, "ProgressChanged", g_variant_new("(d)", event->progress));
+            break;
+        case TASK_EVENT_FINISHED:
+            task_emit_batch(task, &batch, &count);
+            task_complete(task, event->status);
+            break;
+        }
+        task_event_free(event);
+    }
+    task_emit_batch(task, &batch, &count);
+    g_variant_builder_clear(&batch);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Queue an event without taking a lock, the workers never wait on each
+ * other or on the main loop here.  The first event of an empty queue
+ * wakes the main loop up, after a short while for the results close
+ * behind it to join.
+ */
+static void
+task_push(Task *task, TaskEvent *event)
+{
+    TaskEvent *head;
+
+    do {
+        head = g_atomic_pointer_get(&task->priv->events);
+        event->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&task->priv->events, head, event));
+
+    if (head == NULL) {
+        g_timeout_add_full(G_PRIORITY_DEFAULT, 
+                           TASK_BATCH_MS, 
+                           task_drain, 
+                           g_object_ref(task), 
+                           g_object_unref);
+    }
+}
+
+void
+task_found(Task        *task,
+           const gchar *part,
+           const gchar *name,
+           const gchar *shortname,
+           const gchar *type)
+{
+    TaskEvent *event = g_new0(TaskEvent, 1);
+
+    event->type = TASK_EVENT_FOUND;
+    event->record = g_variant_ref_sink(g_variant_new("(ssss)", part, name, shortname, type));
+    task_push(task, event);
+}
+
+void
+task_error(Task *task, const gchar *message)
+{
+    TaskEvent *event = g_new0(TaskEvent, 1);
+
+    event->type = TASK_EVENT_ERROR;
+    event->message = g_strdup(message);
+    task_push(task, event);
+}
+
+void
+task_progress(Task *task, guint done, guint total)
+{
+    TaskEvent *event = g_new0(TaskEvent, 1);
+
+    event->type = TASK_EVENT_PROGRESS;
+    event->progress = total ? (gdouble)done / total : 1.0;
+    task_push(task, event);
+}
+
+/* A task finishes once, whoever comes second is ignored */
+void
+task_finish(Task *task, gint64 status)
+{
+    TaskEvent *event;
+
+    if (!g_atomic_int_compare_and_exchange(&task->priv->finished, FALSE, TRUE))
+        return;
+
+    event = g_new0(TaskEvent, 1);
+    event->type = TASK_EVENT_FINISHED;
+    event->status = status;
+    task_push(task, event);
+}
+
+static void
+task_osprober_task_iface_init(OSProberOSProberTaskIface *iface)
+{
+    iface->handle_cancel = task_cancel;
+}
@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include "types.h"
+#include "task-generated.h"
+
+G_BEGIN_DECLS
+
+#define TYPE_TASK         (task_get_type())
+#define TASK(o)           (G_TYPE_CHECK_INSTANCE_CAST((o), TYPE_TASK, Task))
+#define TASK_CLASS(k)     (G_TYPE_CHECK_CLASS_CAST((k), TYPE_TASK, TaskClass))
+#define IS_TASK(o)        (G_TYPE_CHECK_INSTANCE_TYPE((o), TYPE_TASK))
+#define IS_TASK_CLASS(k)  (G_TYPE_CHECK_CLASS_TYPE((k), TYPE_TASK))
+#define TASK_GET_CLASS(o) (G_TYPE_INSTANCE_GET_CLASS((o), TYPE_TASK, TaskClass))
+
+/* How long a finished task stays exported for its caller to read the
+ * properties.
+ */
+#define TASK_LINGER_SECONDS 60
+
+/* How long the results found close together are gathered before they
+ * go out as one FoundBatch.
+ */
+#define TASK_BATCH_MS 20
+
+typedef struct TaskClass TaskClass;
+typedef struct TaskPrivate TaskPrivate;
+
+/* Called in the main loop when the owner of the task cancels it, or
+ * leaves the bus before the task is finished.
+ */
+typedef void (*TaskCancelFunc)(Task *task, gpointer user_data);
+
+struct Task {
+    OSProberOSProberTaskSkeleton parent;
+    TaskPrivate *priv;
+};
+
+struct TaskClass {
+    OSProberOSProberTaskSkeletonClass parent_class;
+};
+
+GType        task_get_type       (void) G_GNUC_CONST;
+Task        *task_new            (GDBusConnection *connection,
+                                  const gchar     *sender,
+                                  GError         **error);
+const gchar *task_get_object_path(Task            *task);
+void         task_set_cancel_func(Task            *task,
+                                  TaskCancelFunc   func,
+                                  gpointer         user_data);
+
+/* safe to call from any thread, the signals go out from the main loop */
+
+void         task_found          (Task            *task,
+                                  const gchar     *part,
+                                  const gchar     *name,
+                                  const gchar     *shortname,
+                                  const gchar     *type);
+void         task_error          (Task            *task,
+                                  const gchar     *message);
+void         task_progress       (Task            *task,
+                                  guint            done,
+                                  guint            total);
+void         task_finish         (Task            *task,
+                                  gint64           status);
+
+G_END_DECLS
+
+#endif /* __TASK_H__ */
@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+static GMutex trace_lock;
+static FILE *trace_file = NULL;
+static gboolean trace_first = TRUE;
+static gboolean trace_journal = FALSE;
+
+void
+trace_init(const gchar *path)
+{
+    trace_journal = g_log_writer_is_journald(fileno(stderr));
+
+    if (path == NULL)
+        return;
+
+    trace_file = fopen(path, "we");
+    if (trace_file == NULL) {
+        g_warning("Failed to open trace file %s: %s", path, g_strerror(errno));
+        return;
+    }
+    fputs("[\n", trace_file);
+}
+
+void
+trace_close()
+{
+    g_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    g_mutex_unlock(&trace_lock);
+}
+
+gboolean
+trace_enabled()
+{
+    return trace_file || trace_journal;
+}
+
+/* 0 when tracing is off, so that spans cost nothing then */
+gint64
+trace_now()
+{
+    return trace_enabled() ? g_get_monotonic_time() : 0;
+}
+
+static void
+trace_write_string(const gchar *str)
+{
+    const gchar *p;
+
+    fputc('"', trace_file);
+    for (p = str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(trace_file, "\\%c", *p);
+        else if ((guchar)*p < 0x20)
+            fprintf(trace_file, "\\u%04x", (guchar)*p);
+        else
+            fputc(*p, trace_file);
+    }
+    fputc('"', trace_file);
+}
+
+/* A complete event ("ph": "X"), flushed at once so that the trace of a
+ * daemon which gets killed is still readable.
+ */
+static void
+trace_write_event(const gchar *category, 
+                  const gchar *name, 
+                  gint64       start, 
+                  gint64       duration, 
+                  pid_t        tid, 
+                  const gchar *detail)
+{
+    g_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fputs(trace_first ? "  {" : ",\n  {", trace_file);
+        trace_first = FALSE;
+        fputs("\"name\": ", trace_file);
+        trace_write_string(name);
+        fputs(", \"cat\": ", trace_file);
+        trace_write_string(category);
+        fprintf(trace_file, 
+                ", \"ph\": \"X\", \"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT 
+                ", \"pid\": %d, \"tid\": %d", 
+                start, 
+                duration, 
+                (int)getpid(), 
+                (int)tid);
+        if (detail) {
+            fputs(", \"args\": { \"detail\": ", trace_file);
+            trace_write_string(detail);
+            fputs(" }", trace_file);
+        }
+        fputc('}', trace_file);
+        fflush(trace_file);
+    }
+    g_mutex_unlock(&trace_lock);
+}
+
+static void
+trace_write_journal(const gchar *category, 
+                    const gchar *name, 
+                    gint64       start, 
+                    gint64       duration, 
+                    pid_t        tid, 
+                    const gchar *detail)
+{
+    gchar *message = g_strdup_printf("%s %s%s%s took %" G_GINT64_FORMAT " us", 
+                                     category, 
+                                     name, 
+                                     detail ? " " : "", 
+                                     detail ? detail : "", 
+                                     duration);
+    gchar *start_str = g_strdup_printf("%" G_GINT64_FORMAT, start);
+    gchar *duration_str = g_strdup_printf("%" G_GINT64_FORMAT, duration);
+    gchar *tid_str = g_strdup_printf("%d", (int)tid);
+    const GLogField fields[] = {
+        { "MESSAGE", message, -1 },
+        { "PRIORITY", "7", -1 },
+        { "GLIB_DOMAIN", "isoft-os-prober", -1 },
+        { "SPAN_CATEGORY", category, -1 },
+        { "SPAN_NAME", name, -1 },
+        { "SPAN_START_USEC", start_str, -1 },
+        { "SPAN_DURATION_USEC", duration_str, -1 },
+        { "SPAN_TID", tid_str, -1 },
+        { "SPAN_DETAIL", detail ? detail : "", -1 },
+    };
+
+    g_log_writer_journald(G_LOG_LEVEL_DEBUG, fields, G_N_ELEMENTS(fields), NULL);
+
+    g_free(message);
+    g_free(start_str);
+    g_free(duration_str);
+    g_free(tid_str);
+}
+
+void
+trace_span(const gchar *category, 
+           const gchar *name, 
+           gint64       start, 
+           const gchar *detail)
+{
+    gint64 duration;
+    pid_t tid;
+
+    if (!trace_enabled() || start == 0)
+        return;
+
+    duration = g_get_monotonic_time() - start;
+    tid = syscall(SYS_gettid);
+
+    if (trace_file)
+        trace_write_event(category, name, start, duration, tid, detail);
+    if (trace_journal)
+        trace_write_journal(category, name, start, duration, tid, detail);
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Spans of the work of the daemon, written as Chrome trace events to the
+ * file given with --trace, and as structured entries to the journal when
+ * the daemon runs under systemd.  A span is opened with trace_now() and
+ * recorded by trace_span() once it is over.
+ */
+void     trace_init   (const gchar *path);
+void     trace_close  ();
+gboolean trace_enabled();
+gint64   trace_now    ();
+void     trace_span   (const gchar *category,
+                       const gchar *name,
+                       gint64       start,
+                       const gchar *detail);
+
+G_END_DECLS
+
+#endif /* __TRACE_H__ */
@@ -22,5 +22,11 @@
 #define __TYPES_H__
 
 typedef struct Daemon Daemon;
+typedef struct Partition Partition;
+typedef struct EngineCallbacks EngineCallbacks;
+typedef struct Task Task;
+typedef struct Superblock Superblock;
+typedef struct Stats Stats;
+typedef struct FsReader FsReader;
 
 #endif /* __TYPES_H__ */
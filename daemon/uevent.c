@@ -0,0 +1,177 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+
+#include "uevent.h"
+
+/* Kernel multicast group of NETLINK_KOBJECT_UEVENT.  udev sends on group
+ * 2 once it is done with an event; the kernel ones come before that, so
+ * nothing udev sets up for the device is relied on: the prescan reads
+ * the PARTUUID from the partition table.
+ */
+#define UEVENT_KERNEL_GROUP     1
+#define UEVENT_BUFFER_SIZE      8192
+#define UEVENT_RCVBUF_SIZE      (1024 * 1024)
+
+struct UeventMonitor {
+    int fd;
+    guint source;
+    UeventFunc func;
+    gpointer user_data;
+};
+
+/* A message is "ACTION@DEVPATH" followed by KEY=VALUE pairs, all NUL
+ * terminated.
+ */
+static void
+uevent_parse(UeventMonitor *monitor, const gchar *buf, gsize len)
+{
+    const gchar *end = buf + len;
+    const gchar *key;
+    const gchar *action = NULL;
+    const gchar *subsystem = NULL;
+    const gchar *devname = NULL;
+
+    if (memchr(buf, '@', strnlen(buf, len)) == NULL)
+        return;
+
+    for (key = buf + strnlen(buf, len) + 1; key < end; key += strnlen(key, end - key) + 1) {
+        if (memchr(key, '\0', end - key) == NULL)
+            break;
+        if (g_str_has_prefix(key, "ACTION="))
+            action = key + strlen("ACTION=");
+        else if (g_str_has_prefix(key, "SUBSYSTEM="))
+            subsystem = key + strlen("SUBSYSTEM=");
+        else if (g_str_has_prefix(key, "DEVNAME="))
+            devname = key + strlen("DEVNAME=");
+    }
+
+    if (action == NULL || devname == NULL || g_strcmp0(subsystem, "block") != 0)
+        return;
+
+    /* DEVNAME is relative to /dev, block devices do not nest */
+    if (*devname == '\0' || strchr(devname, '/'))
+        return;
+
+#ifdef DEBUG
+    g_print("DEBUG: uevent %s %s\n", action, devname);
+#endif
+    monitor->func(action, devname, monitor->user_data);
+}
+
+static gboolean
+uevent_dispatch(gint fd, GIOCondition condition, gpointer user_data)
+{
+    UeventMonitor *monitor = (UeventMonitor *)user_data;
+    gchar buf[UEVENT_BUFFER_SIZE];
+    struct sockaddr_nl addr;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    ssize_t len;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        len = recvmsg(fd, &msg, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                g_warning("uevent socket overflowed, events were lost");
+                monitor->func(NULL, NULL, monitor->user_data);
+                continue;
+            }
+            break;
+        }
+
+        /* only the kernel, never another process */
+        if (addr.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+            continue;
+
+        uevent_parse(monitor, buf, len);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+UeventMonitor *
+uevent_monitor_new(UeventFunc func, gpointer user_data, GError **error)
+{
+    UeventMonitor *monitor;
+    struct sockaddr_nl addr;
+    int rcvbuf = UEVENT_RCVBUF_SIZE;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) {
+        g_set_error(error, 
+                    G_IO_ERROR, 
+                    g_io_error_from_errno(errno), 
+                    "failed to open uevent socket: %s", 
+                    g_strerror(errno));
+        return NULL;
+    }
+
+    /* bursts of LUN churn are larger than the default buffer */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_KERNEL_GROUP;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        g_set_error(error, 
+                    G_IO_ERROR, 
+                    g_io_error_from_errno(errno), 
+                    "failed to bind uevent socket: %s", 
+                    g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    monitor = g_new0(UeventMonitor, 1);
+    monitor->fd = fd;
+    monitor->func = func;
+    monitor->user_data = user_data;
+    monitor->source = g_unix_fd_add(fd, G_IO_IN, uevent_dispatch, monitor);
+
+    return monitor;
+}
+
+void
+uevent_monitor_free(UeventMonitor *monitor)
+{
+    if (monitor == NULL)
+        return;
+
+    g_source_remove(monitor->source);
+    close(monitor->fd);
+    g_free(monitor);
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __UEVENT_H__
+#define __UEVENT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct UeventMonitor UeventMonitor;
+
+/* Called in the main loop for every block device uevent, name is the
+ * kernel name (sdb1, dm-3).  action and name are NULL when events were
+ * lost because the socket overflowed.
+ */
+typedef void (*UeventFunc)(const gchar *action,
+                           const gchar *name,
+                           gpointer     user_data);
+
+UeventMonitor *uevent_monitor_new (UeventFunc     func,
+                                   gpointer       user_data,
+                                   GError       **error);
+void           uevent_monitor_free(UeventMonitor *monitor);
+
+G_END_DECLS
+
+#endif /* __UEVENT_H__ */
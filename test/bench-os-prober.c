@@ -0,0 +1,461 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Benchmark of the probe pipeline, reproducible from one host to the
+ * other: a sparse disk image with a known layout (an ESP holding the
+ * Windows boot manager, a Linux root with os-release) is attached to a
+ * loop device and probed by the engine of the daemon, with cold caches,
+ * several times.  Also times the parsing of prober output on its own.
+ *
+ * The fixtures need root, the parse benchmark runs anyway.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "engine.h"
+#include "result.h"
+
+#define BENCH_DEFAULT_RUNS  5
+#define BENCH_PARSE_LINES   10000
+#define BENCH_IMAGE_SIZE    (G_GINT64_CONSTANT(1) << 30)
+
+/* sfdisk script: a 256 MiB ESP, then a 512 MiB Linux root */
+#define BENCH_LAYOUT        "label: gpt\n,256M,U\n,512M,L\n"
+
+typedef struct {
+    gchar *dir;
+    gchar *image;
+    gchar *loop;        /* loop0 */
+    gchar *esp;         /* /dev/loop0p1 */
+    gchar *root;        /* /dev/loop0p2 */
+} Fixture;
+
+typedef struct {
+    GMutex lock;
+    gint64 start;
+    gint64 first;
+    guint found;
+} BenchRun;
+
+static gint runs = BENCH_DEFAULT_RUNS;
+static gboolean parse_only = FALSE;
+static gboolean warm = FALSE;
+
+static gint
+compare_times(gconstpointer a, gconstpointer b)
+{
+    gint64 ta = *(const gint64 *)a;
+    gint64 tb = *(const gint64 *)b;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static void
+report(const gchar *what, GArray *times)
+{
+    g_array_sort(times, compare_times);
+    g_print("%-24s min %9.3f ms  median %9.3f ms  max %9.3f ms\n", 
+            what, 
+            g_array_index(times, gint64, 0) / 1000.0, 
+            g_array_index(times, gint64, times->len / 2) / 1000.0, 
+            g_array_index(times, gint64, times->len - 1) / 1000.0);
+}
+
+static void
+report_rss()
+{
+    struct rusage self, children;
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    g_print("%-24s self %ld KiB  children %ld KiB\n", 
+            "peak RSS", self.ru_maxrss, children.ru_maxrss);
+}
+
+/* Synthetic output of os-prober, a mix of Linux and EFI entries */
+static gchar **
+bench_make_lines(guint count)
+{
+    gchar **lines = g_new0(gchar *, count + 1);
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        if (i % 3 == 0) {
+            lines[i] = g_strdup_printf("/dev/sdb%u@/EFI/Microsoft/Boot/bootmgfw.efi:"
+                                       "Windows Boot Manager:Windows:efi", i);
+        } else {
+            lines[i] = g_strdup_printf("/dev/sda%u:Debian GNU/Linux %u (stretch):Debian:linux", 
+                                       i, i);
+        }
+    }
+
+    return lines;
+}
+
+static void
+bench_parse()
+{
+    gchar **lines = bench_make_lines(BENCH_PARSE_LINES);
+    GArray *times = g_array_new(FALSE, FALSE, sizeof(gint64));
+    ResultTable *table;
+    GVariant *result;
+    gint64 start, elapsed;
+    gint run;
+    guint i;
+
+    /* a table per scan, as the daemon has */
+    for (run = 0; run < runs; run++) {
+        start = g_get_monotonic_time();
+        table = result_table_new();
+        for (i = 0; lines[i]; i++) {
+            result = result_table_add_line(table, lines[i], NULL, NULL);
+            g_variant_unref(result);
+        }
+        result_table_free(table);
+        elapsed = g_get_monotonic_time() - start;
+        g_array_append_val(times, elapsed);
+    }
+
+    g_print("parse %u lines, %d runs\n", BENCH_PARSE_LINES, runs);
+    report("parse", times);
+    g_print("%-24s %9.1f ns\n", 
+            "per line (median)", 
+            g_array_index(times, gint64, times->len / 2) * 1000.0 / BENCH_PARSE_LINES);
+
+    g_array_free(times, TRUE);
+    g_strfreev(lines);
+}
+
+static gboolean
+run_command(const gchar * const *argv, const gchar *input, gchar **output, GError **error)
+{
+    GSubprocess *subprocess;
+    gboolean ret;
+
+    subprocess = g_subprocess_newv(argv, 
+                                   G_SUBPROCESS_FLAGS_STDIN_PIPE | 
+                                   G_SUBPROCESS_FLAGS_STDOUT_PIPE, 
+                                   error);
+    if (subprocess == NULL)
+        return FALSE;
+
+    ret = g_subprocess_communicate_utf8(subprocess, input, NULL, output, NULL, error) &&
+          g_subprocess_wait_check(subprocess, NULL, error);
+    g_object_unref(subprocess);
+
+    return ret;
+}
+
+static gboolean
+write_file(const gchar *root, const gchar *path, const gchar *contents, GError **error)
+{
+    gchar *filename = g_build_filename(root, path, NULL);
+    gchar *dir = g_path_get_dirname(filename);
+    gboolean ret;
+
+    g_mkdir_with_parents(dir, 0755);
+    ret = g_file_set_contents(filename, contents, -1, error);
+    g_free(dir);
+    g_free(filename);
+
+    return ret;
+}
+
+/* Mount a fresh filesystem of the fixture and lay out a fake OS in it */
+static gboolean
+fixture_populate(Fixture *fixture, const gchar *device, const gchar *fstype, GError **error)
+{
+    gchar *mnt = g_build_filename(fixture->dir, "mnt", NULL);
+    gboolean ret = FALSE;
+
+    g_mkdir(mnt, 0755);
+    if (mount(device, mnt, fstype, 0, NULL) == -1) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), 
+                    "mount %s: %s", device, g_strerror(errno));
+        goto out;
+    }
+
+    if (g_strcmp0(fstype, "vfat") == 0) {
+        ret = write_file(mnt, "EFI/Microsoft/Boot/bootmgfw.efi", "MZ", error) &&
+              write_file(mnt, "EFI/Microsoft/Boot/BCD", "regf", error);
+    } else {
+        ret = write_file(mnt, "etc/os-release", 
+                         "NAME=\"Bench Linux\"\n"
+                         "ID=bench\n"
+                         "VERSION_ID=1.0\n"
+                         "PRETTY_NAME=\"Bench Linux 1.0\"\n", error) &&
+              write_file(mnt, "etc/lsb-release", 
+                         "DISTRIB_ID=Bench\n"
+                         "DISTRIB_RELEASE=1.0\n"
+                         "DISTRIB_DESCRIPTION=\"Bench Linux 1.0\"\n", error) &&
+              write_file(mnt, "lib64/ld-linux-x86-64.so.2", "", error) &&
+              write_file(mnt, "boot/vmlinuz-1.0", "", error);
+    }
+
+    umount(mnt);
+out:
+    g_rmdir(mnt);
+    g_free(mnt);
+
+    return ret;
+}
+
+static void
+fixture_destroy(Fixture *fixture)
+{
+    const gchar *detach[] = { "losetup", "-d", NULL, NULL };
+    gchar *device;
+
+    if (fixture->loop) {
+        device = g_strdup_printf("/dev/%s", fixture->loop);
+        detach[2] = device;
+        run_command(detach, NULL, NULL, NULL);
+        g_free(device);
+    }
+    if (fixture->image)
+        g_unlink(fixture->image);
+    if (fixture->dir)
+        g_rmdir(fixture->dir);
+
+    g_free(fixture->dir);
+    g_free(fixture->image);
+    g_free(fixture->loop);
+    g_free(fixture->esp);
+    g_free(fixture->root);
+    memset(fixture, 0, sizeof(Fixture));
+}
+
+static gboolean
+fixture_create(Fixture *fixture, GError **error)
+{
+    const gchar *sfdisk[] = { "sfdisk", "--quiet", NULL, NULL };
+    const gchar *losetup[] = { "losetup", "--find", "--show", "--partscan", NULL, NULL };
+    const gchar *settle[] = { "udevadm", "settle", NULL };
+    const gchar *mkfs_vfat[] = { "mkfs.vfat", "-F", "32", "-n", "ESP", NULL, NULL };
+    const gchar *mkfs_ext4[] = { "mkfs.ext4", "-q", "-F", "-L", "root", NULL, NULL };
+    gchar *output = NULL;
+    int fd;
+
+    memset(fixture, 0, sizeof(Fixture));
+    fixture->dir = g_dir_make_tmp("bench-os-prober.XXXXXX", error);
+    if (fixture->dir == NULL)
+        return FALSE;
+
+    /* sparse, only what mkfs writes takes space */
+    fixture->image = g_build_filename(fixture->dir, "disk.img", NULL);
+    fd = g_open(fixture->image, O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, BENCH_IMAGE_SIZE) == -1) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), 
+                    "%s: %s", fixture->image, g_strerror(errno));
+        if (fd != -1)
+            close(fd);
+        goto error;
+    }
+    close(fd);
+
+    sfdisk[2] = fixture->image;
+    if (!run_command(sfdisk, BENCH_LAYOUT, NULL, error))
+        goto error;
+
+    losetup[4] = fixture->image;
+    if (!run_command(losetup, NULL, &output, error))
+        goto error;
+    g_strstrip(output);
+    fixture->loop = g_path_get_basename(output);
+    fixture->esp = g_strdup_printf("%sp1", output);
+    fixture->root = g_strdup_printf("%sp2", output);
+    g_free(output);
+    output = NULL;
+    run_command(settle, NULL, NULL, NULL);
+
+    mkfs_vfat[5] = fixture->esp;
+    mkfs_ext4[5] = fixture->root;
+    if (!run_command(mkfs_vfat, NULL, NULL, error) ||
+        !run_command(mkfs_ext4, NULL, NULL, error) ||
+        !fixture_populate(fixture, fixture->esp, "vfat", error) ||
+        !fixture_populate(fixture, fixture->root, "ext4", error))
+        goto error;
+
+    return TRUE;
+
+error:
+    fixture_destroy(fixture);
+    return FALSE;
+}
+
+static GPtrArray *
+fixture_get_partitions(Fixture *fixture)
+{
+    GPtrArray *partitions = g_ptr_array_new_with_free_func((GDestroyNotify)partition_free);
+    const gchar *devices[] = { fixture->esp, fixture->root, NULL };
+    Partition *partition;
+    guint i;
+
+    for (i = 0; devices[i]; i++) {
+        partition = partition_new(devices[i] + strlen("/dev/"));
+        partition->device = g_strdup(devices[i]);
+        partition->disk = g_strdup(fixture->loop);
+        g_ptr_array_add(partitions, partition);
+    }
+
+    return partitions;
+}
+
+static void
+bench_found(Partition *partition, const gchar *line, gpointer user_data)
+{
+    BenchRun *run = (BenchRun *)user_data;
+
+    g_mutex_lock(&run->lock);
+    if (run->found++ == 0)
+        run->first = g_get_monotonic_time();
+    g_mutex_unlock(&run->lock);
+}
+
+static void
+bench_error(const gchar *message, gpointer user_data)
+{
+    g_printerr("ERROR: %s\n", message);
+}
+
+static const EngineCallbacks bench_callbacks = {
+    NULL,
+    bench_found,
+    bench_error,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
+
+static void
+drop_caches()
+{
+    GError *error = NULL;
+
+    sync();
+    if (!g_file_set_contents("/proc/sys/vm/drop_caches", "3", -1, &error)) {
+        g_printerr("WARNING: caches not dropped: %s\n", error->message);
+        g_error_free(error);
+        error = NULL;
+    }
+}
+
+static void
+bench_engine()
+{
+    Fixture fixture;
+    GPtrArray *partitions;
+    GArray *ttfr = g_array_new(FALSE, FALSE, sizeof(gint64));
+    GArray *total = g_array_new(FALSE, FALSE, sizeof(gint64));
+    BenchRun run;
+    gint64 elapsed;
+    GError *error = NULL;
+    gint i;
+
+    if (engine_get_probes_dir() == NULL) {
+        g_print("engine: os-probes not installed, skipped\n");
+        return;
+    }
+    if (geteuid() != 0) {
+        g_print("engine: fixtures need root, skipped\n");
+        return;
+    }
+    if (!fixture_create(&fixture, &error)) {
+        g_printerr("ERROR: failed to create fixtures: %s\n", error->message);
+        g_error_free(error);
+        error = NULL;
+        return;
+    }
+
+    partitions = fixture_get_partitions(&fixture);
+    g_mutex_init(&run.lock);
+    for (i = 0; i < runs; i++) {
+        if (!warm)
+            drop_caches();
+
+        run.start = g_get_monotonic_time();
+        run.first = 0;
+        run.found = 0;
+        engine_run(partitions, &bench_callbacks, &run, NULL);
+        elapsed = g_get_monotonic_time() - run.start;
+
+        if (run.found != 2) {
+            g_printerr("WARNING: run %d found %u systems instead of 2\n", i, run.found);
+        }
+        if (run.found) {
+            run.first -= run.start;
+            g_array_append_val(ttfr, run.first);
+        }
+        g_array_append_val(total, elapsed);
+    }
+    g_mutex_clear(&run.lock);
+
+    g_print("engine on %s, %d %s runs\n", fixture.loop, runs, warm ? "warm" : "cold");
+    if (ttfr->len)
+        report("time to first result", ttfr);
+    report("total scan", total);
+
+    g_ptr_array_free(partitions, TRUE);
+    fixture_destroy(&fixture);
+    g_array_free(ttfr, TRUE);
+    g_array_free(total, TRUE);
+}
+
+int main(int argc, char *argv[]) 
+{
+    GOptionContext *context = NULL;
+    GError *error = NULL;
+    static GOptionEntry entries[] = {
+        { "runs", 'n', 0, G_OPTION_ARG_INT, &runs, "Number of runs", "N" },
+        { "parse-only", 0, 0, G_OPTION_ARG_NONE, &parse_only, "Only run the parse benchmark", NULL },
+        { "warm", 0, 0, G_OPTION_ARG_NONE, &warm, "Keep the page cache between runs", NULL },
+        { NULL }
+    };
+
+    context = g_option_context_new("");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("ERROR: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (runs < 1)
+        runs = 1;
+
+    bench_parse();
+    if (!parse_only)
+        bench_engine();
+    report_rss();
+
+    return 0;
+}
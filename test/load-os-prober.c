@@ -0,0 +1,374 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Load generator: a crowd of clients, every one with its own connection,
+ * calls Probe and reads DaemonVersion at once, round after round, and
+ * waits for the Finished signal of its task.  Meant for a daemon running
+ * on a private bus with a stand-in prober:
+ *
+ *   dbus-daemon --session --print-address --fork
+ *   isoft-os-prober-daemon --address=$ADDRESS --prober=test/fake-os-prober
+ *   load-os-prober --address=$ADDRESS --clients=500
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#define NAME            "org.isoftlinux.OSProber"
+#define OBJECT_PATH     "/org/isoftlinux/OSProber"
+#define ROUND_TIMEOUT   60
+
+typedef struct Load Load;
+
+typedef struct {
+    Load *load;
+    GDBusConnection *connection;
+    gint64 probe_start;
+    gint64 property_start;
+    gint64 finished_at;
+} Client;
+
+struct Load {
+    GMainLoop *loop;
+    Client *clients;
+    guint pending;
+    guint errors;
+    guint timeout;
+    GArray *probe_latency;
+    GArray *property_latency;
+    GArray *finished_spread;
+    guint32 pid;
+    guint max_threads;
+    guint64 max_rss;
+};
+
+static gchar *address = NULL;
+static gboolean session = FALSE;
+static gint n_clients = 200;
+static gint rounds = 5;
+
+static void
+load_done(Load *load)
+{
+    if (--load->pending == 0)
+        g_main_loop_quit(load->loop);
+}
+
+static void
+on_probe_reply(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    Client *client = (Client *)user_data;
+    GVariant *reply;
+    GError *error = NULL;
+    gint64 latency = g_get_monotonic_time() - client->probe_start;
+
+    reply = g_dbus_connection_call_finish(client->connection, res, &error);
+    if (reply == NULL) {
+        g_printerr("ERROR: Probe: %s\n", error->message);
+        g_error_free(error);
+        client->load->errors++;
+        /* no Finished will come */
+        load_done(client->load);
+    } else {
+        g_array_append_val(client->load->probe_latency, latency);
+        g_variant_unref(reply);
+    }
+    load_done(client->load);
+}
+
+static void
+on_property_reply(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    Client *client = (Client *)user_data;
+    GVariant *reply;
+    GError *error = NULL;
+    gint64 latency = g_get_monotonic_time() - client->property_start;
+
+    reply = g_dbus_connection_call_finish(client->connection, res, &error);
+    if (reply == NULL) {
+        g_printerr("ERROR: Get: %s\n", error->message);
+        g_error_free(error);
+        client->load->errors++;
+    } else {
+        g_array_append_val(client->load->property_latency, latency);
+        g_variant_unref(reply);
+    }
+    load_done(client->load);
+}
+
+/* Finished may arrive before the reply to Probe when the scan was about
+ * to end, any Finished of the round counts.
+ */
+static void
+on_finished(GDBusConnection *connection,
+            const gchar     *sender_name,
+            const gchar     *object_path,
+            const gchar     *interface_name,
+            const gchar     *signal_name,
+            GVariant        *parameters,
+            gpointer         user_data)
+{
+    Client *client = (Client *)user_data;
+
+    if (client->finished_at)
+        return;
+
+    client->finished_at = g_get_monotonic_time();
+    load_done(client->load);
+}
+
+static gboolean
+on_round_timeout(gpointer user_data)
+{
+    Load *load = (Load *)user_data;
+
+    g_printerr("ERROR: %u replies or signals missing after %d s\n", 
+               load->pending, ROUND_TIMEOUT);
+    load->errors += load->pending;
+    load->pending = 0;
+    load->timeout = 0;
+    g_main_loop_quit(load->loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+load_round(Load *load)
+{
+    Client *client;
+    gint64 first = G_MAXINT64;
+    gint64 spread;
+    gint i;
+
+    load->pending = 3 * n_clients;
+    for (i = 0; i < n_clients; i++) {
+        client = &load->clients[i];
+        client->finished_at = 0;
+
+        client->probe_start = g_get_monotonic_time();
+        g_dbus_connection_call(client->connection, NAME, OBJECT_PATH, NAME, "Probe", 
+                               NULL, G_VARIANT_TYPE("(o)"), G_DBUS_CALL_FLAGS_NONE, 
+                               -1, NULL, on_probe_reply, client);
+
+        client->property_start = g_get_monotonic_time();
+        g_dbus_connection_call(client->connection, NAME, OBJECT_PATH, 
+                               "org.freedesktop.DBus.Properties", "Get", 
+                               g_variant_new("(ss)", NAME, "DaemonVersion"), 
+                               G_VARIANT_TYPE("(v)"), G_DBUS_CALL_FLAGS_NONE, 
+                               -1, NULL, on_property_reply, client);
+    }
+
+    load->timeout = g_timeout_add_seconds(ROUND_TIMEOUT, on_round_timeout, load);
+    g_main_loop_run(load->loop);
+    if (load->timeout) {
+        g_source_remove(load->timeout);
+        load->timeout = 0;
+    }
+
+    /* Every client of a round waits for the same scan, so its Finished
+     * goes out to all of them at once.  What is measured is the spread
+     * of the arrivals here, from the first one: the fan-out of the daemon
+     * and the bus, but the dispatch of this process as well, which
+     * handles the clients one after the other.  It is not the time from
+     * the daemon sending Finished, no clock of the daemon is read.
+     */
+    for (i = 0; i < n_clients; i++) {
+        if (load->clients[i].finished_at && load->clients[i].finished_at < first)
+            first = load->clients[i].finished_at;
+    }
+    for (i = 0; i < n_clients; i++) {
+        if (load->clients[i].finished_at) {
+            spread = load->clients[i].finished_at - first;
+            g_array_append_val(load->finished_spread, spread);
+        }
+    }
+}
+
+/* Threads and RSS of the daemon, from /proc */
+static void
+load_sample_daemon(Load *load)
+{
+    gchar *path = g_strdup_printf("/proc/%u/status", load->pid);
+    gchar *contents = NULL;
+    gchar **lines;
+    guint i;
+
+    if (load->pid && g_file_get_contents(path, &contents, NULL, NULL)) {
+        lines = g_strsplit(contents, "\n", -1);
+        for (i = 0; lines[i]; i++) {
+            if (g_str_has_prefix(lines[i], "Threads:"))
+                load->max_threads = MAX(load->max_threads, atoi(lines[i] + strlen("Threads:")));
+            else if (g_str_has_prefix(lines[i], "VmRSS:"))
+                load->max_rss = MAX(load->max_rss, g_ascii_strtoull(lines[i] + strlen("VmRSS:"), NULL, 10));
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    g_free(path);
+}
+
+static gint
+compare_times(gconstpointer a, gconstpointer b)
+{
+    gint64 ta = *(const gint64 *)a;
+    gint64 tb = *(const gint64 *)b;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static gdouble
+percentile(GArray *times, guint p)
+{
+    return g_array_index(times, gint64, (times->len - 1) * p / 100) / 1000.0;
+}
+
+static void
+report(const gchar *what, GArray *times)
+{
+    if (times->len == 0) {
+        g_print("%-18s no samples\n", what);
+        return;
+    }
+
+    g_array_sort(times, compare_times);
+    g_print("%-18s p50 %8.2f ms  p90 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n", 
+            what, 
+            percentile(times, 50), 
+            percentile(times, 90), 
+            percentile(times, 99), 
+            percentile(times, 100));
+}
+
+static GDBusConnection *
+load_connect(GError **error)
+{
+    if (address == NULL) {
+        address = g_dbus_address_get_for_bus_sync(session ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM, 
+                                                  NULL, 
+                                                  error);
+        if (address == NULL)
+            return NULL;
+    }
+
+    return g_dbus_connection_new_for_address_sync(address, 
+                                                  G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | 
+                                                  G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, 
+                                                  NULL, 
+                                                  NULL, 
+                                                  error);
+}
+
+int main(int argc, char *argv[]) 
+{
+    GOptionContext *context = NULL;
+    GError *error = NULL;
+    GVariant *reply;
+    Load load;
+    gint i;
+    static GOptionEntry entries[] = {
+        { "address", 0, 0, G_OPTION_ARG_STRING, &address, "Message bus of the daemon", "ADDRESS" },
+        { "session", 0, 0, G_OPTION_ARG_NONE, &session, "Use the session bus", NULL },
+        { "clients", 'c', 0, G_OPTION_ARG_INT, &n_clients, "Number of clients", "N" },
+        { "rounds", 'n', 0, G_OPTION_ARG_INT, &rounds, "Number of rounds", "N" },
+        { NULL }
+    };
+
+    context = g_option_context_new("");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("ERROR: %s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (n_clients < 1)
+        n_clients = 1;
+
+    memset(&load, 0, sizeof(Load));
+    load.loop = g_main_loop_new(NULL, FALSE);
+    load.clients = g_new0(Client, n_clients);
+    load.probe_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    load.property_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    load.finished_spread = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    for (i = 0; i < n_clients; i++) {
+        load.clients[i].load = &load;
+        load.clients[i].connection = load_connect(&error);
+        if (load.clients[i].connection == NULL) {
+            g_printerr("ERROR: client %d: %s\n", i, error->message);
+            g_error_free(error);
+            return 1;
+        }
+        g_dbus_connection_signal_subscribe(load.clients[i].connection, 
+                                           NAME, 
+                                           NAME ".Task", 
+                                           "Finished", 
+                                           NULL, 
+                                           NULL, 
+                                           G_DBUS_SIGNAL_FLAGS_NONE, 
+                                           on_finished, 
+                                           &load.clients[i], 
+                                           NULL);
+    }
+
+    reply = g_dbus_connection_call_sync(load.clients[0].connection, 
+                                        "org.freedesktop.DBus", 
+                                        "/org/freedesktop/DBus", 
+                                        "org.freedesktop.DBus", 
+                                        "GetConnectionUnixProcessID", 
+                                        g_variant_new("(s)", NAME), 
+                                        G_VARIANT_TYPE("(u)"), 
+                                        G_DBUS_CALL_FLAGS_NONE, 
+                                        -1, 
+                                        NULL, 
+                                        &error);
+    if (reply == NULL) {
+        g_printerr("ERROR: daemon not found: %s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    g_variant_get(reply, "(u)", &load.pid);
+    g_variant_unref(reply);
+
+    for (i = 0; i < rounds; i++) {
+        load_round(&load);
+        load_sample_daemon(&load);
+    }
+
+    g_print("%d clients, %d rounds, %u errors\n", n_clients, rounds, load.errors);
+    report("Probe", load.probe_latency);
+    report("Get DaemonVersion", load.property_latency);
+    report("Finished spread", load.finished_spread);
+    g_print("%-18s %u threads, %" G_GUINT64_FORMAT " KiB RSS (peaks)\n", 
+            "daemon", load.max_threads, load.max_rss);
+
+    for (i = 0; i < n_clients; i++)
+        g_object_unref(load.clients[i].connection);
+    g_free(load.clients);
+    g_array_free(load.probe_latency, TRUE);
+    g_array_free(load.property_latency, TRUE);
+    g_array_free(load.finished_spread, TRUE);
+    g_main_loop_unref(load.loop);
+
+    return load.errors ? 1 : 0;
+}
@@ -0,0 +1,1283 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "diskio.h"
+#include "fsreader.h"
+#include "superblock.h"
+
+/* The images are built here byte by byte, as small as each filesystem
+ * allows, with no more in them than the readers look at.
+ */
+
+#define OS_RELEASE  "NAME=\"Debian GNU/Linux\"\n" \
+                    "PRETTY_NAME=\"Debian GNU/Linux 9 (stretch)\"\n"
+
+static gchar *tmpdir;
+
+static void
+put_le16(guint8 *p, guint16 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void
+put_le32(guint8 *p, guint32 v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void
+put_le64(guint8 *p, guint64 v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static void
+put_be16(guint8 *p, guint16 v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void
+put_be32(guint8 *p, guint32 v)
+{
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v);
+}
+
+static void
+put_be64(guint8 *p, guint64 v)
+{
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
+static gchar *
+write_image(const gchar *name, const guint8 *image, gsize size)
+{
+    gchar *path = g_build_filename(tmpdir, name, NULL);
+    GError *error = NULL;
+
+    g_file_set_contents(path, (const gchar *)image, size, &error);
+    g_assert_no_error(error);
+
+    return path;
+}
+
+static FsReader *
+open_image(const gchar *name, const guint8 *image, gsize size, FsType type)
+{
+    gchar *path = write_image(name, image, size);
+    Superblock superblock;
+    FsReader *reader;
+    GError *error = NULL;
+
+    g_assert_true(superblock_read(path, &superblock, &error));
+    g_assert_no_error(error);
+    g_assert_cmpint(superblock.type, ==, type);
+
+    reader = fsreader_open(path, type, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(reader);
+    g_free(path);
+
+    return reader;
+}
+
+static void
+assert_file(FsReader *reader, const gchar *path, const gchar *expected)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+
+    g_assert_true(fsreader_read_file(reader, path, &contents, &length, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(length, ==, strlen(expected));
+    g_assert_cmpstr(contents, ==, expected);
+    g_free(contents);
+}
+
+static void
+assert_file_error(FsReader *reader, const gchar *path, gint code)
+{
+    gchar *contents = NULL;
+    GError *error = NULL;
+
+    g_assert_false(fsreader_read_file(reader, path, &contents, NULL, &error));
+    g_assert_error(error, G_IO_ERROR, code);
+    g_assert_null(contents);
+    g_error_free(error);
+}
+
+static void
+assert_linux(FsReader *reader, const gchar *long_name, const gchar *short_name)
+{
+    gchar *detected_long = NULL;
+    gchar *detected_short = NULL;
+    GError *error = NULL;
+
+    g_assert_true(fsreader_detect_linux(reader, &detected_long, &detected_short, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(detected_long, ==, long_name);
+    g_assert_cmpstr(detected_short, ==, short_name);
+    g_free(detected_long);
+    g_free(detected_short);
+}
+
+/* ext2 of 1 KiB blocks and a single group: the inode table in block 4,
+ * / in block 10 through the direct blocks, /etc and /etc/os-release in
+ * blocks 11 and 12 through extents.
+ */
+#define EXT_BLOCK       1024
+#define EXT_SIZE        (64 * EXT_BLOCK)
+#define EXT_EXTENTS_FL  0x00080000
+
+static guint8 *
+ext_inode(guint8 *image, guint32 ino)
+{
+    return image + 4 * EXT_BLOCK + (ino - 1) * 128;
+}
+
+static void
+ext_add_inode(guint8 *image, guint32 ino, guint16 mode, guint32 size, guint32 block, gboolean extents)
+{
+    guint8 *inode = ext_inode(image, ino);
+
+    put_le16(inode, mode);
+    put_le32(inode + 4, size);
+    if (!extents) {
+        put_le32(inode + 0x28, block);
+        return;
+    }
+    put_le32(inode + 0x20, EXT_EXTENTS_FL);
+    put_le16(inode + 0x28, 0xF30A);
+    put_le16(inode + 0x28 + 2, 1);
+    put_le16(inode + 0x28 + 4, 4);
+    put_le32(inode + 0x28 + 12, 0);
+    put_le16(inode + 0x28 + 12 + 4, 1);
+    put_le32(inode + 0x28 + 12 + 8, block);
+}
+
+/* A directory block of names, the last entry spanning the rest */
+static void
+ext_add_dir(guint8 *image, guint32 block, const gchar * const *names, const guint32 *inos)
+{
+    guint8 *p = image + block * EXT_BLOCK;
+    guint8 *end = p + EXT_BLOCK;
+    gsize rec_len;
+    guint i;
+
+    for (i = 0; names[i]; i++) {
+        rec_len = names[i + 1] ? (8 + strlen(names[i]) + 3) & ~3 : (gsize)(end - p);
+        put_le32(p, inos[i]);
+        put_le16(p + 4, rec_len);
+        p[6] = strlen(names[i]);
+        p[7] = 2;
+        memcpy(p + 8, names[i], strlen(names[i]));
+        p += rec_len;
+    }
+}
+
+static guint8 *
+build_ext(void)
+{
+    static const gchar * const root[] = { ".", "..", "etc", NULL };
+    static const guint32 root_inos[] = { 2, 2, 11 };
+    static const gchar * const etc[] = { ".", "..", "os-release", NULL };
+    static const guint32 etc_inos[] = { 11, 2, 12 };
+    guint8 *image = g_malloc0(EXT_SIZE);
+    guint8 *sb = image + 1024;
+
+    put_le32(sb, 32);
+    put_le32(sb + 4, EXT_SIZE / EXT_BLOCK);
+    put_le32(sb + 20, 1);
+    put_le32(sb + 24, 0);
+    put_le32(sb + 32, 8192);
+    put_le32(sb + 40, 32);
+    put_le16(sb + 56, 0xEF53);
+    put_le32(sb + 76, 1);
+    put_le16(sb + 88, 128);
+    put_le32(sb + 96, 0x0002 | 0x0040);
+    put_le32(image + 2 * EXT_BLOCK + 8, 4);
+
+    ext_add_inode(image, 2, S_IFDIR | 0755, EXT_BLOCK, 10, FALSE);
+    ext_add_dir(image, 10, root, root_inos);
+    ext_add_inode(image, 11, S_IFDIR | 0755, EXT_BLOCK, 11, TRUE);
+    ext_add_dir(image, 11, etc, etc_inos);
+    ext_add_inode(image, 12, S_IFREG | 0644, strlen(OS_RELEASE), 12, TRUE);
+    memcpy(image + 12 * EXT_BLOCK, OS_RELEASE, strlen(OS_RELEASE));
+
+    return image;
+}
+
+static void
+test_ext(void)
+{
+    guint8 *image = build_ext();
+    FsReader *reader = open_image("ext", image, EXT_SIZE, FS_EXT);
+
+    assert_file(reader, "/etc/os-release", OS_RELEASE);
+    assert_file(reader, "//etc/./../etc/os-release", OS_RELEASE);
+    assert_file_error(reader, "/etc/lsb-release", G_IO_ERROR_NOT_FOUND);
+    assert_file_error(reader, "/etc", G_IO_ERROR_NOT_REGULAR_FILE);
+    assert_linux(reader, "Debian GNU/Linux 9 (stretch)", "Debian");
+
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* An extent header claiming more entries than it holds, or than the 60
+ * bytes of i_block hold, is not read past.
+ */
+static void
+test_ext_bad_extents(void)
+{
+    guint8 *image = build_ext();
+    FsReader *reader;
+
+    put_le16(ext_inode(image, 11) + 0x28 + 2, 5);
+    reader = open_image("ext-bad-entries", image, EXT_SIZE, FS_EXT);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_INVALID_DATA);
+    fsreader_free(reader);
+
+    put_le16(ext_inode(image, 11) + 0x28 + 4, 5);
+    reader = open_image("ext-bad-max", image, EXT_SIZE, FS_EXT);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_INVALID_DATA);
+    fsreader_free(reader);
+
+    g_free(image);
+}
+
+/* xfs v4 of 512-byte blocks and 256-byte inodes: / is short form in
+ * inode 8, /etc a single-block directory in block 20, /etc/os-release
+ * in block 21.
+ */
+#define XFS_BLOCK       512
+#define XFS_SIZE        (64 * XFS_BLOCK)
+#define XFS_ETC_BLOCK   20
+
+static guint8 *
+xfs_add_inode(guint8 *image, guint64 ino, guint16 mode, guint8 format, guint64 size, guint32 nextents)
+{
+    guint8 *inode = image + (ino >> 1) * XFS_BLOCK + (ino & 1) * 256;
+
+    put_be16(inode, 0x494e);
+    put_be16(inode + 2, mode);
+    inode[4] = 2;
+    inode[5] = format;
+    put_be64(inode + 56, size);
+    put_be32(inode + 76, nextents);
+
+    return inode + 100;
+}
+
+static void
+xfs_add_extent(guint8 *fork, guint64 block, guint32 count)
+{
+    put_be64(fork, 0);
+    put_be64(fork + 8, block << 21 | count);
+}
+
+static gsize
+xfs_add_dir_entry(guint8 *p, guint64 ino, const gchar *name)
+{
+    gsize len = strlen(name);
+    gsize size = (8 + 1 + len + 2 + 7) & ~7;
+
+    put_be64(p, ino);
+    p[8] = len;
+    memcpy(p + 9, name, len);
+
+    return size;
+}
+
+static guint8 *
+build_xfs(void)
+{
+    guint8 *image = g_malloc0(XFS_SIZE);
+    guint8 *fork;
+    guint8 *block = image + XFS_ETC_BLOCK * XFS_BLOCK;
+    gsize offset = 16;
+
+    memcpy(image, "XFSB", 4);
+    put_be32(image + 4, XFS_BLOCK);
+    put_be64(image + 8, XFS_SIZE / XFS_BLOCK);
+    put_be64(image + 56, 8);
+    put_be32(image + 84, XFS_SIZE / XFS_BLOCK);
+    put_be32(image + 88, 1);
+    put_be16(image + 100, 4);
+    put_be16(image + 102, 512);
+    put_be16(image + 104, 256);
+    put_be16(image + 106, 2);
+    image[120] = 9;
+    image[121] = 9;
+    image[122] = 8;
+    image[123] = 1;
+    image[124] = 6;
+
+    fork = xfs_add_inode(image, 8, S_IFDIR | 0755, 1, 6 + 3 + 3 + 4, 0);
+    fork[0] = 1;
+    put_be32(fork + 2, 8);
+    fork[6] = 3;
+    put_be16(fork + 7, 0x60);
+    memcpy(fork + 9, "etc", 3);
+    put_be32(fork + 12, 10);
+
+    fork = xfs_add_inode(image, 10, S_IFDIR | 0755, 2, XFS_BLOCK, 1);
+    xfs_add_extent(fork, XFS_ETC_BLOCK, 1);
+    memcpy(block, "XD2B", 4);
+    offset += xfs_add_dir_entry(block + offset, 10, ".");
+    offset += xfs_add_dir_entry(block + offset, 8, "..");
+    xfs_add_dir_entry(block + offset, 11, "os-release");
+    put_be32(block + XFS_BLOCK - 8, 3);
+
+    fork = xfs_add_inode(image, 11, S_IFREG | 0644, 2, strlen(OS_RELEASE), 1);
+    xfs_add_extent(fork, XFS_ETC_BLOCK + 1, 1);
+    memcpy(image + (XFS_ETC_BLOCK + 1) * XFS_BLOCK, OS_RELEASE, strlen(OS_RELEASE));
+
+    return image;
+}
+
+static void
+test_xfs(void)
+{
+    guint8 *image = build_xfs();
+    FsReader *reader = open_image("xfs", image, XFS_SIZE, FS_XFS);
+
+    assert_file(reader, "/etc/os-release", OS_RELEASE);
+    assert_file_error(reader, "/etc/lsb-release", G_IO_ERROR_NOT_FOUND);
+    assert_file_error(reader, "/usr", G_IO_ERROR_NOT_FOUND);
+    assert_linux(reader, "Debian GNU/Linux 9 (stretch)", "Debian");
+
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* A leaf count of a block directory larger than the block leaves no
+ * entries to look at.
+ */
+static void
+test_xfs_bad_leaf(void)
+{
+    guint8 *image = build_xfs();
+    FsReader *reader;
+
+    put_be32(image + (XFS_ETC_BLOCK + 1) * XFS_BLOCK - 8, 0x10000000);
+    reader = open_image("xfs-bad-leaf", image, XFS_SIZE, FS_XFS);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_NOT_FOUND);
+    fsreader_free(reader);
+
+    put_be32(image + (XFS_ETC_BLOCK + 1) * XFS_BLOCK - 8, XFS_BLOCK / 8);
+    reader = open_image("xfs-full-leaf", image, XFS_SIZE, FS_XFS);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_NOT_FOUND);
+    fsreader_free(reader);
+
+    g_free(image);
+}
+
+/* btrfs of a single device mapped one to one by the system chunk in
+ * the superblock, with leaves for the chunk, root and fs trees.
+ */
+#define BTRFS_NODE          4096
+#define BTRFS_CHUNK_TREE    0x20000
+#define BTRFS_ROOT_TREE     0x21000
+#define BTRFS_FS_TREE       0x22000
+#define BTRFS_SIZE          0x23000
+
+typedef struct {
+    guint64 objectid;
+    guint8 type;
+    guint64 offset;
+    guint8 data[200];
+    guint32 size;
+} BtrfsItem;
+
+static const guint8 btrfs_fsid[16] = { 0x5d, 0x0e, 0x9c, 0x3a, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+
+static guint32
+btrfs_name_hash(const gchar *name)
+{
+    guint32 crc = ~1u;
+    gint i;
+
+    for (; *name; name++) {
+        crc ^= (guint8)*name;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+
+    return crc;
+}
+
+static void
+btrfs_put_key(guint8 *p, guint64 objectid, guint8 type, guint64 offset)
+{
+    put_le64(p, objectid);
+    p[8] = type;
+    put_le64(p + 9, offset);
+}
+
+static void
+btrfs_add_leaf(guint8 *image, guint64 bytenr, const BtrfsItem *items, guint n_items)
+{
+    guint8 *node = image + bytenr;
+    guint32 end = BTRFS_NODE - 101;
+    guint i;
+
+    memcpy(node + 32, btrfs_fsid, 16);
+    put_le64(node + 48, bytenr);
+    put_le32(node + 96, n_items);
+    node[100] = 0;
+    for (i = 0; i < n_items; i++) {
+        end -= items[i].size;
+        btrfs_put_key(node + 101 + i * 25, items[i].objectid, items[i].type, items[i].offset);
+        put_le32(node + 101 + i * 25 + 17, end);
+        put_le32(node + 101 + i * 25 + 21, items[i].size);
+        memcpy(node + 101 + end, items[i].data, items[i].size);
+    }
+}
+
+static void
+btrfs_inode_item(BtrfsItem *item, guint64 ino, guint32 mode, guint64 size)
+{
+    memset(item, 0, sizeof(BtrfsItem));
+    item->objectid = ino;
+    item->type = 1;
+    item->size = 160;
+    put_le64(item->data + 16, size);
+    put_le32(item->data + 52, mode);
+}
+
+static void
+btrfs_dir_item(BtrfsItem *item, guint64 dir, const gchar *name, guint64 ino)
+{
+    memset(item, 0, sizeof(BtrfsItem));
+    item->objectid = dir;
+    item->type = 84;
+    item->offset = btrfs_name_hash(name);
+    item->size = 30 + strlen(name);
+    btrfs_put_key(item->data, ino, 1, 0);
+    put_le16(item->data + 27, strlen(name));
+    memcpy(item->data + 30, name, strlen(name));
+}
+
+static guint8 *
+build_btrfs(void)
+{
+    guint8 *image = g_malloc0(BTRFS_SIZE);
+    guint8 *sb = image + 65536;
+    guint8 *chunk = sb + 0x32b + 17;
+    BtrfsItem items[6];
+
+    memcpy(sb + 0x20, btrfs_fsid, 16);
+    put_le64(sb + 0x30, 65536);
+    memcpy(sb + 0x40, "_BHRfS_M", 8);
+    put_le64(sb + 0x48, 7);
+    put_le64(sb + 0x50, BTRFS_ROOT_TREE);
+    put_le64(sb + 0x58, BTRFS_CHUNK_TREE);
+    put_le32(sb + 0x90, 4096);
+    put_le32(sb + 0x94, BTRFS_NODE);
+    put_le32(sb + 0xa0, 17 + 48 + 32);
+    put_le64(sb + 0xc9, 1);
+    btrfs_put_key(sb + 0x32b, 256, 228, 0);
+    put_le64(chunk, BTRFS_SIZE);
+    put_le64(chunk + 24, 2);
+    put_le16(chunk + 44, 1);
+    put_le64(chunk + 48, 1);
+    put_le64(chunk + 56, 0);
+
+    btrfs_add_leaf(image, BTRFS_CHUNK_TREE, NULL, 0);
+
+    memset(items, 0, sizeof(items));
+    items[0].objectid = 5;
+    items[0].type = 132;
+    items[0].size = 184;
+    put_le64(items[0].data + 176, BTRFS_FS_TREE);
+    btrfs_add_leaf(image, BTRFS_ROOT_TREE, items, 1);
+
+    btrfs_inode_item(&items[0], 256, S_IFDIR | 0755, 0);
+    btrfs_dir_item(&items[1], 256, "etc", 257);
+    btrfs_inode_item(&items[2], 257, S_IFDIR | 0755, 0);
+    btrfs_dir_item(&items[3], 257, "os-release", 258);
+    btrfs_inode_item(&items[4], 258, S_IFREG | 0644, strlen(OS_RELEASE));
+    memset(&items[5], 0, sizeof(BtrfsItem));
+    items[5].objectid = 258;
+    items[5].type = 108;
+    items[5].size = 21 + strlen(OS_RELEASE);
+    put_le64(items[5].data + 8, strlen(OS_RELEASE));
+    memcpy(items[5].data + 21, OS_RELEASE, strlen(OS_RELEASE));
+    btrfs_add_leaf(image, BTRFS_FS_TREE, items, 6);
+
+    return image;
+}
+
+static void
+test_btrfs(void)
+{
+    guint8 *image = build_btrfs();
+    FsReader *reader = open_image("btrfs", image, BTRFS_SIZE, FS_BTRFS);
+
+    assert_file(reader, "/etc/os-release", OS_RELEASE);
+    assert_file_error(reader, "/etc/lsb-release", G_IO_ERROR_NOT_FOUND);
+    assert_linux(reader, "Debian GNU/Linux 9 (stretch)", "Debian");
+
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* A leaf claiming more items than fit is empty, a tree block somewhere
+ * else than it says is not read at all.
+ */
+static void
+test_btrfs_bad_leaf(void)
+{
+    guint8 *image = build_btrfs();
+    FsReader *reader;
+
+    put_le32(image + BTRFS_FS_TREE + 96, 0x1000000);
+    reader = open_image("btrfs-bad-items", image, BTRFS_SIZE, FS_BTRFS);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_NOT_FOUND);
+    fsreader_free(reader);
+
+    put_le32(image + BTRFS_FS_TREE + 96, 6);
+    put_le64(image + BTRFS_FS_TREE + 48, BTRFS_ROOT_TREE);
+    reader = open_image("btrfs-bad-bytenr", image, BTRFS_SIZE, FS_BTRFS);
+    assert_file_error(reader, "/etc/os-release", G_IO_ERROR_INVALID_DATA);
+    fsreader_free(reader);
+
+    g_free(image);
+}
+
+/* FAT12 of 512-byte clusters, an EFI system partition: /EFI in cluster
+ * 2, /EFI/Microsoft and /EFI/Microsoft/Boot in 3 and 4 under long names,
+ * bootmgfw.efi in 5.
+ */
+#define FAT_SECTOR      512
+#define FAT_SIZE        (512 * FAT_SECTOR)
+#define FAT_TABLE       (1 * FAT_SECTOR)
+#define FAT_ROOT        (3 * FAT_SECTOR)
+#define FAT_DATA        (4 * FAT_SECTOR)
+#define BOOTMGFW        "MZ not really bootmgfw"
+
+static void
+fat12_set(guint8 *image, guint32 cluster, guint32 next)
+{
+    guint8 *p = image + FAT_TABLE + cluster + cluster / 2;
+
+    if (cluster & 1) {
+        p[0] = (p[0] & 0x0F) | (next << 4 & 0xF0);
+        p[1] = next >> 4;
+    } else {
+        p[0] = next;
+        p[1] = (p[1] & 0xF0) | (next >> 8 & 0x0F);
+    }
+}
+
+static guint8 *
+fat_cluster(guint8 *image, guint32 cluster)
+{
+    return image + FAT_DATA + (cluster - 2) * FAT_SECTOR;
+}
+
+static void
+fat_add_entry(guint8 *entry, const gchar *name, guint8 attr, guint8 lower, guint32 cluster, guint32 size)
+{
+    memcpy(entry, name, 11);
+    entry[11] = attr;
+    entry[12] = lower;
+    put_le16(entry + 26, cluster);
+    put_le32(entry + 28, size);
+}
+
+/* One slot of long name before the short entry it names */
+static void
+fat_add_long_entry(guint8 *entry, const gchar *long_name, const gchar *name, guint8 attr, guint32 cluster)
+{
+    static const guint offsets[] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    guint8 sum = 0;
+    gsize len = strlen(long_name);
+    guint i;
+
+    for (i = 0; i < 11; i++)
+        sum = (guint8)(((sum & 1) << 7) + (sum >> 1) + (guint8)name[i]);
+
+    entry[0] = 0x41;
+    entry[11] = 0x0F;
+    entry[13] = sum;
+    for (i = 0; i < G_N_ELEMENTS(offsets); i++)
+        put_le16(entry + offsets[i], i < len ? long_name[i] : i == len ? 0 : 0xFFFF);
+    fat_add_entry(entry + 32, name, attr, 0, cluster, 0);
+}
+
+static guint8 *
+build_fat(void)
+{
+    guint8 *image = g_malloc0(FAT_SIZE);
+    guint32 i;
+
+    image[0] = 0xEB;
+    image[1] = 0x3C;
+    image[2] = 0x90;
+    memcpy(image + 3, "mkfs.fat", 8);
+    put_le16(image + 11, FAT_SECTOR);
+    image[13] = 1;
+    put_le16(image + 14, 1);
+    image[16] = 1;
+    put_le16(image + 17, 16);
+    put_le16(image + 19, FAT_SIZE / FAT_SECTOR);
+    image[21] = 0xF8;
+    put_le16(image + 22, 2);
+    image[0x26] = 0x29;
+    put_le32(image + 0x27, 0x1234ABCD);
+    memcpy(image + 0x36, "FAT12   ", 8);
+    put_le16(image + 510, 0xAA55);
+
+    fat12_set(image, 0, 0xFF8);
+    fat12_set(image, 1, 0xFFF);
+    for (i = 2; i <= 5; i++)
+        fat12_set(image, i, 0xFFF);
+
+    fat_add_entry(image + FAT_ROOT, "EFI        ", 0x10, 0, 2, 0);
+    fat_add_entry(fat_cluster(image, 2), ".          ", 0x10, 0, 2, 0);
+    fat_add_entry(fat_cluster(image, 2) + 32, "..         ", 0x10, 0, 0, 0);
+    fat_add_long_entry(fat_cluster(image, 2) + 64, "Microsoft", "MICROS~1   ", 0x10, 3);
+    fat_add_long_entry(fat_cluster(image, 3), "Boot", "BOOT       ", 0x10, 4);
+    fat_add_entry(fat_cluster(image, 4), "BOOTMGFWEFI", 0x20, 0x18, 5, strlen(BOOTMGFW));
+    memcpy(fat_cluster(image, 5), BOOTMGFW, strlen(BOOTMGFW));
+
+    return image;
+}
+
+static void
+test_fat(void)
+{
+    guint8 *image = build_fat();
+    FsReader *reader = open_image("fat", image, FAT_SIZE, FS_VFAT);
+    GPtrArray *loaders = g_ptr_array_new_with_free_func((GDestroyNotify)fsreader_boot_loader_free);
+    GCancellable *cancellable;
+    FsBootLoader *loader;
+    GError *error = NULL;
+
+    /* any case, the long name as the short one */
+    assert_file(reader, "/EFI/Microsoft/Boot/bootmgfw.efi", BOOTMGFW);
+    assert_file(reader, "/efi/MICROS~1/BOOT/BOOTMGFW.EFI", BOOTMGFW);
+    assert_file_error(reader, "/EFI/debian/grubx64.efi", G_IO_ERROR_NOT_FOUND);
+
+    g_assert_true(fsreader_detect_efi(reader, loaders, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(loaders->len, ==, 1);
+    loader = g_ptr_array_index(loaders, 0);
+    g_assert_cmpstr(loader->path, ==, "/EFI/Microsoft/Boot/bootmgfw.efi");
+    g_assert_cmpstr(loader->short_name, ==, "Windows");
+
+    cancellable = g_cancellable_new();
+    fsreader_set_cancellable(reader, cancellable);
+    g_cancellable_cancel(cancellable);
+    assert_file_error(reader, "/EFI/Microsoft/Boot/bootmgfw.efi", G_IO_ERROR_CANCELLED);
+    g_object_unref(cancellable);
+
+    g_ptr_array_free(loaders, TRUE);
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* A chain going on to a cluster past the end of the filesystem */
+static void
+test_fat_bad_chain(void)
+{
+    guint8 *image = build_fat();
+    FsReader *reader;
+
+    put_le32(fat_cluster(image, 4) + 28, FAT_SECTOR + 1);
+    fat12_set(image, 5, 0xFF0);
+    reader = open_image("fat-bad-chain", image, FAT_SIZE, FS_VFAT);
+    assert_file_error(reader, "/EFI/Microsoft/Boot/bootmgfw.efi", G_IO_ERROR_INVALID_DATA);
+    fsreader_free(reader);
+
+    g_free(image);
+}
+
+/* NTFS of 4 KiB clusters and 1 KiB records, $MFT in clusters 4 to 7: /
+ * in record 5, /bootmgr in 7, /Boot in 8 and /Boot/BCD in 9.
+ */
+#define NTFS_CLUSTER    4096
+#define NTFS_RECORD     1024
+#define NTFS_MFT        (4 * NTFS_CLUSTER)
+#define NTFS_SIZE       (32 * NTFS_CLUSTER)
+#define NTFS_LSN        G_GUINT64_CONSTANT(0x2a5c3f1)
+
+static guint8 *
+ntfs_record(guint8 *image, guint32 ino)
+{
+    return image + NTFS_MFT + ino * NTFS_RECORD;
+}
+
+static void
+ntfs_begin_record(guint8 *record, guint16 flags)
+{
+    memcpy(record, "FILE", 4);
+    put_le16(record + 4, 0x30);
+    put_le16(record + 6, NTFS_RECORD / 512 + 1);
+    put_le64(record + 8, NTFS_LSN);
+    put_le16(record + 0x10, 1);
+    put_le16(record + 0x12, 1);
+    put_le16(record + 0x14, 0x38);
+    put_le16(record + 0x16, flags);
+    put_le32(record + 0x18, 0x38 + 8);
+    put_le32(record + 0x1C, NTFS_RECORD);
+    put_le32(record + 0x38, 0xFFFFFFFF);
+}
+
+/* Append a resident attribute in place of the end marker, which only
+ * follows when there is room left for it
+ */
+static void
+ntfs_add_resident(guint8 *record, guint32 type, const gchar *name, const guint8 *value, guint32 len)
+{
+    guint32 used = get_le32(record + 0x18);
+    guint8 *attr = record + used - 8;
+    guint8 name_len = name ? strlen(name) : 0;
+    guint16 value_offset = (0x18 + name_len * 2 + 7) & ~7;
+    guint32 attr_len = (value_offset + len + 7) & ~7;
+    guint i;
+
+    put_le32(attr, type);
+    put_le32(attr + 4, attr_len);
+    attr[9] = name_len;
+    put_le16(attr + 0x0A, 0x18);
+    put_le32(attr + 0x10, len);
+    put_le16(attr + 0x14, value_offset);
+    for (i = 0; i < name_len; i++)
+        put_le16(attr + 0x18 + i * 2, name[i]);
+    memcpy(attr + value_offset, value, len);
+
+    if (used + attr_len <= NTFS_RECORD) {
+        put_le32(attr + attr_len, 0xFFFFFFFF);
+        put_le32(record + 0x18, used + attr_len);
+    } else {
+        put_le32(record + 0x18, NTFS_RECORD);
+    }
+}
+
+static guint32
+ntfs_add_index_entry(guint8 *p, guint64 ino, const gchar *name)
+{
+    gsize len = strlen(name);
+    guint32 entry_len = (16 + 0x42 + len * 2 + 7) & ~7;
+    guint i;
+
+    put_le64(p, ino | G_GUINT64_CONSTANT(1) << 48);
+    put_le16(p + 8, entry_len);
+    put_le16(p + 10, 0x42 + len * 2);
+    p[16 + 0x40] = len;
+    p[16 + 0x41] = 1;
+    for (i = 0; i < len; i++)
+        put_le16(p + 16 + 0x42 + i * 2, name[i]);
+
+    return entry_len;
+}
+
+/* A directory of a small index, all of it in the record.  A short entry
+ * ends the record, for the over-read of its key to leave the record.
+ */
+static void
+ntfs_add_dir(guint8 *image, guint32 ino, const gchar * const *names, const guint32 *inos, gboolean short_entry)
+{
+    guint8 entries[512];
+    guint8 value[NTFS_RECORD];
+    guint8 *record = ntfs_record(image, ino);
+    guint32 len = 0;
+    guint32 size = 16 + 16;
+    guint i;
+
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; names[i]; i++)
+        len += ntfs_add_index_entry(entries + len, inos[i], names[i]);
+    if (short_entry) {
+        /* room for the name length, not for the name space after it */
+        put_le16(entries + len + 8, 16 + 0x40);
+        put_le16(entries + len + 10, 0x42);
+        len += 16 + 0x40;
+        size = NTFS_RECORD - 0x38 - 0x20;
+    } else {
+        put_le16(entries + len + 8, 16);
+        put_le16(entries + len + 12, 0x02);
+        len += 16;
+        size += len;
+    }
+
+    memset(value, 0, sizeof(value));
+    put_le32(value, 0x30);
+    put_le32(value + 8, NTFS_CLUSTER);
+    value[12] = 1;
+    put_le32(value + 16, size - 16 - len);
+    put_le32(value + 20, size - 16);
+    put_le32(value + 24, size - 16);
+    memcpy(value + size - len, entries, len);
+
+    ntfs_begin_record(record, 0x0001 | 0x0002);
+    ntfs_add_resident(record, 0x90, "$I30", value, size);
+}
+
+static void
+ntfs_add_file(guint8 *image, guint32 ino, const guint8 *data, guint32 len)
+{
+    guint8 *record = ntfs_record(image, ino);
+
+    ntfs_begin_record(record, 0x0001);
+    ntfs_add_resident(record, 0x80, NULL, data, len);
+}
+
+/* The update sequence, the last two bytes of every sector swapped out */
+static void
+ntfs_protect(guint8 *record)
+{
+    guint i;
+
+    put_le16(record + 0x30, 0x0007);
+    for (i = 1; i <= NTFS_RECORD / 512; i++) {
+        memcpy(record + 0x30 + i * 2, record + i * 512 - 2, 2);
+        put_le16(record + i * 512 - 2, 0x0007);
+    }
+}
+
+static guint8 *
+build_ntfs(gboolean short_entry)
+{
+    static const gchar * const root[] = { "bootmgr", "Boot", NULL };
+    static const guint32 root_inos[] = { 7, 8 };
+    static const gchar * const boot[] = { "BCD", NULL };
+    static const guint32 boot_inos[] = { 9 };
+    static const guint8 runs[] = { 0x11, 0x04, 0x04, 0x00, 0, 0, 0, 0 };
+    static const gchar bcd[] = "regf....Windows 10....";
+    guint8 *image = g_malloc0(NTFS_SIZE);
+    guint8 *record = ntfs_record(image, 0);
+    guint8 *attr = record + 0x38;
+    guint8 data[64];
+    guint i;
+
+    memcpy(image + 3, "NTFS    ", 8);
+    put_le16(image + 11, 512);
+    image[13] = NTFS_CLUSTER / 512;
+    put_le64(image + 0x28, NTFS_SIZE / 512 - 1);
+    put_le64(image + 0x30, NTFS_MFT / NTFS_CLUSTER);
+    put_le64(image + 0x38, 2);
+    image[0x40] = 0xF6;
+    image[0x44] = 1;
+    put_le64(image + 0x48, G_GUINT64_CONSTANT(0x4a1c62e07b3d9f05));
+    put_le16(image + 510, 0xAA55);
+
+    /* $MFT, its runs in its own record */
+    ntfs_begin_record(record, 0x0001);
+    put_le32(attr, 0x80);
+    put_le32(attr + 4, 0x48);
+    attr[8] = 1;
+    put_le16(attr + 0x0A, 0x40);
+    put_le64(attr + 0x18, 3);
+    put_le16(attr + 0x20, 0x40);
+    put_le64(attr + 0x28, 4 * NTFS_CLUSTER);
+    put_le64(attr + 0x30, 4 * NTFS_CLUSTER);
+    put_le64(attr + 0x38, 4 * NTFS_CLUSTER);
+    memcpy(attr + 0x40, runs, sizeof(runs));
+    put_le32(attr + 0x48, 0xFFFFFFFF);
+    put_le32(record + 0x18, 0x38 + 0x48 + 8);
+
+    /* $Volume, where the LSN of the last mount is */
+    ntfs_begin_record(ntfs_record(image, 3), 0x0001);
+
+    ntfs_add_dir(image, 5, root, root_inos, short_entry);
+    ntfs_add_file(image, 7, (const guint8 *)"BOOTMGR", 7);
+    ntfs_add_dir(image, 8, boot, boot_inos, FALSE);
+    for (i = 0; i < sizeof(bcd) - 1; i++)
+        put_le16(data + i * 2, bcd[i]);
+    ntfs_add_file(image, 9, data, (sizeof(bcd) - 1) * 2);
+
+    for (i = 0; i < 16; i++) {
+        if (memcmp(ntfs_record(image, i), "FILE", 4) == 0)
+            ntfs_protect(ntfs_record(image, i));
+    }
+
+    return image;
+}
+
+static void
+test_ntfs(void)
+{
+    guint8 *image = build_ntfs(FALSE);
+    gchar *path = write_image("ntfs", image, NTFS_SIZE);
+    Superblock superblock;
+    FsReader *reader;
+    gchar *long_name = NULL;
+    GError *error = NULL;
+
+    /* the LSN of $Volume tells when it was last mounted */
+    g_assert_true(superblock_read(path, &superblock, &error));
+    g_assert_no_error(error);
+    g_assert_cmpint(superblock.type, ==, FS_NTFS);
+    g_assert_cmpstr(superblock.uuid, ==, "4A1C62E07B3D9F05");
+    g_assert_true(superblock.has_generation);
+    g_assert_cmpuint(superblock.generation, ==, NTFS_LSN);
+    g_free(path);
+
+    reader = open_image("ntfs", image, NTFS_SIZE, FS_NTFS);
+    assert_file(reader, "/bootmgr", "BOOTMGR");
+    assert_file(reader, "/BOOTMGR", "BOOTMGR");
+    assert_file_error(reader, "/ntldr", G_IO_ERROR_NOT_FOUND);
+    assert_file_error(reader, "/boot", G_IO_ERROR_NOT_REGULAR_FILE);
+
+    g_assert_true(fsreader_detect_windows(reader, &long_name, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(long_name, ==, "Windows 10");
+    g_free(long_name);
+
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* An index entry too short for the name length and name space of its
+ * key, the last one of the index
+ */
+static void
+test_ntfs_short_entry(void)
+{
+    guint8 *image = build_ntfs(TRUE);
+    FsReader *reader = open_image("ntfs-short-entry", image, NTFS_SIZE, FS_NTFS);
+
+    assert_file_error(reader, "/ntldr", G_IO_ERROR_INVALID_DATA);
+
+    fsreader_free(reader);
+    g_free(image);
+}
+
+/* The mounted reader over a directory tree: files are NULL-terminated
+ * pairs of a path and its contents.
+ */
+static FsReader *
+open_tree(const gchar *name, FsType type, const gchar * const *files)
+{
+    gchar *root = g_build_filename(tmpdir, name, NULL);
+    gchar *path;
+    gchar *dir;
+    FsReader *reader;
+    GError *error = NULL;
+    guint i;
+
+    g_assert_cmpint(g_mkdir_with_parents(root, 0755), ==, 0);
+    for (i = 0; files[i]; i += 2) {
+        path = g_build_filename(root, files[i], NULL);
+        dir = g_path_get_dirname(path);
+        g_assert_cmpint(g_mkdir_with_parents(dir, 0755), ==, 0);
+        g_file_set_contents(path, files[i + 1], -1, &error);
+        g_assert_no_error(error);
+        g_free(dir);
+        g_free(path);
+    }
+
+    reader = fsreader_open_mounted(root, type, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(reader);
+    g_free(root);
+
+    return reader;
+}
+
+static void
+test_linux(void)
+{
+    static const gchar * const lsb[] = {
+        "etc/lsb-release", "DISTRIB_ID=Ubuntu\n"
+                           "DISTRIB_RELEASE=18.04\n"
+                           "DISTRIB_DESCRIPTION=\"Ubuntu 18.04.1 LTS\"\n",
+        "etc/os-release", "NAME=\"Ubuntu\"\n",
+        NULL
+    };
+    static const gchar * const release[] = {
+        "etc/lsb-release", "DISTRIB_ID=\"Linux Mint\"\n"
+                           "DISTRIB_RELEASE=19\n"
+                           "DISTRIB_DESCRIPTION=\"Linux Mint: Tara\"\n",
+        NULL
+    };
+    static const gchar * const os_release[] = {
+        "etc/lsb-release", "LSB_VERSION=1.4\n",
+        "etc/os-release", "NAME=Fedora\nVERSION=\"28 (Twenty Eight)\"\n",
+        NULL
+    };
+    static const gchar * const none[] = { "etc/fstab", "", NULL };
+    FsReader *reader;
+    gchar *long_name = NULL;
+    gchar *short_name = NULL;
+    GError *error = NULL;
+
+    reader = open_tree("linux-lsb", FS_EXT, lsb);
+    assert_linux(reader, "Ubuntu 18.04.1 LTS", "Ubuntu");
+    fsreader_free(reader);
+
+    /* the release when the description lacks it, no colons */
+    reader = open_tree("linux-release", FS_EXT, release);
+    assert_linux(reader, "Linux Mint  Tara (19)", "LinuxMint");
+    fsreader_free(reader);
+
+    reader = open_tree("linux-os-release", FS_EXT, os_release);
+    assert_linux(reader, "Fedora", "Fedora");
+    fsreader_free(reader);
+
+    reader = open_tree("linux-none", FS_EXT, none);
+    g_assert_false(fsreader_detect_linux(reader, &long_name, &short_name, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+    g_assert_null(long_name);
+    g_assert_null(short_name);
+    g_clear_error(&error);
+    fsreader_free(reader);
+}
+
+static void
+test_windows(void)
+{
+    static const gchar * const xp[] = {
+        "ntldr", "",
+        "NTDETECT.COM", "",
+        "boot.ini", "[boot loader]\r\n"
+                    "default=multi(0)disk(0)rdisk(0)partition(1)\\WINDOWS\r\n"
+                    "[operating systems]\r\n"
+                    "multi(0)disk(0)rdisk(0)partition(1)\\WINDOWS=\"Microsoft Windows XP Professional\" /fastdetect\r\n",
+        NULL
+    };
+    static const gchar * const none[] = { "pagefile.sys", "", NULL };
+    FsReader *reader;
+    gchar *long_name = NULL;
+    GError *error = NULL;
+
+    reader = open_tree("windows-xp", FS_NTFS, xp);
+    g_assert_true(fsreader_detect_windows(reader, &long_name, &error));
+    g_assert_no_error(error);
+    g_assert_cmpstr(long_name, ==, "Microsoft Windows XP Professional");
+    g_free(long_name);
+    fsreader_free(reader);
+
+    reader = open_tree("windows-none", FS_NTFS, none);
+    g_assert_false(fsreader_detect_windows(reader, &long_name, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND);
+    g_clear_error(&error);
+    fsreader_free(reader);
+}
+
+/* The boot entries of reader, one "label|kernel|initrd|params" each */
+static void
+assert_boot_entries(FsReader *reader, const gchar * const *expected)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func((GDestroyNotify)fsreader_boot_entry_free);
+    FsBootEntry *entry;
+    gchar *joined;
+    GError *error = NULL;
+    guint i;
+
+    g_assert_true(fsreader_detect_boot_entries(reader, entries, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(entries->len, ==, g_strv_length((gchar **)expected));
+    for (i = 0; i < entries->len; i++) {
+        entry = g_ptr_array_index(entries, i);
+        joined = g_strjoin("|", entry->label, entry->kernel, entry->initrd, entry->params, NULL);
+        g_assert_cmpstr(joined, ==, expected[i]);
+        g_free(joined);
+    }
+    g_ptr_array_free(entries, TRUE);
+}
+
+static void
+assert_boot_entries_error(FsReader *reader, gint code)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func((GDestroyNotify)fsreader_boot_entry_free);
+    GError *error = NULL;
+
+    g_assert_false(fsreader_detect_boot_entries(reader, entries, &error));
+    g_assert_error(error, G_IO_ERROR, code);
+    g_error_free(error);
+    g_ptr_array_free(entries, TRUE);
+}
+
+static void
+test_grub(void)
+{
+    static const gchar * const files[] = {
+        "boot/grub/grub.cfg",
+        "set default=\"0\"\n"
+        "menuentry 'Debian GNU/Linux' --class debian --class gnu-linux $menuentry_id_option 'gnulinux-simple' {\n"
+        "\tload_video\n"
+        "\tlinux\t/boot/vmlinuz-4.9.0-8-amd64 root=UUID=0f2c1e7a ro  quiet\n"
+        "\tinitrd\t/boot/initrd.img-4.9.0-8-amd64\n"
+        "}\n"
+        "submenu 'Advanced options for Debian GNU/Linux' {\n"
+        "\tmenuentry \"Debian GNU/Linux, with Linux 4.9.0-8-amd64 (recovery mode)\" {\n"
+        "\t\tlinux /vmlinuz-4.9.0-8-amd64 root=UUID=0f2c1e7a ro single\n"
+        "\t\tinitrd /initrd.img-4.9.0-8-amd64\n"
+        "\t}\n"
+        "}\n"
+        "menuentry 'On another disk' {\n"
+        "\tlinux /vmlinuz-4.19.0-6-amd64 root=/dev/sdb1\n"
+        "}\n"
+        "menuentry 'Variable' {\n"
+        "\tlinux $kernel root=/dev/sda1\n"
+        "}\n",
+        "boot/vmlinuz-4.9.0-8-amd64", "",
+        "boot/initrd.img-4.9.0-8-amd64", "",
+        NULL
+    };
+    static const gchar * const expected[] = {
+        "Debian GNU/Linux|/boot/vmlinuz-4.9.0-8-amd64|/boot/initrd.img-4.9.0-8-amd64|"
+        "root=UUID=0f2c1e7a ro quiet",
+        "Debian GNU/Linux, with Linux 4.9.0-8-amd64 (recovery mode)|/boot/vmlinuz-4.9.0-8-amd64|"
+        "/boot/initrd.img-4.9.0-8-amd64|root=UUID=0f2c1e7a ro single",
+        NULL
+    };
+    static const gchar * const elsewhere[] = {
+        "boot/grub2/grub.cfg",
+        "menuentry 'Fedora' {\n"
+        "\tlinux16 /vmlinuz-4.16.3-301.fc28.x86_64 root=/dev/sda3\n"
+        "}\n",
+        NULL
+    };
+    FsReader *reader;
+
+    reader = open_tree("grub", FS_EXT, files);
+    assert_boot_entries(reader, expected);
+    fsreader_free(reader);
+
+    /* for a /boot of its own, which is not this one */
+    reader = open_tree("grub-elsewhere", FS_EXT, elsewhere);
+    assert_boot_entries_error(reader, G_IO_ERROR_NOT_SUPPORTED);
+    fsreader_free(reader);
+}
+
+static void
+test_bls(void)
+{
+    static const gchar * const files[] = {
+        "boot/grub2/grub.cfg", "insmod blscfg\nblscfg\n",
+        "boot/grub2/grubenv", "# GRUB Environment Block\n"
+                              "kernelopts=root=/dev/mapper/fedora-root ro rhgb quiet\n",
+        "boot/loader/entries/5d0e9c3a-5.0.9-301.fc30.x86_64.conf",
+        "title Fedora (5.0.9-301.fc30.x86_64) 30 (Thirty)\n"
+        "version 5.0.9-301.fc30.x86_64\n"
+        "linux /vmlinuz-5.0.9-301.fc30.x86_64\n"
+        "initrd /initramfs-5.0.9-301.fc30.x86_64.img\n"
+        "options $kernelopts\n",
+        "boot/loader/entries/5d0e9c3a-0-rescue.conf",
+        "title Fedora (0-rescue-5d0e9c3a) 30 (Thirty)\n"
+        "linux /vmlinuz-0-rescue-5d0e9c3a\n"
+        "options $kernelopts rd.auto\n",
+        "boot/loader/entries/README", "",
+        "boot/vmlinuz-5.0.9-301.fc30.x86_64", "",
+        "boot/initramfs-5.0.9-301.fc30.x86_64.img", "",
+        "boot/vmlinuz-0-rescue-5d0e9c3a", "",
+        NULL
+    };
+    static const gchar * const expected[] = {
+        "Fedora (0-rescue-5d0e9c3a) 30 (Thirty)|/boot/vmlinuz-0-rescue-5d0e9c3a||"
+        "root=/dev/mapper/fedora-root ro rhgb quiet rd.auto",
+        "Fedora (5.0.9-301.fc30.x86_64) 30 (Thirty)|/boot/vmlinuz-5.0.9-301.fc30.x86_64|"
+        "/boot/initramfs-5.0.9-301.fc30.x86_64.img|root=/dev/mapper/fedora-root ro rhgb quiet",
+        NULL
+    };
+    FsReader *reader = open_tree("bls", FS_XFS, files);
+
+    assert_boot_entries(reader, expected);
+    fsreader_free(reader);
+}
+
+static void
+test_kernels(void)
+{
+    static const gchar * const files[] = {
+        "boot/config-4.19.0-6-amd64", "",
+        "boot/vmlinuz-4.19.0-6-amd64", "",
+        "boot/initrd.img-4.19.0-6-amd64", "",
+        "boot/vmlinuz-5.10.0-9-amd64", "",
+        NULL
+    };
+    static const gchar * const expected[] = {
+        "vmlinuz-4.19.0-6-amd64|/boot/vmlinuz-4.19.0-6-amd64|/boot/initrd.img-4.19.0-6-amd64|",
+        "vmlinuz-5.10.0-9-amd64|/boot/vmlinuz-5.10.0-9-amd64||",
+        NULL
+    };
+    static const gchar * const none[] = { "etc/fstab", "", NULL };
+    FsReader *reader;
+
+    reader = open_tree("kernels", FS_BTRFS, files);
+    assert_boot_entries(reader, expected);
+    fsreader_free(reader);
+
+    reader = open_tree("kernels-none", FS_BTRFS, none);
+    assert_boot_entries_error(reader, G_IO_ERROR_NOT_FOUND);
+    fsreader_free(reader);
+}
+
+static gint
+remove_path(const gchar *path, const struct stat *st, gint flag, struct FTW *ftw)
+{
+    return g_remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    gint ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpdir = g_dir_make_tmp("test-fsreader-XXXXXX", &error);
+    g_assert_no_error(error);
+
+    g_test_add_func("/fsreader/ext", test_ext);
+    g_test_add_func("/fsreader/ext-bad-extents", test_ext_bad_extents);
+    g_test_add_func("/fsreader/xfs", test_xfs);
+    g_test_add_func("/fsreader/xfs-bad-leaf", test_xfs_bad_leaf);
+    g_test_add_func("/fsreader/btrfs", test_btrfs);
+    g_test_add_func("/fsreader/btrfs-bad-leaf", test_btrfs_bad_leaf);
+    g_test_add_func("/fsreader/fat", test_fat);
+    g_test_add_func("/fsreader/fat-bad-chain", test_fat_bad_chain);
+    g_test_add_func("/fsreader/ntfs", test_ntfs);
+    g_test_add_func("/fsreader/ntfs-short-entry", test_ntfs_short_entry);
+    g_test_add_func("/fsreader/linux", test_linux);
+    g_test_add_func("/fsreader/windows", test_windows);
+    g_test_add_func("/fsreader/grub", test_grub);
+    g_test_add_func("/fsreader/bls", test_bls);
+    g_test_add_func("/fsreader/kernels", test_kernels);
+
+    ret = g_test_run();
+
+    nftw(tmpdir, remove_path, 16, FTW_DEPTH | FTW_PHYS);
+    g_free(tmpdir);
+
+    return ret;
+}
@@ -21,62 +21,40 @@
 #include <string.h>
 #include <glib.h>
 
+#include "result.h"
+
 gpointer osprober_routine(gpointer data)
 {
-    gboolean ret;
     gchar *out = NULL;
-    gchar *err;
+    gchar *err = NULL;
     int status;
     GError *error = NULL;
-    gchar **tokens = NULL;
-    gchar **line;
-    gchar **ptr;
-    gchar *part = NULL;
-    gchar *name = NULL;
-    gchar *shortname = NULL;
-    int i;
+    ResultTable *table = NULL;
+    GVariant *result;
+    const gchar *part, *name, *shortname, *type;
+    gchar *line;
+    gchar *next;
 
-    ret = g_spawn_command_line_sync("/usr/bin/os-prober", 
-                                    &out, 
-                                    &err, 
-                                    &status, 
-                                    &error);
+    g_spawn_command_line_sync("/usr/bin/os-prober", 
+                              &out, 
+                              &err, 
+                              &status, 
+                              &error);
     if (out) {
-        tokens = g_strsplit(out, "\n", -1);
-        if (tokens) {
-            for (line = tokens; *line; line++) {
-                if (strlen(*line) == 0) 
-                    continue;
-                tokens = g_strsplit(*line, ":", -1);
-                if (tokens) {
-                    for (ptr = tokens, i = 0; *ptr; ptr++, i++) {
-                        if (i == 0)
-                            part = g_strdup(*ptr);
-                        else if (i == 1)
-                            name = g_strdup(*ptr);
-                        else if (i == 2)
-                            shortname = g_strdup(*ptr);
-                    }
-                    g_print("Found %s (%s) at %s\n", name, shortname, part);
-                    if (part) {
-                        g_free(part);
-                        part = NULL;
-                    }
-                    if (name) {
-                        g_free(name);
-                        name = NULL;
-                    }
-                    if (shortname) {
-                        g_free(shortname);
-                        shortname = NULL;
-                    }
-                    g_strfreev(tokens);
-                    tokens = NULL;
-                }
-            }
-            g_strfreev(tokens);
-            tokens = NULL;
+        table = result_table_new();
+        for (line = out; line && *line; line = next) {
+            next = strchr(line, '\n');
+            if (next)
+                *next++ = '\0';
+            result = result_table_add_line(table, line, NULL, NULL);
+            if (result == NULL)
+                continue;
+            g_variant_get(result, "(&s&s&s&s)", &part, &name, &shortname, &type);
+            g_print("Found %s (%s, %s) at %s\n", name, shortname, type, part);
+            g_variant_unref(result);
         }
+        result_table_free(table);
+        table = NULL;
     }
 
     if (error) {
@@ -84,6 +62,8 @@ gpointer osprober_routine(gpointer data)
         g_error_free(error);
         error = NULL;
     }
+    g_free(out);
+    g_free(err);
 
     return NULL;
 }
@@ -0,0 +1,400 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <glib.h>
+
+#include "result.h"
+
+/* The records of key, one "part|name|shortname|type" per record */
+static void
+assert_records(ResultTable *table, const gchar *key, const gchar * const *expected)
+{
+    GVariant *records = result_table_lookup(table, key);
+    const gchar *part, *name, *shortname, *type;
+    gchar *joined;
+    gsize i;
+
+    if (expected == NULL) {
+        g_assert_null(records);
+        return;
+    }
+
+    g_assert_nonnull(records);
+    g_assert_cmpuint(g_variant_n_children(records), ==, g_strv_length((gchar **)expected));
+    for (i = 0; expected[i]; i++) {
+        g_variant_get_child(records, i, "(&s&s&s&s)", &part, &name, &shortname, &type);
+        joined = g_strjoin("|", part, name, shortname, type, NULL);
+        g_assert_cmpstr(joined, ==, expected[i]);
+        g_free(joined);
+    }
+    g_variant_unref(records);
+}
+
+static void
+add_line(ResultTable *table, const gchar *line, const gchar *partition, const gchar *partuuid)
+{
+    GVariant *record = result_table_add_line(table, line, partition, partuuid);
+
+    g_assert_nonnull(record);
+    g_variant_unref(record);
+}
+
+static void
+test_lookup(void)
+{
+    ResultTable *table = result_table_new();
+    const gchar *sda1[] = { "/dev/sda1|Debian GNU/Linux 9 (stretch)|Debian|linux", NULL };
+    const gchar *sda2[] = { "/dev/sda2|Windows 10|Windows|chain", NULL };
+
+    add_line(table, "/dev/sda1:Debian GNU/Linux 9 (stretch):Debian:linux", "sda1", "8a2c7b1e-01");
+    add_line(table, "/dev/sda2:Windows 10:Windows:chain", "sda2", NULL);
+
+    assert_records(table, "/dev/sda1", sda1);
+    assert_records(table, "sda1", sda1);
+    assert_records(table, "8a2c7b1e-01", sda1);
+    assert_records(table, "/dev/sda2", sda2);
+    assert_records(table, "sda2", sda2);
+    assert_records(table, "sda3", NULL);
+    assert_records(table, "", NULL);
+
+    result_table_free(table);
+}
+
+static void
+test_efi(void)
+{
+    ResultTable *table = result_table_new();
+    const gchar *sda1[] = {
+        "/dev/sda1@/EFI/Microsoft/Boot/bootmgfw.efi|Windows Boot Manager|Windows|efi",
+        "/dev/sda1@/EFI/debian/grubx64.efi|Debian|Debian|efi",
+        NULL
+    };
+
+    add_line(table, "/dev/sda1@/EFI/Microsoft/Boot/bootmgfw.efi:Windows Boot Manager:Windows:efi", 
+             "sda1", NULL);
+    add_line(table, "/dev/sda1@/EFI/debian/grubx64.efi:Debian:Debian:efi", "sda1", NULL);
+
+    /* the boot loaders are on the device, whatever their path */
+    assert_records(table, "/dev/sda1", sda1);
+    assert_records(table, "sda1", sda1);
+    assert_records(table, "/dev/sda1@/EFI/debian/grubx64.efi", NULL);
+
+    result_table_free(table);
+}
+
+static void
+test_missing_fields(void)
+{
+    ResultTable *table = result_table_new();
+    const gchar *sda3[] = { "/dev/sda3|Some OS||", NULL };
+    const gchar *sda4[] = { "/dev/sda4|||", NULL };
+    const gchar *sda5[] = { "/dev/sda5|Haiku|Haiku|chain:extra", NULL };
+
+    g_assert_null(result_table_add_line(table, "", "sda6", NULL));
+    add_line(table, "/dev/sda3:Some OS", "sda3", NULL);
+    add_line(table, "/dev/sda4", "sda4", NULL);
+    /* the type is the rest of the line */
+    add_line(table, "/dev/sda5:Haiku:Haiku:chain:extra", "sda5", NULL);
+
+    assert_records(table, "sda3", sda3);
+    assert_records(table, "sda4", sda4);
+    assert_records(table, "sda5", sda5);
+    assert_records(table, "sda6", NULL);
+
+    result_table_free(table);
+}
+
+static void
+test_remove(void)
+{
+    ResultTable *table = result_table_new();
+    const gchar *sda1[] = { "/dev/sda1|Fedora 28|Fedora|linux", NULL };
+    const gchar *sda2[] = { "/dev/sda2|Windows 10|Windows|chain", NULL };
+
+    add_line(table, "/dev/sda1:Debian GNU/Linux 9 (stretch):Debian:linux", "sda1", "8a2c7b1e-01");
+    add_line(table, "/dev/sda1@/EFI/debian/grubx64.efi:Debian:Debian:efi", "sda1", "8a2c7b1e-01");
+    add_line(table, "/dev/sda2:Windows 10:Windows:chain", "sda2", "8a2c7b1e-02");
+
+    /* by any key, all of them go */
+    result_table_remove(table, "8a2c7b1e-01");
+    assert_records(table, "/dev/sda1", NULL);
+    assert_records(table, "sda1", NULL);
+    assert_records(table, "8a2c7b1e-01", NULL);
+    assert_records(table, "sda2", sda2);
+
+    /* added again, nothing of before comes back */
+    add_line(table, "/dev/sda1:Fedora 28:Fedora:linux", "sda1", "8a2c7b1e-01");
+    assert_records(table, "8a2c7b1e-01", sda1);
+
+    result_table_remove(table, "sda3");
+    result_table_remove(table, "/dev/sda2");
+    assert_records(table, "8a2c7b1e-02", NULL);
+    assert_records(table, "sda1", sda1);
+
+    result_table_free(table);
+}
+
+static void
+test_compact(void)
+{
+    ResultTable *table = result_table_new();
+    const gchar *sda1[] = {
+        "/dev/sda1|Debian GNU/Linux 9 (stretch)|Debian|linux",
+        "/dev/sda1@/EFI/debian/grubx64.efi|Debian|Debian|efi",
+        "/dev/sda1@/EFI/Microsoft/Boot/bootmgfw.efi|Windows Boot Manager|Windows|efi",
+        NULL
+    };
+    const gchar *sdb1[] = {
+        "/dev/sdb1|Fedora 28|Fedora|linux",
+        "/dev/sdb1@/EFI/fedora/shimx64.efi|Fedora|Fedora|efi",
+        NULL
+    };
+    guint i;
+
+    add_line(table, "/dev/sda1:Debian GNU/Linux 9 (stretch):Debian:linux", "sda1", "8a2c7b1e-01");
+    add_line(table, "/dev/sda1@/EFI/debian/grubx64.efi:Debian:Debian:efi", "sda1", "8a2c7b1e-01");
+
+    /* far more dead records than live ones, the table compacts a few
+     * times on the way
+     */
+    for (i = 0; i < 200; i++) {
+        result_table_remove(table, "sdb1");
+        add_line(table, "/dev/sdb1:Fedora 28:Fedora:linux", "sdb1", "5d0e9c3a-01");
+        add_line(table, "/dev/sdb1@/EFI/fedora/shimx64.efi:Fedora:Fedora:efi", "sdb1", "5d0e9c3a-01");
+    }
+    add_line(table, 
+             "/dev/sda1@/EFI/Microsoft/Boot/bootmgfw.efi:Windows Boot Manager:Windows:efi", 
+             "sda1", "8a2c7b1e-01");
+
+    assert_records(table, "/dev/sda1", sda1);
+    assert_records(table, "sda1", sda1);
+    assert_records(table, "8a2c7b1e-01", sda1);
+    assert_records(table, "/dev/sdb1", sdb1);
+    assert_records(table, "5d0e9c3a-01", sdb1);
+
+    result_table_free(table);
+}
+
+/* The label given to an OS named shortname on part */
+static gchar *
+number(ResultLabels *labels, const gchar *part, const gchar *shortname)
+{
+    GVariant *record = g_variant_ref_sink(g_variant_new("(ssss)", part, "Some OS", shortname, "linux"));
+    GVariant *numbered = result_labels_number(labels, record);
+    gchar *label;
+
+    g_variant_get_child(numbered, 2, "s", &label);
+    g_variant_unref(numbered);
+    g_variant_unref(record);
+
+    return label;
+}
+
+static void
+assert_label(ResultLabels *labels, const gchar *part, const gchar *shortname, const gchar *expected)
+{
+    gchar *label = number(labels, part, shortname);
+
+    g_assert_cmpstr(label, ==, expected);
+    g_free(label);
+}
+
+static void
+test_labels(void)
+{
+    ResultLabels *labels = result_labels_new();
+
+    /* numbered in partition order, like os-prober */
+    assert_label(labels, "/dev/sda1", "Debian", "Debian");
+    assert_label(labels, "/dev/sda2", "Windows", "Windows");
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+    assert_label(labels, "/dev/sdc1", "Debian", "Debian2");
+
+    /* the next scan, they keep their labels */
+    assert_label(labels, "/dev/sda1", "Debian", "Debian");
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+    assert_label(labels, "/dev/sdc1", "Debian", "Debian2");
+
+    /* without a short name, nothing to number */
+    assert_label(labels, "/dev/sdd1", "", "");
+    assert_label(labels, "/dev/sdd2", "", "");
+
+    result_labels_free(labels);
+}
+
+static void
+test_labels_release(void)
+{
+    ResultLabels *labels = result_labels_new();
+    GVariant *record;
+
+    assert_label(labels, "/dev/sda1", "Debian", "Debian");
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+
+    /* only the part holding a label gives it back */
+    record = g_variant_ref_sink(g_variant_new("(ssss)", "/dev/sdb1", "Some OS", "Debian", "linux"));
+    result_labels_release(labels, record);
+    g_variant_unref(record);
+    assert_label(labels, "/dev/sdc1", "Debian", "Debian2");
+
+    /* the first free one goes to the next */
+    record = g_variant_ref_sink(g_variant_new("(ssss)", "/dev/sda1", "Some OS", "Debian", "linux"));
+    result_labels_release(labels, record);
+    g_variant_unref(record);
+    assert_label(labels, "/dev/sdd1", "Debian", "Debian");
+    assert_label(labels, "/dev/sda1", "Debian", "Debian3");
+
+    /* held again as announced before */
+    record = g_variant_ref_sink(g_variant_new("(ssss)", "/dev/sde1", "Some OS", "Debian7", "linux"));
+    result_labels_hold(labels, record);
+    g_variant_unref(record);
+    assert_label(labels, "/dev/sde1", "Debian", "Debian7");
+
+    result_labels_free(labels);
+}
+
+/* A uevent has a partition probed again on its own */
+static void
+test_labels_rescan(void)
+{
+    ResultLabels *labels = result_labels_new();
+    GVariant *record;
+
+    assert_label(labels, "/dev/sda1", "Debian", "Debian");
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+
+    /* sdb1 alone, it does not take the label of sda1 */
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+
+    /* a disk plugged in */
+    assert_label(labels, "/dev/sdc1", "Debian", "Debian2");
+
+    /* sda1 gone, the others keep theirs */
+    record = g_variant_ref_sink(g_variant_new("(ssss)", "/dev/sda1", "Some OS", "Debian", "linux"));
+    result_labels_release(labels, record);
+    g_variant_unref(record);
+    assert_label(labels, "/dev/sdb1", "Debian", "Debian1");
+    assert_label(labels, "/dev/sdc1", "Debian", "Debian2");
+
+    result_labels_free(labels);
+}
+
+/* The cached records, "part|shortname" each, numbered along devices,
+ * as "part|label" in the order they come out
+ */
+static void
+assert_cached(ResultLabels *labels, const gchar * const *cached, const gchar * const *devices, const gchar * const *expected)
+{
+    GVariantBuilder builder;
+    GPtrArray *order = g_ptr_array_new();
+    GVariant *numbered;
+    const gchar *part, *label;
+    gchar **fields;
+    gchar *joined;
+    gsize i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssss)"));
+    for (i = 0; cached[i]; i++) {
+        fields = g_strsplit(cached[i], "|", 2);
+        g_variant_builder_add(&builder, "(ssss)", fields[0], "Some OS", fields[1], "linux");
+        g_strfreev(fields);
+    }
+    for (i = 0; devices[i]; i++)
+        g_ptr_array_add(order, (gpointer)devices[i]);
+
+    numbered = g_variant_ref_sink(result_labels_number_all(labels, g_variant_builder_end(&builder), order));
+    g_assert_cmpuint(g_variant_n_children(numbered), ==, g_strv_length((gchar **)expected));
+    for (i = 0; expected[i]; i++) {
+        g_variant_get_child(numbered, i, "(&s&s&s&s)", &part, NULL, &label, NULL);
+        joined = g_strjoin("|", part, label, NULL);
+        g_assert_cmpstr(joined, ==, expected[i]);
+        g_free(joined);
+    }
+    g_variant_unref(numbered);
+    g_ptr_array_free(order, TRUE);
+}
+
+/* Installs of the same distribution answered from the cache, which
+ * keeps the short names as found and the partitions in no order, with
+ * or without one of them known.
+ */
+static void
+test_labels_cached(void)
+{
+    static const gchar * const devices[] = { "/dev/sda1", "/dev/sda2", "/dev/sda10", "/dev/sdb1", NULL };
+    static const gchar * const cached[] = {
+        "/dev/sdc1|Debian",
+        "/dev/sda10|Debian",
+        "/dev/sda1@/efi/debian/grubx64.efi|Debian",
+        "/dev/sdb1|Debian",
+        "/dev/sda1@/efi/Microsoft/Boot/bootmgfw.efi|Windows",
+        "/dev/sda2|Debian",
+        NULL
+    };
+    /* sda10 after sda2, sdc1 gone from the machine last */
+    static const gchar * const numbered[] = {
+        "/dev/sda1@/efi/debian/grubx64.efi|Debian",
+        "/dev/sda1@/efi/Microsoft/Boot/bootmgfw.efi|Windows",
+        "/dev/sda2|Debian1",
+        "/dev/sda10|Debian2",
+        "/dev/sdb1|Debian3",
+        "/dev/sdc1|Debian4",
+        NULL
+    };
+    static const gchar * const known[] = {
+        "/dev/sda1@/efi/debian/grubx64.efi|Debian1",
+        "/dev/sda1@/efi/Microsoft/Boot/bootmgfw.efi|Windows",
+        "/dev/sda2|Debian2",
+        "/dev/sda10|Debian3",
+        "/dev/sdb1|Debian",
+        "/dev/sdc1|Debian4",
+        NULL
+    };
+    ResultLabels *labels = result_labels_new();
+    GVariant *record;
+
+    assert_cached(labels, cached, devices, numbered);
+    result_labels_free(labels);
+
+    /* sdb1 known as Debian keeps it */
+    labels = result_labels_new();
+    record = g_variant_ref_sink(g_variant_new("(ssss)", "/dev/sdb1", "Some OS", "Debian", "linux"));
+    result_labels_hold(labels, record);
+    g_variant_unref(record);
+    assert_cached(labels, cached, devices, known);
+    result_labels_free(labels);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/result/lookup", test_lookup);
+    g_test_add_func("/result/efi", test_efi);
+    g_test_add_func("/result/missing-fields", test_missing_fields);
+    g_test_add_func("/result/remove", test_remove);
+    g_test_add_func("/result/compact", test_compact);
+    g_test_add_func("/result/labels", test_labels);
+    g_test_add_func("/result/labels-release", test_labels_release);
+    g_test_add_func("/result/labels-rescan", test_labels_rescan);
+    g_test_add_func("/result/labels-cached", test_labels_cached);
+
+    return g_test_run();
+}
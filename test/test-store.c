@@ -0,0 +1,363 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Copyright (C) 2017 Leslie Zhai <xiang.zhai@i-soft.com.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "store.h"
+
+static gchar *tmpdir;
+
+static GPtrArray *
+make_results(const gchar * const *lines)
+{
+    GPtrArray *results = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    gchar **fields;
+    guint i;
+
+    for (i = 0; lines && lines[i]; i++) {
+        fields = g_strsplit(lines[i], "|", 4);
+        g_ptr_array_add(results,
+                        g_variant_ref_sink(g_variant_new("(ssss)",
+                                                         fields[0], fields[1],
+                                                         fields[2], fields[3])));
+        g_strfreev(fields);
+    }
+
+    return results;
+}
+
+/* The results as "part|name|shortname|type" */
+static void
+assert_results(GPtrArray *results, const gchar * const *expected)
+{
+    const gchar *part, *name, *shortname, *type;
+    gchar *joined;
+    guint i;
+
+    g_assert_cmpuint(results->len, ==, expected ? g_strv_length((gchar **)expected) : 0);
+    for (i = 0; i < results->len; i++) {
+        g_variant_get(g_ptr_array_index(results, i), "(&s&s&s&s)",
+                      &part, &name, &shortname, &type);
+        joined = g_strjoin("|", part, name, shortname, type, NULL);
+        g_assert_cmpstr(joined, ==, expected[i]);
+        g_free(joined);
+    }
+}
+
+static void
+assert_entry(Store *store, const gchar *key, const gchar *device, guint64 generation,
+             gboolean valid, const gchar * const *expected)
+{
+    const gchar *found_device = NULL;
+    guint64 found_generation = 0;
+    gboolean found_valid = !valid;
+    GPtrArray *results = NULL;
+
+    g_assert_true(store_lookup(store, key, &found_device, &found_generation, &found_valid, &results));
+    g_assert_cmpstr(found_device, ==, device);
+    g_assert_cmpuint(found_generation, ==, generation);
+    g_assert_cmpint(found_valid, ==, valid);
+    assert_results(results, expected);
+    g_ptr_array_unref(results);
+}
+
+static void
+assert_no_entry(Store *store, const gchar *key)
+{
+    const gchar *device = NULL;
+    guint64 generation = 0;
+    gboolean valid = FALSE;
+    GPtrArray *results = NULL;
+
+    g_assert_false(store_lookup(store, key, &device, &generation, &valid, &results));
+    g_assert_null(results);
+}
+
+static const gchar * const sda1[] = {
+    "/dev/sda1|Debian GNU/Linux 9 (stretch)|Debian|linux",
+    "/dev/sda1@/EFI/debian/grubx64.efi|Debian|Debian|efi",
+    NULL
+};
+static const gchar * const sda2[] = { "/dev/sda2|Windows 10|Windows|chain", NULL };
+
+/* A store of sda1 and sda2 by UUID, and an empty sdb1 not valid any
+ * more, saved as name in the temporary directory
+ */
+static gchar *
+save_store(const gchar *name)
+{
+    StoreWriter *writer = store_writer_new();
+    GPtrArray *results;
+    gchar *path = g_build_filename(tmpdir, name, NULL);
+    GError *error = NULL;
+
+    results = make_results(sda1);
+    store_writer_add(writer, "8a2c7b1e-5d0e-4c3a-9f05-1e7a0f2c5d3b", "/dev/sda1",
+                     G_GUINT64_CONSTANT(0x5be1a2f300000001), TRUE, results);
+    g_ptr_array_unref(results);
+    results = make_results(sda2);
+    store_writer_add(writer, "4A1C62E07B3D9F05", "/dev/sda2", 0, TRUE, results);
+    g_ptr_array_unref(results);
+    results = make_results(NULL);
+    store_writer_add(writer, "5d0e9c3a-01", "/dev/sdb1", 42, FALSE, results);
+    g_ptr_array_unref(results);
+
+    g_assert_true(store_writer_save(writer, path, &error));
+    g_assert_no_error(error);
+    store_writer_free(writer);
+
+    return path;
+}
+
+static void
+count_entry(const gchar *key, GPtrArray *results, gpointer user_data)
+{
+    GHashTable *seen = user_data;
+
+    g_assert_false(g_hash_table_contains(seen, key));
+    g_hash_table_insert(seen, g_strdup(key), GUINT_TO_POINTER(results->len));
+}
+
+static void
+test_round_trip(void)
+{
+    gchar *path = save_store("round-trip");
+    Store *store = store_open(path);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    g_assert_nonnull(store);
+    g_assert_cmpuint(store_get_n_entries(store), ==, 3);
+    assert_entry(store, "8a2c7b1e-5d0e-4c3a-9f05-1e7a0f2c5d3b", "/dev/sda1",
+                 G_GUINT64_CONSTANT(0x5be1a2f300000001), TRUE, sda1);
+    assert_entry(store, "4A1C62E07B3D9F05", "/dev/sda2", 0, TRUE, sda2);
+    assert_entry(store, "5d0e9c3a-01", "/dev/sdb1", 42, FALSE, NULL);
+    assert_no_entry(store, "5d0e9c3a-02");
+    assert_no_entry(store, "/dev/sda1");
+    assert_no_entry(store, "");
+
+    store_foreach(store, count_entry, seen);
+    g_assert_cmpuint(g_hash_table_size(seen), ==, 3);
+    g_assert_cmpuint(GPOINTER_TO_UINT(g_hash_table_lookup(seen, "8a2c7b1e-5d0e-4c3a-9f05-1e7a0f2c5d3b")), ==, 2);
+    g_assert_cmpuint(GPOINTER_TO_UINT(g_hash_table_lookup(seen, "4A1C62E07B3D9F05")), ==, 1);
+    g_assert_cmpuint(GPOINTER_TO_UINT(g_hash_table_lookup(seen, "5d0e9c3a-01")), ==, 0);
+
+    g_hash_table_destroy(seen);
+    store_free(store);
+    g_free(path);
+}
+
+static void
+test_empty(void)
+{
+    StoreWriter *writer = store_writer_new();
+    gchar *path = g_build_filename(tmpdir, "empty", NULL);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GError *error = NULL;
+    Store *store;
+
+    g_assert_true(store_writer_save(writer, path, &error));
+    g_assert_no_error(error);
+    store_writer_free(writer);
+
+    store = store_open(path);
+    g_assert_nonnull(store);
+    g_assert_cmpuint(store_get_n_entries(store), ==, 0);
+    assert_no_entry(store, "8a2c7b1e-01");
+    store_foreach(store, count_entry, seen);
+    g_assert_cmpuint(g_hash_table_size(seen), ==, 0);
+
+    g_hash_table_destroy(seen);
+    store_free(store);
+    g_free(path);
+}
+
+/* The saved store as name, changed by change at offset, to len bytes */
+static gchar *
+corrupt_store(const gchar *name, gsize offset, const guint8 *change, gsize change_len, gssize len)
+{
+    gchar *path = save_store(name);
+    gchar *contents = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+
+    g_assert_true(g_file_get_contents(path, &contents, &length, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(offset + change_len, <=, length);
+    memcpy(contents + offset, change, change_len);
+    g_assert_true(g_file_set_contents(path, contents, len < 0 ? (gssize)length : len, &error));
+    g_assert_no_error(error);
+    g_free(contents);
+
+    return path;
+}
+
+static void
+assert_rejected(const gchar *name, gsize offset, const guint8 *change, gsize change_len, gssize len)
+{
+    gchar *path = corrupt_store(name, offset, change, change_len, len);
+
+    g_assert_null(store_open(path));
+    g_free(path);
+}
+
+static void
+test_rejected(void)
+{
+    static const guint8 magic[] = "OSPRIDY";
+    static const guint8 old_version[] = { STORE_VERSION - 1, 0, 0, 0 };
+    static const guint8 future_version[] = { STORE_VERSION + 1, 0, 0, 0 };
+    static const guint8 many[] = { 0xff, 0xff, 0xff, 0x0f };
+    static const guint8 far[] = { 0x00, 0x00, 0x00, 0x80 };
+    static const guint8 nothing[] = { 0 };
+    gchar *path;
+    gchar *contents = NULL;
+    gsize length = 0;
+
+    /* nothing but part of the header */
+    assert_rejected("truncated-header", 0, nothing, 0, 47);
+    assert_rejected("empty-file", 0, nothing, 0, 0);
+
+    assert_rejected("bad-magic", 0, magic, sizeof(magic), -1);
+    assert_rejected("old-version", 8, old_version, sizeof(old_version), -1);
+    assert_rejected("future-version", 8, future_version, sizeof(future_version), -1);
+
+    /* tables past the end of the file */
+    assert_rejected("many-entries", 12, many, sizeof(many), -1);
+    assert_rejected("many-results", 16, many, sizeof(many), -1);
+    assert_rejected("long-strings", 20, many, sizeof(many), -1);
+    assert_rejected("far-entries", 24, far, sizeof(far), -1);
+    assert_rejected("far-results", 28, far, sizeof(far), -1);
+    assert_rejected("far-strings", 32, far, sizeof(far), -1);
+
+    /* the string table cut short, no NUL at its end */
+    path = save_store("truncated-strings");
+    g_assert_true(g_file_get_contents(path, &contents, &length, NULL));
+    g_free(path);
+    g_free(contents);
+    assert_rejected("truncated-strings", 0, nothing, 0, length - 1);
+}
+
+/* A string offset of an entry or result past the string table makes
+ * that entry or result go, not the store
+ */
+static void
+test_bad_strings(void)
+{
+    static const guint8 far[] = { 0xf0, 0xff, 0xff, 0xff };
+    static const gchar * const keys[] = {
+        "8a2c7b1e-5d0e-4c3a-9f05-1e7a0f2c5d3b", "4A1C62E07B3D9F05", "5d0e9c3a-01"
+    };
+    const gchar *device;
+    guint64 generation;
+    gboolean valid;
+    GPtrArray *results;
+    GHashTable *seen;
+    Store *store;
+    gchar *path;
+    guint entry, i, found;
+
+    /* entries are sorted by hash, so try the key and device of each */
+    for (entry = 0; entry < G_N_ELEMENTS(keys); entry++) {
+        path = corrupt_store("bad-key", 48 + entry * 32 + 4, far, sizeof(far), -1);
+        store = store_open(path);
+        g_assert_nonnull(store);
+        seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        store_foreach(store, count_entry, seen);
+        g_assert_cmpuint(g_hash_table_size(seen), ==, G_N_ELEMENTS(keys) - 1);
+        for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+            if (!g_hash_table_contains(seen, keys[i]))
+                assert_no_entry(store, keys[i]);
+        }
+        g_hash_table_destroy(seen);
+        store_free(store);
+        g_free(path);
+
+        path = corrupt_store("bad-device", 48 + entry * 32 + 8, far, sizeof(far), -1);
+        store = store_open(path);
+        g_assert_nonnull(store);
+        for (i = 0, found = 0; i < G_N_ELEMENTS(keys); i++) {
+            results = NULL;
+            if (store_lookup(store, keys[i], &device, &generation, &valid, &results)) {
+                g_ptr_array_unref(results);
+                found++;
+            } else {
+                g_assert_null(results);
+            }
+        }
+        g_assert_cmpuint(found, ==, G_N_ELEMENTS(keys) - 1);
+        store_free(store);
+        g_free(path);
+    }
+
+    /* the name of the first result, results are in the order added */
+    path = corrupt_store("bad-result", 48 + 3 * 32 + 4, far, sizeof(far), -1);
+    store = store_open(path);
+    g_assert_nonnull(store);
+    assert_entry(store, keys[0], "/dev/sda1", G_GUINT64_CONSTANT(0x5be1a2f300000001), TRUE, sda1 + 1);
+    assert_entry(store, keys[1], "/dev/sda2", 0, TRUE, sda2);
+    store_free(store);
+    g_free(path);
+}
+
+static void
+test_missing(void)
+{
+    gchar *path = g_build_filename(tmpdir, "missing", NULL);
+
+    g_assert_null(store_open(path));
+    g_free(path);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    const gchar *name;
+    gchar *path;
+    GDir *dir;
+    gint ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmpdir = g_dir_make_tmp("test-store-XXXXXX", &error);
+    g_assert_no_error(error);
+
+    g_test_add_func("/store/round-trip", test_round_trip);
+    g_test_add_func("/store/empty", test_empty);
+    g_test_add_func("/store/rejected", test_rejected);
+    g_test_add_func("/store/bad-strings", test_bad_strings);
+    g_test_add_func("/store/missing", test_missing);
+
+    ret = g_test_run();
+
+    dir = g_dir_open(tmpdir, 0, NULL);
+    while (dir && (name = g_dir_read_name(dir))) {
+        path = g_build_filename(tmpdir, name, NULL);
+        g_unlink(path);
+        g_free(path);
+    }
+    if (dir)
+        g_dir_close(dir);
+    g_rmdir(tmpdir);
+    g_free(tmpdir);
+
+    return ret;
+}